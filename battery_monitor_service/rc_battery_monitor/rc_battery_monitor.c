@@ -13,23 +13,31 @@
 #include "../../libraries/roboticscape.h"
 #include "../../libraries/rc_defs.h"
 #include "../../libraries/mmap/rc_mmap_gpio_adc.h"
+#include "../../libraries/other/rc_battery.h"
 #include <sys/file.h>
 
 #define BATTPIDFILE	"/var/run/rc_battery_monitor.pid"
 
 // Critical Max voltages of packs used to detect number of cells in pack
 #define CELL_MAX		4.25 // set higher than actual to detect num cells
-#define CELL_FULL		3.90 // minimum V to consider battery full
-#define CELL_75			3.80 // minimum V to consider battery 75%
-#define CELL_50			3.60 // minimum V to consider battery 50%
-#define CELL_25			3.25 // minimum V to consider battery 25%
 #define CELL_DIS		2.70 // Threshold for detecting disconnected battery
 #define V_CHG_DETECT	4.15 // above this assume finished charging
 
+// state of charge needed to light each number of LEDs, blink below SOC_1
+#define SOC_4			0.75
+#define SOC_3			0.50
+#define SOC_2			0.25
+#define SOC_1			0.05
+
+// defaults for the state of charge estimator, see README.txt
+#define DEFAULT_CAPACITY_MAH	2200
+#define DEFAULT_AMPS_PER_DUTY	1.0
+#define DEFAULT_IDLE_AMPS		0.25
+
 // filter
-#define LOOP_HZ				3
-#define LOOP_SLEEP_US	1000000/LOOP_HZ
-#define FITLER_SAMPLES		6		// average over 6 samples, 3 seconds
+#define SAMPLE_HZ			24		// state of charge estimator
+#define LOOP_HZ				3		// pack detection and LEDs
+#define FITLER_SAMPLES		6		// average over 6 samples, 2 seconds
 #define STD_DEV_TOLERANCE	0.04	// above 0.1 definitely charging
 
 // functions
@@ -44,12 +52,17 @@ int batt_led_2;
 int running;
 
 
-// main() takes only one optional argument: -k (kill)
+// main() takes optional arguments -k (kill) or the estimator settings
 int main(int argc, char *argv[]){
 	FILE* fd;
 	float v_pack;	// 2S pack voltage on JST XH 2S balance connector
 	float v_jack;	// could be dc power supply or another battery
-	float cell_voltage;	// cell voltage from either 2S or external pack
+	float cell_voltage = 0;	// cell voltage from either 2S or external pack
+	float raw_pack, raw_jack, v_est;
+	float capacity_mah = DEFAULT_CAPACITY_MAH;
+	float amps_per_duty = DEFAULT_AMPS_PER_DUTY;
+	float idle_amps = DEFAULT_IDLE_AMPS;
+	int tick = 0;
 	int toggle = 0;
 	int printing = 0;
 	int num_cells = 0;
@@ -59,8 +72,11 @@ int main(int argc, char *argv[]){
 	int c;
 	float stddev;
 	rc_bb_model_t model;
+	rc_periodic_t loop;
 	rc_filter_t filterB = rc_empty_filter();
 	rc_filter_t filterJ = rc_empty_filter(); // battery and jack filters
+	battery_soc_t est;
+	rc_battery_state_t state;
 
 	// ensure root privaleges until we sort out udev rules
 	if(geteuid()!=0){
@@ -70,11 +86,23 @@ int main(int argc, char *argv[]){
 
 	// parse arguments to check for kill mode
 	opterr = 0;
-	while ((c = getopt(argc, argv, "k")) != -1){
+	while ((c = getopt(argc, argv, "kc:a:i:")) != -1){
 		switch (c){
 		case 'k':  // kill mode
 			return kill_existing_instance();
 			break;
+
+		case 'c':  // battery capacity in mAh
+			capacity_mah = atof(optarg);
+			break;
+
+		case 'a':  // battery current of one motor at full duty
+			amps_per_duty = atof(optarg);
+			break;
+
+		case 'i':  // current drawn with the motors off
+			idle_amps = atof(optarg);
+			break;
 			
 		default:
 			fprintf(stderr,"\nInvalid Argument \n");
@@ -83,6 +111,10 @@ int main(int argc, char *argv[]){
 		}
 	}
 
+	if(battery_soc_init(&est, capacity_mah/1000.0, amps_per_duty, idle_amps)){
+		return -1;
+	}
+
 	// whitelist blue, black, and black wireless only when RC device tree is in use
 	model = rc_get_bb_model();
 	if(model!=BB_BLACK_RC && model!=BB_BLACK_W_RC && model!=BB_BLUE){
@@ -150,27 +182,54 @@ int main(int argc, char *argv[]){
 	}
 	rc_prefill_filter_outputs(&filterJ, v_jack);
 	rc_prefill_filter_inputs(&filterJ, v_jack);		
+
+	// share the estimate with other processes
+	if(battery_shm_open(1)){
+		fprintf(stderr,"ERROR in rc_battery_monitor, failed to open shared memory\n");
+		remove(PID_FILE);
+		return -1;
+	}
 	
 	// first decide if the user has called this from a terminal
 	// or as a startup process
 	if(isatty(fileno(stdout))){
 		printing = 1;
-		printf("\n2S Pack   Jack   #Cells   Cell\n");
+		printf("\n2S Pack   Jack   #Cells   Cell     SoC   Current  Remaining\n");
 	}
 	
 	// run intil running==0 which is set by signal handler
 	running = 1;
+	rc_periodic_init(&loop, "battery_monitor", SAMPLE_HZ);
 	while(running){
-		charging = 0;
 		// read in the voltage of the 2S pack and DC jack
-		v_pack = rc_march_filter(&filterB, rc_battery_voltage());
-		v_jack = rc_march_filter(&filterJ, rc_dc_jack_voltage());
-
-		if(v_pack==-1 || v_jack==-1){
+		raw_pack = rc_battery_voltage();
+		raw_jack = rc_dc_jack_voltage();
+		if(raw_pack==-1 || raw_jack==-1){
 			fprintf(stderr,"ERROR in rc_battery_monitor, can't read ADC voltages\n");
+			rc_periodic_cleanup(&loop);
 			remove(PID_FILE);
 			return -1;
 		}
+
+		// The estimator sees every unfiltered sample so it can catch the
+		// voltage stepping with the motor current, using the pack found by
+		// the slower detection below.
+		if(num_cells==0) v_est = 0;
+		else if(pack_connected) v_est = raw_pack;
+		else v_est = raw_jack;
+		battery_soc_update(&est, rc_nanos_since_boot(), v_est, num_cells, \
+														charging, &state);
+		battery_shm_publish(&state);
+
+		tick++;
+		if(tick<SAMPLE_HZ/LOOP_HZ){
+			rc_periodic_wait(&loop);
+			continue;
+		}
+		tick = 0;
+
+		v_pack = rc_march_filter(&filterB, raw_pack);
+		v_jack = rc_march_filter(&filterJ, raw_jack);
 		
 		// find standard deviation of battery signal to determine
 		// if a 2S pack is connected or not
@@ -222,6 +281,16 @@ int main(int argc, char *argv[]){
 		if(printing){
 			printf("\r %0.2fV   %0.2fV	 %d	 %0.2fV   ", \
 									v_pack, v_jack, num_cells, cell_voltage);
+			if(num_cells==0) printf("  --      --       --     ");
+			else if(state.remaining_s<0){
+				printf("%3.0f%%   %0.2fA      --     ", \
+									100*state.soc, state.current_a);
+			}
+			else{
+				printf("%3.0f%%   %0.2fA   %3d:%02d    ", 100*state.soc, \
+					state.current_a, (int)state.remaining_s/60, \
+					(int)state.remaining_s%60);
+			}
 			fflush(stdout);
 		}
 
@@ -237,12 +306,13 @@ int main(int argc, char *argv[]){
 		else if(num_cells!=2 && v_jack>11.5 && v_jack<12.5){
 			illuminate_leds(0);
 		}	
-		// normal battery discharging
+		// normal battery discharging, by estimated charge so the LEDs don't
+		// drop when the voltage sags under load
 		else if(cell_voltage<CELL_DIS)	illuminate_leds(0);
-		else if(cell_voltage>CELL_FULL) illuminate_leds(4);
-		else if(cell_voltage>CELL_75) 	illuminate_leds(3);
-		else if(cell_voltage>CELL_50) 	illuminate_leds(2);
-		else if(cell_voltage>CELL_25) 	illuminate_leds(1);
+		else if(state.soc>SOC_4)	illuminate_leds(4);
+		else if(state.soc>SOC_3)	illuminate_leds(3);
+		else if(state.soc>SOC_2)	illuminate_leds(2);
+		else if(state.soc>SOC_1)	illuminate_leds(1);
 		// battery is extremely low, blink all 4
 		else{
 			if(toggle) toggle=0;
@@ -252,10 +322,13 @@ int main(int argc, char *argv[]){
 		
 
 		// sleepy time
-		rc_usleep(LOOP_SLEEP_US);
+		rc_periodic_wait(&loop);
 	}
 
-	// exit
+	// exit, a zero time tells readers nothing is being published
+	state.t_ns = 0;
+	battery_shm_publish(&state);
+	rc_periodic_cleanup(&loop);
 	illuminate_leds(0);
 	printf("battery_monitor exiting cleanly\n");
 	remove(PID_FILE);
@@ -327,43 +400,17 @@ int kill_existing_instance(){
 
 
 void illuminate_leds(int i){
-	switch(i){
-	// now illuminate LEDs properly
-	case 4:
-		rc_gpio_set_value_mmap(BATT_LED_1,HIGH);
-		rc_gpio_set_value_mmap(batt_led_2,HIGH);
-		rc_gpio_set_value_mmap(BATT_LED_3,HIGH);
-		rc_gpio_set_value_mmap(BATT_LED_4,HIGH);
-		break;
-	case 3:
-		rc_gpio_set_value_mmap(BATT_LED_1,HIGH);
-		rc_gpio_set_value_mmap(batt_led_2,HIGH);
-		rc_gpio_set_value_mmap(BATT_LED_3,HIGH);
-		rc_gpio_set_value_mmap(BATT_LED_4,LOW);
-		break;
-	case 2:
-		rc_gpio_set_value_mmap(BATT_LED_1,HIGH);
-		rc_gpio_set_value_mmap(batt_led_2,HIGH);
-		rc_gpio_set_value_mmap(BATT_LED_3,LOW);
-		rc_gpio_set_value_mmap(BATT_LED_4,LOW);
-		break;
-	case 1:
-		rc_gpio_set_value_mmap(BATT_LED_1,HIGH);
-		rc_gpio_set_value_mmap(batt_led_2,LOW);
-		rc_gpio_set_value_mmap(BATT_LED_3,LOW);
-		rc_gpio_set_value_mmap(BATT_LED_4,LOW);
-		break;
-	case 0:
-		rc_gpio_set_value_mmap(BATT_LED_1,LOW);
-		rc_gpio_set_value_mmap(batt_led_2,LOW);
-		rc_gpio_set_value_mmap(BATT_LED_3,LOW);
-		rc_gpio_set_value_mmap(BATT_LED_4,LOW);
-		break;
-	default:
+	int pins[4] = {BATT_LED_1, batt_led_2, BATT_LED_3, BATT_LED_4};
+	int values[4];
+	int j;
+	if(i<0 || i>4){
 		fprintf(stderr,"ERROR in rc_battery_monitor, can only illuminate between 0 and 4 leds\n");
 		fprintf(stderr,"attempted %d\n", i);
-		break;
+		return;
 	}
+	// light the first i leds, all four change in one batched write
+	for(j=0;j<4;j++) values[j] = (j<i) ? HIGH : LOW;
+	rc_gpio_set_values(4, pins, values);
 	return;
 }
 
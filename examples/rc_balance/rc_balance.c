@@ -89,6 +89,7 @@ core_state_t cstate;
 setpoint_t setpoint;
 rc_filter_t D1, D2, D3;
 rc_imu_data_t imu_data;
+rc_periodic_t setpoint_loop, battery_loop, printf_loop_timing;
 
 /*******************************************************************************
 * main()
@@ -211,6 +212,10 @@ int main(){
 	rc_free_filter(&D2);
 	rc_free_filter(&D3);
 	rc_power_off_imu();
+	if(isatty(fileno(stdout))) rc_print_periodic_stats();
+	rc_periodic_cleanup(&setpoint_loop);
+	rc_periodic_cleanup(&battery_loop);
+	rc_periodic_cleanup(&printf_loop_timing);
 	rc_cleanup();
 	return 0;
 }
@@ -232,9 +237,10 @@ void* setpoint_manager(void* ptr){
 	rc_set_led(RED,0);
 	rc_set_led(GREEN,1);
 	
+	rc_periodic_init(&setpoint_loop, "setpoint", SETPOINT_MANAGER_HZ);
 	while(rc_get_state()!=EXITING){
-		// sleep at beginning of loop so we can use the 'continue' statement
-		rc_usleep(1000000/SETPOINT_MANAGER_HZ); 
+		// wait at beginning of loop so we can use the 'continue' statement
+		rc_periodic_wait(&setpoint_loop);
 		
 		// nothing to do if paused, go back to beginning of loop
 		if(rc_get_state() != RUNNING) continue;
@@ -489,12 +495,13 @@ int wait_for_starting_condition(){
 *******************************************************************************/
 void* battery_checker(void* ptr){
 	float new_v;
+	rc_periodic_init(&battery_loop, "battery", BATTERY_CHECK_HZ);
 	while(rc_get_state()!=EXITING){
 		new_v = rc_battery_voltage();
 		// if the value doesn't make sense, use nominal voltage
 		if (new_v>9.0 || new_v<5.0) new_v = V_NOMINAL;
 		cstate.vBatt = new_v;
-		rc_usleep(1000000 / BATTERY_CHECK_HZ);
+		rc_periodic_wait(&battery_loop);
 	}
 	return NULL;
 }
@@ -508,6 +515,7 @@ void* battery_checker(void* ptr){
 void* printf_loop(void* ptr){
 	rc_state_t last_rc_state, new_rc_state; // keep track of last state 
 	last_rc_state = rc_get_state();
+	rc_periodic_init(&printf_loop_timing, "printf", PRINTF_HZ);
 	while(rc_get_state()!=EXITING){
 		new_rc_state = rc_get_state();
 		// check if this is the first time since being paused
@@ -545,7 +553,7 @@ void* printf_loop(void* ptr){
 			else printf("DISARMED |");
 			fflush(stdout);
 		}
-		rc_usleep(1000000 / PRINTF_HZ);
+		rc_periodic_wait(&printf_loop_timing);
 	}
 	return NULL;
 } 
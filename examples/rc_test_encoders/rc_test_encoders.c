@@ -1,7 +1,7 @@
 /*******************************************************************************
 * rc_test_encoders.c
 *
-* Prints out current encoder ticks for all 4 channels
+* Prints out current encoder ticks and velocity for all 4 channels
 * channels 1-3 are counted using eQEP 0-2. Channel 4 is counted by PRU0
 *******************************************************************************/
 
@@ -17,11 +17,15 @@ int main(){
 		return -1;
 	}
 
-	printf("\nRaw encoder positions\n");
+	printf("\nRaw encoder positions and velocity (counts/s)\n");
 	printf("   E1   |");
 	printf("   E2   |");
 	printf("   E3   |");
 	printf("   E4   |");
+	printf("  V1    |");
+	printf("  V2    |");
+	printf("  V3    |");
+	printf("  V4    |");
 	printf(" \n");
 
 	while(rc_get_state() != EXITING){
@@ -29,6 +33,9 @@ int main(){
 		for(i=1;i<=4;i++){
 			printf("%6d  |", rc_get_encoder_pos(i));
 		}
+		for(i=1;i<=4;i++){
+			printf("%7.0f |", rc_get_encoder_velocity(i));
+		}
 		fflush(stdout);
 		rc_usleep(50000);
 	}
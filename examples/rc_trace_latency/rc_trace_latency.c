@@ -0,0 +1,130 @@
+/*******************************************************************************
+* rc_trace_latency.c
+*
+* Measures the latency from the IMU interrupt edge through the DMP fifo read
+* and the user callback to the motor and servo writes using the library's
+* trace points. When done, per-stage latency histograms are printed and the
+* raw events are written as Chrome trace JSON for chrome://tracing or
+* ui.perfetto.dev. Motors are left in standby and commanded to 0 duty so this
+* is safe to run with everything connected.
+*******************************************************************************/
+
+#include "../../libraries/rc_usefulincludes.h"
+#include "../../libraries/roboticscape.h"
+
+// Global Variables
+rc_imu_data_t data;
+int use_servos = 0;
+
+// local functions
+void print_usage();
+void imu_callback(); // imu interrupt function
+
+/*******************************************************************************
+* void print_usage()
+*
+* Printed if some invalid argument was given, or -h option given.
+*******************************************************************************/
+void print_usage(){
+	printf("\n Options\n");
+	printf("-r {rate}	Set IMU sample rate in HZ (default 100)\n");
+	printf("-t {seconds}	Seconds to record for (default 10)\n");
+	printf("-o {file}	Chrome trace output file (default trace.json)\n");
+	printf("-n {events}	Events kept per thread (default 4096)\n");
+	printf("-s		Also send 1500us servo pulses from the callback,\n");
+	printf("		don't use this with ESCs connected\n");
+	printf("-h		Print this help message\n\n");
+	return;
+}
+
+/*******************************************************************************
+* void imu_callback()
+*
+* Stands in for a controller, writes all motors and optionally servos so the
+* interrupt-to-actuator latency shows up in the trace.
+*******************************************************************************/
+void imu_callback(){
+	rc_set_motor_all(0.0);
+	if(use_servos) rc_send_servo_pulse_us_all(1500);
+	return;
+}
+
+/*******************************************************************************
+* int main()
+*
+* parses options, records for the requested time, then dumps the trace
+*******************************************************************************/
+int main(int argc, char *argv[]){
+	int c, sample_rate, events = 0;
+	double seconds = 10.0;
+	char* path = "trace.json";
+	uint64_t end;
+	rc_imu_config_t conf = rc_default_imu_config();
+
+	// parse arguments
+	opterr = 0;
+	while ((c=getopt(argc, argv, "r:t:o:n:sh"))!=-1 && argc>1){
+		switch (c){
+		case 'r': // sample rate option
+			sample_rate = atoi(optarg);
+			if(sample_rate>200 || sample_rate<4){
+				printf("sample_rate must be between 4 & 200\n");
+				return -1;
+			}
+			conf.dmp_sample_rate = sample_rate;
+			break;
+		case 't':
+			seconds = atof(optarg);
+			if(seconds<=0){
+				printf("seconds must be >0\n");
+				return -1;
+			}
+			break;
+		case 'o':
+			path = optarg;
+			break;
+		case 'n':
+			events = atoi(optarg);
+			break;
+		case 's':
+			use_servos = 1;
+			break;
+		case 'h':
+			print_usage();
+			return 0;
+		default:
+			printf("invalid argument\n");
+			print_usage();
+			return -1;
+		}
+	}
+
+	if(rc_initialize()){
+		fprintf(stderr,"ERROR: failed to run rc_initialize(), are you root?\n");
+		return -1;
+	}
+	if(rc_trace_enable(events)){
+		rc_cleanup();
+		return -1;
+	}
+	if(rc_initialize_imu_dmp(&data, conf)){
+		printf("rc_initialize_imu_failed\n");
+		rc_cleanup();
+		return -1;
+	}
+	rc_set_imu_interrupt_func(&imu_callback);
+
+	printf("recording for %.1f seconds\n", seconds);
+	end = rc_nanos_since_boot() + (uint64_t)(seconds*1000000000.0);
+	while(rc_get_state()!=EXITING && rc_nanos_since_boot()<end){
+		rc_usleep(100000);
+	}
+	rc_trace_disable();
+
+	rc_print_trace_latencies();
+	if(rc_write_trace_json(path)==0) printf("\nwrote %s\n", path);
+
+	rc_power_off_imu();
+	rc_cleanup();
+	return 0;
+}
@@ -5,10 +5,18 @@
 #include "../roboticscape.h"
 #include "../rc_defs.h"
 #include "rc_bmp280_defs.h"
+#include "../mpu9250/rc_mpu9250.h"
 
 #include <stdio.h>
 #include <math.h>
 #include <unistd.h>
+#include <pthread.h>
+
+// service reads status through the data registers in one transaction
+#define BMP_SERVICE_FIRST_REG	BMP280_STATUS_REG
+#define BMP_SERVICE_LEN			(BMP280_TEMPERATURE_XLSB-BMP280_STATUS_REG+1)
+#define BMP_SERVICE_MIN_HZ		1.0
+#define BMP_STANDBY_NS			500000	// normal mode standby with BMP280_TSB_0
 
 typedef struct bmp280_cal_t{
     uint16_t dig_T1;
@@ -41,6 +49,34 @@ typedef struct bmp280_data_t{
 bmp280_cal_t cal;
 bmp280_data_t data;
 
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+static int initialized = 0;
+static uint8_t ctrl_meas;			// normal mode setting from initialization
+static uint8_t config_reg;			// standby and IIR filter from initialization
+static rc_periodic_t service_task;
+static volatile int service_running = 0;
+static uint8_t forced_meas;			// ctrl_meas value that starts a conversion
+static uint64_t meas_typ_ns, meas_max_ns, service_period_ns;
+static uint64_t trigger_ns;			// when the pending conversion was started
+static float filter_tc;
+static rc_bmp_sample_t latest;
+static int filter_started;
+static pthread_mutex_t sample_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*******************************************************************************
+* Local Function Declarations
+*******************************************************************************/
+static int compensate(int32_t adc_T, int32_t adc_P, int32_t* T, uint32_t* P);
+static int compensate_batch(int32_t* adc_T, int32_t* adc_P, int n, int32_t* T, \
+																	float* P);
+static int pressure_coeffs(int64_t t_fine, int64_t* div, int64_t* off);
+static void conversion_ns(uint8_t oversample, uint64_t* typ, uint64_t* max);
+static int write_config(uint8_t config);
+static void publish(int32_t T, uint32_t P, uint64_t t_ns);
+static void service_func();
+
 
 /*******************************************************************************
 * int rc_initialize_barometer(rc_bmp_oversample_t oversample, rc_bmp_filter_t filter)
@@ -52,8 +88,8 @@ int rc_initialize_barometer(rc_bmp_oversample_t oversample, rc_bmp_filter_t filt
 	uint8_t buf[24];
 	uint8_t c;
 	int i;
-	// make sure the bus is not currently in use by another thread
-	// do not proceed to prevent interfering with that process
+	// another thread may be using the bus, rc_i2c_claim_bus() below waits
+	// for it to finish so just let the user know
 	if(rc_i2c_get_in_use_state(BMP_BUS)){
 		printf("i2c bus claimed by another process\n");
 		printf("Continuing with rc_initialize_barometer() anyway.\n");
@@ -66,9 +102,8 @@ int rc_initialize_barometer(rc_bmp_oversample_t oversample, rc_bmp_filter_t filt
 		return -1;
 	}
 
-	// claiming the bus does no guarantee other code will not interfere 
-	// with this process, but best to claim it so other code can check
-	// like we did above
+	// hold the bus through the reset, calibration read and setup so no
+	// other thread's transactions land in between
 	rc_i2c_claim_bus(BMP_BUS);
 	
 	// reset the barometer
@@ -99,6 +134,7 @@ int rc_initialize_barometer(rc_bmp_oversample_t oversample, rc_bmp_filter_t filt
 	c = BMP_MODE_NORMAL;
 	c |= BMP_TEMP_OVERSAMPLE_1;
 	c |= oversample;
+	ctrl_meas = c;
 	// write the measurement control register
 	if(rc_i2c_write_byte(BMP_BUS,BMP280_CTRL_MEAS,c)<0){
 		printf("ERROR: can't write to bmp measurement control register\n");
@@ -110,6 +146,7 @@ int rc_initialize_barometer(rc_bmp_oversample_t oversample, rc_bmp_filter_t filt
 	// set up the filter config register
 	c = BMP280_TSB_0; 	// minimal sleep delay between samples
 	c |= filter;		// user selectable filter coefficient
+	config_reg = c;
 	if(rc_i2c_write_byte(BMP_BUS,BMP280_CONFIG,c)<0){
 		printf("failed to write to bmp_config register\n");
 		printf("aborting initialize_bmp\n");
@@ -123,7 +160,7 @@ int rc_initialize_barometer(rc_bmp_oversample_t oversample, rc_bmp_filter_t filt
 	i = 0;
 	c = BMP280_IM_UPDATE_STATUS;
 	do{
-		usleep(20000);
+		rc_usleep(20000);
 		if(rc_i2c_read_byte(BMP_BUS, BMP280_STATUS_REG	, &c)<0){
 			printf("ERROR: can't read status byte from barometer\n");
 			printf("aborting initialize_bmp\n");
@@ -161,12 +198,13 @@ int rc_initialize_barometer(rc_bmp_oversample_t oversample, rc_bmp_filter_t filt
 	
 	// use default for now unless use sets it otherwise
 	cal.sea_level_pa = DEFAULT_SEA_LEVEL_PA; 
+	initialized = 1;
 	
 	// release control of the bus
 	rc_i2c_release_bus(BMP_BUS);
 
 	// wait for the barometer to settle and get its first internal read.
-	usleep(50000);
+	rc_usleep(50000);
 
 	// read in data to it's ready for the user to access right away
 	if(rc_read_barometer()<0){
@@ -184,12 +222,8 @@ int rc_initialize_barometer(rc_bmp_oversample_t oversample, rc_bmp_filter_t filt
 * Puts the barometer into low power standby
 *******************************************************************************/
 int rc_power_off_barometer(){
-	// make sure the bus is not currently in use by another thread
-	// do not proceed to prevent interfering with that process
-	if(rc_i2c_get_in_use_state(BMP_BUS)){
-		printf("i2c bus claimed by another process\n");
-		printf("Continuing with rc_initialize_barometer() anyway.\n");
-	}
+	rc_bmp_stop_service();
+	initialized = 0;
 	// set the i2c address
 	if(rc_i2c_set_device_address(BMP_BUS, BMP_ADDR)<0){
 		printf("ERROR: failed to set the i2c device address\n");
@@ -219,74 +253,31 @@ int rc_power_off_barometer(){
 * returns 0 on success, otherwise -1.
 *******************************************************************************/
 int rc_read_barometer(){
-	int64_t var1, var2, var3, var4, t_fine, T, p;
 	uint8_t raw[6];
-	int32_t adc_P, adc_T;
-	
-	// check claim bus state to avoid stepping on IMU reads
-	if(rc_i2c_get_in_use_state(BMP_BUS)){
-		printf("WARNING: i2c bus is claimed, aborting rc_read_barometer\n");
-		return -1;
-	}
+	int32_t adc_P, adc_T, T;
+	uint32_t P;
 	
-	// claim bus for ourselves and set the device address
-	rc_i2c_claim_bus(BMP_BUS);
+	// the service keeps the values up to date already
+	if(service_running) return 0;
+
+	// set the device address for this thread
 	if(rc_i2c_set_device_address(BMP_BUS, BMP_ADDR)<0){
 		printf("ERROR: failed to set the i2c device address\n");
-		rc_i2c_release_bus(BMP_BUS);
 		return -1;
 	}
 	
-	// if new data is ready, read it in
+	// one transaction, it waits behind IMU reads if they are queued
 	if(rc_i2c_read_bytes(BMP_BUS,BMP280_PRESSURE_MSB,6,raw)<0){
 		printf("ERROR: failed to read barometer data registers\n");
-		rc_i2c_release_bus(BMP_BUS);
 		return -1;
 	}
 	
-	// we got the data, so we release the bus
-	rc_i2c_release_bus(BMP_BUS);
-	
-	// run the numbers, thanks to Bosch for putting this code in their datasheet
 	adc_P = (raw[0] << 12)|
 			(raw[1] << 4)|(raw[2] >> 4);
 	adc_T = (raw[3] << 12)|
 			(raw[4] << 4)|(raw[5] >> 4);
-	
-	var1  = ((((adc_T>>3) - ((int32_t)cal.dig_T1 <<1))) *
-			((int32_t)cal.dig_T2)) >> 11;
-	var2  = (((((adc_T>>4) - ((int32_t)cal.dig_T1)) *
-			((adc_T>>4) - ((int32_t)cal.dig_T1))) >> 12) *
-			((int32_t)cal.dig_T3)) >> 14;
-			   
-	t_fine = var1 + var2;
-	
-	T  = (t_fine * 5 + 128) >> 8;
-	data.temp =  T/100.0;
-
-	var3 = ((int64_t)t_fine) - 128000;
-	var4 = var3 * var3 * (int64_t)cal.dig_P6;
-	var4 = var4 + ((var3*(int64_t)cal.dig_P5)<<17);
-	var4 = var4 + (((int64_t)cal.dig_P4)<<35);
-	var3 = ((var3 * var3 * (int64_t)cal.dig_P3)>>8) +
-		   ((var3 * (int64_t)cal.dig_P2)<<12);
-	var3 = (((((int64_t)1)<<47)+var3))*((int64_t)cal.dig_P1)>>33;
-
-	if (var3 == 0){
-		return 0;  // avoid exception caused by division by zero
-	}
-  
-	p = 1048576 - adc_P;
-	p = (((p<<31) - var4)*3125) / var3;
-	var3 = (((int64_t)cal.dig_P9) * (p >> 13) * (p >> 13)) >> 25;
-	var4 = (((int64_t)cal.dig_P8) * p) >> 19;
-
-	p = ((p + var3 + var4) >> 8) + (((int64_t)cal.dig_P7) << 4);
-	data.pressure = (float)p/256;
-	
-
-	data.alt = 44330.0*(1.0 - pow((data.pressure/cal.sea_level_pa), 0.1903));
-
+	if(compensate(adc_T, adc_P, &T, &P)) return 0;
+	publish(T, P, rc_nanos_since_boot());
 	return 0;
 }
 
@@ -341,4 +332,394 @@ int rc_set_sea_level_pressure_pa(float pa){
 	return 0;
 }
 
+/*******************************************************************************
+* int rc_bmp_start_service(rc_bmp_oversample_t oversample, double rate_hz,
+*														float filter_tc)
+*
+* Switches the barometer to forced mode and starts a background task that
+* starts one conversion per period and reads it back on the next. Each read
+* is done straight after an IMU FIFO read so it never holds up the IMU.
+*******************************************************************************/
+int rc_bmp_start_service(rc_bmp_oversample_t oversample, double rate_hz, \
+														float filter_tc){
+	if(!initialized){
+		fprintf(stderr,"ERROR in rc_bmp_start_service, barometer not initialized\n");
+		return -1;
+	}
+	if(service_running){
+		fprintf(stderr,"ERROR in rc_bmp_start_service, already running\n");
+		return -1;
+	}
+	if(oversample<BMP_OVERSAMPLE_1 || oversample>BMP_OVERSAMPLE_16){
+		fprintf(stderr,"ERROR in rc_bmp_start_service, invalid oversample\n");
+		return -1;
+	}
+	conversion_ns(oversample, &meas_typ_ns, &meas_max_ns);
+	if(rate_hz<BMP_SERVICE_MIN_HZ || rate_hz>1e9/meas_max_ns){
+		fprintf(stderr,"ERROR in rc_bmp_start_service, rate must be between %d and %d hz\n",\
+						(int)BMP_SERVICE_MIN_HZ, (int)(1e9/meas_max_ns));
+		fprintf(stderr,"for this oversample\n");
+		return -1;
+	}
+	service_period_ns = 1e9/rate_hz;
+	forced_meas = BMP_TEMP_OVERSAMPLE_1 | oversample | BMP_MODE_FORCED;
+	filter_tc = filter_tc>0.0f ? filter_tc : 0.0f;
+	filter_started = 0;
+
+	// forced mode only works from sleep, then kick off the first conversion
+	rc_i2c_set_device_address(BMP_BUS, BMP_ADDR);
+	if(rc_i2c_write_byte(BMP_BUS, BMP280_CTRL_MEAS, BMP_MODE_SLEEP) || \
+		rc_i2c_write_byte(BMP_BUS, BMP280_CTRL_MEAS, forced_meas)){
+		fprintf(stderr,"ERROR in rc_bmp_start_service, failed to start conversion\n");
+		return -1;
+	}
+	trigger_ns = rc_nanos_since_boot();
+	service_running = 1;
+	if(rc_start_periodic_task(&service_task, "bmp", rate_hz, service_func, 0, -1)){
+		service_running = 0;
+		rc_i2c_write_byte(BMP_BUS, BMP280_CTRL_MEAS, ctrl_meas);
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_bmp_stop_service()
+*
+* stops the background task and puts the barometer back in normal mode so
+* rc_read_barometer() works as before
+*******************************************************************************/
+int rc_bmp_stop_service(){
+	if(!service_running) return 0;
+	service_running = 0;
+	if(service_task.func!=NULL) rc_stop_periodic_task(&service_task);
+	rc_i2c_set_device_address(BMP_BUS, BMP_ADDR);
+	if(rc_i2c_write_byte(BMP_BUS, BMP280_CTRL_MEAS, ctrl_meas)){
+		fprintf(stderr,"ERROR in rc_bmp_stop_service, failed to restore normal mode\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_bmp_get_sample(rc_bmp_sample_t* sample)
+*
+* copies the newest sample from the service or rc_read_barometer()
+*******************************************************************************/
+int rc_bmp_get_sample(rc_bmp_sample_t* sample){
+	if(sample==NULL){
+		fprintf(stderr,"ERROR in rc_bmp_get_sample, received NULL pointer\n");
+		return -1;
+	}
+	pthread_mutex_lock(&sample_mutex);
+	*sample = latest;
+	pthread_mutex_unlock(&sample_mutex);
+	if(sample->seq==0){
+		fprintf(stderr,"ERROR in rc_bmp_get_sample, no samples yet\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_read_barometer_burst(int n, rc_bmp_burst_t* burst)
+*
+* Reads n conversions from normal mode, one per measurement cycle, then
+* compensates and averages them as a batch. The IIR filter is off for the
+* burst, filtered samples are correlated and would make the noise estimate
+* and the error of the mean look smaller than they are.
+*******************************************************************************/
+int rc_read_barometer_burst(int n, rc_bmp_burst_t* burst){
+	int32_t adc_T[RC_BMP_MAX_BURST], adc_P[RC_BMP_MAX_BURST], T;
+	float P[RC_BMP_MAX_BURST];
+	uint8_t raw[6];
+	uint64_t typ, max, cycle, t_first, t_last, now;
+	double sum, mean, var;
+	float slope;
+	int i, ret, unfiltered = 0;
+	if(burst==NULL){
+		fprintf(stderr,"ERROR in rc_read_barometer_burst, received NULL pointer\n");
+		return -1;
+	}
+	if(n<2 || n>RC_BMP_MAX_BURST){
+		fprintf(stderr,"ERROR in rc_read_barometer_burst, n must be between 2 and %d\n",\
+															RC_BMP_MAX_BURST);
+		return -1;
+	}
+	if(!initialized || service_running){
+		fprintf(stderr,"ERROR in rc_read_barometer_burst, barometer not initialized or service running\n");
+		return -1;
+	}
+	// wait a worst case cycle between reads so none is read twice
+	conversion_ns(ctrl_meas&BMP_PRES_OVERSAMPLE_MASK, &typ, &max);
+	cycle = max + BMP_STANDBY_NS;
+	if(rc_i2c_set_device_address(BMP_BUS, BMP_ADDR)<0){
+		fprintf(stderr,"ERROR in rc_read_barometer_burst, failed to set the i2c device address\n");
+		return -1;
+	}
+	if(config_reg&BMP280_FILTER_MASK){
+		if(write_config(config_reg&~BMP280_FILTER_MASK)){
+			fprintf(stderr,"ERROR in rc_read_barometer_burst, failed to turn off the filter\n");
+			write_config(config_reg);
+			return -1;
+		}
+		unfiltered = 1;
+	}
+	// after restarting normal mode the first conversion is a cycle away too
+	t_first = t_last = rc_nanos_since_boot();
+	ret = 0;
+	for(i=0;i<n;i++){
+		if(i>0 || unfiltered){
+			now = rc_nanos_since_boot();
+			if(t_last+cycle>now) rc_nanosleep(t_last+cycle-now);
+			t_last = rc_nanos_since_boot();
+			if(i==0) t_first = t_last;
+		}
+		if(rc_i2c_read_bytes(BMP_BUS, BMP280_PRESSURE_MSB, 6, raw)<0){
+			fprintf(stderr,"ERROR in rc_read_barometer_burst, failed to read data registers\n");
+			ret = -1;
+			break;
+		}
+		adc_P[i] = (raw[0] << 12)|
+				(raw[1] << 4)|(raw[2] >> 4);
+		adc_T[i] = (raw[3] << 12)|
+				(raw[4] << 4)|(raw[5] >> 4);
+	}
+	if(unfiltered && write_config(config_reg)){
+		fprintf(stderr,"ERROR in rc_read_barometer_burst, failed to restore the filter\n");
+		ret = -1;
+	}
+	if(ret) return -1;
+	if(compensate_batch(adc_T, adc_P, n, &T, P)){
+		fprintf(stderr,"ERROR in rc_read_barometer_burst, invalid calibration\n");
+		return -1;
+	}
+
+	sum = 0.0;
+	for(i=0;i<n;i++) sum += P[i];
+	mean = sum/n;
+	var = 0.0;
+	for(i=0;i<n;i++) var += (P[i]-mean)*(P[i]-mean);
+	var /= n-1;
+	// each read returns the conversion finished during the cycle before it
+	publish(T, (uint32_t)(mean*256.0 + 0.5), (t_first+t_last)/2 - cycle/2);
+
+	burst->t_ns = latest.t_ns;
+	burst->n = n;
+	burst->temp_c = data.temp;
+	burst->pressure_pa = data.pressure;
+	burst->pressure_std_pa = sqrt(var);
+	burst->alt_m = data.alt;
+	// slope of the altitude formula in publish() at this pressure
+	slope = 44330.0*0.1903*pow(data.pressure/cal.sea_level_pa, 0.1903-1.0) \
+															/ cal.sea_level_pa;
+	burst->alt_std_m = slope*sqrt(var/n);
+	return 0;
+}
+
+/*******************************************************************************
+* static void service_func()
+*
+* Periodic task body. The status register comes back in the same read as the
+* data so a conversion that hasn't finished is never published, it is picked
+* up on the next period instead.
+*******************************************************************************/
+static void service_func(){
+	uint8_t buf[BMP_SERVICE_LEN];
+	uint8_t* raw = &buf[BMP280_PRESSURE_MSB-BMP_SERVICE_FIRST_REG];
+	int32_t adc_P, adc_T, T;
+	uint32_t P;
+	uint64_t t;
+
+	// go right after an IMU read so the bus is free for both transactions
+	imu_wait_for_read(service_period_ns/4);
+	rc_i2c_set_device_address(BMP_BUS, BMP_ADDR);
+	rc_i2c_claim_bus(BMP_BUS);
+	if(rc_i2c_read_bytes(BMP_BUS, BMP_SERVICE_FIRST_REG, BMP_SERVICE_LEN, buf) \
+														!=BMP_SERVICE_LEN){
+		rc_i2c_release_bus(BMP_BUS);
+		return;
+	}
+	if(buf[0]&BMP280_MEAS_STATUS){
+		rc_i2c_release_bus(BMP_BUS);
+		return;
+	}
+	t = trigger_ns;
+	if(rc_i2c_write_byte(BMP_BUS, BMP280_CTRL_MEAS, forced_meas)==0){
+		trigger_ns = rc_nanos_since_boot();
+	}
+	else trigger_ns = 0;
+	rc_i2c_release_bus(BMP_BUS);
+	// nothing was converting if the last trigger failed
+	if(t==0) return;
+
+	adc_P = (raw[0] << 12)|
+			(raw[1] << 4)|(raw[2] >> 4);
+	adc_T = (raw[3] << 12)|
+			(raw[4] << 4)|(raw[5] >> 4);
+	if(compensate(adc_T, adc_P, &T, &P)) return;
+	// stamp the middle of the conversion
+	publish(T, P, t + meas_typ_ns/2);
+}
+
+/*******************************************************************************
+* static int compensate(int32_t adc_T, int32_t adc_P, int32_t* T, uint32_t* P)
+*
+* Bosch's integer compensation. T comes out in 0.01 degC and P in pascals
+* as Q24.8 fixed point. Returns -1 if the calibration would divide by zero.
+*******************************************************************************/
+static int compensate(int32_t adc_T, int32_t adc_P, int32_t* T, uint32_t* P){
+	int64_t var1, var2, var3, var4, t_fine, p;
+
+	// run the numbers, thanks to Bosch for putting this code in their datasheet
+	var1  = ((((adc_T>>3) - ((int32_t)cal.dig_T1 <<1))) *
+			((int32_t)cal.dig_T2)) >> 11;
+	var2  = (((((adc_T>>4) - ((int32_t)cal.dig_T1)) *
+			((adc_T>>4) - ((int32_t)cal.dig_T1))) >> 12) *
+			((int32_t)cal.dig_T3)) >> 14;
+			   
+	t_fine = var1 + var2;
+	
+	*T  = (t_fine * 5 + 128) >> 8;
+
+	if(pressure_coeffs(t_fine, &var3, &var4)) return -1;
+  
+	p = 1048576 - adc_P;
+	p = (((p<<31) - var4)*3125) / var3;
+	var3 = (((int64_t)cal.dig_P9) * (p >> 13) * (p >> 13)) >> 25;
+	var4 = (((int64_t)cal.dig_P8) * p) >> 19;
+
+	*P = ((p + var3 + var4) >> 8) + (((int64_t)cal.dig_P7) << 4);
+	return 0;
+}
+
+/*******************************************************************************
+* static int compensate_batch(int32_t* adc_T, int32_t* adc_P, int n,
+*												int32_t* T, float* P)
+*
+* Compensation for a batch, T for the batch in 0.01 degC and each P in
+* pascals. Temperature can't move measurably within a burst so the pressure
+* coefficients are worked out once from the mean with the same 64 bit
+* numbers as compensate(). What is left per sample is a line and a small
+* quadratic correction in 32 bit floats, plain loops which gcc vectorizes
+* with NEON instead of a 64 bit software divide per sample. Returns -1 if
+* the calibration would divide by zero.
+*******************************************************************************/
+static int compensate_batch(int32_t* adc_T, int32_t* adc_P, int n, int32_t* T, \
+																	float* P){
+	int32_t t_fine[RC_BMP_MAX_BURST];
+	int32_t var1, var2, dT;
+	int64_t sum = 0, div, off;
+	float gain, x0, p;
+	int i;
+
+	for(i=0;i<n;i++){
+		var1 = (((adc_T[i]>>3) - ((int32_t)cal.dig_T1<<1)) * \
+											((int32_t)cal.dig_T2)) >> 11;
+		dT = (adc_T[i]>>4) - (int32_t)cal.dig_T1;
+		var2 = (((dT*dT) >> 12) * ((int32_t)cal.dig_T3)) >> 14;
+		t_fine[i] = var1 + var2;
+	}
+	for(i=0;i<n;i++) sum += t_fine[i];
+	*T = ((sum/n)*5 + 128) >> 8;
+	if(pressure_coeffs(sum/n, &div, &off)) return -1;
+
+	// compensate() computes ((x<<31) - off)*3125/div with x = 1048576-adc_P
+	// in 1/65536 Pa, written as gain*(x-x0) so the float subtraction doesn't
+	// cancel
+	gain = 3125.0*2147483648.0/div;
+	x0 = off/2147483648.0;
+	for(i=0;i<n;i++){
+		p = gain*((float)(1048576-adc_P[i]) - x0);
+		P[i] = (p + cal.dig_P9*(p*p)*(1.0f/(8192.0f*8192.0f*33554432.0f)) + \
+				cal.dig_P8*p*(1.0f/524288.0f))*(1.0f/65536.0f) + cal.dig_P7/16.0f;
+	}
+	return 0;
+}
 
+/*******************************************************************************
+* static int pressure_coeffs(int64_t t_fine, int64_t* div, int64_t* off)
+*
+* The temperature dependent part of Bosch's 64 bit pressure compensation.
+* Returns -1 if the calibration would divide by zero.
+*******************************************************************************/
+static int pressure_coeffs(int64_t t_fine, int64_t* div, int64_t* off){
+	int64_t var3, var4;
+	var3 = t_fine - 128000;
+	var4 = var3 * var3 * (int64_t)cal.dig_P6;
+	var4 = var4 + ((var3*(int64_t)cal.dig_P5)<<17);
+	var4 = var4 + (((int64_t)cal.dig_P4)<<35);
+	var3 = ((var3 * var3 * (int64_t)cal.dig_P3)>>8) +
+		   ((var3 * (int64_t)cal.dig_P2)<<12);
+	var3 = (((((int64_t)1)<<47)+var3))*((int64_t)cal.dig_P1)>>33;
+	if (var3 == 0){
+		return -1;  // avoid exception caused by division by zero
+	}
+	*div = var3;
+	*off = var4;
+	return 0;
+}
+
+/*******************************************************************************
+* static void conversion_ns(uint8_t oversample, uint64_t* typ, uint64_t* max)
+*
+* conversion times from the datasheet with 1x temperature oversampling
+*******************************************************************************/
+static void conversion_ns(uint8_t oversample, uint64_t* typ, uint64_t* max){
+	uint64_t osr = 1<<((oversample>>2)-1);
+	*typ = (3500 + 2000*osr)*1000;
+	*max = (4125 + 2300*osr)*1000;
+}
+
+/*******************************************************************************
+* static int write_config(uint8_t config)
+*
+* Writes the config register, which the BMP280 may ignore in normal mode, by
+* going through sleep mode. Restarting normal mode also restarts the filter.
+*******************************************************************************/
+static int write_config(uint8_t config){
+	if(rc_i2c_write_byte(BMP_BUS, BMP280_CTRL_MEAS, \
+							(ctrl_meas&~BMP_MODE_NORMAL)|BMP_MODE_SLEEP)<0 || \
+		rc_i2c_write_byte(BMP_BUS, BMP280_CONFIG, config)<0 || \
+		rc_i2c_write_byte(BMP_BUS, BMP280_CTRL_MEAS, ctrl_meas)<0){
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* static void publish(int32_t T, uint32_t P, uint64_t t_ns)
+*
+* Updates the values behind the rc_bmp_get functions and the latest sample.
+* With a filter time constant the altitude goes through a critically damped
+* alpha-beta filter which also gives the vertical speed.
+*******************************************************************************/
+static void publish(int32_t T, uint32_t P, uint64_t t_ns){
+	float dt, theta, r;
+	pthread_mutex_lock(&sample_mutex);
+	data.temp =  T/100.0;
+	data.pressure = (float)P/256;
+	data.alt = 44330.0*(1.0 - pow((data.pressure/cal.sea_level_pa), 0.1903));
+
+	if(service_running && filter_tc>0.0f){
+		if(!filter_started || t_ns<=latest.t_ns){
+			latest.filtered_alt_m = data.alt;
+			latest.vertical_speed_ms = 0.0f;
+			filter_started = 1;
+		}
+		else{
+			dt = (t_ns-latest.t_ns)*1e-9f;
+			theta = expf(-dt/filter_tc);
+			latest.filtered_alt_m += latest.vertical_speed_ms*dt;
+			r = data.alt - latest.filtered_alt_m;
+			latest.filtered_alt_m += (1.0f-theta*theta)*r;
+			latest.vertical_speed_ms += (1.0f-theta)*(1.0f-theta)*r/dt;
+		}
+	}
+	latest.t_ns = t_ns;
+	latest.temp_c = data.temp;
+	latest.pressure_pa = data.pressure;
+	latest.alt_m = data.alt;
+	latest.seq++;
+	pthread_mutex_unlock(&sample_mutex);
+}
@@ -35,6 +35,7 @@
 #define BMP280_FILTER_4			(0x02<<2)
 #define BMP280_FILTER_8			(0x03<<2)
 #define BMP280_FILTER_16		(0x04<<2)
+#define BMP280_FILTER_MASK		(0x07<<2)
 // SPI enable
 #define BMP280_SPI3W_EN			(0x01)
 
@@ -53,6 +54,7 @@
 #define BMP_PRES_OVERSAMPLE_4	(0x03<<2)
 #define BMP_PRES_OVERSAMPLE_8	(0x04<<2)
 #define BMP_PRES_OVERSAMPLE_16	(0x05<<2)
+#define BMP_PRES_OVERSAMPLE_MASK	(0x07<<2)
 // mode
 #define BMP_MODE_SLEEP			0x00
 #define BMP_MODE_FORCED			0x01
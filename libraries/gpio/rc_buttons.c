@@ -1,239 +1,364 @@
 /*******************************************************************************
 * rc_buttons.c
 *
-* 4 threads for managing the pause and press buttons
+* One thread services both buttons. Each button is a GPIO character device
+* event line (or a sysfs value fd on older kernels) in a single epoll set.
+* Debouncing is a per-button state machine driven by edge timestamps so the
+* first edge of a press is dispatched immediately and the bounce after it is
+* ignored, instead of sleeping and re-sampling the pin. Long-press and
+* double-click are derived from the same timestamps.
 *******************************************************************************/
 #define _GNU_SOURCE
 #include "../roboticscape.h"
 #include "../rc_defs.h"
 #include "../preprocessor_macros.h"
+#include "../other/rc_realtime.h"
 #include <pthread.h>
 #include <errno.h>
 #include <stdio.h>
-#include <poll.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <sys/epoll.h>
 
-#define POLL_BUF_LEN 1024
+#define BUTTON_PRIORITY (sched_get_priority_max(SCHED_FIFO)-5)
+#define NUM_BUTTONS 2
+#define DEFAULT_DEBOUNCE_US		5000
+#define DEFAULT_LONG_PRESS_MS	1000
+#define DEFAULT_DOUBLE_CLICK_MS	400
 
 // function pointers for button handlers
-void (*pause_pressed_func)(void)	= &rc_null_func;
-void (*pause_released_func)(void)	= &rc_null_func;
-void (*mode_pressed_func)(void)		= &rc_null_func;
-void (*mode_released_func)(void)	= &rc_null_func;
+void (*pause_pressed_func)(void)		= &rc_null_func;
+void (*pause_released_func)(void)		= &rc_null_func;
+void (*pause_long_press_func)(void)		= &rc_null_func;
+void (*pause_double_click_func)(void)	= &rc_null_func;
+void (*mode_pressed_func)(void)			= &rc_null_func;
+void (*mode_released_func)(void)		= &rc_null_func;
+void (*mode_long_press_func)(void)		= &rc_null_func;
+void (*mode_double_click_func)(void)	= &rc_null_func;
 
+/*******************************************************************************
+* Local Types
+*******************************************************************************/
+typedef struct button_t{
+	int pin;
+	const char* label;
+	rc_gpio_lines_t line;		// event line, fd is -1 when using sysfs
+	int sysfs_fd;				// sysfs value fd, -1 when using the event line
+	rc_button_state_t state;	// debounced state
+	uint64_t lockout_until;		// edges before this are bounce, 0 if idle
+	uint64_t pressed_at;		// time of the last debounced press
+	uint64_t first_click_at;	// press that may start a double-click, or 0
+	int long_press_sent;
+	void (**pressed_func)(void);
+	void (**released_func)(void);
+	void (**long_press_func)(void);
+	void (**double_click_func)(void);
+} button_t;
 
 /*******************************************************************************
-* local thread function declarations
+* Local Global Variables
 *******************************************************************************/
-void* pause_pressed_handler(void* ptr);
-void* pause_released_handler(void* ptr);
-void* mode_pressed_handler(void* ptr);
-void* mode_released_handler(void* ptr);
+static button_t buttons[NUM_BUTTONS] = {
+	{PAUSE_BTN, "pause_button", {.fd = -1}, -1, RELEASED, 0, 0, 0, 0, \
+		&pause_pressed_func, &pause_released_func, \
+		&pause_long_press_func, &pause_double_click_func},
+	{MODE_BTN, "mode_button", {.fd = -1}, -1, RELEASED, 0, 0, 0, 0, \
+		&mode_pressed_func, &mode_released_func, \
+		&mode_long_press_func, &mode_double_click_func}
+};
+static uint64_t debounce_ns		= DEFAULT_DEBOUNCE_US*1000ULL;
+static uint64_t long_press_ns	= DEFAULT_LONG_PRESS_MS*1000000ULL;
+static uint64_t double_click_ns	= DEFAULT_DOUBLE_CLICK_MS*1000000ULL;
+static int epoll_fd = -1;
+static pthread_t button_thread;
+static int button_thread_started = 0;
 
 /*******************************************************************************
-* local thread structs
+* Local Function Declarations
 *******************************************************************************/
-pthread_t pause_pressed_thread;
-pthread_t pause_released_thread;
-pthread_t mode_pressed_thread;
-pthread_t mode_released_thread;
+static void* button_handler(void* ptr);
+static int open_button(button_t* b);
+static void close_button(button_t* b);
+static int sample_button(button_t* b, rc_button_state_t* state);
+static void service_button(button_t* b);
+static void handle_edge(button_t* b, rc_button_state_t level, uint64_t t);
+static void run_timers(button_t* b, uint64_t now);
+static void commit_state(button_t* b, rc_button_state_t level, uint64_t t);
+static int next_timeout_ms(uint64_t now);
+static uint64_t monotonic_nanos();
 
 
 /*******************************************************************************
 *	int initialize_button_handlers()
 *
-*	start 4 threads to handle 4 interrupt routines for pressing and
-*	releasing the two buttons.
+*	opens both button lines, adds them to one epoll set and starts the thread
+*	that dispatches all button callbacks
 *******************************************************************************/
 int initialize_button_handlers(){
+	struct epoll_event ev;
+	int i;
 
 	#ifdef DEBUG
 	printf("setting pause_pressed function\n");
 	#endif
 	rc_set_pause_pressed_func(&rc_null_func);
 
-	#ifdef DEBUG
-	printf("setting remaining button functions\n");
-	#endif
-	//rc_set_pause_released_func(&rc_null_func);
-	//rc_set_mode_pressed_func(&rc_null_func);
-	//rc_set_mode_released_func(&rc_null_func);
-	
-	#ifdef DEBUG
-	printf("starting button threads\n");
-	#endif
-	pthread_create(&pause_pressed_thread, NULL,	\
-				pause_pressed_handler, (void*) NULL);
-	pthread_create(&pause_released_thread, NULL,	\
-				pause_released_handler, (void*) NULL);
-	pthread_create(&mode_pressed_thread, NULL,		\
-					mode_pressed_handler, (void*) NULL);
-	pthread_create(&mode_released_thread, NULL,	\
-					mode_released_handler, (void*) NULL);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(epoll_fd<0){
+		perror("ERROR in initialize_button_handlers, epoll_create1");
+		return -1;
+	}
+	for(i=0;i<NUM_BUTTONS;i++){
+		if(open_button(&buttons[i])<0) goto fail;
+		memset(&ev, 0, sizeof(ev));
+		ev.data.ptr = &buttons[i];
+		if(buttons[i].line.fd>=0){
+			ev.events = EPOLLIN;
+			if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, buttons[i].line.fd, &ev)<0){
+				perror("ERROR in initialize_button_handlers, epoll_ctl");
+				goto fail;
+			}
+		}
+		else{
+			ev.events = EPOLLPRI | EPOLLERR;
+			if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, buttons[i].sysfs_fd, &ev)<0){
+				perror("ERROR in initialize_button_handlers, epoll_ctl");
+				goto fail;
+			}
+		}
+	}
 
-	// apply priority to all threads
 	#ifdef DEBUG
-	printf("setting button thread priorities\n");
+	printf("starting button thread\n");
 	#endif
-	struct sched_param params;
-	params.sched_priority = sched_get_priority_max(SCHED_FIFO)-5;
-	pthread_setschedparam(pause_pressed_thread, SCHED_FIFO, &params);
-	pthread_setschedparam(pause_released_thread, SCHED_FIFO, &params);
-	pthread_setschedparam(mode_pressed_thread, SCHED_FIFO, &params);
-	pthread_setschedparam(mode_released_thread, SCHED_FIFO, &params);
-	 
+	// the thread applies its own priority on startup, see configure_rt_thread
+	if(pthread_create(&button_thread, NULL, button_handler, (void*) NULL)){
+		fprintf(stderr,"ERROR in initialize_button_handlers, can't start thread\n");
+		goto fail;
+	}
+	button_thread_started = 1;
 	return 0;
+
+fail:
+	for(i=0;i<NUM_BUTTONS;i++) close_button(&buttons[i]);
+	close(epoll_fd);
+	epoll_fd = -1;
+	return -1;
 }
 
 /*******************************************************************************
-*	void* pause_pressed_handler( __unused void* ptr)
-* 
-*	wait on falling edge of pause button
+*	void* button_handler( __unused void* ptr)
+*
+*	Waits on both buttons at once. The epoll timeout is the nearest pending
+*	debounce or long-press deadline, capped at POLL_TIMEOUT so program exit is
+*	noticed.
 *******************************************************************************/
-void* pause_pressed_handler( __unused void* ptr){
-	struct pollfd fdset[1];
-	char buf[POLL_BUF_LEN];
-	int gpio_fd = rc_gpio_fd_open(PAUSE_BTN);
-	fdset[0].fd = gpio_fd;
-	fdset[0].events = POLLPRI; // high-priority interrupt
+static void* button_handler( __unused void* ptr){
+	struct epoll_event events[NUM_BUTTONS];
+	uint64_t now;
+	int i, n;
+
+	configure_rt_thread(RT_THREAD_BUTTONS, BUTTON_PRIORITY);
 	// keep running until the program closes
-	while(rc_get_state() != EXITING) {
-		// system hangs here until FIFO interrupt
-		poll(fdset, 1, POLL_TIMEOUT);        
-		if (fdset[0].revents & POLLPRI) {
-			lseek(fdset[0].fd, 0, SEEK_SET);  
-			read(fdset[0].fd, buf, POLL_BUF_LEN);
-			// delay debouce
-			usleep(500); 
-			if(rc_get_pause_button()==PRESSED){
-				usleep(500);
-				if(rc_get_pause_button()==PRESSED){
-					usleep(500);
-					if(rc_get_pause_button()==PRESSED){
-						pause_pressed_func(); 
-					}
-				}
-			}
-			// purge any interrupts that may have stacked up
-			lseek(fdset[0].fd, 0, SEEK_SET);  
-			read(fdset[0].fd, buf, POLL_BUF_LEN);
+	while(rc_get_state() != EXITING){
+		n = epoll_wait(epoll_fd, events, NUM_BUTTONS, \
+										next_timeout_ms(monotonic_nanos()));
+		if(n<0 && errno!=EINTR){
+			perror("ERROR in button_handler, epoll_wait");
+			break;
 		}
+		for(i=0;i<n;i++) service_button((button_t*)events[i].data.ptr);
+		now = monotonic_nanos();
+		for(i=0;i<NUM_BUTTONS;i++) run_timers(&buttons[i], now);
 	}
-	rc_gpio_fd_close(gpio_fd);
+	for(i=0;i<NUM_BUTTONS;i++) close_button(&buttons[i]);
+	close(epoll_fd);
+	epoll_fd = -1;
+	release_rt_thread();
 	return 0;
 }
 
 /*******************************************************************************
-* @ void* pause_released_handler( __unused void* ptr) 
+* static int open_button(button_t* b)
 *
-* wait on rising edge of pause button
+* Requests the button as a both-edge event line, falling back to the sysfs
+* value file exported by configure_gpio_pins() on kernels without the GPIO
+* character device. The initial debounced state is read from the pin.
 *******************************************************************************/
-void* pause_released_handler( __unused void* ptr){
-	struct pollfd fdset[1];
-	char buf[POLL_BUF_LEN];
-	int gpio_fd = rc_gpio_fd_open(PAUSE_BTN);
-	fdset[0].fd = gpio_fd;
-	fdset[0].events = POLLPRI; // high-priority interrupt
-	// keep running until the program closes
-	while(rc_get_state() != EXITING) {
-		// system hangs here until FIFO interrupt
-		poll(fdset, 1, POLL_TIMEOUT);        
-		if (fdset[0].revents & POLLPRI) {
-			lseek(fdset[0].fd, 0, SEEK_SET);  
-			read(fdset[0].fd, buf, POLL_BUF_LEN);
-			// delay debouce
-			usleep(500); 
-			if(rc_get_pause_button()==RELEASED){
-				usleep(500);
-				if(rc_get_pause_button()==RELEASED){
-					usleep(500);
-					if(rc_get_pause_button()==RELEASED){
-						pause_released_func(); 
-					}
-				}
-			}
-			// purge any interrupts that may have stacked up
-			lseek(fdset[0].fd, 0, SEEK_SET);  
-			read(fdset[0].fd, buf, POLL_BUF_LEN);
+static int open_button(button_t* b){
+	char buf[8];
+	if(rc_gpio_chardev_available()){
+		// a sysfs export holds the line, possibly left over from another run
+		rc_gpio_unexport(b->pin);
+		if(rc_gpio_event_request(&b->line, b->pin, EDGE_BOTH, b->label)<0){
+			fprintf(stderr,"ERROR: can't request %s gpio line\n", b->label);
+			return -1;
 		}
+		// edges are drained in a loop, don't block on the last one
+		fcntl(b->line.fd, F_SETFL, O_NONBLOCK);
 	}
-	rc_gpio_fd_close(gpio_fd);
+	else{
+		b->sysfs_fd = rc_gpio_fd_open(b->pin);
+		if(b->sysfs_fd<0){
+			fprintf(stderr,"ERROR: can't open %s gpio fd\n", b->label);
+			return -1;
+		}
+		// clear the notification that is pending from opening the file
+		lseek(b->sysfs_fd, 0, SEEK_SET);
+		read(b->sysfs_fd, buf, sizeof(buf));
+	}
+	b->lockout_until = 0;
+	b->first_click_at = 0;
+	b->long_press_sent = 1;
+	if(sample_button(b, &b->state)<0) b->state = RELEASED;
 	return 0;
 }
 
 /*******************************************************************************
-*	void* mode_pressed_handler( __unused void* ptr) 
-*	wait on falling edge of mode button
+* static void close_button(button_t* b)
 *******************************************************************************/
-void* mode_pressed_handler( __unused void* ptr){
-	struct pollfd fdset[1];
-	char buf[POLL_BUF_LEN];
-	int gpio_fd = rc_gpio_fd_open(MODE_BTN);
-	fdset[0].fd = gpio_fd;
-	fdset[0].events = POLLPRI; // high-priority interrupt
-	// keep running until the program closes
-	while(rc_get_state() != EXITING) {
-		// system hangs here until FIFO interrupt
-		poll(fdset, 1, POLL_TIMEOUT);        
-		if (fdset[0].revents & POLLPRI) {
-			lseek(fdset[0].fd, 0, SEEK_SET);  
-			read(fdset[0].fd, buf, POLL_BUF_LEN);
-			// delay debouce
-			usleep(500); 
-			if(rc_get_mode_button()==PRESSED){
-				usleep(500);
-				if(rc_get_mode_button()==PRESSED){
-					usleep(500);
-					if(rc_get_mode_button()==PRESSED){
-						mode_pressed_func(); 
-					}
-				}
-			}
-			// purge any interrupts that may have stacked up
-			lseek(fdset[0].fd, 0, SEEK_SET);  
-			read(fdset[0].fd, buf, POLL_BUF_LEN);
-		}
+static void close_button(button_t* b){
+	if(b->line.fd>=0) rc_gpio_lines_release(&b->line);
+	if(b->sysfs_fd>=0) rc_gpio_fd_close(b->sysfs_fd);
+	b->sysfs_fd = -1;
+}
+
+/*******************************************************************************
+* static int sample_button(button_t* b, rc_button_state_t* state)
+*
+* reads the current level of the button pin, which is low when pressed
+*******************************************************************************/
+static int sample_button(button_t* b, rc_button_state_t* state){
+	int value;
+	char buf[8];
+	if(b->line.fd>=0){
+		if(rc_gpio_lines_get(&b->line, &value)<0) return -1;
+	}
+	else{
+		lseek(b->sysfs_fd, 0, SEEK_SET);
+		if(read(b->sysfs_fd, buf, sizeof(buf))<1) return -1;
+		value = (buf[0]!='0');
 	}
-	rc_gpio_fd_close(gpio_fd);
+	*state = value ? RELEASED : PRESSED;
 	return 0;
 }
 
 /*******************************************************************************
-*	void* mode_released_handler( __unused void* ptr) 
-*	wait on rising edge of mode button
+* static void service_button(button_t* b)
+*
+* Feeds every queued edge to the state machine. Event lines deliver each edge
+* with the time the kernel saw it. sysfs only says something changed so the
+* pin is sampled and the current time is used.
 *******************************************************************************/
-void* mode_released_handler( __unused void* ptr){
-	struct pollfd fdset[1];
-	char buf[POLL_BUF_LEN];
-	int gpio_fd = rc_gpio_fd_open(MODE_BTN);
-	fdset[0].fd = gpio_fd;
-	fdset[0].events = POLLPRI; // high-priority interrupt
-	// keep running until the program closes
-	while(rc_get_state() != EXITING) {
-		// system hangs here until FIFO interrupt
-		poll(fdset, 1, POLL_TIMEOUT);        
-		if (fdset[0].revents & POLLPRI) {
-			lseek(fdset[0].fd, 0, SEEK_SET);  
-			read(fdset[0].fd, buf, POLL_BUF_LEN);
-			// delay debouce
-			usleep(500); 
-			if(rc_get_mode_button()==RELEASED){
-				usleep(500);
-				if(rc_get_mode_button()==RELEASED){
-					usleep(500);
-					if(rc_get_mode_button()==RELEASED){
-						mode_released_func(); 
-					}
-				}
-			}
-			// purge any interrupts that may have stacked up
-			lseek(fdset[0].fd, 0, SEEK_SET);  
-			read(fdset[0].fd, buf, POLL_BUF_LEN);
+static void service_button(button_t* b){
+	rc_gpio_event_t ev;
+	rc_button_state_t level;
+	if(b->line.fd>=0){
+		while(rc_gpio_event_read(&b->line, &ev)==0){
+			level = (ev.edge==EDGE_FALLING) ? PRESSED : RELEASED;
+			handle_edge(b, level, ev.timestamp_ns);
 		}
 	}
-	rc_gpio_fd_close(gpio_fd);
-	return 0;
+	else if(sample_button(b, &level)==0){
+		handle_edge(b, level, monotonic_nanos());
+	}
+}
+
+/*******************************************************************************
+* static void handle_edge(button_t* b, rc_button_state_t level, uint64_t t)
+*
+* An edge outside the lockout window that changes the debounced state is
+* accepted immediately. Edges inside the window are bounce and are dropped,
+* the pin is sampled again when the window closes in run_timers().
+*******************************************************************************/
+static void handle_edge(button_t* b, rc_button_state_t level, uint64_t t){
+	if(b->lockout_until!=0 && t<b->lockout_until) return;
+	b->lockout_until = 0;
+	if(level!=b->state) commit_state(b, level, t);
+}
+
+/*******************************************************************************
+* static void run_timers(button_t* b, uint64_t now)
+*
+* Closes an expired lockout window, catching a release or press that happened
+* during the bounce, and fires long-press once a press has been held long
+* enough.
+*******************************************************************************/
+static void run_timers(button_t* b, uint64_t now){
+	rc_button_state_t level;
+	if(b->lockout_until!=0 && now>=b->lockout_until){
+		b->lockout_until = 0;
+		if(sample_button(b, &level)==0 && level!=b->state){
+			commit_state(b, level, now);
+		}
+	}
+	if(b->state==PRESSED && !b->long_press_sent \
+							&& now-b->pressed_at>=long_press_ns){
+		b->long_press_sent = 1;
+		// a long press can't also be the first half of a double-click
+		b->first_click_at = 0;
+		(*b->long_press_func)();
+	}
+}
+
+/*******************************************************************************
+* static void commit_state(button_t* b, rc_button_state_t level, uint64_t t)
+*
+* records a debounced transition, opens a lockout window and dispatches the
+* matching callbacks
+*******************************************************************************/
+static void commit_state(button_t* b, rc_button_state_t level, uint64_t t){
+	b->state = level;
+	b->lockout_until = t + debounce_ns;
+	if(level==RELEASED){
+		(*b->released_func)();
+		return;
+	}
+	b->pressed_at = t;
+	b->long_press_sent = 0;
+	(*b->pressed_func)();
+	if(b->first_click_at!=0 && t-b->first_click_at<=double_click_ns){
+		b->first_click_at = 0;
+		(*b->double_click_func)();
+	}
+	else b->first_click_at = t;
+}
+
+/*******************************************************************************
+* static int next_timeout_ms(uint64_t now)
+*
+* milliseconds until the nearest lockout or long-press deadline, rounded up
+*******************************************************************************/
+static int next_timeout_ms(uint64_t now){
+	uint64_t next = now + POLL_TIMEOUT*1000000ULL;
+	uint64_t t;
+	int i;
+	for(i=0;i<NUM_BUTTONS;i++){
+		if(buttons[i].lockout_until!=0 && buttons[i].lockout_until<next){
+			next = buttons[i].lockout_until;
+		}
+		if(buttons[i].state==PRESSED && !buttons[i].long_press_sent){
+			t = buttons[i].pressed_at + long_press_ns;
+			if(t<next) next = t;
+		}
+	}
+	if(next<=now) return 0;
+	return (int)((next-now+999999)/1000000);
+}
+
+/*******************************************************************************
+* static uint64_t monotonic_nanos()
+*
+* Button edges are physical events timestamped by the kernel on
+* CLOCK_MONOTONIC, so debounce timing stays on the real clock even when
+* rc_nanos_since_boot() has been redirected.
+*******************************************************************************/
+static uint64_t monotonic_nanos(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec*1000000000ULL) + ts.tv_nsec;
 }
 
 /*******************************************************************************
@@ -255,6 +380,22 @@ int rc_set_pause_released_func(void (*func)(void)){
 	pause_released_func = func;
 	return 0;
 }
+int rc_set_pause_long_press_func(void (*func)(void)){
+	if(func==NULL){
+		printf("ERROR: trying to assign NULL pointer to pause_long_press_func\n");
+		return -1;
+	}
+	pause_long_press_func = func;
+	return 0;
+}
+int rc_set_pause_double_click_func(void (*func)(void)){
+	if(func==NULL){
+		printf("ERROR: trying to assign NULL pointer to pause_double_click_func\n");
+		return -1;
+	}
+	pause_double_click_func = func;
+	return 0;
+}
 int rc_set_mode_pressed_func(void (*func)(void)){
 	if(func==NULL){
 		printf("ERROR: trying to assign NULL pointer to mode_pressed_func\n");
@@ -271,6 +412,38 @@ int rc_set_mode_released_func(void (*func)(void)){
 	mode_released_func = func;
 	return 0;
 }
+int rc_set_mode_long_press_func(void (*func)(void)){
+	if(func==NULL){
+		printf("ERROR: trying to assign NULL pointer to mode_long_press_func\n");
+		return -1;
+	}
+	mode_long_press_func = func;
+	return 0;
+}
+int rc_set_mode_double_click_func(void (*func)(void)){
+	if(func==NULL){
+		printf("ERROR: trying to assign NULL pointer to mode_double_click_func\n");
+		return -1;
+	}
+	mode_double_click_func = func;
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_set_button_timing(int debounce_us, int long_press_ms,
+*													int double_click_ms)
+*******************************************************************************/
+int rc_set_button_timing(int debounce_us, int long_press_ms, \
+													int double_click_ms){
+	if(debounce_us<0 || long_press_ms<=0 || double_click_ms<0){
+		printf("ERROR in rc_set_button_timing, invalid argument\n");
+		return -1;
+	}
+	debounce_ns = debounce_us*1000ULL;
+	long_press_ns = long_press_ms*1000000ULL;
+	double_click_ns = double_click_ms*1000000ULL;
+	return 0;
+}
 
 /*******************************************************************************
 * rc_button_state_t rc_get_pause_button()
@@ -297,38 +470,18 @@ rc_button_state_t rc_get_mode_button(){
 *******************************************************************************/
 int wait_for_button_handlers_to_join(){
 	int ret = 0;
+	if(!button_thread_started) return 0;
 
 	//allow up to 3 seconds for thread cleanup
 	struct timespec thread_timeout;
 	clock_gettime(CLOCK_REALTIME, &thread_timeout);
 	thread_timeout.tv_sec += 3;
 	int thread_err = 0;
-	thread_err = pthread_timedjoin_np(pause_pressed_thread, NULL, \
-															&thread_timeout);
-	if(thread_err == ETIMEDOUT){
-		printf("WARNING: pause_pressed_thread exit timeout\n");
-		ret = -1;
-	}
-	thread_err = 0;
-	thread_err = pthread_timedjoin_np(pause_released_thread, NULL, \
-															&thread_timeout);
-	if(thread_err == ETIMEDOUT){
-		printf("WARNING: pause_released_thread exit timeout\n");
-		ret = -1;
-	}
-	thread_err = 0;
-	thread_err = pthread_timedjoin_np(mode_pressed_thread, NULL, \
-															&thread_timeout);
-	if(thread_err == ETIMEDOUT){
-		printf("WARNING: mode_pressed_thread exit timeout\n");
-		ret = -1;
-	}
-	thread_err = 0;
-	thread_err = pthread_timedjoin_np(mode_released_thread, NULL, \
-															&thread_timeout);
+	thread_err = pthread_timedjoin_np(button_thread, NULL, &thread_timeout);
 	if(thread_err == ETIMEDOUT){
-		printf("WARNING: mode_released_thread exit timeout\n");
+		printf("WARNING: button_thread exit timeout\n");
 		ret = -1;
 	}
+	button_thread_started = 0;
 	return ret;
 }
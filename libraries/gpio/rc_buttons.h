@@ -1,7 +1,7 @@
 /*******************************************************************************
 * roboticscape_buttons.h
 *
-* function declarations for starting and stopping button handlers
+* function declarations for starting and stopping the button thread
 * the rest of the button functions are in roboticscape.h for the user to access
 *******************************************************************************/
 
@@ -7,6 +7,8 @@
 *******************************************************************************/
 
 #include "../roboticscape.h"
+#include "../preprocessor_macros.h"
+#include "../mmap/rc_mmap_gpio_adc.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,9 +16,26 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
 
 #define SYSFS_GPIO_DIR "/sys/class/gpio"
 #define MAX_BUF 64
+#define MAX_GPIO_PIN 128 // 4 banks of 32
+#define GPIO_BANKS 4
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+// value file of each pin, opened on first use and kept open. Stored as fd+1
+// so the zero-initialized array means nothing is open yet.
+static int value_fd[MAX_GPIO_PIN];
+static pthread_mutex_t value_fd_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*******************************************************************************
+* Local Function Declarations
+*******************************************************************************/
+static int get_value_fd(unsigned int gpio);
+static void close_value_fd(unsigned int gpio);
 
 /****************************************************************
  * rc_gpio_export
@@ -50,6 +69,9 @@ int rc_gpio_unexport(unsigned int gpio){
 		return fd;
 	}
 
+	// the value file is about to disappear, drop our cached fd to it
+	close_value_fd(gpio);
+
 	len = snprintf(buf, sizeof(buf), "%d", gpio);
 	write(fd, buf, len);
 	close(fd);
@@ -83,23 +105,15 @@ int rc_gpio_set_dir(int gpio, rc_pin_direction_t out_flag){
  * rc_gpio_set_value
  ****************************************************************/
 int rc_gpio_set_value(unsigned int gpio, int value){
-	int fd;
-	char buf[MAX_BUF];
-
-	snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "/gpio%d/value", gpio);
-
-	fd = open(buf, O_WRONLY);
+	int fd = get_value_fd(gpio);
 	if (fd < 0) {
 		perror("gpio/set-value");
 		return fd;
 	}
-
-	if(value)
-		write(fd, "1", 2);
-	else
-		write(fd, "0", 2);
-
-	close(fd);
+	if(pwrite(fd, value ? "1" : "0", 1, 0) != 1){
+		perror("gpio/set-value");
+		return -1;
+	}
 	return 0;
 }
 
@@ -107,25 +121,20 @@ int rc_gpio_set_value(unsigned int gpio, int value){
  * rc_gpio_get_value
  ****************************************************************/
 int rc_gpio_get_value(unsigned int gpio){
-	int fd, ret;
-	char buf[MAX_BUF];
+	int fd;
 	char ch;
 
-	snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "/gpio%d/value", gpio);
-
-	fd = open(buf, O_RDONLY);
+	fd = get_value_fd(gpio);
 	if (fd < 0) {
 		perror("gpio/get-value");
 		return fd;
 	}
-
-	read(fd, &ch, 1);
-
-	if (ch != '0') ret = 1;
-	else ret = 0;
-
-	close(fd);
-	return ret;
+	// sysfs regenerates the value on every read from offset 0
+	if(pread(fd, &ch, 1, 0) != 1){
+		perror("gpio/get-value");
+		return -1;
+	}
+	return (ch != '0');
 }
 
 
@@ -203,4 +212,164 @@ int rc_gpio_fd_close(int fd){
 	return close(fd);
 }
 
+/*******************************************************************************
+* int rc_gpio_handle_open(rc_gpio_handle_t* h, int pin)
+*
+* Prepares a handle for fast repeated access to an exported pin. When the
+* mmap gpio interface has been initialized (rc_initialize does this) the
+* handle writes the bank registers directly, otherwise it keeps the pin's
+* sysfs value file open.
+*******************************************************************************/
+int rc_gpio_handle_open(rc_gpio_handle_t* h, int pin){
+	if(h==NULL){
+		fprintf(stderr,"ERROR in rc_gpio_handle_open, received NULL pointer\n");
+		return -1;
+	}
+	if(pin<0 || pin>=MAX_GPIO_PIN){
+		fprintf(stderr,"ERROR in rc_gpio_handle_open, invalid pin %d\n", pin);
+		return -1;
+	}
+	h->pin = pin;
+	h->bank = pin/32;
+	h->mask = 1u<<(pin%32);
+	h->fd = -1;
+	if(mmap_gpio_is_initialized()) return 0;
+	h->fd = get_value_fd(pin);
+	if(h->fd<0){
+		perror("gpio/handle-open");
+		return -1;
+	}
+	return 0;
+}
 
+/*******************************************************************************
+* int rc_gpio_handle_close(rc_gpio_handle_t* h)
+*
+* Invalidates the handle. The cached value file stays open for other users
+* of the pin until rc_gpio_unexport().
+*******************************************************************************/
+int rc_gpio_handle_close(rc_gpio_handle_t* h){
+	if(h==NULL){
+		fprintf(stderr,"ERROR in rc_gpio_handle_close, received NULL pointer\n");
+		return -1;
+	}
+	h->pin = -1;
+	h->fd = -1;
+	h->mask = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_gpio_handle_set(rc_gpio_handle_t* h, int value)
+*
+* sets an output pin HIGH or LOW through a handle
+*******************************************************************************/
+int rc_gpio_handle_set(rc_gpio_handle_t* h, int value){
+	if(likely(h->fd<0)){
+		if(value) return mmap_gpio_write_bank(h->bank, h->mask, 0);
+		return mmap_gpio_write_bank(h->bank, 0, h->mask);
+	}
+	if(pwrite(h->fd, value ? "1" : "0", 1, 0) != 1) return -1;
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_gpio_handle_get(rc_gpio_handle_t* h)
+*
+* returns 1 or 0 for the level of a pin, or -1 on error
+*******************************************************************************/
+int rc_gpio_handle_get(rc_gpio_handle_t* h){
+	uint32_t bank;
+	char ch;
+	if(likely(h->fd<0)){
+		if(mmap_gpio_read_bank(h->bank, &bank)) return -1;
+		return (bank & h->mask) != 0;
+	}
+	if(pread(h->fd, &ch, 1, 0) != 1) return -1;
+	return (ch != '0');
+}
+
+/*******************************************************************************
+* int rc_gpio_set_values(int n, const int* pins, const int* values)
+*
+* Sets n output pins at once. Pins are grouped by bank so with mmap each bank
+* touched costs one write to its SETDATAOUT and/or CLEARDATAOUT register and
+* all pins in a bank change together. Without mmap this falls back to the
+* cached sysfs value files one pin at a time.
+*******************************************************************************/
+int rc_gpio_set_values(int n, const int* pins, const int* values){
+	uint32_t set_mask[GPIO_BANKS] = {0};
+	uint32_t clear_mask[GPIO_BANKS] = {0};
+	int i, ret = 0;
+
+	if(pins==NULL || values==NULL){
+		fprintf(stderr,"ERROR in rc_gpio_set_values, received NULL pointer\n");
+		return -1;
+	}
+	for(i=0;i<n;i++){
+		if(pins[i]<0 || pins[i]>=MAX_GPIO_PIN){
+			fprintf(stderr,"ERROR in rc_gpio_set_values, invalid pin %d\n",\
+																	pins[i]);
+			return -1;
+		}
+	}
+	if(!mmap_gpio_is_initialized()){
+		for(i=0;i<n;i++) ret |= rc_gpio_set_value(pins[i], values[i]);
+		return ret;
+	}
+	for(i=0;i<n;i++){
+		if(values[i]) set_mask[pins[i]/32] |= 1u<<(pins[i]%32);
+		else clear_mask[pins[i]/32] |= 1u<<(pins[i]%32);
+	}
+	for(i=0;i<GPIO_BANKS;i++){
+		if(set_mask[i] || clear_mask[i]){
+			ret |= mmap_gpio_write_bank(i, set_mask[i], clear_mask[i]);
+		}
+	}
+	return ret;
+}
+
+/*******************************************************************************
+* static int get_value_fd(unsigned int gpio)
+*
+* returns the cached value file descriptor for a pin, opening it on first use
+*******************************************************************************/
+static int get_value_fd(unsigned int gpio){
+	int fd;
+	char buf[MAX_BUF];
+
+	if(unlikely(gpio>=MAX_GPIO_PIN)){
+		errno = EINVAL;
+		return -1;
+	}
+	fd = value_fd[gpio]-1;
+	if(likely(fd>=0)) return fd;
+
+	pthread_mutex_lock(&value_fd_mutex);
+	fd = value_fd[gpio]-1;
+	if(fd<0){
+		snprintf(buf, sizeof(buf), SYSFS_GPIO_DIR "/gpio%d/value", gpio);
+		// fall back to read-only for inputs with a write-protected value file
+		fd = open(buf, O_RDWR);
+		if(fd<0) fd = open(buf, O_RDONLY);
+		if(fd>=0) value_fd[gpio] = fd+1;
+	}
+	pthread_mutex_unlock(&value_fd_mutex);
+	return fd;
+}
+
+/*******************************************************************************
+* static void close_value_fd(unsigned int gpio)
+*
+* closes the cached value file of a pin if there is one
+*******************************************************************************/
+static void close_value_fd(unsigned int gpio){
+	if(gpio>=MAX_GPIO_PIN) return;
+	pthread_mutex_lock(&value_fd_mutex);
+	if(value_fd[gpio]>0){
+		close(value_fd[gpio]-1);
+		value_fd[gpio] = 0;
+	}
+	pthread_mutex_unlock(&value_fd_mutex);
+	return;
+}
@@ -0,0 +1,334 @@
+/*******************************************************************************
+* rc_gpio_chardev.c
+*
+* GPIO access through the Linux GPIO character device (/dev/gpiochipN) which
+* replaces the deprecated /sys/class/gpio interface. Lines are requested
+* directly without exporting, several lines on one bank can be read or
+* written with a single ioctl, and edge events are queued by the kernel with
+* a timestamp taken in the interrupt handler. This uses the v1 ioctl ABI
+* available since Linux 4.8 so it works on the stock Beaglebone kernels.
+*******************************************************************************/
+#include "../roboticscape.h"
+#include "../preprocessor_macros.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+#define GPIO_BANKS		4
+#define LINES_PER_BANK	32
+#define MAX_GPIOCHIPS	8
+#define DEFAULT_LABEL	"roboticscape"
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+// AM335x gpio bank base addresses, the kernel uses these as chip labels
+static const char* bank_labels[GPIO_BANKS] = {
+	"44e07000", "4804c000", "481ac000", "481ae000"
+};
+static int bank_chip[GPIO_BANKS]; // gpiochip number of each bank
+static int chips_probed = 0;
+static int chardev_ok = 0;
+static pthread_mutex_t probe_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*******************************************************************************
+* Local Function Declarations
+*******************************************************************************/
+static int probe_chips();
+static int open_bank_chip(int bank);
+static int check_lines(int n, const int* pins);
+static uint64_t event_time_to_boot(uint64_t ts);
+
+/*******************************************************************************
+* int rc_gpio_chardev_available()
+*
+* returns 1 if the GPIO character devices exist and can be opened, otherwise 0
+*******************************************************************************/
+int rc_gpio_chardev_available(){
+	probe_chips();
+	return chardev_ok;
+}
+
+/*******************************************************************************
+* int rc_gpio_lines_request(rc_gpio_lines_t* l, int n, const int* pins,
+*			rc_pin_direction_t dir, const int* defaults, const char* label)
+*
+* Requests n lines from the same bank as inputs or outputs. defaults gives the
+* initial output values and may be NULL for all LOW. label shows up as the
+* consumer in gpioinfo and may be NULL.
+*******************************************************************************/
+int rc_gpio_lines_request(rc_gpio_lines_t* l, int n, const int* pins, \
+			rc_pin_direction_t dir, const int* defaults, const char* label){
+	struct gpiohandle_request req;
+	int i, chip_fd;
+
+	if(l==NULL || pins==NULL){
+		fprintf(stderr,"ERROR in rc_gpio_lines_request, received NULL pointer\n");
+		return -1;
+	}
+	if(n<1 || n>RC_GPIO_MAX_LINES){
+		fprintf(stderr,"ERROR in rc_gpio_lines_request, n must be between 1 & %d\n",\
+														RC_GPIO_MAX_LINES);
+		return -1;
+	}
+	if(check_lines(n, pins)) return -1;
+
+	memset(&req, 0, sizeof(req));
+	for(i=0;i<n;i++){
+		req.lineoffsets[i] = pins[i]%LINES_PER_BANK;
+		if(defaults!=NULL) req.default_values[i] = (defaults[i]!=0);
+	}
+	req.lines = n;
+	req.flags = (dir==OUTPUT_PIN) ? GPIOHANDLE_REQUEST_OUTPUT : \
+													GPIOHANDLE_REQUEST_INPUT;
+	strncpy(req.consumer_label, (label==NULL)?DEFAULT_LABEL:label, \
+											sizeof(req.consumer_label)-1);
+
+	chip_fd = open_bank_chip(pins[0]/LINES_PER_BANK);
+	if(chip_fd<0) return -1;
+	if(ioctl(chip_fd, GPIO_GET_LINEHANDLE_IOCTL, &req)<0){
+		fprintf(stderr,"ERROR in rc_gpio_lines_request, can't request lines: %s\n",\
+															strerror(errno));
+		if(errno==EBUSY){
+			fprintf(stderr,"a line is in use, maybe exported through sysfs\n");
+		}
+		close(chip_fd);
+		return -1;
+	}
+	close(chip_fd);
+
+	l->fd = req.fd;
+	l->num_lines = n;
+	for(i=0;i<n;i++) l->pins[i] = pins[i];
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_gpio_lines_get(rc_gpio_lines_t* l, int* values)
+*
+* reads every line of a request in one ioctl, values must hold num_lines ints
+*******************************************************************************/
+int rc_gpio_lines_get(rc_gpio_lines_t* l, int* values){
+	struct gpiohandle_data data;
+	int i;
+	if(unlikely(ioctl(l->fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data)<0)){
+		fprintf(stderr,"ERROR in rc_gpio_lines_get: %s\n", strerror(errno));
+		return -1;
+	}
+	for(i=0;i<l->num_lines;i++) values[i] = data.values[i];
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_gpio_lines_set(rc_gpio_lines_t* l, const int* values)
+*
+* writes every line of an output request in one ioctl
+*******************************************************************************/
+int rc_gpio_lines_set(rc_gpio_lines_t* l, const int* values){
+	struct gpiohandle_data data;
+	int i;
+	memset(&data, 0, sizeof(data));
+	for(i=0;i<l->num_lines;i++) data.values[i] = (values[i]!=0);
+	if(unlikely(ioctl(l->fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data)<0)){
+		fprintf(stderr,"ERROR in rc_gpio_lines_set: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_gpio_lines_release(rc_gpio_lines_t* l)
+*
+* gives lines or an event line back to the kernel
+*******************************************************************************/
+int rc_gpio_lines_release(rc_gpio_lines_t* l){
+	if(l==NULL){
+		fprintf(stderr,"ERROR in rc_gpio_lines_release, received NULL pointer\n");
+		return -1;
+	}
+	if(l->fd>=0) close(l->fd);
+	l->fd = -1;
+	l->num_lines = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_gpio_event_request(rc_gpio_lines_t* l, int pin, rc_pin_edge_t edge,
+*														const char* label)
+*
+* Requests a single input line that reports edges. l->fd becomes readable
+* (POLLIN) when an event is queued so it can be added to poll() or epoll()
+* together with other event lines. rc_gpio_lines_get() also works on it.
+*******************************************************************************/
+int rc_gpio_event_request(rc_gpio_lines_t* l, int pin, rc_pin_edge_t edge, \
+														const char* label){
+	struct gpioevent_request req;
+	int chip_fd;
+
+	if(l==NULL){
+		fprintf(stderr,"ERROR in rc_gpio_event_request, received NULL pointer\n");
+		return -1;
+	}
+	if(check_lines(1, &pin)) return -1;
+
+	memset(&req, 0, sizeof(req));
+	req.lineoffset = pin%LINES_PER_BANK;
+	req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+	switch(edge){
+	case EDGE_RISING:
+		req.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+		break;
+	case EDGE_FALLING:
+		req.eventflags = GPIOEVENT_REQUEST_FALLING_EDGE;
+		break;
+	case EDGE_BOTH:
+		req.eventflags = GPIOEVENT_REQUEST_BOTH_EDGES;
+		break;
+	default:
+		fprintf(stderr,"ERROR in rc_gpio_event_request, invalid edge\n");
+		return -1;
+	}
+	strncpy(req.consumer_label, (label==NULL)?DEFAULT_LABEL:label, \
+											sizeof(req.consumer_label)-1);
+
+	chip_fd = open_bank_chip(pin/LINES_PER_BANK);
+	if(chip_fd<0) return -1;
+	if(ioctl(chip_fd, GPIO_GET_LINEEVENT_IOCTL, &req)<0){
+		fprintf(stderr,"ERROR in rc_gpio_event_request, can't request gpio %d: %s\n",\
+														pin, strerror(errno));
+		close(chip_fd);
+		return -1;
+	}
+	close(chip_fd);
+
+	l->fd = req.fd;
+	l->num_lines = 1;
+	l->pins[0] = pin;
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_gpio_event_read(rc_gpio_lines_t* l, rc_gpio_event_t* ev)
+*
+* Pops the oldest queued event, blocking if there is none. The timestamp is
+* converted to CLOCK_MONOTONIC nanoseconds, the same as rc_nanos_since_boot()
+* with the real clock.
+*******************************************************************************/
+int rc_gpio_event_read(rc_gpio_lines_t* l, rc_gpio_event_t* ev){
+	struct gpioevent_data data;
+	ssize_t ret;
+
+	do ret = read(l->fd, &data, sizeof(data));
+	while(ret<0 && errno==EINTR);
+	if(ret!=sizeof(data)){
+		if(ret<0 && errno==EAGAIN) return -1;
+		fprintf(stderr,"ERROR in rc_gpio_event_read, bad read from gpio %d\n",\
+																l->pins[0]);
+		return -1;
+	}
+	ev->pin = l->pins[0];
+	ev->edge = (data.id==GPIOEVENT_EVENT_RISING_EDGE)?EDGE_RISING:EDGE_FALLING;
+	ev->timestamp_ns = event_time_to_boot(data.timestamp);
+	return 0;
+}
+
+/*******************************************************************************
+* static int probe_chips()
+*
+* Works out which /dev/gpiochipN serves each bank by matching the chip labels
+* against the bank base addresses. If labels don't match, as with some
+* device trees, assume chips are numbered in bank order.
+*******************************************************************************/
+static int probe_chips(){
+	struct gpiochip_info info;
+	char path[32];
+	int i, b, fd;
+
+	if(likely(chips_probed)) return 0;
+	pthread_mutex_lock(&probe_mutex);
+	if(chips_probed){
+		pthread_mutex_unlock(&probe_mutex);
+		return 0;
+	}
+	for(b=0;b<GPIO_BANKS;b++) bank_chip[b] = b;
+	for(i=0;i<MAX_GPIOCHIPS;i++){
+		snprintf(path, sizeof(path), "/dev/gpiochip%d", i);
+		fd = open(path, O_RDONLY);
+		if(fd<0) continue;
+		chardev_ok = 1;
+		if(ioctl(fd, GPIO_GET_CHIPINFO_IOCTL, &info)==0){
+			for(b=0;b<GPIO_BANKS;b++){
+				if(strstr(info.label, bank_labels[b])!=NULL) bank_chip[b] = i;
+			}
+		}
+		close(fd);
+	}
+	chips_probed = 1;
+	pthread_mutex_unlock(&probe_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* static int open_bank_chip(int bank)
+*
+* returns an open fd to the character device of a bank or -1
+*******************************************************************************/
+static int open_bank_chip(int bank){
+	char path[32];
+	int fd;
+	probe_chips();
+	snprintf(path, sizeof(path), "/dev/gpiochip%d", bank_chip[bank]);
+	fd = open(path, O_RDONLY);
+	if(fd<0){
+		fprintf(stderr,"ERROR: can't open %s: %s\n", path, strerror(errno));
+	}
+	return fd;
+}
+
+/*******************************************************************************
+* static int check_lines(int n, const int* pins)
+*
+* all lines of one request must be valid pins on the same bank
+*******************************************************************************/
+static int check_lines(int n, const int* pins){
+	int i;
+	for(i=0;i<n;i++){
+		if(pins[i]<0 || pins[i]>=GPIO_BANKS*LINES_PER_BANK){
+			fprintf(stderr,"ERROR: invalid gpio pin %d\n", pins[i]);
+			return -1;
+		}
+		if(pins[i]/LINES_PER_BANK != pins[0]/LINES_PER_BANK){
+			fprintf(stderr,"ERROR: gpio %d and %d are on different banks\n",\
+															pins[0], pins[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* static uint64_t event_time_to_boot(uint64_t ts)
+*
+* Kernels before 5.7 stamp line events with CLOCK_REALTIME and later ones
+* with CLOCK_MONOTONIC. Whichever clock the stamp is closer to is the one it
+* came from, convert it to CLOCK_MONOTONIC.
+*******************************************************************************/
+static uint64_t event_time_to_boot(uint64_t ts){
+	struct timespec t;
+	int64_t real, mono;
+	clock_gettime(CLOCK_REALTIME, &t);
+	real = (int64_t)t.tv_sec*1000000000 + t.tv_nsec;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	mono = (int64_t)t.tv_sec*1000000000 + t.tv_nsec;
+	if(llabs(real-(int64_t)ts) < llabs(mono-(int64_t)ts)){
+		return (uint64_t)((int64_t)ts - real + mono);
+	}
+	return ts;
+}
@@ -107,14 +107,16 @@ int configure_gpio_pins(){
 	// servo power
 	ret |= setup_output_pin(SERVO_PWR, LOW);
 
-	// buttons
-	ret |= setup_input_pin(MODE_BTN); 
-	ret |= setup_input_pin(PAUSE_BTN);
-	rc_gpio_set_edge(MODE_BTN, EDGE_BOTH);
-	rc_gpio_set_edge(PAUSE_BTN, EDGE_BOTH);
-
-	// IMU
-	ret |= setup_input_pin(IMU_INTERRUPT_PIN);
+	// buttons and IMU interrupt. The button thread and rc_initialize_imu_dmp()
+	// request these as character device event lines when possible which a
+	// sysfs export would block
+	if(!rc_gpio_chardev_available()){
+		ret |= setup_input_pin(MODE_BTN); 
+		ret |= setup_input_pin(PAUSE_BTN);
+		rc_gpio_set_edge(MODE_BTN, EDGE_BOTH);
+		rc_gpio_set_edge(PAUSE_BTN, EDGE_BOTH);
+		ret |= setup_input_pin(IMU_INTERRUPT_PIN);
+	}
 
 	// UART1, GPS, and SPI pins
 	// ret |= setup_input_pin(GPS_HEADER_PIN_3); 
@@ -177,6 +177,33 @@ int rc_gpio_get_value_mmap(int pin) {
 	return (map[(bank_offset-MMAP_OFFSET+GPIO_DATAIN)/4] & (1<<id))>>id;
 }
 
+// returns 1 if initialize_mmap_gpio() has already succeeded. Unlike the
+// functions above this never tries to initialize so it is quiet without root
+int mmap_gpio_is_initialized(){
+	return gpio_initialized;
+}
+
+// sets the pins in set_mask and clears the pins in clear_mask of one bank
+// using the SETDATAOUT/CLEARDATAOUT registers, so no read-modify-write race
+// with other threads and one bus write per mask
+int mmap_gpio_write_bank(int bank, uint32_t set_mask, uint32_t clear_mask){
+	static const int bank_offset[4] = {GPIO0, GPIO1, GPIO2, GPIO3};
+	if(unlikely(!gpio_initialized || bank<0 || bank>3)) return -1;
+	if(set_mask) map[(bank_offset[bank]-MMAP_OFFSET+GPIO_SETDATAOUT)/4] = set_mask;
+	if(clear_mask){
+		map[(bank_offset[bank]-MMAP_OFFSET+GPIO_CLEARDATAOUT)/4] = clear_mask;
+	}
+	return 0;
+}
+
+// reads the input level of all 32 pins of one bank at once
+int mmap_gpio_read_bank(int bank, uint32_t* value){
+	static const int bank_offset[4] = {GPIO0, GPIO1, GPIO2, GPIO3};
+	if(unlikely(!gpio_initialized || bank<0 || bank>3)) return -1;
+	*value = map[(bank_offset[bank]-MMAP_OFFSET+GPIO_DATAIN)/4];
+	return 0;
+}
+
 
 /*********************************************
 *   ADC
@@ -238,6 +265,9 @@ int initialize_mmap_adc() {
 	map[(ADCSTEPDELAY7-MMAP_OFFSET)/4]  = 0<<24;
 	map[(ADCSTEPCONFIG8-MMAP_OFFSET)/4] = 0x07<<19 | ADC_AVG8 | ADC_SW_ONESHOT;
 	map[(ADCSTEPDELAY8-MMAP_OFFSET)/4]  = 0<<24;
+
+	// tag fifo words with their step so continuous samples can be sorted
+	map[(ADC_CTRL-MMAP_OFFSET)/4] |= ADC_CTRL_STEP_ID_TAG;
 	
 	// enable the ADC
 	map[(ADC_CTRL-MMAP_OFFSET)/4] |= 0x01;
@@ -276,3 +306,64 @@ int mmap_adc_read_raw(int ch) {
 	return output;
 }
 
+// ADC clock after the divider, the conversion rate depends on this
+int mmap_adc_clock_hz(){
+	if(initialize_mmap_adc()) return -1;
+	return ADC_CLK_IN_HZ/((map[(ADC_CLKDIV-MMAP_OFFSET)/4] & 0xFFFF)+1);
+}
+
+// Runs steps 9-16 in software continuous mode, one step per channel 0-7, so
+// the sequencer sweeps all channels into FIFO1 without the CPU. open_delay
+// in ADC clocks is inserted before each step to set the sweep rate. With
+// average set each step averages 8 conversions, otherwise it takes one so
+// sweeps can run 8 times faster. Oneshot reads keep using steps 1-8 and
+// FIFO0, the sequencer fits them in between. Only one user can own FIFO1.
+int mmap_adc_start_continuous(uint32_t open_delay, int average){
+	int i, output = 0;
+	if(initialize_mmap_adc()) return -1;
+	if(map[(ADC_STEPENABLE-MMAP_OFFSET)/4] & (0xFF<<9)){
+		printf("ERROR: ADC continuous sampling already in use\n");
+		return -1;
+	}
+	if(open_delay>ADC_OPEN_DELAY_MASK) open_delay = ADC_OPEN_DELAY_MASK;
+	for(i=0;i<8;i++){
+		map[(ADCSTEPCONFIG(ADC_STREAM_FIRST_STEP_ID+1+i)-MMAP_OFFSET)/4] = i<<19 \
+								| (average ? ADC_AVG8 : ADC_AVG1) \
+								| ADC_FIFO1_SELECT | ADC_SW_CONTINUOUS;
+		map[(ADCSTEPDELAY(ADC_STREAM_FIRST_STEP_ID+1+i)-MMAP_OFFSET)/4] = 0<<24 | open_delay;
+	}
+	// start from an empty fifo and clear any old overrun
+	while(map[(FIFO1COUNT-MMAP_OFFSET)/4] & FIFO_COUNT_MASK){
+		output = map[(ADC_FIFO1DATA-MMAP_OFFSET)/4];
+	}
+	if(output){}
+	map[(ADC_IRQSTATUS-MMAP_OFFSET)/4] = ADC_IRQ_FIFO1_OVERRUN;
+	map[(ADC_STEPENABLE-MMAP_OFFSET)/4] |= 0xFF<<9;
+	return 0;
+}
+
+int mmap_adc_stop_continuous(){
+	if(initialize_mmap_adc()) return -1;
+	map[(ADC_STEPENABLE-MMAP_OFFSET)/4] &= ~(0xFF<<9);
+	return 0;
+}
+
+// copies up to max raw FIFO1 words, each holds the step id in bits 16-19
+// and the sample in bits 0-11, returns the number copied
+int mmap_adc_drain_continuous(uint32_t* words, int max){
+	int i, n;
+	n = map[(FIFO1COUNT-MMAP_OFFSET)/4] & FIFO_COUNT_MASK;
+	if(n>max) n = max;
+	for(i=0;i<n;i++) words[i] = map[(ADC_FIFO1DATA-MMAP_OFFSET)/4];
+	return n;
+}
+
+// returns 1 and clears the flag if FIFO1 overflowed since the last call
+int mmap_adc_continuous_overrun(){
+	if(!(map[(ADC_IRQSTATUS_RAW-MMAP_OFFSET)/4] & ADC_IRQ_FIFO1_OVERRUN)){
+		return 0;
+	}
+	map[(ADC_IRQSTATUS-MMAP_OFFSET)/4] = ADC_IRQ_FIFO1_OVERRUN;
+	return 1;
+}
+
@@ -19,12 +19,25 @@ Big thanks to Ethan Hayon for the GPIO code
 
 
 // GPIO
+#include <stdint.h>
 int initialize_mmap_gpio();
+int mmap_gpio_is_initialized();
+int mmap_gpio_write_bank(int bank, uint32_t set_mask, uint32_t clear_mask);
+int mmap_gpio_read_bank(int bank, uint32_t* value);
 
 
 // ADC
 int initialize_mmap_adc();
 int mmap_adc_read_raw(int ch);
+int mmap_adc_clock_hz();
+int mmap_adc_start_continuous(uint32_t open_delay, int average);
+int mmap_adc_stop_continuous();
+int mmap_adc_drain_continuous(uint32_t* words, int max);
+int mmap_adc_continuous_overrun();
+
+// continuous sampling uses steps 9-16, the step id tag in bits 16-19 of
+// their FIFO words counts from 0 so channel 0 comes tagged 8
+#define ADC_STREAM_FIRST_STEP_ID	8
 
 
 #endif
@@ -58,12 +58,30 @@
 #define ADC_AVG16 (0b100 << 2)
 
 #define ADC_SW_ONESHOT 0b00
+#define ADC_SW_CONTINUOUS 0b01
+#define ADC_FIFO1_SELECT (0x01<<26)
+#define ADC_OPEN_DELAY_MASK 0x3FFFF
 #define FIFO0COUNT (ADC_TSC+0xE4)
 #define FIFO_COUNT_MASK 0b01111111
 
 #define ADC_FIFO0DATA (ADC_TSC+0x100)
 #define ADC_FIFO_MASK (0xFFF)
 
+// steps 9-16, used for continuous sampling into FIFO1
+#define ADCSTEPCONFIG(n) (ADC_TSC+0x64+((n)-1)*8)
+#define ADCSTEPDELAY(n)  (ADC_TSC+0x68+((n)-1)*8)
+#define FIFO1COUNT (ADC_TSC+0xF0)
+#define ADC_FIFO1DATA (ADC_TSC+0x200)
+#define ADC_FIFO_CHANNEL(word) (((word)>>16)&0xF)
+#define ADC_FIFO_SIZE 64
+
+#define ADC_CTRL_STEP_ID_TAG (0x01<<1)
+#define ADC_CLKDIV (ADC_TSC+0x4C)
+#define ADC_CLK_IN_HZ 24000000
+#define ADC_IRQSTATUS_RAW (ADC_TSC+0x24)
+#define ADC_IRQSTATUS (ADC_TSC+0x28)
+#define ADC_IRQ_FIFO1_OVERRUN (0x01<<6)
+
 #define TRUE 1
 #define FALSE 0
 
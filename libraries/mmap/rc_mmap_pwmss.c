@@ -23,6 +23,21 @@ volatile char *pwm_base[3]; // pwm subsystem pointers for eQEP
 int pwmss_mapped[3] = {0,0,0}; // to record which subsystems have been mapped
 int eqep_initialized[3] = {0,0,0};
 int pwm_initialized[3] = {0,0,0};
+int hr_enabled[3] = {0,0,0}; // channel A high resolution, see rc_pwm_set_high_res
+static int counters_synced = 0;
+static int update_depth = 0; // nesting of rc_pwm_begin_update()
+
+// nominal MEP steps per 10ns TBCLK for the ~150ps step size given by TI, the
+// real step varies with process and temperature and is not calibrated here
+#define HR_MEP_STEPS 66
+// don't release held compare values this close to the end of a period, in
+// TBCLK counts, so the release can't straddle a counter zero
+#define COMMIT_MARGIN 256
+// counts two synced counters may differ by when read back to back
+#define SYNC_TOLERANCE 32
+
+static inline void write_cmp(int ss, int ch, uint16_t period, float duty);
+static int pwm_running(int ss);
 
 /********************************************
 *  PWMSS Mapping
@@ -215,6 +230,61 @@ int write_eqep(int ch, int val){
 	return 0;
 }
 
+/*******************************************************************************
+* int init_eqep_velocity(int ss, uint32_t unit_period_us, int ccps, int upps)
+*
+* Sets the unit timer to time out every unit_period_us and enables the
+* capture unit. On each time-out the position, capture period and capture
+* timer are latched together. The capture timer runs at SYSCLK/2^ccps and
+* measures the time between unit events, one every 2^upps counts. The
+* time-out interrupt is turned off so the kernel driver doesn't clear the
+* flag before read_eqep_velocity() sees it.
+*******************************************************************************/
+int init_eqep_velocity(int ss, uint32_t unit_period_us, int ccps, int upps){
+	volatile char* base;
+	if(init_eqep(ss)) return -1;
+	if(ccps<0 || ccps>7 || upps<0 || upps>11 || unit_period_us==0){
+		fprintf(stderr,"ERROR in init_eqep_velocity, invalid argument\n");
+		return -1;
+	}
+	base = pwm_base[ss]+EQEP_OFFSET;
+	*(volatile uint16_t*)(base+QEINT) = 0;
+	// capture settings can only change while the capture unit is disabled
+	*(volatile uint16_t*)(base+QCAPCTL) = 0;
+	*(volatile uint32_t*)(base+QUPRD) = \
+				(uint32_t)((uint64_t)unit_period_us*(EQEP_SYSCLK_HZ/1000000));
+	*(volatile uint16_t*)(base+QCAPCTL) = CEN | (ccps<<4) | upps;
+	// start from clean flags
+	*(volatile uint16_t*)(base+QEPSTS) = COEF | CDEF;
+	*(volatile uint16_t*)(base+QCLR) = UTOF;
+	return 0;
+}
+
+/*******************************************************************************
+* int read_eqep_velocity(int ss, eqep_velocity_latch_t* l)
+*
+* Reads the registers latched at the last unit time-out. new_unit says if a
+* time-out happened since the previous call, the other fields are only
+* meaningful when it is set. Error flags are cleared for the next period.
+*******************************************************************************/
+int read_eqep_velocity(int ss, eqep_velocity_latch_t* l){
+	volatile char* base = pwm_base[ss]+EQEP_OFFSET;
+	uint16_t sts;
+	l->new_unit = (*(volatile uint16_t*)(base+QFLG) & UTOF) != 0;
+	if(!l->new_unit) return 0;
+	l->pos = *(volatile int32_t*)(base+QPOSLAT);
+	l->cap_period = *(volatile uint16_t*)(base+QCPRDLAT);
+	l->cap_timer = *(volatile uint16_t*)(base+QCTMRLAT);
+	sts = *(volatile uint16_t*)(base+QEPSTS);
+	l->cap_error = (sts & (COEF|CDEF)) != 0;
+	l->forward = (sts & QDF) != 0;
+	*(volatile uint16_t*)(base+QEPSTS) = COEF | CDEF;
+	*(volatile uint16_t*)(base+QCLR) = UTOF;
+	// time since the latch, for working out how many unit periods passed
+	l->since_unit = *(volatile uint32_t*)(base+QUTMR);
+	return 0;
+}
+
 /*******************************************************************************
 * int rc_pwm_set_duty_mmap(int ss, char ch, float duty)
 *
@@ -243,20 +313,18 @@ int rc_pwm_set_duty_mmap(int ss, char ch, float duty){
 	
 	// duty ranges from 0 to TBPRD+1 for 0-100% PWM duty
 	uint16_t period = *(uint16_t*)(pwm_base[ss]+PWM_OFFSET+TBPRD);
-	uint16_t new_duty = (uint16_t)lroundf(duty * (period+1));
 	
 	#ifdef DEBUG
 		printf("period : %d\n", period);
-		printf("new_duty : %d\n", new_duty);
 	#endif
 	
 	// change appropriate compare register
 	switch(ch){
 	case 'A':
-		*(uint16_t*)(pwm_base[ss]+PWM_OFFSET+CMPA) = new_duty;
+		write_cmp(ss, 0, period, duty);
 		break;
 	case 'B':
-		*(uint16_t*)(pwm_base[ss]+PWM_OFFSET+CMPB) = new_duty;
+		write_cmp(ss, 1, period, duty);
 		break;
 	default:
 		fprintf(stderr,"ERROR in rc_pwm_set_duty_mmap, pwm channel must be 'A' or 'B'\n");
@@ -265,3 +333,211 @@ int rc_pwm_set_duty_mmap(int ss, char ch, float duty){
 	
 	return 0;
 }
+
+/*******************************************************************************
+* int mmap_pwm_write_duty_pair(int ss, float duty_a, float duty_b)
+*
+* Writes CMPA and CMPB of one subsystem back to back from a single read of the
+* period. With the default shadow loading both values take effect at the same
+* counter zero so the two channels never show a mix of old and new duties.
+* Duties must already be clamped to 0.0f-1.0f, this is for internal callers
+* like rc_set_motors() that have done their own checking.
+*******************************************************************************/
+int mmap_pwm_write_duty_pair(int ss, float duty_a, float duty_b){
+	volatile uint16_t* regs;
+	uint16_t period;
+	if(unlikely(map_pwmss(ss))) return -1;
+	regs = (volatile uint16_t*)(pwm_base[ss]+PWM_OFFSET);
+	period = regs[TBPRD/2];
+	write_cmp(ss, 0, period, duty_a);
+	write_cmp(ss, 1, period, duty_b);
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_pwm_set_high_res(int ss, int enable)
+*
+* Turns the micro edge positioner on channel A's falling edge on or off. While
+* on, the fraction of a TBCLK count left over from the duty cycle goes into
+* CMPAHR. The hardware only supports this with an undivided time-base clock
+* and only on channel A.
+*******************************************************************************/
+int rc_pwm_set_high_res(int ss, int enable){
+	volatile char* base;
+	if(map_pwmss(ss)){
+		fprintf(stderr,"ERROR in rc_pwm_set_high_res, failed to map PWMSS %d\n", ss);
+		return -1;
+	}
+	base = pwm_base[ss]+PWM_OFFSET;
+	if(!enable){
+		*(volatile uint16_t*)(base+HRCNFG) = HR_DISABLE;
+		*(volatile uint16_t*)(base+CMPAHR) = 0;
+		hr_enabled[ss] = 0;
+		return 0;
+	}
+	if(*(volatile uint16_t*)(base+TBCTL) & (TB_CLKDIV_MASK|TB_HSPCLKDIV_MASK)){
+		fprintf(stderr,"ERROR in rc_pwm_set_high_res, PWMSS %d time-base clock is divided\n", ss);
+		fprintf(stderr,"use a higher frequency with rc_pwm_init()\n");
+		return -1;
+	}
+	// channel A is set at zero and cleared on CMPA so move the falling edge,
+	// the fraction is shadowed and loads at zero with CMPA
+	*(volatile uint16_t*)(base+HRCNFG) = HR_FEP | HR_CMP | HR_CTR_ZERO;
+	hr_enabled[ss] = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_pwm_sync_counters()
+*
+* Aligns the time-base counters of every running subsystem so their periods
+* start on the same TBCLK edge. Each counter loads a phase of 0 on a sync
+* pulse and passes the pulse on. A software sync is forced on the first
+* subsystem and travels down the sync chain. Any subsystem still out of step
+* afterwards, if the chain doesn't reach it, is synced directly which leaves
+* a skew of a few counts.
+*******************************************************************************/
+int rc_pwm_sync_counters(){
+	volatile char* base[3];
+	uint16_t period = 0;
+	int ss, first = -1, n = 0;
+	int c0, c;
+
+	for(ss=0;ss<3;ss++){
+		if(!pwm_running(ss)) continue;
+		base[ss] = pwm_base[ss]+PWM_OFFSET;
+		if(first<0){
+			first = ss;
+			period = *(volatile uint16_t*)(base[ss]+TBPRD);
+		}
+		else if(*(volatile uint16_t*)(base[ss]+TBPRD)!=period){
+			fprintf(stderr,"ERROR in rc_pwm_sync_counters, subsystems run at different frequencies\n");
+			return -1;
+		}
+		n++;
+	}
+	if(n<2){
+		fprintf(stderr,"ERROR in rc_pwm_sync_counters, need 2 running subsystems\n");
+		return -1;
+	}
+	for(ss=first;ss<3;ss++){
+		if(!pwm_running(ss)) continue;
+		*(volatile uint16_t*)(base[ss]+TBPHS) = 0;
+		*(volatile uint16_t*)(base[ss]+TBCTL) = \
+			(*(volatile uint16_t*)(base[ss]+TBCTL) & ~(TB_SYNCOSEL_MASK|TB_PHSEN_MASK)) \
+			| TB_SYNC_IN | TB_ENABLE;
+	}
+	*(volatile uint16_t*)(base[first]+TBCTL) |= TB_SWFSYNC;
+
+	for(ss=first+1;ss<3;ss++){
+		if(!pwm_running(ss)) continue;
+		c0 = *(volatile uint16_t*)(base[first]+TBCNT);
+		c = *(volatile uint16_t*)(base[ss]+TBCNT);
+		// compare modulo the period in case a zero fell between the reads
+		if(abs(c-c0)>SYNC_TOLERANCE && abs(c-c0)<period-SYNC_TOLERANCE){
+			*(volatile uint16_t*)(base[first]+TBCTL) |= TB_SWFSYNC;
+			*(volatile uint16_t*)(base[ss]+TBCTL) |= TB_SWFSYNC;
+		}
+	}
+	counters_synced = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_pwm_begin_update()
+*
+* Freezes the shadow to active compare register loads on all mapped
+* subsystems. Compare writes from here on stay in the shadow registers until
+* rc_pwm_commit_update(). Calls nest, only the outermost pair takes effect.
+* CMPAHR can't be frozen so with high resolution on, the fractional part may
+* land up to a period before its CMPA, an error of less than one count.
+*******************************************************************************/
+int rc_pwm_begin_update(){
+	volatile uint16_t* cmpctl;
+	int ss;
+	if(__atomic_fetch_add(&update_depth, 1, __ATOMIC_ACQ_REL)!=0) return 0;
+	for(ss=0;ss<3;ss++){
+		if(!pwmss_mapped[ss]) continue;
+		cmpctl = (volatile uint16_t*)(pwm_base[ss]+PWM_OFFSET+CMPCTL);
+		*cmpctl = (*cmpctl & ~(CC_SHDW_MODE_MASK|CC_LOAD_MODE_MASK)) \
+			| CC_SHADOW_A | CC_SHADOW_B | CC_LOAD_FREEZE_A | CC_LOAD_FREEZE_B;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_pwm_commit_update()
+*
+* Lets every mapped subsystem load its shadow compare values at the next
+* counter zero. When the counters have been aligned with
+* rc_pwm_sync_counters() this waits, at most a few microseconds, until the
+* counters are clear of the end of a period so every subsystem loads on the
+* same zero.
+*******************************************************************************/
+int rc_pwm_commit_update(){
+	volatile uint16_t* cmpctl;
+	volatile uint16_t* cnt;
+	uint16_t period, margin, c, last;
+	int ss, depth;
+
+	depth = __atomic_sub_fetch(&update_depth, 1, __ATOMIC_ACQ_REL);
+	if(unlikely(depth<0)){
+		__atomic_store_n(&update_depth, 0, __ATOMIC_RELEASE);
+		fprintf(stderr,"ERROR in rc_pwm_commit_update, no matching rc_pwm_begin_update\n");
+		return -1;
+	}
+	if(depth>0) return 0;
+
+	if(counters_synced){
+		for(ss=0;ss<3;ss++) if(pwm_running(ss)) break;
+		if(ss<3){
+			period = *(volatile uint16_t*)(pwm_base[ss]+PWM_OFFSET+TBPRD);
+			cnt = (volatile uint16_t*)(pwm_base[ss]+PWM_OFFSET+TBCNT);
+			margin = (period/4<COMMIT_MARGIN) ? period/4 : COMMIT_MARGIN;
+			// spin until the counter wraps if it is about to
+			last = *cnt;
+			while(period-last<margin){
+				c = *cnt;
+				if(c<last) break;
+				last = c;
+			}
+		}
+	}
+	for(ss=0;ss<3;ss++){
+		if(!pwmss_mapped[ss]) continue;
+		cmpctl = (volatile uint16_t*)(pwm_base[ss]+PWM_OFFSET+CMPCTL);
+		*cmpctl = (*cmpctl & ~CC_LOAD_MODE_MASK) | CC_CTR_ZERO_A | CC_CTR_ZERO_B;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* static inline void write_cmp(int ss, int ch, uint16_t period, float duty)
+*
+* Writes one compare register, channel 0 is A and 1 is B. With high
+* resolution on, CMPA and CMPAHR are adjacent so both go in one 32-bit store.
+*******************************************************************************/
+static inline void write_cmp(int ss, int ch, uint16_t period, float duty){
+	volatile char* base = pwm_base[ss]+PWM_OFFSET;
+	float counts = duty * (period+1);
+	uint32_t whole;
+	if(ch==0 && hr_enabled[ss]){
+		whole = (uint32_t)counts;
+		*(volatile uint32_t*)(base+CMPAHR) = (whole<<16) \
+				| ((uint32_t)((counts-whole)*HR_MEP_STEPS)<<8);
+	}
+	else if(ch==0) *(volatile uint16_t*)(base+CMPA) = (uint16_t)lroundf(counts);
+	else *(volatile uint16_t*)(base+CMPB) = (uint16_t)lroundf(counts);
+}
+
+/*******************************************************************************
+* static int pwm_running(int ss)
+*
+* returns 1 if a subsystem is mapped and its time-base counter is running
+*******************************************************************************/
+static int pwm_running(int ss){
+	uint16_t tbctl;
+	if(!pwmss_mapped[ss]) return 0;
+	tbctl = *(volatile uint16_t*)(pwm_base[ss]+PWM_OFFSET+TBCTL);
+	return (tbctl & TB_FREEZE) != TB_FREEZE;
+}
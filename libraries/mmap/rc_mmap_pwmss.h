@@ -15,11 +15,30 @@ be done through /sys/class/pwm or with simple_pwm.c
 #ifndef MMAP_PWMSS
 #define MMAP_PWMSS
 
+#include <stdint.h>
+
 // eQEP
 int init_eqep(int ss);
 int read_eqep(int ch);
 int write_eqep(int ch, int val);
 
+// eQEP unit timer and capture latches for velocity measurement
+typedef struct eqep_velocity_latch_t{
+	int new_unit;			// a unit time-out happened since the last read
+	int32_t pos;			// QPOSLAT, position at the last unit time-out
+	uint32_t since_unit;	// QUTMR, SYSCLK ticks since that time-out
+	uint16_t cap_period;	// QCPRDLAT, capture ticks between unit events
+	uint16_t cap_timer;		// QCTMRLAT, capture ticks since the last event
+	int cap_error;			// capture overflow or direction change
+	int forward;			// QDF, direction of the last quadrature count
+} eqep_velocity_latch_t;
+int init_eqep_velocity(int ss, uint32_t unit_period_us, int ccps, int upps);
+int read_eqep_velocity(int ss, eqep_velocity_latch_t* l);
+
+// PWM
+int map_pwmss(int ss);
+int mmap_pwm_write_duty_pair(int ss, float duty_a, float duty_b);
+
 
 #endif
 
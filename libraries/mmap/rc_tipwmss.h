@@ -105,6 +105,19 @@
 #define EQEP_INTERRUPT_MASK (0x0FFF)
 #define UTOF                (0x0001 << 11)
 
+// Bits for the QEPSTS register
+#define UPEVNT     (0x0001 << 7)
+#define FDF        (0x0001 << 6)
+#define QDF        (0x0001 << 5)
+#define QDLF       (0x0001 << 4)
+#define COEF       (0x0001 << 3)
+#define CDEF       (0x0001 << 2)
+#define FIMF       (0x0001 << 1)
+#define PCEF       (0x0001 << 0)
+
+// eQEP functional clock, SYSCLKOUT
+#define EQEP_SYSCLK_HZ 100000000
+
 // Modes for the eQEP unit
 //  Absolute - the position entry represents the current position of the encoder.
 //             Poll this value and it will be notified every period nanoseconds
@@ -163,6 +176,13 @@
 // PHSEN bit
 #define TB_DISABLE 0x0<<2
 #define TB_ENABLE 0x1<<2
+// SWFSYNC bit, writing 1 forces a sync pulse
+#define TB_SWFSYNC 0x1<<6
+// masks for read-modify-write of TBCTL fields
+#define TB_PHSEN_MASK 0x1<<2
+#define TB_SYNCOSEL_MASK 0x3<<4
+#define TB_CLKDIV_MASK 0x7<<10
+#define TB_HSPCLKDIV_MASK 0x7<<7
 
 /*********************************
 * CMPCTL (Compare Control)
@@ -181,6 +201,24 @@
 #define CC_CTR_PRD_A 0x1
 #define CC_CTR_EITHER_A 0x2
 #define CC_LOAD_FREEZE_A 0x3
+// masks for read-modify-write of CMPCTL fields
+#define CC_SHDW_MODE_MASK ((0x1<<6)|(0x1<<4))
+#define CC_LOAD_MODE_MASK 0xF
+
+/*********************************
+* HRCNFG (High-resolution Configuration)
+*********************************/
+// EDGMODE bits, which edge the micro edge positioner moves
+#define HR_DISABLE 0x0
+#define HR_REP 0x1
+#define HR_FEP 0x2
+#define HR_BEP 0x3
+// CTLMODE bit
+#define HR_CMP 0x0<<2
+#define HR_PHS 0x1<<2
+// HRLOAD bit
+#define HR_CTR_ZERO 0x0<<3
+#define HR_CTR_PRD 0x1<<3
 
 
 /*********************************
@@ -219,6 +257,8 @@
 #define AQ_SFRC 0x1A
 #define AQ_CSFRC 0x1C
 
+#define HRCNFG 0xC0
+
 /*********************************
 * clock control registers
 *********************************/
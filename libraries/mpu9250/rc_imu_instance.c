@@ -0,0 +1,222 @@
+/*******************************************************************************
+* rc_imu_instance.c
+*
+* MPU9250s behind a handle in random-read mode so the onboard IMU and external
+* ones can be sampled side by side. Each instance has its own bus and selects
+* it for the calling thread while using the register helpers it shares with
+* the onboard driver in rc_mpu9250.c.
+*******************************************************************************/
+#include "../rc_defs.h"
+#include "../roboticscape.h"
+#include "../preprocessor_macros.h"
+#include "rc_mpu9250_defs.h"
+#include "rc_mpu9250.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BURST_LEN		14	// accel, temp and gyro from ACCEL_XOUT_H
+#define MAG_BURST_LEN	22	// plus ST1 through ST2 from slave 0
+
+/*******************************************************************************
+* Local Function Declarations
+*******************************************************************************/
+static int configure(rc_imu_t* imu);
+static int is_onboard(rc_imu_config_t* conf);
+static void convert_mag(rc_imu_t* imu, uint8_t* raw);
+
+/*******************************************************************************
+* int rc_imu_open(rc_imu_t* imu, rc_imu_config_t conf)
+*
+* Opens the bus given in conf, resets the device and configures it for
+* random reads. The onboard IMU picks up its calibration from disk.
+*******************************************************************************/
+int rc_imu_open(rc_imu_t* imu, rc_imu_config_t conf){
+	imu_bus_t* b;
+	imu_bus_t* prev;
+	int i, ret;
+	if(imu==NULL){
+		fprintf(stderr,"ERROR in rc_imu_open, received NULL pointer\n");
+		return -1;
+	}
+	b = calloc(1, sizeof(imu_bus_t));
+	if(b==NULL){
+		fprintf(stderr,"ERROR in rc_imu_open, failed to allocate memory\n");
+		return -1;
+	}
+	if(imu_bus_open(b, &conf)){
+		free(b);
+		return -1;
+	}
+	imu->conf = conf;
+	imu->bus = b;
+	imu->mag_valid = 0;
+	for(i=0;i<3;i++){
+		imu->gyro_offset[i] = 0.0f;
+		imu->mag_adjust[i] = 1.0f;
+		imu->mag_offset[i] = 0.0f;
+		imu->mag_scale[i] = 1.0f;
+		imu->mag[i] = 0.0f;
+	}
+	prev = imu_select_bus(b);
+	imu_claim_bus();
+	ret = configure(imu);
+	imu_release_bus();
+	imu_select_bus(prev);
+	if(ret){
+		imu_bus_close(b);
+		free(b);
+		imu->bus = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_imu_read(rc_imu_t* imu, rc_imu_sample_t* s)
+*
+* Reads accel, temperature and gyro in one burst, with the magnetometer too
+* when it comes through the I2C master, and stamps the sample at the middle
+* of the transfer. Without the master the magnetometer is read separately
+* when it has new data. Returns -1 on a bus error.
+*******************************************************************************/
+int rc_imu_read(rc_imu_t* imu, rc_imu_sample_t* s){
+	imu_bus_t* prev;
+	uint8_t raw[MAG_BURST_LEN], st1;
+	uint64_t t0, t1;
+	int i, len, ret = 0;
+	if(unlikely(imu==NULL || imu->bus==NULL || s==NULL)){
+		fprintf(stderr,"ERROR in rc_imu_read, instance not open\n");
+		return -1;
+	}
+	prev = imu_select_bus(imu->bus);
+	len = BURST_LEN;
+	if(imu->conf.enable_magnetometer && !imu_transport_has_bypass()){
+		len = MAG_BURST_LEN;
+	}
+	imu_claim_bus();
+	t0 = rc_nanos_since_boot();
+	if(imu_read_bytes(ACCEL_XOUT_H, len, raw)!=len) ret = -1;
+	t1 = rc_nanos_since_boot();
+	if(ret==0 && len==MAG_BURST_LEN){
+		if(raw[BURST_LEN]&MAG_DATA_READY) convert_mag(imu, &raw[BURST_LEN+1]);
+	}
+	else if(ret==0 && imu->conf.enable_magnetometer){
+		// with the bypass check ST1 first, reading through ST2 latches
+		if(mag_read_byte(AK8963_ST1, &st1)<0) ret = -1;
+		else if(st1&MAG_DATA_READY){
+			if(mag_read_bytes(AK8963_XOUT_L, 7, &raw[BURST_LEN+1])<0) ret = -1;
+			else convert_mag(imu, &raw[BURST_LEN+1]);
+		}
+	}
+	imu_release_bus();
+	imu_select_bus(prev);
+	if(unlikely(ret)) return -1;
+
+	s->t_ns = t0 + (t1-t0)/2;
+	for(i=0;i<3;i++){
+		s->accel[i] = (int16_t)(((uint16_t)raw[2*i]<<8)|raw[2*i+1]) \
+														* imu->accel_to_ms2;
+		s->gyro[i] = (int16_t)(((uint16_t)raw[8+2*i]<<8)|raw[9+2*i]) \
+									* imu->gyro_to_degs - imu->gyro_offset[i];
+		s->mag[i] = imu->mag[i];
+	}
+	s->temp = 21.0f + (int16_t)(((uint16_t)raw[6]<<8)|raw[7])/TEMP_SENSITIVITY;
+	s->mag_valid = imu->mag_valid;
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_imu_close(rc_imu_t* imu)
+*
+* puts the device to sleep and releases its bus
+*******************************************************************************/
+int rc_imu_close(rc_imu_t* imu){
+	imu_bus_t* prev;
+	if(imu==NULL || imu->bus==NULL) return 0;
+	prev = imu_select_bus(imu->bus);
+	imu_claim_bus();
+	imu_write_byte(PWR_MGMT_1, MPU_SLEEP);
+	imu_release_bus();
+	imu_select_bus(prev);
+	imu_bus_close(imu->bus);
+	free(imu->bus);
+	imu->bus = NULL;
+	return 0;
+}
+
+/*******************************************************************************
+* static int configure(rc_imu_t* imu)
+*
+* same setup as rc_initialize_imu() on the instance's bus, which the caller
+* has selected and claimed
+*******************************************************************************/
+static int configure(rc_imu_t* imu){
+	rc_imu_data_t scales;
+	uint8_t c;
+	int i;
+	if(imu_reset_registers()){
+		fprintf(stderr,"ERROR in rc_imu_open, failed to reset MPU9250\n");
+		return -1;
+	}
+	if(imu_read_byte(WHO_AM_I_MPU9250, &c)<0 || c!=0x71){
+		fprintf(stderr,"ERROR in rc_imu_open, no MPU9250 found\n");
+		return -1;
+	}
+	if(is_onboard(&imu->conf) && load_gyro_offets()) return -1;
+	// 1khz sample rate
+	if(imu_write_byte(SMPLRT_DIV, 0x00)){
+		fprintf(stderr,"ERROR in rc_imu_open, bus write error\n");
+		return -1;
+	}
+	if(set_gyro_fsr(imu->conf.gyro_fsr, &scales)) return -1;
+	if(set_accel_fsr(imu->conf.accel_fsr, &scales)) return -1;
+	if(set_gyro_dlpf(imu->conf.gyro_dlpf)) return -1;
+	if(set_accel_dlpf(imu->conf.accel_dlpf)) return -1;
+	imu->accel_to_ms2 = scales.accel_to_ms2;
+	imu->gyro_to_degs = scales.gyro_to_degs;
+	if(!imu->conf.enable_magnetometer){
+		power_down_magnetometer();
+		return 0;
+	}
+	if(imu_mag_setup(imu->mag_adjust)){
+		fprintf(stderr,"ERROR in rc_imu_open, failed to initialize magnetometer\n");
+		return -1;
+	}
+	if(is_onboard(&imu->conf)){
+		load_mag_calibration();
+		for(i=0;i<3;i++){
+			imu->mag_offset[i] = mag_offsets[i];
+			if(mag_scales[i]!=0.0f) imu->mag_scale[i] = mag_scales[i];
+		}
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* static int is_onboard(rc_imu_config_t* conf)
+*
+* the calibration files on disk belong to the onboard IMU only
+*******************************************************************************/
+static int is_onboard(rc_imu_config_t* conf){
+	return conf->spi_slave==0 && conf->i2c_bus==IMU_BUS && conf->i2c_addr==IMU_ADDR;
+}
+
+/*******************************************************************************
+* static void convert_mag(rc_imu_t* imu, uint8_t* raw)
+*
+* raw holds HXL through ST2. The magnetometer axes are swapped relative to
+* the accel and gyro, see rc_read_mag_data().
+*******************************************************************************/
+static void convert_mag(rc_imu_t* imu, uint8_t* raw){
+	float m[3];
+	int16_t adc[3];
+	int i;
+	// discard saturated readings such as from a local field source
+	if(raw[6]&MAGNETOMETER_SATURATION) return;
+	for(i=0;i<3;i++) adc[i] = (int16_t)(((uint16_t)raw[2*i+1]<<8)|raw[2*i]);
+	m[0] = adc[1] * imu->mag_adjust[1] * MAG_RAW_TO_uT;
+	m[1] = adc[0] * imu->mag_adjust[0] * MAG_RAW_TO_uT;
+	m[2] = -adc[2] * imu->mag_adjust[2] * MAG_RAW_TO_uT;
+	for(i=0;i<3;i++) imu->mag[i] = (m[i]-imu->mag_offset[i])*imu->mag_scale[i];
+	imu->mag_valid = 1;
+}
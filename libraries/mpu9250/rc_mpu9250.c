@@ -10,8 +10,11 @@
 #include "../roboticscape.h"
 #include "../preprocessor_macros.h"
 #include "rc_mpu9250_defs.h"
+#include "rc_mpu9250.h"
 #include "dmp_firmware.h"
 #include "dmpKey.h"
+#include "../other/rc_realtime.h"
+#include "../other/rc_trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
@@ -19,6 +22,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <poll.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
@@ -67,6 +71,7 @@ int last_read_successful;
 uint64_t last_interrupt_timestamp_nanos;
 rc_imu_data_t* data_ptr;
 int shutdown_interrupt_thread = 0;
+rc_gpio_lines_t imu_event_line = {.fd = -1}; // chardev interrupt line if used
 // for magnetometer Yaw filtering
 rc_filter_t low_pass, high_pass;
 
@@ -74,12 +79,7 @@ rc_filter_t low_pass, high_pass;
 *	config functions for internal use only
 *******************************************************************************/
 int reset_mpu9250();
-int set_gyro_fsr(rc_gyro_fsr_t fsr, rc_imu_data_t* data);
-int set_accel_fsr(rc_accel_fsr_t, rc_imu_data_t* data);
-int set_gyro_dlpf(rc_gyro_dlpf_t);
-int set_accel_dlpf(rc_accel_dlpf_t);
 int initialize_magnetometer();
-int power_down_magnetometer();
 int mpu_set_bypass(unsigned char bypass_on);
 int mpu_write_mem(unsigned short mem_addr, unsigned short length,\
 												unsigned char *data);
@@ -99,8 +99,6 @@ int set_int_enable(unsigned char enable);
 int dmp_set_interrupt_mode(unsigned char mode);
 int read_dmp_fifo(rc_imu_data_t* data);
 int data_fusion(rc_imu_data_t* data);
-int load_gyro_offets();
-int load_mag_calibration();
 int write_mag_cal_to_disk(float offsets[3], float scale[3]);
 void* imu_interrupt_handler(void* ptr);
 int check_quaternion_validity(unsigned char* raw, int i);
@@ -127,6 +125,12 @@ rc_imu_config_t rc_default_imu_config(){
 	conf.compass_time_constant = 5.0;
 	conf.dmp_interrupt_priority = sched_get_priority_max(SCHED_FIFO)-1;
 	conf.show_warnings = 0;
+	
+	// bus
+	conf.spi_slave = 0;
+	conf.spi_speed_hz = 20000000;
+	conf.i2c_bus = IMU_BUS;
+	conf.i2c_addr = IMU_ADDR;
 	return conf;
 }
 
@@ -148,22 +152,13 @@ int rc_set_imu_config_to_defaults(rc_imu_config_t *conf){
 int rc_initialize_imu(rc_imu_data_t *data, rc_imu_config_t conf){  
 	uint8_t c;
 	
-	// make sure the bus is not currently in use by another thread
-	// do not proceed to prevent interfering with that process
-	if(rc_i2c_get_in_use_state(IMU_BUS)){
-		printf("i2c bus claimed by another process\n");
-		printf("Continuing with rc_initialize_imu() anyway.\n");
-	}
-	
-	// if it is not claimed, start the i2c bus
-	if(rc_i2c_init(IMU_BUS, IMU_ADDR)<0){
-		fprintf(stderr,"failed to initialize i2c bus\n");
+	// start the i2c or spi bus
+	if(imu_transport_init(&conf)<0){
+		fprintf(stderr,"failed to initialize IMU bus\n");
 		return -1;
 	}
-	// claiming the bus does no guarantee other code will not interfere 
-	// with this process, but best to claim it so other code can check
-	// like we did above
-	rc_i2c_claim_bus(IMU_BUS);
+	// keep the bus for the whole setup, other threads wait for it
+	imu_claim_bus();
 	
 	// update local copy of config struct with new values
 	config=conf;
@@ -171,57 +166,57 @@ int rc_initialize_imu(rc_imu_data_t *data, rc_imu_config_t conf){
 	// restart the device so we start with clean registers
 	if(reset_mpu9250()<0){
 		fprintf(stderr,"ERROR: failed to reset_mpu9250\n");
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	
 	//check the who am i register to make sure the chip is alive
-	if(rc_i2c_read_byte(IMU_BUS, WHO_AM_I_MPU9250, &c)<0){
+	if(imu_read_byte(WHO_AM_I_MPU9250, &c)<0){
 		fprintf(stderr,"Reading WHO_AM_I_MPU9250 register failed\n");
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	if(c!=0x71){
 		fprintf(stderr,"mpu9250 WHO AM I register should return 0x71\n");
 		fprintf(stderr,"WHO AM I returned: 0x%x\n", c);
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
  
 	// load in gyro calibration offsets from disk
 	if(load_gyro_offets()<0){
 		fprintf(stderr,"ERROR: failed to load gyro calibration offsets\n");
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	
 	// Set sample rate = 1000/(1 + SMPLRT_DIV)
 	// here we use a divider of 0 for 1khz sample
-	if(rc_i2c_write_byte(IMU_BUS, SMPLRT_DIV, 0x00)){
+	if(imu_write_byte(SMPLRT_DIV, 0x00)){
 		fprintf(stderr,"I2C bus write error\n");
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	
 	// set full scale ranges and filter constants
 	if(set_gyro_fsr(conf.gyro_fsr, data)){
 		fprintf(stderr,"failed to set gyro fsr\n");
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	if(set_accel_fsr(conf.accel_fsr, data)){
 		fprintf(stderr,"failed to set accel fsr\n");
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	if(set_gyro_dlpf(conf.gyro_dlpf)){
 		fprintf(stderr,"failed to set gyro dlpf\n");
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	if(set_accel_dlpf(conf.accel_dlpf)){
 		fprintf(stderr,"failed to set accel_dlpf\n");
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	
@@ -229,14 +224,14 @@ int rc_initialize_imu(rc_imu_data_t *data, rc_imu_config_t conf){
 	if(conf.enable_magnetometer){
 		if(initialize_magnetometer()){
 			fprintf(stderr,"failed to initialize magnetometer\n");
-			rc_i2c_release_bus(IMU_BUS);
+			imu_release_bus();
 			return -1;
 		}
 	}
 	else power_down_magnetometer();
 	
 	// all done!!
-	rc_i2c_release_bus(IMU_BUS);
+	imu_release_bus();
 	return 0;
 }
 
@@ -249,10 +244,8 @@ int rc_initialize_imu(rc_imu_data_t *data, rc_imu_config_t conf){
 int rc_read_accel_data(rc_imu_data_t *data){
 	// new register data stored here
 	uint8_t raw[6];  
-	// set the device address
-	rc_i2c_set_device_address(IMU_BUS, IMU_ADDR);
 	 // Read the six raw data registers into data array
-	if(rc_i2c_read_bytes(IMU_BUS, ACCEL_XOUT_H, 6, &raw[0])<0){
+	if(imu_read_bytes(ACCEL_XOUT_H, 6, &raw[0])<0){
 		return -1;
 	}
 	// Turn the MSB and LSB into a signed 16-bit value
@@ -275,10 +268,8 @@ int rc_read_accel_data(rc_imu_data_t *data){
 int rc_read_gyro_data(rc_imu_data_t *data){
 	// new register data stored here
 	uint8_t raw[6];
-	// set the device address
-	rc_i2c_set_device_address(IMU_BUS, IMU_ADDR);
 	// Read the six raw data registers into data array
-	if(rc_i2c_read_bytes(IMU_BUS, GYRO_XOUT_H, 6, &raw[0])<0){
+	if(imu_read_bytes(GYRO_XOUT_H, 6, &raw[0])<0){
 		return -1;
 	}
 	// Turn the MSB and LSB into a signed 16-bit value
@@ -301,7 +292,7 @@ int rc_read_gyro_data(rc_imu_data_t *data){
 *******************************************************************************/
 int rc_read_mag_data(rc_imu_data_t* data){
 	uint8_t st1;
-	uint8_t raw[7];
+	uint8_t raw[8];	// ST1 through ST2 over the I2C master, XOUT_L to ST2 otherwise
 	int16_t adc[3];
 	float factory_cal_data[3];
 	if(config.enable_magnetometer==0){
@@ -311,10 +302,18 @@ int rc_read_mag_data(rc_imu_data_t* data){
 	}
 	// magnetometer is actually a separate device with its
 	// own address inside the mpu9250
-	// MPU9250 was put into passthrough mode 
-	rc_i2c_set_device_address(IMU_BUS, AK8963_ADDR);
+	// MPU9250 was put into passthrough mode, over SPI the MPU's I2C master
+	// copies ST1 through ST2 into the external sensor registers instead
+	if(!imu_transport_has_bypass()){
+		if(imu_read_bytes(EXT_SENS_DATA_00, 8, &raw[0])<0){
+			fprintf(stderr,"ERROR reading Magnetometer through I2C master\n");
+			return -1;
+		}
+		st1 = raw[0];
+		memmove(&raw[0], &raw[1], 7);
+	}
 	// read the data ready bit to see if there is new data
-	if(rc_i2c_read_byte(IMU_BUS, AK8963_ST1, &st1)<0){
+	else if(mag_read_byte(AK8963_ST1, &st1)<0){
 		fprintf(stderr,"ERROR reading Magnetometer, i2c_bypass is probably not set\n");
 		return -1;
 	}
@@ -328,7 +327,7 @@ int rc_read_mag_data(rc_imu_data_t* data){
 		return 0;
 	}
 	// Read the six raw data regs into data array	
-	if(rc_i2c_read_bytes(IMU_BUS,AK8963_XOUT_L,7,&raw[0])<0){
+	if(imu_transport_has_bypass() && mag_read_bytes(AK8963_XOUT_L,7,&raw[0])<0){
 		printf("rc_read_mag_data failed\n");
 		return -1;
 	}
@@ -374,10 +373,8 @@ int rc_read_mag_data(rc_imu_data_t* data){
 *******************************************************************************/
 int rc_read_imu_temp(rc_imu_data_t* data){
 	uint16_t adc;
-	// set device address
-	rc_i2c_set_device_address(IMU_BUS, IMU_ADDR);
 	// Read the two raw data registers
-	if(rc_i2c_read_word(IMU_BUS, TEMP_OUT_H, &adc)<0){
+	if(imu_read_word(TEMP_OUT_H, &adc)<0){
 		fprintf(stderr,"failed to read IMU temperature registers\n");
 		return -1;
 	}
@@ -396,22 +393,30 @@ int rc_read_imu_temp(rc_imu_data_t* data){
 int reset_mpu9250(){
 	// disable the interrupt to prevent it from doing things while we reset
 	shutdown_interrupt_thread = 1;
-	// set the device address
-	rc_i2c_set_device_address(IMU_BUS, IMU_ADDR);
+	return imu_reset_registers();
+}
+
+/*******************************************************************************
+* int imu_reset_registers()
+*
+* the register part of reset_mpu9250() on the selected bus, also used by
+* rc_imu_open()
+*******************************************************************************/
+int imu_reset_registers(){
 	// write the reset bit
-	if(rc_i2c_write_byte(IMU_BUS, PWR_MGMT_1, H_RESET)){
+	if(imu_write_byte(PWR_MGMT_1, H_RESET)){
 		// wait and try again
 		rc_usleep(10000);
-			if(rc_i2c_write_byte(IMU_BUS, PWR_MGMT_1, H_RESET)){
+			if(imu_write_byte(PWR_MGMT_1, H_RESET)){
 				fprintf(stderr,"I2C write to MPU9250 Failed\n");
 			return -1;
 		}
 	}
 	// make sure all other power management features are off
-	if(rc_i2c_write_byte(IMU_BUS, PWR_MGMT_1, 0)){
+	if(imu_write_byte(PWR_MGMT_1, 0)){
 		// wait and try again
 		rc_usleep(10000);
-		if(rc_i2c_write_byte(IMU_BUS, PWR_MGMT_1, 0)){
+		if(imu_write_byte(PWR_MGMT_1, 0)){
 			fprintf(stderr,"I2C write to MPU9250 Failed\n");
 		return -1;
 		}
@@ -448,7 +453,7 @@ int set_gyro_fsr(rc_gyro_fsr_t fsr, rc_imu_data_t* data){
 		fprintf(stderr,"invalid gyro fsr\n");
 		return -1;
 	}
-	return rc_i2c_write_byte(IMU_BUS, GYRO_CONFIG, c);
+	return imu_write_byte(GYRO_CONFIG, c);
 }
 
 /*******************************************************************************
@@ -479,7 +484,7 @@ int set_accel_fsr(rc_accel_fsr_t fsr, rc_imu_data_t* data){
 		fprintf(stderr,"invalid accel fsr\n");
 		return -1;
 	}
-	return rc_i2c_write_byte(IMU_BUS, ACCEL_CONFIG, c);
+	return imu_write_byte(ACCEL_CONFIG, c);
 }
 
 /*******************************************************************************
@@ -516,7 +521,7 @@ int set_gyro_dlpf(rc_gyro_dlpf_t dlpf){
 		fprintf(stderr,"invalid gyro_dlpf\n");
 		return -1;
 	}
-	return rc_i2c_write_byte(IMU_BUS, CONFIG, c); 
+	return imu_write_byte(CONFIG, c); 
 }
 
 /*******************************************************************************
@@ -553,7 +558,7 @@ int set_accel_dlpf(rc_accel_dlpf_t dlpf){
 		fprintf(stderr,"invalid gyro_dlpf\n");
 		return -1;
 	}
-	return rc_i2c_write_byte(IMU_BUS, ACCEL_CONFIG_2, c);
+	return imu_write_byte(ACCEL_CONFIG_2, c);
 }
 
 /*******************************************************************************
@@ -563,9 +568,21 @@ int set_accel_dlpf(rc_accel_dlpf_t dlpf){
 * sensitivity values into the global variables;
 *******************************************************************************/
 int initialize_magnetometer(){
+	if(imu_mag_setup(mag_factory_adjust)) return -1;
+	// load in magnetometer calibration
+	load_mag_calibration();
+	return 0;
+}
+
+/*******************************************************************************
+* int imu_mag_setup(float factory_adjust[3])
+*
+* the register part of initialize_magnetometer() on the selected bus, gives
+* the factory sensitivity adjustment
+*******************************************************************************/
+int imu_mag_setup(float factory_adjust[3]){
 	uint8_t raw[3];  // calibration data stored here
 	
-	rc_i2c_set_device_address(IMU_BUS, IMU_ADDR);
 	// Enable i2c bypass to allow talking to magnetometer
 	if(mpu_set_bypass(1)){
 		fprintf(stderr,"failed to set mpu9250 into bypass i2c mode\n");
@@ -573,36 +590,37 @@ int initialize_magnetometer(){
 	}
 	// magnetometer is actually a separate device with its
 	// own address inside the mpu9250
-	rc_i2c_set_device_address(IMU_BUS, AK8963_ADDR);
 	// Power down magnetometer  
-	rc_i2c_write_byte(IMU_BUS, AK8963_CNTL, MAG_POWER_DN); 
+	mag_write_byte(AK8963_CNTL, MAG_POWER_DN); 
 	rc_usleep(1000);
 	// Enter Fuse ROM access mode
-	rc_i2c_write_byte(IMU_BUS, AK8963_CNTL, MAG_FUSE_ROM); 
+	mag_write_byte(AK8963_CNTL, MAG_FUSE_ROM); 
 	rc_usleep(1000);
 	// Read the xyz sensitivity adjustment values
-	if(rc_i2c_read_bytes(IMU_BUS, AK8963_ASAX, 3, &raw[0])<0){
+	if(mag_read_bytes(AK8963_ASAX, 3, &raw[0])<0){
 		fprintf(stderr,"failed to read magnetometer adjustment register\n");
-		rc_i2c_set_device_address(IMU_BUS, IMU_ADDR);
 		mpu_set_bypass(0);
 		return -1;
 	}
 	// Return sensitivity adjustment values
-	mag_factory_adjust[0] = (raw[0]-128)/256.0 + 1.0;   
-	mag_factory_adjust[1] = (raw[1]-128)/256.0 + 1.0;  
-	mag_factory_adjust[2] = (raw[2]-128)/256.0 + 1.0; 
+	factory_adjust[0] = (raw[0]-128)/256.0 + 1.0;   
+	factory_adjust[1] = (raw[1]-128)/256.0 + 1.0;  
+	factory_adjust[2] = (raw[2]-128)/256.0 + 1.0; 
 	// Power down magnetometer again
-	rc_i2c_write_byte(IMU_BUS, AK8963_CNTL, MAG_POWER_DN); 
+	mag_write_byte(AK8963_CNTL, MAG_POWER_DN); 
 	rc_usleep(100);
 	// Configure the magnetometer for 16 bit resolution 
 	// and continuous sampling mode 2 (100hz)
 	uint8_t c = MSCALE_16|MAG_CONT_MES_2;
-	rc_i2c_write_byte(IMU_BUS, AK8963_CNTL, c);
+	mag_write_byte(AK8963_CNTL, c);
 	rc_usleep(100);
-	// go back to configuring the IMU, leave bypass on
-	rc_i2c_set_device_address(IMU_BUS,IMU_ADDR);
-	// load in magnetometer calibration
-	load_mag_calibration();
+	// go back to configuring the IMU, leave bypass on. Without bypass have
+	// slave 0 read ST1 through ST2 for rc_read_mag_data()
+	if(!imu_transport_has_bypass()){
+		imu_write_byte(I2C_SLV0_ADDR, 0x80|AK8963_ADDR);
+		imu_write_byte(I2C_SLV0_REG, AK8963_ST1);
+		imu_write_byte(I2C_SLV0_CTRL, 0x88);
+	}
 	return 0;
 }
 
@@ -612,7 +630,6 @@ int initialize_magnetometer(){
 * Make sure the magnetometer is off.
 *******************************************************************************/
 int power_down_magnetometer(){
-	rc_i2c_set_device_address(IMU_BUS, IMU_ADDR);
 	// Enable i2c bypass to allow talking to magnetometer
 	if(mpu_set_bypass(1)){
 		fprintf(stderr,"failed to set mpu9250 into bypass i2c mode\n");
@@ -620,13 +637,11 @@ int power_down_magnetometer(){
 	}
 	// magnetometer is actually a separate device with its
 	// own address inside the mpu9250
-	rc_i2c_set_device_address(IMU_BUS, AK8963_ADDR);
 	// Power down magnetometer  
-	if(rc_i2c_write_byte(IMU_BUS, AK8963_CNTL, MAG_POWER_DN)<0){
+	if(mag_write_byte(AK8963_CNTL, MAG_POWER_DN)<0){
 		fprintf(stderr,"failed to write to magnetometer\n");
 		return -1;
 	}
-	rc_i2c_set_device_address(IMU_BUS, IMU_ADDR);
 	// Enable i2c bypass to allow talking to magnetometer
 	if(mpu_set_bypass(0)){
 		fprintf(stderr,"failed to set mpu9250 into bypass i2c mode\n");
@@ -640,22 +655,20 @@ int power_down_magnetometer(){
 *******************************************************************************/
 int rc_power_off_imu(){
 	shutdown_interrupt_thread = 1;
-	// set the device address
-	rc_i2c_set_device_address(IMU_BUS, IMU_ADDR);
 	// write the reset bit
-	if(rc_i2c_write_byte(IMU_BUS, PWR_MGMT_1, H_RESET)){
+	if(imu_write_byte(PWR_MGMT_1, H_RESET)){
 		//wait and try again
 		rc_usleep(1000);
-		if(rc_i2c_write_byte(IMU_BUS, PWR_MGMT_1, H_RESET)){
+		if(imu_write_byte(PWR_MGMT_1, H_RESET)){
 			fprintf(stderr,"I2C write to MPU9250 Failed\n");
 			return -1;
 		}
 	}
 	// write the sleep bit
-	if(rc_i2c_write_byte(IMU_BUS, PWR_MGMT_1, MPU_SLEEP)){
+	if(imu_write_byte(PWR_MGMT_1, MPU_SLEEP)){
 		//wait and try again
 		rc_usleep(1000);
-		if(rc_i2c_write_byte(IMU_BUS, PWR_MGMT_1, MPU_SLEEP)){
+		if(imu_write_byte(PWR_MGMT_1, MPU_SLEEP)){
 			fprintf(stderr,"I2C write to MPU9250 Failed\n");
 			return -1;
 		}
@@ -698,55 +711,60 @@ int rc_initialize_imu_dmp(rc_imu_data_t *data, rc_imu_config_t conf){
 		fprintf(stderr,"ERROR: compass time constant must be greater than 0.1\n");
 		return -1;
 	}
-	// make sure the bus is not currently in use by another thread
-	// do not proceed to prevent interfering with that process
-	if(rc_i2c_get_in_use_state(IMU_BUS)){
-		fprintf(stderr,"WARNING: i2c bus claimed by another process\n");
-		fprintf(stderr,"Continuing with rc_initialize_imu_dmp() anyway\n");
-	}
-	// start the i2c bus
-	if(rc_i2c_init(IMU_BUS, IMU_ADDR)){
-		fprintf(stderr,"rc_initialize_imu_dmp failed at rc_i2c_init\n");
+	// start the i2c or spi bus
+	if(imu_transport_init(&conf)){
+		fprintf(stderr,"rc_initialize_imu_dmp failed at imu_transport_init\n");
 		return -1;
 	}
-	// configure the gpio interrupt pin
-	if(rc_gpio_export(IMU_INTERRUPT_PIN)<0){
-		fprintf(stderr,"ERROR: failed to export GPIO %d", IMU_INTERRUPT_PIN);
-		return -1;
-	}
-	if(rc_gpio_set_dir(IMU_INTERRUPT_PIN, INPUT_PIN)<0){
-		fprintf(stderr,"ERROR: failed to configure GPIO %d", IMU_INTERRUPT_PIN);
-		return -1;
+	// configure the gpio interrupt pin. Prefer a character device event line
+	// which timestamps the edge in the kernel, fall back to sysfs
+	if(imu_event_line.fd<0 && rc_gpio_chardev_available()){
+		// a sysfs export holds the line, possibly left over from another run
+		rc_gpio_unexport(IMU_INTERRUPT_PIN);
+		if(rc_gpio_event_request(&imu_event_line, IMU_INTERRUPT_PIN, \
+										EDGE_FALLING, "imu_interrupt")){
+			imu_event_line.fd = -1;
+		}
 	}
-	if(rc_gpio_set_edge(IMU_INTERRUPT_PIN, EDGE_FALLING)<0){
-		fprintf(stderr,"ERROR: failed to configure GPIO %d", IMU_INTERRUPT_PIN);
-		return -1;
+	if(imu_event_line.fd<0){
+		if(rc_gpio_export(IMU_INTERRUPT_PIN)<0){
+			fprintf(stderr,"ERROR: failed to export GPIO %d", IMU_INTERRUPT_PIN);
+			return -1;
+		}
+		if(rc_gpio_set_dir(IMU_INTERRUPT_PIN, INPUT_PIN)<0){
+			fprintf(stderr,"ERROR: failed to configure GPIO %d", IMU_INTERRUPT_PIN);
+			return -1;
+		}
+		if(rc_gpio_set_edge(IMU_INTERRUPT_PIN, EDGE_FALLING)<0){
+			fprintf(stderr,"ERROR: failed to configure GPIO %d", IMU_INTERRUPT_PIN);
+			return -1;
+		}
 	}
 	// claiming the bus does no guarantee other code will not interfere 
 	// with this process, but best to claim it so other code can check
 	// like we did above
-	rc_i2c_claim_bus(IMU_BUS);
+	imu_claim_bus();
 	// restart the device so we start with clean registers
 	if(reset_mpu9250()<0){
 		fprintf(stderr,"failed to reset_mpu9250()\n");
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	//check the who am i register to make sure the chip is alive
-	if(rc_i2c_read_byte(IMU_BUS, WHO_AM_I_MPU9250, &c)<0){
+	if(imu_read_byte(WHO_AM_I_MPU9250, &c)<0){
 		fprintf(stderr,"i2c_read_byte failed reading who_am_i register\n");
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	} if(c!=0x71){
 		fprintf(stderr,"mpu9250 WHO AM I register should return 0x71\n");
 		fprintf(stderr,"WHO AM I returned: 0x%x\n", c);
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	// load in gyro calibration offsets from disk
 	if(load_gyro_offets()<0){
 		fprintf(stderr,"ERROR: failed to load gyro calibration offsets\n");
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	// log locally that the dmp will be running
@@ -758,14 +776,14 @@ int rc_initialize_imu_dmp(rc_imu_data_t *data, rc_imu_config_t conf){
 	// DMP will divide this frequency down further itself
 	if(mpu_set_sample_rate(200)<0){
 		fprintf(stderr,"ERROR: setting IMU sample rate\n");
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	// initialize the magnetometer too if requested in config
 	if(conf.enable_magnetometer){
 		if(initialize_magnetometer()){
 			fprintf(stderr,"ERROR: failed to initialize_magnetometer\n");
-			rc_i2c_release_bus(IMU_BUS);
+			imu_release_bus();
 			return -1;
 		}
 	}
@@ -781,53 +799,53 @@ int rc_initialize_imu_dmp(rc_imu_data_t *data, rc_imu_config_t conf){
 	// set up the DMP
 	if(dmp_load_motion_driver_firmware()<0){
 		fprintf(stderr,"failed to load DMP motion driver\n");
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	if(dmp_set_fifo_rate(config.dmp_sample_rate)<0){
 		fprintf(stderr,"ERROR: failed to set DMP fifo rate\n");
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	// Set fifo/sensor sample rate. Will have to set the DMP sample
 	// rate to match this shortly.
 	if(dmp_set_orientation((unsigned short)conf.orientation)<0){
 		fprintf(stderr,"ERROR: failed to set dmp orientation\n");
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	if(dmp_enable_feature(DMP_FEATURE_6X_LP_QUAT|DMP_FEATURE_SEND_RAW_ACCEL| \
 												DMP_FEATURE_SEND_RAW_GYRO)<0){
 		fprintf(stderr,"ERROR: failed to enable DMP features\n");
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	if(dmp_set_interrupt_mode(DMP_INT_CONTINUOUS)<0){
 		fprintf(stderr,"ERROR: failed to set DMP interrupt mode to continuous\n");
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	if (mpu_set_dmp_state(1)<0) {
 		fprintf(stderr,"ERROR: mpu_set_dmp_state(1) failed\n");
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	// set up the IMU to put magnetometer data in the fifo too if enabled
 	if(conf.enable_magnetometer){
 		// enable slave 0 (mag) in fifo
-		rc_i2c_write_byte(IMU_BUS,FIFO_EN, FIFO_SLV0_EN);	
+		imu_write_byte(FIFO_EN, FIFO_SLV0_EN);	
 		// enable master, and clock speed
-		rc_i2c_write_byte(IMU_BUS,I2C_MST_CTRL,	0x8D);
+		imu_write_byte(I2C_MST_CTRL,	0x8D);
 		// set slave 0 address to magnetometer address
-		rc_i2c_write_byte(IMU_BUS,I2C_SLV0_ADDR,	0X8C);
+		imu_write_byte(I2C_SLV0_ADDR,	0X8C);
 		// set mag data register to read from
-		rc_i2c_write_byte(IMU_BUS,I2C_SLV0_REG,	AK8963_XOUT_L);
+		imu_write_byte(I2C_SLV0_REG,	AK8963_XOUT_L);
 		// set slave 0 to read 7 bytes
-		rc_i2c_write_byte(IMU_BUS,I2C_SLV0_CTRL,	0x87);
+		imu_write_byte(I2C_SLV0_CTRL,	0x87);
 		packet_len += 7; // add 7 more bytes to the fifo reads
 	}
 	// done with I2C for now
-	rc_i2c_release_bus(IMU_BUS);
+	imu_release_bus();
 	#ifdef DEBUG
 	printf("packet_len: %d\n", packet_len);
 	#endif
@@ -873,9 +891,9 @@ int mpu_write_mem(unsigned short mem_addr, unsigned short length,\
 		fprintf(stderr,"mpu_write_mem exceeds bank size\n");
 		return -1;
 	}
-	if (rc_i2c_write_bytes(IMU_BUS,MPU6500_BANK_SEL, 2, tmp))
+	if (imu_write_bytes(MPU6500_BANK_SEL, 2, tmp))
 		return -1;
-	if (rc_i2c_write_bytes(IMU_BUS,MPU6500_MEM_R_W, length, data))
+	if (imu_write_bytes(MPU6500_MEM_R_W, length, data))
 		return -1;
 	return 0;
 }
@@ -903,9 +921,9 @@ int mpu_read_mem(unsigned short mem_addr, unsigned short length,\
 		printf("mpu_read_mem exceeds bank size\n");
 		return -1;
 	}
-	if (rc_i2c_write_bytes(IMU_BUS,MPU6500_BANK_SEL, 2, tmp))
+	if (imu_write_bytes(MPU6500_BANK_SEL, 2, tmp))
 		return -1;
-	if (rc_i2c_read_bytes(IMU_BUS,MPU6500_MEM_R_W, length, data)!=length)
+	if (imu_read_bytes(MPU6500_MEM_R_W, length, data)!=length)
 		return -1;
 	return 0;
 }
@@ -920,8 +938,6 @@ int dmp_load_motion_driver_firmware(){
 	unsigned short this_write;
 	// Must divide evenly into st.hw->bank_size to avoid bank crossings.
 	unsigned char cur[DMP_LOAD_CHUNK], tmp[2];
-	// make sure the address is set correctly
-	rc_i2c_set_device_address(IMU_BUS, IMU_ADDR);
 	// loop through 16 bytes at a time and check each write for corruption
 	for (ii=0; ii<DMP_CODE_SIZE; ii+=this_write) {
 		this_write = min(DMP_LOAD_CHUNK, DMP_CODE_SIZE - ii);
@@ -941,7 +957,7 @@ int dmp_load_motion_driver_firmware(){
 	// Set program start address.
 	tmp[0] = dmp_start_addr >> 8;
 	tmp[1] = dmp_start_addr & 0xFF;
-	if (rc_i2c_write_bytes(IMU_BUS, MPU6500_PRGM_START_H, 2, tmp)){
+	if (imu_write_bytes(MPU6500_PRGM_START_H, 2, tmp)){
 		fprintf(stderr,"ERROR writing to MPU6500_PRGM_START register\n");
 		return -1;
 	}
@@ -1041,9 +1057,18 @@ int dmp_set_fifo_rate(unsigned short rate){
 * off after configuration and the MPU fetches magnetometer data automatically.
 * USER_CTRL - based on global variable dsp_en
 * INT_PIN_CFG based on requested bypass state
+* Over SPI there is no bypass, the I2C master is left on instead and the
+* magnetometer is reached through it.
 *******************************************************************************/
 int mpu_set_bypass(uint8_t bypass_on){
 	uint8_t tmp = 0;
+	if(!imu_transport_has_bypass()){
+		bypass_on = 0;
+		if(imu_write_byte(I2C_MST_CTRL, I2C_MST_CLK_400K)){
+			fprintf(stderr,"ERROR in mpu_set_bypass, failed to write I2C_MST_CTRL register\n");
+			return -1;
+		}
+	}
 	// set up USER_CTRL first
 	if(dmp_en){
 		tmp |= FIFO_EN_BIT; // enable fifo for dsp mode
@@ -1051,7 +1076,7 @@ int mpu_set_bypass(uint8_t bypass_on){
 	if(!bypass_on){
 		tmp |= I2C_MST_EN; // i2c master mode when not in bypass
 	}
-	if (rc_i2c_write_byte(IMU_BUS, USER_CTRL, tmp)){
+	if (imu_write_byte(USER_CTRL, tmp)){
 		fprintf(stderr,"ERROR in mpu_set_bypass, failed to write USER_CTRL register\n");
 		return -1;
 	}
@@ -1061,7 +1086,7 @@ int mpu_set_bypass(uint8_t bypass_on){
 	tmp =  ACTL_ACTIVE_LOW;
 	if(bypass_on)
 		tmp |= BYPASS_EN;
-	if (rc_i2c_write_byte(IMU_BUS, INT_PIN_CFG, tmp)){
+	if (imu_write_byte(INT_PIN_CFG, tmp)){
 		fprintf(stderr,"ERROR in mpu_set_bypass, failed to write INT_PIN_CFG register\n");
 		return -1;
 	}
@@ -1255,34 +1280,31 @@ int dmp_enable_lp_quat(unsigned char enable){
 *******************************************************************************/
 int mpu_reset_fifo(void){
 	uint8_t data;
-	// make sure the i2c address is set correctly. 
-	// this shouldn't take any time at all if already set
-	rc_i2c_set_device_address(IMU_BUS, IMU_ADDR);
 	data = 0;
-	if (rc_i2c_write_byte(IMU_BUS, INT_ENABLE, data)) return -1;
-	if (rc_i2c_write_byte(IMU_BUS, FIFO_EN, data)) return -1;
-	//if (rc_i2c_write_byte(IMU_BUS, USER_CTRL, data)) return -1;
+	if (imu_write_byte(INT_ENABLE, data)) return -1;
+	if (imu_write_byte(FIFO_EN, data)) return -1;
+	//if (imu_write_byte(USER_CTRL, data)) return -1;
 	data = BIT_FIFO_RST | BIT_DMP_RST;
-	if (rc_i2c_write_byte(IMU_BUS, USER_CTRL, data)) return -1;
+	if (imu_write_byte(USER_CTRL, data)) return -1;
 	rc_usleep(1000);
 	data = BIT_DMP_EN | BIT_FIFO_EN;
 	if(config.enable_magnetometer){
 		data |= I2C_MST_EN;
 	}
-	if(rc_i2c_write_byte(IMU_BUS, USER_CTRL, data)){
+	if(imu_write_byte(USER_CTRL, data)){
 		return -1;
 	}
 	if(config.enable_magnetometer){
-		rc_i2c_write_byte(IMU_BUS, FIFO_EN, FIFO_SLV0_EN);
+		imu_write_byte(FIFO_EN, FIFO_SLV0_EN);
 	}
 	else{
-		rc_i2c_write_byte(IMU_BUS, FIFO_EN, 0);
+		imu_write_byte(FIFO_EN, 0);
 	}
 	if(dmp_en){
-		rc_i2c_write_byte(IMU_BUS, INT_ENABLE, BIT_DMP_INT_EN);
+		imu_write_byte(INT_ENABLE, BIT_DMP_INT_EN);
 	}
 	else{
-		rc_i2c_write_byte(IMU_BUS, INT_ENABLE, 0);
+		imu_write_byte(INT_ENABLE, 0);
 	}
 	return 0;
 }
@@ -1323,12 +1345,12 @@ int set_int_enable(unsigned char enable){
 	else{
 		tmp = 0x00;
 	}
-	if(rc_i2c_write_byte(IMU_BUS, INT_ENABLE, tmp)){
+	if(imu_write_byte(INT_ENABLE, tmp)){
 		fprintf(stderr, "ERROR: in set_int_enable, failed to write INT_ENABLE register\n");
 		return -1;
 	}
 	// disable all other FIFO features leaving just DMP
-	if (rc_i2c_write_byte(IMU_BUS, FIFO_EN, 0)){
+	if (imu_write_byte(FIFO_EN, 0)){
 		fprintf(stderr, "ERROR: in set_int_enable, failed to write FIFO_EN register\n");
 		return -1;
 	}
@@ -1350,7 +1372,7 @@ int mpu_set_sample_rate(int rate){
 	#ifdef DEBUG
 	printf("setting divider to %d\n", div);
 	#endif
-	if(rc_i2c_write_byte(IMU_BUS, SMPLRT_DIV, div)){
+	if(imu_write_byte(SMPLRT_DIV, div)){
 		fprintf(stderr,"ERROR: in mpu_set_sample_rate, failed to write SMPLRT_DIV register\n");
 		return -1;
 	}
@@ -1371,7 +1393,7 @@ int mpu_set_dmp_state(unsigned char enable){
 		// Disable bypass mode.
 		mpu_set_bypass(0);
 		// Remove FIFO elements.
-		rc_i2c_write_byte(IMU_BUS, FIFO_EN , 0);
+		imu_write_byte(FIFO_EN , 0);
 		// Enable DMP interrupt.
 		set_int_enable(1);
 		mpu_reset_fifo();
@@ -1380,7 +1402,7 @@ int mpu_set_dmp_state(unsigned char enable){
 		// Disable DMP interrupt.
 		set_int_enable(0);
 		// Restore FIFO settings.
-		rc_i2c_write_byte(IMU_BUS, FIFO_EN , 0);
+		imu_write_byte(FIFO_EN , 0);
 		mpu_reset_fifo();
 	}
 	return 0;
@@ -1393,20 +1415,37 @@ int mpu_set_dmp_state(unsigned char enable){
 * monitors the gpio pin IMU_INTERRUPT_PIN with the blocking function call 
 * poll(). If a valid interrupt is received from the IMU then mark the timestamp,
 * read in the IMU data, and call the user-defined interrupt function if set.
+* With a character device event line the timestamp is the kernel's record of
+* the edge rather than the time this thread woke up.
 *******************************************************************************/
 void* imu_interrupt_handler( __unused void* ptr){ 
 	struct pollfd fdset[1];
 	int ret;
 	char buf[64];
 	int first_run = 1;
-	int imu_gpio_fd = rc_gpio_fd_open(IMU_INTERRUPT_PIN);
-	if(imu_gpio_fd == -1){
-		fprintf(stderr,"ERROR: can't open IMU_INTERRUPT_PIN gpio fd\n");
-		fprintf(stderr,"aborting imu_interrupt_handler\n");
-		return NULL;
-	}
-	fdset[0].fd = imu_gpio_fd;
-	fdset[0].events = POLLPRI;
+	int imu_gpio_fd = -1;
+	int got_edge;
+	rc_gpio_event_t ev;
+	uint64_t now_boot;
+	// priority is also set by the creator, this adds affinity and prefaulting
+	configure_rt_thread(RT_THREAD_IMU, config.dmp_interrupt_priority);
+	if(imu_event_line.fd>=0){
+		// drain the event queue without blocking on each wakeup
+		fcntl(imu_event_line.fd, F_SETFL, O_NONBLOCK);
+		fdset[0].fd = imu_event_line.fd;
+		fdset[0].events = POLLIN;
+	}
+	else{
+		imu_gpio_fd = rc_gpio_fd_open(IMU_INTERRUPT_PIN);
+		if(imu_gpio_fd == -1){
+			fprintf(stderr,"ERROR: can't open IMU_INTERRUPT_PIN gpio fd\n");
+			fprintf(stderr,"aborting imu_interrupt_handler\n");
+			release_rt_thread();
+			return NULL;
+		}
+		fdset[0].fd = imu_gpio_fd;
+		fdset[0].events = POLLPRI;
+	}
 	// keep running until the program closes
 	mpu_reset_fifo();
 	while(rc_get_state()!=EXITING && shutdown_interrupt_thread!=1) {
@@ -1415,25 +1454,37 @@ void* imu_interrupt_handler( __unused void* ptr){
 		if(rc_get_state()==EXITING || shutdown_interrupt_thread==1){
 			break;
 		}
-		else if (fdset[0].revents & POLLPRI) {
+		got_edge = 0;
+		if(fdset[0].revents & POLLIN){
+			// keep only the newest edge if we fell behind
+			while(rc_gpio_event_read(&imu_event_line, &ev)==0) got_edge = 1;
+			if(got_edge){
+				now_boot = rc_nanos_since_boot();
+				last_interrupt_timestamp_nanos = rc_nanos_since_epoch();
+				if(ev.timestamp_ns<now_boot){
+					last_interrupt_timestamp_nanos -= now_boot-ev.timestamp_ns;
+				}
+			}
+		}
+		else if(fdset[0].revents & POLLPRI){
 			lseek(fdset[0].fd, 0, SEEK_SET);  
 			read(fdset[0].fd, buf, 64);
 			// interrupt received, mark the timestamp
 			last_interrupt_timestamp_nanos = rc_nanos_since_epoch();
-			// try to load fifo no matter the claim bus state
-			if(rc_i2c_get_in_use_state(IMU_BUS)){
-				fprintf(stderr,"WARNING: Something has claimed the I2C bus when an\n");
-				fprintf(stderr,"IMU interrupt was received. Reading IMU anyway.\n");
-			}
-
-			// aquires bus
-			rc_i2c_claim_bus(IMU_BUS);
+			got_edge = 1;
+		}
+		if(got_edge){
+			TRACE_POINT(TRACE_IMU_INTERRUPT, 0);
+			// aquires bus, waiting for any transaction in progress
+			imu_claim_bus();
 
 			// aquires mutex
 			pthread_mutex_lock( &rc_imu_read_mutex );
 
 			// read data
+			TRACE_POINT(TRACE_IMU_READ_START, 0);
 			ret = read_dmp_fifo(data_ptr);
+			TRACE_POINT(TRACE_IMU_READ_END, ret);
 
 			// record if it was successful or not
 			if (ret==0) {
@@ -1448,14 +1499,16 @@ void* imu_interrupt_handler( __unused void* ptr){
 			pthread_mutex_unlock( &rc_imu_read_mutex );
 
 			// releases bus
-			rc_i2c_release_bus(IMU_BUS);
+			imu_release_bus();
 			
 			// call the user function if not the first run
 			if(first_run == 1){
 				first_run = 0;
 			}
 			else if(interrupt_func_set && last_read_successful){
-				imu_interrupt_func(); 
+				TRACE_POINT(TRACE_IMU_CALLBACK_START, 0);
+				imu_interrupt_func();
+				TRACE_POINT(TRACE_IMU_CALLBACK_END, 0);
 			}
 		}
 	}
@@ -1467,8 +1520,10 @@ void* imu_interrupt_handler( __unused void* ptr){
 	// releases mutex
 	pthread_mutex_unlock( &rc_imu_read_mutex );
 
-	rc_gpio_fd_close(imu_gpio_fd);
+	if(imu_event_line.fd>=0) rc_gpio_lines_release(&imu_event_line);
+	else rc_gpio_fd_close(imu_gpio_fd);
 	thread_running_flag = 0;
+	release_rt_thread();
 	return 0;
 }
 
@@ -1532,13 +1587,10 @@ int read_dmp_fifo(rc_imu_data_t* data){
 		return -1;
 	}
 	
-	// make sure the i2c address is set correctly. 
-	// this shouldn't take any time at all if already set
-	rc_i2c_set_device_address(IMU_BUS, IMU_ADDR);
 	int is_new_dmp_data = 0;
 
 	// check fifo count register to make sure new data is there
-	if(rc_i2c_read_word(IMU_BUS, FIFO_COUNTH, &fifo_count)<0){
+	if(imu_read_word(FIFO_COUNTH, &fifo_count)<0){
 		if(config.show_warnings){
 			printf("fifo_count i2c error: %s\n",strerror(errno));
 		}
@@ -1653,10 +1705,10 @@ int read_dmp_fifo(rc_imu_data_t* data){
 READ_FIFO:
 	memset(raw,0,MAX_FIFO_BUFFER);
 	// read it in!
-	ret = rc_i2c_read_bytes(IMU_BUS, FIFO_R_W, fifo_count, &raw[0]);
+	ret = imu_read_bytes(FIFO_R_W, fifo_count, &raw[0]);
 	if(ret<0){
 		// if i2c_read returned -1 there was an error, try again
-		ret = rc_i2c_read_bytes(IMU_BUS, FIFO_R_W, fifo_count, &raw[0]);
+		ret = imu_read_bytes(FIFO_R_W, fifo_count, &raw[0]);
 	}
 	if(ret!=fifo_count){
 		if(config.show_warnings){
@@ -2053,7 +2105,7 @@ int load_gyro_offets(){
 	data[5] = (-z/4)       & 0xFF;
 
 	// Push gyro biases to hardware registers
-	if(rc_i2c_write_bytes(IMU_BUS, XG_OFFSET_H, 6, &data[0])){
+	if(imu_write_bytes(XG_OFFSET_H, 6, &data[0])){
 		fprintf(stderr,"ERROR: failed to load gyro offsets into IMU register\n");
 		return -1;
 	}
@@ -2072,79 +2124,70 @@ int rc_calibrate_gyro_routine(){
 	int16_t offsets[3];
 	int was_last_steady = 1;
 	
-	// make sure the bus is not currently in use by another thread
-	// do not proceed to prevent interfering with that process
-	if(rc_i2c_get_in_use_state(IMU_BUS)){
-		fprintf(stderr,"i2c bus claimed by another process\n");
-		fprintf(stderr,"aborting gyro calibration()\n");
-		return -1;
-	}
-	
-	// if it is not claimed, start the i2c bus
-	if(rc_i2c_init(IMU_BUS, IMU_ADDR)){
-		fprintf(stderr,"rc_initialize_imu_dmp failed at rc_i2c_init\n");
+	// start the i2c bus
+	if(imu_transport_init(NULL)){
+		fprintf(stderr,"failed to initialize IMU bus\n");
 		return -1;
 	}
 	
-	// claiming the bus does no guarantee other code will not interfere 
-	// with this process, but best to claim it so other code can check
-	// like we did above
-	rc_i2c_claim_bus(IMU_BUS);
+	// keep the bus for the whole calibration, other threads wait for it
+	imu_claim_bus();
 	
 	// reset device, reset all registers
 	if(reset_mpu9250()<0){
 		fprintf(stderr,"ERROR: failed to reset MPU9250\n");
+		imu_release_bus();
 		return -1;
 	}
 
 	// set up the IMU specifically for calibration. 
-	rc_i2c_write_byte(IMU_BUS, PWR_MGMT_1, 0x01);  
-	rc_i2c_write_byte(IMU_BUS, PWR_MGMT_2, 0x00); 
+	imu_write_byte(PWR_MGMT_1, 0x01);  
+	imu_write_byte(PWR_MGMT_2, 0x00); 
 	rc_usleep(200000);
 	
 	// // set bias registers to 0
 	// // Push gyro biases to hardware registers
 	// uint8_t zeros[] = {0,0,0,0,0,0};
-	// if(rc_i2c_write_bytes(IMU_BUS, XG_OFFSET_H, 6, zeros)){
+	// if(imu_write_bytes(XG_OFFSET_H, 6, zeros)){
 		// fprintf(stderr,"ERROR: failed to load gyro offsets into IMU register\n");
 		// return -1;
 	// }
 
-	rc_i2c_write_byte(IMU_BUS, INT_ENABLE, 0x00);  // Disable all interrupts
-	rc_i2c_write_byte(IMU_BUS, FIFO_EN, 0x00);     // Disable FIFO
-	rc_i2c_write_byte(IMU_BUS, PWR_MGMT_1, 0x00);  // Turn on internal clock source
-	rc_i2c_write_byte(IMU_BUS, I2C_MST_CTRL, 0x00);// Disable I2C master
-	rc_i2c_write_byte(IMU_BUS, USER_CTRL, 0x00);   // Disable FIFO and I2C master
-	rc_i2c_write_byte(IMU_BUS, USER_CTRL, 0x0C);   // Reset FIFO and DMP
+	imu_write_byte(INT_ENABLE, 0x00);  // Disable all interrupts
+	imu_write_byte(FIFO_EN, 0x00);     // Disable FIFO
+	imu_write_byte(PWR_MGMT_1, 0x00);  // Turn on internal clock source
+	imu_write_byte(I2C_MST_CTRL, 0x00);// Disable I2C master
+	imu_write_byte(USER_CTRL, 0x00);   // Disable FIFO and I2C master
+	imu_write_byte(USER_CTRL, 0x0C);   // Reset FIFO and DMP
 	rc_usleep(15000);
 
 	// Configure MPU9250 gyro and accelerometer for bias calculation
-	rc_i2c_write_byte(IMU_BUS, CONFIG, 0x01);      // Set low-pass filter to 188 Hz
-	rc_i2c_write_byte(IMU_BUS, SMPLRT_DIV, 0x04);  // Set sample rate to 200hz
+	imu_write_byte(CONFIG, 0x01);      // Set low-pass filter to 188 Hz
+	imu_write_byte(SMPLRT_DIV, 0x04);  // Set sample rate to 200hz
 	// Set gyro full-scale to 250 degrees per second, maximum sensitivity
-	rc_i2c_write_byte(IMU_BUS, GYRO_CONFIG, 0x00); 
+	imu_write_byte(GYRO_CONFIG, 0x00); 
 	// Set accelerometer full-scale to 2 g, maximum sensitivity	
-	rc_i2c_write_byte(IMU_BUS, ACCEL_CONFIG, 0x00); 
+	imu_write_byte(ACCEL_CONFIG, 0x00); 
 
 COLLECT_DATA:
 
 	if(rc_get_state()==EXITING){
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 
 	// Configure FIFO to capture gyro data for bias calculation
-	rc_i2c_write_byte(IMU_BUS, USER_CTRL, 0x40);   // Enable FIFO  
+	imu_write_byte(USER_CTRL, 0x40);   // Enable FIFO  
 	// Enable gyro sensors for FIFO (max size 512 bytes in MPU-9250)
 	c = FIFO_GYRO_X_EN|FIFO_GYRO_Y_EN|FIFO_GYRO_Z_EN;
-	rc_i2c_write_byte(IMU_BUS, FIFO_EN, c); 
+	imu_write_byte(FIFO_EN, c); 
 	// 6 bytes per sample. 200hz. wait 0.4 seconds
 	rc_usleep(400000);
 
 	// At end of sample accumulation, turn off FIFO sensor read
-	rc_i2c_write_byte(IMU_BUS, FIFO_EN, 0x00);   
+	imu_write_byte(FIFO_EN, 0x00);   
 	// read FIFO sample count and log number of samples
-	rc_i2c_read_bytes(IMU_BUS, FIFO_COUNTH, 2, &data[0]); 
+	imu_read_bytes(FIFO_COUNTH, 2, &data[0]); 
 	int16_t fifo_count = ((uint16_t)data[0] << 8) | data[1];
 	int samples = fifo_count/6;
 
@@ -2166,8 +2209,9 @@ COLLECT_DATA:
 	gyro_sum[2] = 0;
 	for (i=0; i<samples; i++) {
 		// read data for averaging
-		if(rc_i2c_read_bytes(IMU_BUS, FIFO_R_W, 6, data)<0){
+		if(imu_read_bytes(FIFO_R_W, 6, data)<0){
 			fprintf(stderr,"ERROR: failed to read FIFO\n");
+			imu_release_bus();
 			return -1;
 		}
 		x = (int16_t)(((int16_t)data[0] << 8) | data[1]) ;
@@ -2218,7 +2262,7 @@ COLLECT_DATA:
 		goto COLLECT_DATA;
 	}
 	// done with I2C for now
-	rc_i2c_release_bus(IMU_BUS);
+	imu_release_bus();
 	#ifdef DEBUG
 	printf("offsets: %d %d %d\n", offsets[0], offsets[1], offsets[2]);
 	#endif
@@ -2353,6 +2397,32 @@ uint64_t rc_nanos_since_last_imu_interrupt(){
 	return rc_nanos_since_epoch() - last_interrupt_timestamp_nanos;
 }
 
+/*******************************************************************************
+* int imu_wait_for_read(uint64_t max_ns)
+*
+* Blocks until the interrupt thread finishes its next FIFO read, which leaves
+* the bus free for most of a sample period. Waits at most max_ns or one and a
+* half sample periods. Returns 0 right after a read or when the interrupt
+* thread isn't running, -1 on timeout.
+*******************************************************************************/
+int imu_wait_for_read(uint64_t max_ns){
+	struct timespec ts;
+	uint64_t period_ns, end;
+	int ret;
+	if(!thread_running_flag || shutdown_interrupt_thread) return 0;
+	period_ns = 1500000000ULL/config.dmp_sample_rate;
+	if(period_ns<max_ns) max_ns = period_ns;
+	// the read condition uses the default CLOCK_REALTIME
+	clock_gettime(CLOCK_REALTIME, &ts);
+	end = (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec + max_ns;
+	ts.tv_sec = end/1000000000ULL;
+	ts.tv_nsec = end%1000000000ULL;
+	pthread_mutex_lock(&rc_imu_read_mutex);
+	ret = pthread_cond_timedwait(&rc_imu_read_condition, &rc_imu_read_mutex, &ts);
+	pthread_mutex_unlock(&rc_imu_read_mutex);
+	return ret ? -1 : 0;
+}
+
 /*******************************************************************************
 * int write_mag_cal_to_disk(float offsets[3], float scale[3])
 *
@@ -2465,45 +2535,36 @@ int rc_calibrate_mag_routine(){
 	config = rc_default_imu_config();
 	config.enable_magnetometer = 1;
 	
-	// make sure the bus is not currently in use by another thread
-	// do not proceed to prevent interfering with that process
-	if(rc_i2c_get_in_use_state(IMU_BUS)){
-		fprintf(stderr,"i2c bus claimed by another process\n");
-		fprintf(stderr,"aborting gyro calibration()\n");
-		return -1;
-	}
-	
-	// if it is not claimed, start the i2c bus
-	if(rc_i2c_init(IMU_BUS, IMU_ADDR)){
-		fprintf(stderr,"rc_initialize_imu_dmp failed at rc_i2c_init\n");
+	// start the i2c bus
+	if(imu_transport_init(NULL)){
+		fprintf(stderr,"failed to initialize IMU bus\n");
 		return -1;
 	}
 	
-	// claiming the bus does no guarantee other code will not interfere 
-	// with this process, but best to claim it so other code can check
-	// like we did above
-	rc_i2c_claim_bus(IMU_BUS);
+	// keep the bus for the whole calibration, other threads wait for it
+	imu_claim_bus();
 	
 	// reset device, reset all registers
 	if(reset_mpu9250()<0){
 		fprintf(stderr,"ERROR: failed to reset MPU9250\n");
+		imu_release_bus();
 		return -1;
 	}
 	//check the who am i register to make sure the chip is alive
-	if(rc_i2c_read_byte(IMU_BUS, WHO_AM_I_MPU9250, &c)<0){
+	if(imu_read_byte(WHO_AM_I_MPU9250, &c)<0){
 		fprintf(stderr,"Reading WHO_AM_I_MPU9250 register failed\n");
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	if(c!=0x71){
 		fprintf(stderr,"mpu9250 WHO AM I register should return 0x71\n");
 		fprintf(stderr,"WHO AM I returned: 0x%x\n", c);
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	if(initialize_magnetometer()){
 		fprintf(stderr,"ERROR: failed to initialize_magnetometer\n");
-		rc_i2c_release_bus(IMU_BUS);
+		imu_release_bus();
 		return -1;
 	}
 	
@@ -2547,7 +2608,7 @@ int rc_calibrate_mag_routine(){
 	}
 	// done with I2C for now
 	rc_power_off_imu();
-	rc_i2c_release_bus(IMU_BUS);
+	imu_release_bus();
 	
 	printf("\n\nOkay Stop!\n");
 	printf("Calculating calibration constants.....\n");
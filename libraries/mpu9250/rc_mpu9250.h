@@ -0,0 +1,59 @@
+/*******************************************************************************
+* rc_mpu9250.h
+*
+* internal hooks for other drivers sharing the IMU's I2C bus, the bus
+* transport and the register helpers shared between the onboard IMU driver
+* and rc_imu_t instances. The functions for the user are in roboticscape.h
+*******************************************************************************/
+
+#ifndef RC_MPU9250
+#define RC_MPU9250
+
+#include <stdint.h>
+#include <pthread.h>
+#include "../roboticscape.h"
+
+// one MPU9250 on I2C or SPI
+typedef struct imu_bus_t{
+	const struct imu_ops_t* ops;	// NULL while closed
+	int has_bypass;		// magnetometer reachable through the bypass
+	int i2c_bus;
+	uint8_t i2c_addr;
+	int spi_slave;		// 0 on I2C
+	uint32_t fast_hz;	// SPI speed for sensor and fifo registers
+	uint32_t reg_hz;	// SPI speed for everything else
+	pthread_mutex_t lock;	// SPI claims
+} imu_bus_t;
+
+// rc_mpu9250.c
+int imu_wait_for_read(uint64_t max_ns);
+int imu_reset_registers();
+int imu_mag_setup(float factory_adjust[3]);
+int set_gyro_fsr(rc_gyro_fsr_t fsr, rc_imu_data_t* data);
+int set_accel_fsr(rc_accel_fsr_t fsr, rc_imu_data_t* data);
+int set_gyro_dlpf(rc_gyro_dlpf_t dlpf);
+int set_accel_dlpf(rc_accel_dlpf_t dlpf);
+int power_down_magnetometer();
+int load_gyro_offets();
+int load_mag_calibration();
+extern float mag_offsets[3];
+extern float mag_scales[3];
+
+// rc_mpu9250_transport.c
+int imu_bus_open(imu_bus_t* b, rc_imu_config_t* conf);
+int imu_bus_close(imu_bus_t* b);
+imu_bus_t* imu_select_bus(imu_bus_t* b);
+int imu_transport_init(rc_imu_config_t* conf);
+int imu_transport_has_bypass();
+int imu_read_bytes(uint8_t reg, int len, uint8_t* data);
+int imu_read_byte(uint8_t reg, uint8_t* data);
+int imu_read_word(uint8_t reg, uint16_t* data);
+int imu_write_bytes(uint8_t reg, int len, uint8_t* data);
+int imu_write_byte(uint8_t reg, uint8_t data);
+int mag_read_bytes(uint8_t reg, int len, uint8_t* data);
+int mag_read_byte(uint8_t reg, uint8_t* data);
+int mag_write_byte(uint8_t reg, uint8_t data);
+int imu_claim_bus();
+int imu_release_bus();
+
+#endif // RC_MPU9250
@@ -245,6 +245,14 @@ identical but the latter has a different register map
 #define I2C_MST_RST			0x01<<1
 #define SIG_COND_RST			0x01
 
+/*******************************************************************
+* I2C_SLV4_CTRL and I2C_MST_STATUS bits
+*******************************************************************/
+#define I2C_SLV4_EN			0x01<<7
+#define I2C_SLV4_DONE			0x01<<6
+#define I2C_SLV4_NACK			0x01<<4
+#define I2C_MST_CLK_400K		0x0D
+
 
 
 
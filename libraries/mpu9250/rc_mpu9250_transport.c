@@ -0,0 +1,383 @@
+/*******************************************************************************
+* rc_mpu9250_transport.c
+*
+* Register access for the MPU9250 driver over either bus. Each device has an
+* imu_bus_t and the driver functions act on the one selected by the calling
+* thread, the onboard IMU unless imu_select_bus() picked another. The first
+* MPU9250 on an I2C bus reaches its magnetometer through the bypass. Every
+* other one, and all on SPI, go through the MPU's own I2C master one byte at
+* a time so the AK8963s, which all sit at the same address, never share a
+* bus. That path is only used during setup and for random reads. On SPI the
+* sensor and FIFO registers are read at the configured speed, everything
+* else at the 1mhz the datasheet allows.
+*******************************************************************************/
+#include "../rc_defs.h"
+#include "../roboticscape.h"
+#include "rc_mpu9250_defs.h"
+#include "rc_mpu9250.h"
+#include <stdio.h>
+#include <pthread.h>
+
+#define SPI_REG_SPEED_HZ	1000000	// limit for all but sensor registers
+#define READ_BIT			0x80
+#define MAG_TIMEOUT_US		50000	// I2C master runs at the sample rate
+#define MAG_POLL_US			200
+#define I2C_MAX_LEN			255
+#define I2C_BUSES			3
+
+/*******************************************************************************
+* Local Types
+*******************************************************************************/
+typedef struct imu_ops_t{
+	int (*read_bytes)(imu_bus_t* b, uint8_t reg, int len, uint8_t* data);
+	int (*write_bytes)(imu_bus_t* b, uint8_t reg, int len, uint8_t* data);
+	int (*claim)(imu_bus_t* b);
+	int (*release)(imu_bus_t* b);
+} imu_ops_t;
+
+/*******************************************************************************
+* Local Function Declarations
+*******************************************************************************/
+static int i2c_read_bytes(imu_bus_t* b, uint8_t reg, int len, uint8_t* data);
+static int i2c_write_bytes(imu_bus_t* b, uint8_t reg, int len, uint8_t* data);
+static int i2c_claim(imu_bus_t* b);
+static int i2c_release(imu_bus_t* b);
+static int spi_read_bytes(imu_bus_t* b, uint8_t reg, int len, uint8_t* data);
+static int spi_write_bytes(imu_bus_t* b, uint8_t reg, int len, uint8_t* data);
+static int spi_claim(imu_bus_t* b);
+static int spi_release(imu_bus_t* b);
+static int spi_fast_reg(uint8_t reg);
+static int slv4(imu_bus_t* b, uint8_t addr, uint8_t reg, uint8_t out, uint8_t* in);
+static imu_bus_t* cur();
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+static const imu_ops_t i2c_ops = {i2c_read_bytes, i2c_write_bytes, \
+												i2c_claim, i2c_release};
+static const imu_ops_t spi_ops = {spi_read_bytes, spi_write_bytes, \
+												spi_claim, spi_release};
+static imu_bus_t default_bus;		// the onboard IMU driver's bus
+static rc_imu_config_t default_conf;
+static int default_conf_set = 0;
+static __thread imu_bus_t* thread_bus = NULL;
+// device using the bypass on each I2C bus
+static imu_bus_t* bypass_owner[I2C_BUSES];
+static pthread_mutex_t owner_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*******************************************************************************
+* int imu_bus_open(imu_bus_t* b, rc_imu_config_t* conf)
+*
+* Opens the bus selected by conf, SPI slave spi_slave or I2C bus i2c_bus at
+* i2c_addr when spi_slave is 0. Opening a bus object again closes it first.
+*******************************************************************************/
+int imu_bus_open(imu_bus_t* b, rc_imu_config_t* conf){
+	pthread_mutexattr_t attr;
+	ss_mode_t ss;
+	if(b->ops!=NULL) imu_bus_close(b);
+	if(conf->spi_slave==0){
+		if(conf->i2c_bus<0 || conf->i2c_bus>=I2C_BUSES){
+			fprintf(stderr,"ERROR: invalid IMU i2c_bus %d\n", conf->i2c_bus);
+			return -1;
+		}
+		if(rc_i2c_init(conf->i2c_bus, conf->i2c_addr)){
+			fprintf(stderr,"ERROR: failed to initialize i2c bus for IMU\n");
+			return -1;
+		}
+		// IMU reads go ahead of slower devices sharing the bus
+		rc_i2c_set_device_priority(conf->i2c_bus, conf->i2c_addr, IMU_I2C_PRIORITY);
+		b->i2c_bus = conf->i2c_bus;
+		b->i2c_addr = conf->i2c_addr;
+		b->spi_slave = 0;
+		pthread_mutex_lock(&owner_mutex);
+		if(bypass_owner[b->i2c_bus]==NULL) bypass_owner[b->i2c_bus] = b;
+		b->has_bypass = (bypass_owner[b->i2c_bus]==b);
+		pthread_mutex_unlock(&owner_mutex);
+		if(b->has_bypass){
+			rc_i2c_set_device_priority(b->i2c_bus, AK8963_ADDR, IMU_I2C_PRIORITY);
+		}
+		b->ops = &i2c_ops;
+		return 0;
+	}
+	if(conf->spi_slave!=1 && conf->spi_slave!=2){
+		fprintf(stderr,"ERROR: IMU spi_slave must be 0 for I2C or SPI slave 1 or 2\n");
+		return -1;
+	}
+	// slave 2 on the cape only has a gpio select line
+	if(conf->spi_slave==2 && rc_get_bb_model()!=BB_BLUE) ss = SS_MODE_MANUAL;
+	else ss = SS_MODE_AUTO;
+	if(rc_spi_init(ss, SPI_MODE_CPOL1_CPHA1, conf->spi_speed_hz, conf->spi_slave)){
+		fprintf(stderr,"ERROR: failed to initialize SPI slave %d for IMU\n", conf->spi_slave);
+		return -1;
+	}
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&b->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	b->spi_slave = conf->spi_slave;
+	b->fast_hz = conf->spi_speed_hz;
+	b->reg_hz = (b->fast_hz<SPI_REG_SPEED_HZ) ? b->fast_hz : SPI_REG_SPEED_HZ;
+	b->has_bypass = 0;
+	b->ops = &spi_ops;
+	return 0;
+}
+
+/*******************************************************************************
+* int imu_bus_close(imu_bus_t* b)
+*
+* releases the SPI slave or the I2C bypass, the I2C bus itself stays open for
+* other devices on it
+*******************************************************************************/
+int imu_bus_close(imu_bus_t* b){
+	if(b->ops==NULL) return 0;
+	if(b->ops==&spi_ops){
+		rc_spi_close(b->spi_slave);
+		pthread_mutex_destroy(&b->lock);
+	}
+	else{
+		pthread_mutex_lock(&owner_mutex);
+		if(bypass_owner[b->i2c_bus]==b) bypass_owner[b->i2c_bus] = NULL;
+		pthread_mutex_unlock(&owner_mutex);
+	}
+	b->ops = NULL;
+	return 0;
+}
+
+/*******************************************************************************
+* imu_bus_t* imu_select_bus(imu_bus_t* b)
+*
+* Points the calling thread's driver functions at bus b, NULL for the onboard
+* IMU. Returns the previous selection so it can be restored.
+*******************************************************************************/
+imu_bus_t* imu_select_bus(imu_bus_t* b){
+	imu_bus_t* prev = thread_bus;
+	thread_bus = b;
+	return prev;
+}
+
+/*******************************************************************************
+* int imu_transport_init(rc_imu_config_t* conf)
+*
+* Opens the onboard IMU driver's bus as selected by conf. With NULL the bus
+* chosen last is used again, I2C if there was none, which is what the
+* calibration routines use.
+*******************************************************************************/
+int imu_transport_init(rc_imu_config_t* conf){
+	if(conf==NULL){
+		// keep an SPI device open rather than reinitializing it
+		if(default_bus.ops==&spi_ops) return 0;
+		if(!default_conf_set) default_conf = rc_default_imu_config();
+	}
+	else default_conf = *conf;
+	default_conf_set = 1;
+	return imu_bus_open(&default_bus, &default_conf);
+}
+
+/*******************************************************************************
+* int imu_transport_has_bypass()
+*
+* 1 if the magnetometer can be reached directly through the MPU's bypass
+*******************************************************************************/
+int imu_transport_has_bypass(){
+	return cur()->has_bypass;
+}
+
+/*******************************************************************************
+* Register access for the driver on the selected bus. Reads return the number
+* of bytes or words read and writes 0, both -1 on error, like the rc_i2c
+* functions they replace.
+*******************************************************************************/
+int imu_read_bytes(uint8_t reg, int len, uint8_t* data){
+	imu_bus_t* b = cur();
+	return b->ops->read_bytes(b, reg, len, data);
+}
+
+int imu_read_byte(uint8_t reg, uint8_t* data){
+	return imu_read_bytes(reg, 1, data);
+}
+
+int imu_read_word(uint8_t reg, uint16_t* data){
+	uint8_t buf[2];
+	if(imu_read_bytes(reg, 2, buf)!=2) return -1;
+	*data = ((uint16_t)buf[0]<<8) | buf[1];
+	return 1;
+}
+
+int imu_write_bytes(uint8_t reg, int len, uint8_t* data){
+	imu_bus_t* b = cur();
+	return b->ops->write_bytes(b, reg, len, data);
+}
+
+int imu_write_byte(uint8_t reg, uint8_t data){
+	return imu_write_bytes(reg, 1, &data);
+}
+
+int mag_read_bytes(uint8_t reg, int len, uint8_t* data){
+	imu_bus_t* b = cur();
+	int i, ret = 0;
+	if(len<1 || len>I2C_MAX_LEN) return -1;
+	if(b->has_bypass){
+		rc_i2c_set_device_address(b->i2c_bus, AK8963_ADDR);
+		return rc_i2c_read_bytes(b->i2c_bus, reg, len, data);
+	}
+	b->ops->claim(b);
+	for(i=0;i<len && ret==0;i++){
+		ret = slv4(b, AK8963_ADDR|READ_BIT, reg+i, 0, &data[i]);
+	}
+	b->ops->release(b);
+	return ret ? -1 : len;
+}
+
+int mag_read_byte(uint8_t reg, uint8_t* data){
+	return mag_read_bytes(reg, 1, data);
+}
+
+int mag_write_byte(uint8_t reg, uint8_t data){
+	imu_bus_t* b = cur();
+	int ret;
+	if(b->has_bypass){
+		rc_i2c_set_device_address(b->i2c_bus, AK8963_ADDR);
+		return rc_i2c_write_byte(b->i2c_bus, reg, data);
+	}
+	b->ops->claim(b);
+	ret = slv4(b, AK8963_ADDR, reg, data, NULL);
+	b->ops->release(b);
+	return ret;
+}
+
+/*******************************************************************************
+* int imu_claim_bus()
+* int imu_release_bus()
+*
+* keep the IMU to the calling thread across several accesses, these nest
+*******************************************************************************/
+int imu_claim_bus(){
+	imu_bus_t* b = cur();
+	return b->ops->claim(b);
+}
+
+int imu_release_bus(){
+	imu_bus_t* b = cur();
+	return b->ops->release(b);
+}
+
+/*******************************************************************************
+* static imu_bus_t* cur()
+*
+* the bus selected by this thread, the onboard IMU by default
+*******************************************************************************/
+static imu_bus_t* cur(){
+	return (thread_bus!=NULL) ? thread_bus : &default_bus;
+}
+
+/*******************************************************************************
+* I2C transport, the device address is per thread so set it every time
+*******************************************************************************/
+static int i2c_read_bytes(imu_bus_t* b, uint8_t reg, int len, uint8_t* data){
+	if(len<1 || len>I2C_MAX_LEN) return -1;
+	rc_i2c_set_device_address(b->i2c_bus, b->i2c_addr);
+	return rc_i2c_read_bytes(b->i2c_bus, reg, len, data);
+}
+
+static int i2c_write_bytes(imu_bus_t* b, uint8_t reg, int len, uint8_t* data){
+	if(len<1 || len>I2C_MAX_LEN) return -1;
+	rc_i2c_set_device_address(b->i2c_bus, b->i2c_addr);
+	return rc_i2c_write_bytes(b->i2c_bus, reg, len, data);
+}
+
+static int i2c_claim(imu_bus_t* b){
+	rc_i2c_set_device_address(b->i2c_bus, b->i2c_addr);
+	return rc_i2c_claim_bus(b->i2c_bus);
+}
+
+static int i2c_release(imu_bus_t* b){
+	return rc_i2c_release_bus(b->i2c_bus);
+}
+
+/*******************************************************************************
+* SPI transport
+*******************************************************************************/
+static int spi_read_bytes(imu_bus_t* b, uint8_t reg, int len, uint8_t* data){
+	rc_spi_xfer_t x[2] = {{0}};
+	uint8_t cmd = reg | READ_BIT;
+	uint32_t speed = spi_fast_reg(reg) ? b->fast_hz : b->reg_hz;
+	if(len<1) return -1;
+	x[0].tx = &cmd;
+	x[0].len = 1;
+	x[0].speed_hz = speed;
+	x[1].rx = data;
+	x[1].len = len;
+	x[1].speed_hz = speed;
+	if(rc_spi_transfer_list(b->spi_slave, x, 2)<0) return -1;
+	return len;
+}
+
+static int spi_write_bytes(imu_bus_t* b, uint8_t reg, int len, uint8_t* data){
+	rc_spi_xfer_t x = {0};
+	uint8_t buf[len+1];
+	int i;
+	if(len<1) return -1;
+	buf[0] = reg & ~READ_BIT;
+	for(i=0;i<len;i++) buf[i+1] = data[i];
+	// resets turn the I2C interface back on, keep it off while on SPI
+	if(reg==USER_CTRL) buf[1] |= I2C_IF_DIS;
+	x.tx = buf;
+	x.len = len+1;
+	x.speed_hz = b->reg_hz;
+	if(rc_spi_transfer_list(b->spi_slave, &x, 1)<0) return -1;
+	return 0;
+}
+
+static int spi_claim(imu_bus_t* b){
+	pthread_mutex_lock(&b->lock);
+	return 0;
+}
+
+static int spi_release(imu_bus_t* b){
+	pthread_mutex_unlock(&b->lock);
+	return 0;
+}
+
+/*******************************************************************************
+* static int spi_fast_reg(uint8_t reg)
+*
+* sensor, interrupt status and FIFO registers can be read at up to 20mhz
+*******************************************************************************/
+static int spi_fast_reg(uint8_t reg){
+	if(reg>=INT_STATUS && reg<=EXT_SENS_DATA_23) return 1;
+	if(reg==FIFO_COUNTH || reg==FIFO_COUNTL || reg==FIFO_R_W) return 1;
+	return 0;
+}
+
+/*******************************************************************************
+* static int slv4(imu_bus_t* b, uint8_t addr, uint8_t reg, uint8_t out,
+*															uint8_t* in)
+*
+* One byte over the MPU's I2C master through slave 4. The read bit in addr
+* selects a read into in, otherwise out is written. Needs I2C_MST_EN, see
+* mpu_set_bypass().
+*******************************************************************************/
+static int slv4(imu_bus_t* b, uint8_t addr, uint8_t reg, uint8_t out, uint8_t* in){
+	uint8_t status;
+	int waited;
+	if(b->ops->write_bytes(b, I2C_SLV4_ADDR, 1, &addr)) return -1;
+	if(b->ops->write_bytes(b, I2C_SLV4_REG, 1, &reg)) return -1;
+	if(!(addr&READ_BIT) && b->ops->write_bytes(b, I2C_SLV4_DO, 1, &out)) return -1;
+	status = I2C_SLV4_EN;
+	if(b->ops->write_bytes(b, I2C_SLV4_CTRL, 1, &status)) return -1;
+	for(waited=0; waited<MAG_TIMEOUT_US; waited+=MAG_POLL_US){
+		rc_usleep(MAG_POLL_US);
+		if(b->ops->read_bytes(b, I2C_MST_STATUS, 1, &status)!=1) return -1;
+		if(status&I2C_SLV4_NACK){
+			fprintf(stderr,"ERROR: magnetometer did not respond on I2C master\n");
+			return -1;
+		}
+		if(status&I2C_SLV4_DONE){
+			if(in!=NULL && b->ops->read_bytes(b, I2C_SLV4_DI, 1, in)!=1) return -1;
+			return 0;
+		}
+	}
+	fprintf(stderr,"ERROR: timeout talking to magnetometer through I2C master\n");
+	return -1;
+}
@@ -0,0 +1,240 @@
+/*******************************************************************************
+* rc_adc_stream.c
+*
+* Continuous ADC sampling. The ADC sequencer sweeps all 8 channels by itself
+* into FIFO1 at a set rate and a background task drains the FIFO into a
+* timestamped ring buffer per channel. Readers take the latest sample or a
+* window of recent samples without waiting on a conversion.
+*******************************************************************************/
+#include "../roboticscape.h"
+#include "../preprocessor_macros.h"
+#include "../mmap/rc_mmap_gpio_adc.h"
+#include "rc_adc_stream.h"
+#include <stdio.h>
+#include <pthread.h>
+
+#define ADC_CHANNELS		8
+#define ADC_STREAM_LEN		512		// samples kept per channel
+#define ADC_FIFO_WORDS		64
+#define ADC_SAMPLE_CLKS		15		// ADC clocks per conversion incl. sampling
+#define ADC_AVERAGES		8		// hardware averaging set up for each step
+#define ADC_MAX_DRAIN_HZ	2000
+
+/*******************************************************************************
+* Local Types
+*******************************************************************************/
+typedef struct adc_ring_t{
+	uint16_t raw[ADC_STREAM_LEN];
+	uint64_t t_ns[ADC_STREAM_LEN];
+	uint32_t count;		// total samples written, index is count%LEN
+} adc_ring_t;
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+static adc_ring_t rings[ADC_CHANNELS];
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static rc_periodic_t drain_task;
+static volatile int streaming = 0;
+static uint64_t overruns = 0;
+static uint64_t last_drain_ns;
+static double word_period_ns;	// measured time between fifo words
+
+/*******************************************************************************
+* Local Function Declarations
+*******************************************************************************/
+static void drain_fifo();
+static int adc_stream_decode(uint32_t word, int* raw);
+
+/*******************************************************************************
+* int rc_adc_start_continuous(double rate_hz)
+*
+* Starts sweeping all channels rate_hz times per second. The sweep rate is
+* set with a delay before each conversion so it is approximate, timestamps
+* are based on the measured rate rather than the requested one.
+*******************************************************************************/
+int rc_adc_start_continuous(double rate_hz){
+	int i, clk;
+	double delay, drain_hz;
+	if(streaming){
+		fprintf(stderr,"ERROR in rc_adc_start_continuous, already running\n");
+		return -1;
+	}
+	clk = mmap_adc_clock_hz();
+	if(clk<=0){
+		fprintf(stderr,"ERROR in rc_adc_start_continuous, can't access ADC\n");
+		return -1;
+	}
+	if(rate_hz<=0.0 || rate_hz>(double)clk/(ADC_CHANNELS*ADC_AVERAGES*ADC_SAMPLE_CLKS)){
+		fprintf(stderr,"ERROR in rc_adc_start_continuous, rate must be between 0 and %d\n",\
+						clk/(ADC_CHANNELS*ADC_AVERAGES*ADC_SAMPLE_CLKS));
+		return -1;
+	}
+	// ADC clocks per step minus the conversions themselves
+	delay = clk/(rate_hz*ADC_CHANNELS) - ADC_AVERAGES*ADC_SAMPLE_CLKS;
+	if(delay<0.0) delay = 0.0;
+
+	pthread_mutex_lock(&ring_mutex);
+	for(i=0;i<ADC_CHANNELS;i++) rings[i].count = 0;
+	overruns = 0;
+	word_period_ns = 1e9/(rate_hz*ADC_CHANNELS);
+	pthread_mutex_unlock(&ring_mutex);
+
+	if(mmap_adc_start_continuous((uint32_t)delay, 1)) return -1;
+	last_drain_ns = rc_nanos_since_boot();
+	streaming = 1;
+	// drain when the fifo is about a quarter full
+	drain_hz = rate_hz*ADC_CHANNELS*4/ADC_FIFO_WORDS;
+	if(drain_hz>ADC_MAX_DRAIN_HZ) drain_hz = ADC_MAX_DRAIN_HZ;
+	if(drain_hz<10.0) drain_hz = 10.0;
+	if(rc_start_periodic_task(&drain_task, "adc", drain_hz, drain_fifo, 0, -1)){
+		streaming = 0;
+		mmap_adc_stop_continuous();
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_adc_stop_continuous()
+*******************************************************************************/
+int rc_adc_stop_continuous(){
+	if(!streaming) return 0;
+	streaming = 0;
+	if(drain_task.func!=NULL) rc_stop_periodic_task(&drain_task);
+	return mmap_adc_stop_continuous();
+}
+
+/*******************************************************************************
+* int rc_adc_get_latest(int ch, int* raw, uint64_t* t_ns)
+*
+* Gives the newest sample of a channel and the rc_nanos_since_boot() time it
+* was converted at. t_ns may be NULL.
+*******************************************************************************/
+int rc_adc_get_latest(int ch, int* raw, uint64_t* t_ns){
+	adc_ring_t* r;
+	int i;
+	if(ch<0 || ch>=ADC_CHANNELS || raw==NULL){
+		fprintf(stderr,"ERROR in rc_adc_get_latest, invalid argument\n");
+		return -1;
+	}
+	r = &rings[ch];
+	pthread_mutex_lock(&ring_mutex);
+	if(!streaming || r->count==0){
+		pthread_mutex_unlock(&ring_mutex);
+		fprintf(stderr,"ERROR in rc_adc_get_latest, no samples, see rc_adc_start_continuous\n");
+		return -1;
+	}
+	i = (r->count-1)%ADC_STREAM_LEN;
+	*raw = r->raw[i];
+	if(t_ns!=NULL) *t_ns = r->t_ns[i];
+	pthread_mutex_unlock(&ring_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_adc_get_window(int ch, int n, int* raw, uint64_t* t_ns)
+*
+* Copies up to the n most recent samples of a channel, oldest first. t_ns may
+* be NULL. Returns the number of samples copied.
+*******************************************************************************/
+int rc_adc_get_window(int ch, int n, int* raw, uint64_t* t_ns){
+	adc_ring_t* r;
+	uint32_t first;
+	int i, avail;
+	if(ch<0 || ch>=ADC_CHANNELS || n<0 || raw==NULL){
+		fprintf(stderr,"ERROR in rc_adc_get_window, invalid argument\n");
+		return -1;
+	}
+	r = &rings[ch];
+	pthread_mutex_lock(&ring_mutex);
+	avail = (r->count<ADC_STREAM_LEN) ? (int)r->count : ADC_STREAM_LEN;
+	if(n>avail) n = avail;
+	first = r->count - n;
+	for(i=0;i<n;i++){
+		raw[i] = r->raw[(first+i)%ADC_STREAM_LEN];
+		if(t_ns!=NULL) t_ns[i] = r->t_ns[(first+i)%ADC_STREAM_LEN];
+	}
+	pthread_mutex_unlock(&ring_mutex);
+	return n;
+}
+
+/*******************************************************************************
+* uint64_t rc_adc_get_overruns()
+*
+* number of times the FIFO filled up before it was drained and samples were
+* lost since rc_adc_start_continuous()
+*******************************************************************************/
+uint64_t rc_adc_get_overruns(){
+	return overruns;
+}
+
+/*******************************************************************************
+* int adc_stream_latest(int ch, int* raw)
+*
+* like rc_adc_get_latest() but quietly returns -1 when there is no sample so
+* rc_adc_raw() can fall back to a oneshot conversion
+*******************************************************************************/
+int adc_stream_latest(int ch, int* raw){
+	adc_ring_t* r = &rings[ch];
+	int ret = -1;
+	if(!streaming) return -1;
+	pthread_mutex_lock(&ring_mutex);
+	if(r->count!=0){
+		*raw = r->raw[(r->count-1)%ADC_STREAM_LEN];
+		ret = 0;
+	}
+	pthread_mutex_unlock(&ring_mutex);
+	return ret;
+}
+
+/*******************************************************************************
+* static void drain_fifo()
+*
+* Periodic task body. Words come out of the FIFO in conversion order so the
+* last one was converted just now and each earlier one a word period before.
+* The word period is tracked from how many words arrive between drains.
+*******************************************************************************/
+static void drain_fifo(){
+	uint32_t words[ADC_FIFO_WORDS];
+	uint64_t now;
+	adc_ring_t* r;
+	int i, n, ch, raw, overrun;
+
+	n = mmap_adc_drain_continuous(words, ADC_FIFO_WORDS);
+	now = rc_nanos_since_boot();
+	overrun = mmap_adc_continuous_overrun();
+	if(unlikely(overrun)) overruns++;
+	if(n==0) return;
+
+	pthread_mutex_lock(&ring_mutex);
+	// slow average, the delay setting only approximates the real rate. Words
+	// lost to an overrun would make the period look too long.
+	if(likely(!overrun)){
+		word_period_ns += ((double)(now-last_drain_ns)/n - word_period_ns)/16.0;
+	}
+	last_drain_ns = now;
+	for(i=0;i<n;i++){
+		ch = adc_stream_decode(words[i], &raw);
+		if(unlikely(ch<0)) continue;
+		r = &rings[ch];
+		r->raw[r->count%ADC_STREAM_LEN] = raw;
+		r->t_ns[r->count%ADC_STREAM_LEN] = now - (uint64_t)((n-1-i)*word_period_ns);
+		r->count++;
+	}
+	pthread_mutex_unlock(&ring_mutex);
+}
+
+/*******************************************************************************
+* static int adc_stream_decode(uint32_t word, int* raw)
+*
+* Splits a FIFO1 word into its sample and channel. The tag is the step id,
+* not the channel, so words from steps other than the continuous ones return
+* -1.
+*******************************************************************************/
+static int adc_stream_decode(uint32_t word, int* raw){
+	int ch = (int)((word>>16)&0xF) - ADC_STREAM_FIRST_STEP_ID;
+	if(ch<0 || ch>=ADC_CHANNELS) return -1;
+	*raw = word&0xFFF;
+	return ch;
+}
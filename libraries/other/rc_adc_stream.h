@@ -0,0 +1,13 @@
+/*******************************************************************************
+* rc_adc_stream.h
+*
+* internal hook so rc_adc_raw() can use the continuous samples, the functions
+* for the user are in roboticscape.h
+*******************************************************************************/
+
+#ifndef RC_ADC_STREAM
+#define RC_ADC_STREAM
+
+int adc_stream_latest(int ch, int* raw);
+
+#endif // RC_ADC_STREAM
@@ -0,0 +1,441 @@
+/*******************************************************************************
+* rc_battery.c
+*
+* State of charge of the battery powering the cape and the shared memory
+* segment rc_battery_monitor publishes it through.
+*
+* The cape can't measure current so every process driving motors writes its
+* duty cycles into the segment and the monitor turns their sum into a current
+* estimate, unless a process with a current sensor reports the real value
+* with rc_battery_report_current(). Charge is counted from that current and
+* corrected towards the charge the open circuit voltage says, where the open
+* circuit voltage is the measured one plus the sag across an internal
+* resistance learned from how the voltage steps when the current steps. Low
+* voltage under load therefore reads as sag rather than as an empty battery.
+*******************************************************************************/
+#include "../roboticscape.h"
+#include "../rc_defs.h"
+#include "../preprocessor_macros.h"
+#include "rc_battery.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHM_NAME		"/rc_battery"
+#define SHM_MAGIC		0x42415454
+#define RETRY_NS		1000000000ULL	// between attempts to open the segment
+#define SHM_MODE		0664			// motor processes in the group may write
+#define CURRENT_TIMEOUT_MS	1000		// reported current older than this is ignored
+
+#define OCV_POINTS		11				// 0 to 100% in steps of 10
+#define CELL_R_GUESS	0.03f			// ohms per cell until learned
+#define R_MAX			1.0f			// larger steps are not resistance
+#define R_GAIN			0.05f			// weight of each new resistance step
+#define MIN_STEP_A		0.3f			// smallest current step to learn from
+#define MAX_STEP_NS		200000000ULL	// samples further apart are not a step
+#define MAX_DT_S		1.0f
+#define AVG_TC_S		30.0f			// averaging of current for remaining time
+#define VOLT_TC_S		20.0f			// time to trust the voltage over counting
+#define CELL_V_STD		0.01f			// open circuit voltage error per cell
+#define SAG_STD			0.5f			// fraction of the sag correction in doubt
+#define DUTY_I_STD		0.3f			// fraction of a duty based current in doubt
+#define SENSOR_I_STD	0.02f			// same for a reported current
+#define SOC_DRIFT		0.0002f			// random walk per root second
+#define SOC_INIT_STD	0.1f
+#define MIN_AVG_A		0.05f
+
+/*******************************************************************************
+* Local Types
+*******************************************************************************/
+// Written by the monitor under the seq counter, which is odd while the state
+// is being changed, and by processes driving motors or reading a current
+// sensor without locking as each field is a single word.
+typedef struct battery_shm_t{
+	uint32_t magic;
+	volatile uint32_t seq;
+	rc_battery_state_t state;
+	volatile float duty[MOTOR_CHANNELS];
+	volatile int32_t duty_pid[MOTOR_CHANNELS];	// process that set each duty
+	volatile float current_a;
+	volatile uint32_t current_ms;
+} battery_shm_t;
+
+/*******************************************************************************
+* Local Function Declarations
+*******************************************************************************/
+static int map_segment(int create);
+static float load_current(battery_soc_t* e, int* measured);
+static float soc_from_ocv(float cell_v, float* slope);
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+static battery_shm_t* shm = NULL;
+static int writable = 0;
+static int warned_readonly = 0;
+static float held_duty[MOTOR_CHANNELS];	// this process's duties, for a late map
+static int held_mask = 0;				// channels this process has set
+static uint64_t last_try_ns = 0;
+static pthread_mutex_t shm_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// resting LiPo cell voltage at 0, 10, ... 100% charge
+static const float ocv_table[OCV_POINTS] = {
+	3.27f, 3.69f, 3.73f, 3.77f, 3.80f, 3.84f, 3.87f, 3.95f, 4.02f, 4.11f, 4.20f
+};
+
+/*******************************************************************************
+* int rc_battery_get_state(rc_battery_state_t* s)
+*
+* Copies the latest estimate published by rc_battery_monitor. Returns -1 if
+* the monitor isn't running or never published.
+*******************************************************************************/
+int rc_battery_get_state(rc_battery_state_t* s){
+	uint32_t seq;
+	int i;
+	if(s==NULL){
+		fprintf(stderr,"ERROR in rc_battery_get_state, received NULL pointer\n");
+		return -1;
+	}
+	if(shm==NULL && map_segment(0)) return -1;
+	for(i=0;i<1000;i++){
+		seq = shm->seq;
+		if(seq&1){
+			sched_yield();	// let the monitor finish publishing
+			continue;
+		}
+		__sync_synchronize();
+		memcpy(s, &shm->state, sizeof(rc_battery_state_t));
+		__sync_synchronize();
+		if(shm->seq==seq) return (s->t_ns==0) ? -1 : 0;
+	}
+	return -1;
+}
+
+/*******************************************************************************
+* int rc_battery_report_current(float amps)
+*
+* For robots with a current sensor on the battery. The monitor uses the
+* reported discharge current instead of the one it estimates from the motor
+* duty cycles for as long as it keeps being reported at least once a second.
+*******************************************************************************/
+int rc_battery_report_current(float amps){
+	if(shm==NULL && map_segment(0)) return -1;
+	if(!writable){
+		fprintf(stderr,"ERROR in rc_battery_report_current, no write access to %s\n", SHM_NAME);
+		return -1;
+	}
+	shm->current_a = amps;
+	__sync_synchronize();
+	shm->current_ms = (uint32_t)(rc_nanos_since_boot()/1000000);
+	return 0;
+}
+
+/*******************************************************************************
+* void battery_report_duty(int ch, float duty)
+*
+* Called by the motor functions with channel 0-3 and the magnitude of its
+* duty. The duty is stamped with the pid of the caller so the monitor can
+* drop it if the process dies without stopping its motors. While the monitor
+* isn't running this tries to map the segment again at most once every
+* RETRY_NS and, once it can, shares every duty this process holds.
+*******************************************************************************/
+void battery_report_duty(int ch, float duty){
+	int i;
+	held_duty[ch] = duty;
+	held_mask |= 1<<ch;
+	if(shm==NULL){
+		if(map_segment(0)) return;
+		if(writable){
+			// only the channels set here, others may belong to another program
+			for(i=0;i<MOTOR_CHANNELS;i++){
+				if(!(held_mask&(1<<i))) continue;
+				shm->duty_pid[i] = getpid();
+				__sync_synchronize();
+				shm->duty[i] = held_duty[i];
+			}
+			return;
+		}
+	}
+	if(!writable){
+		if(!warned_readonly){
+			fprintf(stderr,"WARNING: no write access to the battery monitor, motor current won't be counted\n");
+			warned_readonly = 1;
+		}
+		return;
+	}
+	shm->duty_pid[ch] = getpid();
+	__sync_synchronize();
+	shm->duty[ch] = duty;
+}
+
+/*******************************************************************************
+* int battery_shm_open(int create)
+*
+* Maps the segment, creating it if create is set which only the monitor does.
+* The motor functions call this once at initialization so their hook is just
+* two stores when the monitor is already running.
+*******************************************************************************/
+int battery_shm_open(int create){
+	if(shm!=NULL) return 0;
+	return map_segment(create);
+}
+
+/*******************************************************************************
+* int battery_shm_publish(const rc_battery_state_t* s)
+*
+* monitor side, replaces the published state
+*******************************************************************************/
+int battery_shm_publish(const rc_battery_state_t* s){
+	if(shm==NULL || !writable){
+		fprintf(stderr,"ERROR in battery_shm_publish, segment not open for writing\n");
+		return -1;
+	}
+	shm->seq++;
+	__sync_synchronize();
+	memcpy(&shm->state, s, sizeof(rc_battery_state_t));
+	__sync_synchronize();
+	shm->seq++;
+	return 0;
+}
+
+/*******************************************************************************
+* int battery_soc_init(battery_soc_t* e, float capacity_ah, float amps_per_duty,
+*																float idle_a)
+*
+* amps_per_duty is the battery current with one motor at full duty, idle_a
+* what the board and everything but the motors draw from it.
+*******************************************************************************/
+int battery_soc_init(battery_soc_t* e, float capacity_ah, float amps_per_duty, \
+																float idle_a){
+	if(e==NULL){
+		fprintf(stderr,"ERROR in battery_soc_init, received NULL pointer\n");
+		return -1;
+	}
+	if(capacity_ah<=0.0f || amps_per_duty<0.0f || idle_a<0.0f){
+		fprintf(stderr,"ERROR in battery_soc_init, invalid argument\n");
+		return -1;
+	}
+	memset(e, 0, sizeof(battery_soc_t));
+	e->capacity_as = capacity_ah*3600.0f;
+	e->amps_per_duty = amps_per_duty;
+	e->idle_a = idle_a;
+	return 0;
+}
+
+/*******************************************************************************
+* int battery_soc_update(battery_soc_t* e, uint64_t t_ns, float v, int cells,
+*									int charging, rc_battery_state_t* out)
+*
+* Takes one unfiltered voltage sample of the pack with the given number of
+* cells, 0 when there is none, and fills out. Meant to be called at a steady
+* rate fast enough to see the voltage step when the motors change, 20hz or so.
+*******************************************************************************/
+int battery_soc_update(battery_soc_t* e, uint64_t t_ns, float v, int cells, \
+								int charging, rc_battery_state_t* out){
+	float i, dt, di, r, ocv, z, slope, i_std, v_std, meas_var, k;
+	int measured;
+	if(unlikely(e==NULL || out==NULL)){
+		fprintf(stderr,"ERROR in battery_soc_update, received NULL pointer\n");
+		return -1;
+	}
+	memset(out, 0, sizeof(rc_battery_state_t));
+	out->t_ns = t_ns;
+	out->voltage = v;
+	out->cells = cells;
+	out->charging = charging;
+	out->remaining_s = -1.0f;
+	i = load_current(e, &measured);
+	out->current_measured = measured;
+	// a different pack, start over
+	if(cells!=e->cells){
+		e->cells = cells;
+		e->last_ns = 0;
+		if(cells==0) return 0;
+		e->resistance = CELL_R_GUESS*cells;
+	}
+	if(cells==0) return 0;
+
+	if(e->last_ns==0){
+		e->soc = soc_from_ocv((v + e->resistance*i)/cells, &slope);
+		e->var = SOC_INIT_STD*SOC_INIT_STD;
+		e->avg_i = i;
+		dt = 0.0f;
+	}
+	else{
+		dt = (t_ns - e->last_ns)/1e9f;
+		if(dt>MAX_DT_S) dt = MAX_DT_S;
+		// a current step against the matching voltage step gives resistance
+		di = i - e->last_i;
+		if(t_ns-e->last_ns<MAX_STEP_NS && fabsf(di)>MIN_STEP_A){
+			r = (e->last_v - v)/di;
+			if(r>0.0f && r<R_MAX) e->resistance += R_GAIN*(r - e->resistance);
+		}
+	}
+	e->last_ns = t_ns;
+	e->last_v = v;
+	e->last_i = i;
+	ocv = v + e->resistance*i;
+
+	if(charging){
+		// charge current is unknown, all there is to go by is the voltage
+		e->soc = soc_from_ocv(v/cells, &slope);
+		e->var = SOC_INIT_STD*SOC_INIT_STD;
+		e->avg_i = e->idle_a;
+	}
+	else if(dt>0.0f){
+		// count the charge drawn since the last sample
+		i_std = (measured ? SENSOR_I_STD : DUTY_I_STD)*i;
+		e->soc -= i*dt/e->capacity_as;
+		e->var += (i_std*dt/e->capacity_as)*(i_std*dt/e->capacity_as) + \
+											SOC_DRIFT*SOC_DRIFT*dt;
+		// Correct towards the open circuit voltage. Its error is scaled up by
+		// the sample rate so the voltage takes VOLT_TC_S to pull the estimate
+		// over regardless of how often this runs, and where the curve is flat
+		// a small voltage error is a big charge error so it counts for less.
+		z = soc_from_ocv(ocv/cells, &slope);
+		v_std = CELL_V_STD + SAG_STD*e->resistance*i/cells;
+		meas_var = slope*v_std*slope*v_std*VOLT_TC_S/dt;
+		k = e->var/(e->var + meas_var);
+		e->soc += k*(z - e->soc);
+		e->var *= 1.0f - k;
+		if(e->soc<0.0f) e->soc = 0.0f;
+		else if(e->soc>1.0f) e->soc = 1.0f;
+		e->avg_i += (i - e->avg_i)*dt/AVG_TC_S;
+	}
+
+	out->ocv = ocv;
+	out->current_a = i;
+	out->resistance = e->resistance;
+	out->soc = e->soc;
+	out->soc_std = sqrtf(e->var);
+	if(!charging && e->avg_i>MIN_AVG_A){
+		out->remaining_s = e->soc*e->capacity_as/e->avg_i;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* static int map_segment(int create)
+*
+* Opens the segment read-write if allowed, otherwise read only. Failed
+* attempts are retried at most once every RETRY_NS so readers polling in a
+* loop don't hammer the filesystem while the monitor isn't running.
+*******************************************************************************/
+static int map_segment(int create){
+	int fd;
+	struct stat st;
+	void* ptr;
+	uint64_t now = rc_nanos_since_boot();
+	pthread_mutex_lock(&shm_mutex);
+	if(shm!=NULL){
+		pthread_mutex_unlock(&shm_mutex);
+		return 0;
+	}
+	if(!create && last_try_ns!=0 && now-last_try_ns<RETRY_NS){
+		pthread_mutex_unlock(&shm_mutex);
+		return -1;
+	}
+	last_try_ns = now;
+	writable = 1;
+	fd = shm_open(SHM_NAME, O_RDWR | (create ? O_CREAT : 0), SHM_MODE);
+	if(fd<0 && !create){
+		writable = 0;
+		fd = shm_open(SHM_NAME, O_RDONLY, 0);
+	}
+	if(fd<0){
+		if(create) perror("ERROR in battery_shm_open, shm_open failed");
+		pthread_mutex_unlock(&shm_mutex);
+		return -1;
+	}
+	// a new segment is sized and comes back zeroed, an existing one from an
+	// earlier monitor is kept so processes that mapped it stay connected
+	if(create && ftruncate(fd, sizeof(battery_shm_t))){
+		perror("ERROR in battery_shm_open, ftruncate failed");
+		close(fd);
+		pthread_mutex_unlock(&shm_mutex);
+		return -1;
+	}
+	// the umask usually takes the group write bit off
+	if(create && fchmod(fd, SHM_MODE)){
+		perror("WARNING in battery_shm_open, fchmod failed");
+	}
+	if(fstat(fd, &st) || st.st_size!=sizeof(battery_shm_t)){
+		close(fd);
+		pthread_mutex_unlock(&shm_mutex);
+		return -1;
+	}
+	ptr = mmap(NULL, sizeof(battery_shm_t), \
+			writable ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(ptr==MAP_FAILED){
+		pthread_mutex_unlock(&shm_mutex);
+		return -1;
+	}
+	if(create) ((battery_shm_t*)ptr)->magic = SHM_MAGIC;
+	else if(((battery_shm_t*)ptr)->magic!=SHM_MAGIC){
+		munmap(ptr, sizeof(battery_shm_t));
+		pthread_mutex_unlock(&shm_mutex);
+		return -1;
+	}
+	shm = ptr;
+	pthread_mutex_unlock(&shm_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* static float load_current(battery_soc_t* e, int* measured)
+*
+* A current reported within the last second, otherwise the board's own
+* draw plus the motor duty cycles scaled by amps_per_duty. A duty left behind
+* by a process that no longer exists isn't counted.
+*******************************************************************************/
+static float load_current(battery_soc_t* e, int* measured){
+	uint32_t now_ms, t_ms;
+	float i;
+	int ch;
+	pid_t pid;
+	*measured = 0;
+	if(shm==NULL) return e->idle_a;
+	t_ms = shm->current_ms;
+	now_ms = (uint32_t)(rc_nanos_since_boot()/1000000);
+	if(t_ms!=0 && now_ms-t_ms<CURRENT_TIMEOUT_MS){
+		*measured = 1;
+		return shm->current_a;
+	}
+	i = e->idle_a;
+	for(ch=0;ch<MOTOR_CHANNELS;ch++){
+		if(shm->duty[ch]==0.0f) continue;
+		pid = shm->duty_pid[ch];
+		// left alone rather than cleared, a new owner may be writing it
+		if(pid<=0 || (kill(pid, 0) && errno==ESRCH)) continue;
+		i += shm->duty[ch]*e->amps_per_duty;
+	}
+	return i;
+}
+
+/*******************************************************************************
+* static float soc_from_ocv(float cell_v, float* slope)
+*
+* Interpolates the charge for a resting cell voltage and gives the slope of
+* charge against voltage there, that of the end segment outside the table.
+*******************************************************************************/
+static float soc_from_ocv(float cell_v, float* slope){
+	const float step = 1.0f/(OCV_POINTS-1);
+	int j;
+	if(cell_v<=ocv_table[0]){
+		*slope = step/(ocv_table[1]-ocv_table[0]);
+		return 0.0f;
+	}
+	for(j=1;j<OCV_POINTS-1 && cell_v>ocv_table[j];j++);
+	*slope = step/(ocv_table[j]-ocv_table[j-1]);
+	if(cell_v>=ocv_table[OCV_POINTS-1]) return 1.0f;
+	return (j-1)*step + (cell_v-ocv_table[j-1])*(*slope);
+}
@@ -0,0 +1,37 @@
+/*******************************************************************************
+* rc_battery.h
+*
+* State of charge estimator run by rc_battery_monitor and the shared memory it
+* publishes through. The hook for the motor functions is here too. The
+* functions for the user are in roboticscape.h
+*******************************************************************************/
+
+#ifndef RC_BATTERY
+#define RC_BATTERY
+
+#include "../roboticscape.h"
+
+typedef struct battery_soc_t{
+	float capacity_as;	// pack capacity in amp seconds
+	float amps_per_duty;// motor current at full duty summed over motors
+	float idle_a;		// current of the board itself
+	int cells;			// 0 until the first update with a pack
+	uint64_t last_ns;
+	float last_v;
+	float last_i;
+	float resistance;	// pack internal resistance, ohms
+	float soc;
+	float var;			// variance of soc
+	float avg_i;		// slow average of the current for remaining time
+} battery_soc_t;
+
+int battery_soc_init(battery_soc_t* e, float capacity_ah, float amps_per_duty, \
+															float idle_a);
+int battery_soc_update(battery_soc_t* e, uint64_t t_ns, float v, int cells, \
+								int charging, rc_battery_state_t* out);
+
+int battery_shm_open(int create);
+int battery_shm_publish(const rc_battery_state_t* s);
+void battery_report_duty(int ch, float duty);
+
+#endif // RC_BATTERY
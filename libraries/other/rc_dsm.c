@@ -6,12 +6,17 @@
 #include "../rc_defs.h"
 #include "../preprocessor_macros.h"
 #include "../mmap/rc_mmap_gpio_adc.h"
+#include "rc_realtime.h"
+#include "rc_trace.h"
 #include <stdio.h>
 #include <pthread.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
 
 #define MAX_DSM_CHANNELS 9
 #define PAUSE 115	//microseconds
@@ -22,6 +27,11 @@
 #define DSM_UART_BUS	4
 #define DSM_BAUD_RATE	115200
 #define DSM_PACKET_SIZE	16
+#define DSM_READ_BUF_SIZE	64 // up to 4 frames if the parser falls behind
+#define DSM_POLL_TIMEOUT_MS	100
+// frames take 1.4ms to arrive at 115200 baud and are sent every 11 or 22ms,
+// any silence longer than this falls between two frames
+#define DSM_FRAME_GAP_NS	3000000
 
 /*******************************************************************************
 * Local Global Variables
@@ -39,11 +49,23 @@ pthread_t serial_parser_thread;
 int listening; // for calibration routine only
 void (*dsm_ready_func)();
 int rc_is_dsm_active_flag; 
+static uint64_t last_frame_ns; // rc_nanos_since_boot() of last complete set
+static uint64_t resync_count;
+static char frame_buf[DSM_PACKET_SIZE]; // partial frame held by read_dsm_frame
+static int frame_len;
+static uint64_t last_rx_ns;
+static char rx_buf[DSM_READ_BUF_SIZE]; // last read() not yet framed
+static int rx_len;
+static int rx_pos;
+static uint64_t rx_buf_ns; // when rx_buf was read
 
 /*******************************************************************************
 * Local Function Declarations
 *******************************************************************************/
 int load_default_calibration();
+int configure_dsm_uart();
+int read_dsm_frame(char* frame, uint64_t* frame_ns);
+static void reset_framing();
 void* serial_parser(void *ptr); //background thread
 void* calibration_listen_func(void *ptr);
 
@@ -90,7 +112,10 @@ int rc_initialize_dsm(){
 	running = 1; // lets uarts 4 thread know it can run
 	num_channels = 0;
 	last_time = 0;
+	last_frame_ns = 0;
+	resync_count = 0;
 	rc_is_dsm_active_flag = 0;
+	reset_framing();
 	rc_set_dsm_data_func(&rc_null_func);
 	
 	if(rc_uart_init(DSM_UART_BUS, DSM_BAUD_RATE, 0.1)){
@@ -249,6 +274,134 @@ int rc_is_dsm_active(){
 	return rc_is_dsm_active_flag;
 }
 
+/*******************************************************************************
+* @ uint64_t rc_get_dsm_frame_timestamp()
+* 
+* returns the time in nanoseconds since boot (same clock as
+* rc_nanos_since_boot) at which the frame completing the most recent set of
+* channel data was received. returns 0 if no data has been received yet.
+*******************************************************************************/
+uint64_t rc_get_dsm_frame_timestamp(){
+	return last_frame_ns;
+}
+
+/*******************************************************************************
+* @ uint64_t rc_get_dsm_resync_count()
+* 
+* returns the number of partial frames the parser has dropped to get back in
+* sync with the receiver since rc_initialize_dsm()
+*******************************************************************************/
+uint64_t rc_get_dsm_resync_count(){
+	return resync_count;
+}
+
+/*******************************************************************************
+* int configure_dsm_uart()
+*
+* rc_uart_init() sets the port up for blocking reads of up to 128 bytes. The
+* parser instead waits in poll() and then reads whatever has arrived, so set
+* VMIN=1 VTIME=0 which makes poll() report the first byte of a frame right
+* away and read() return immediately with everything available.
+*******************************************************************************/
+int configure_dsm_uart(){
+	struct termios config;
+	int fd = rc_uart_fd(DSM_UART_BUS);
+	if(fd<0) return -1;
+	if(tcgetattr(fd, &config)){
+		printf("ERROR: can't get dsm uart attributes\n");
+		return -1;
+	}
+	config.c_cc[VMIN] = 1;
+	config.c_cc[VTIME] = 0;
+	if(tcsetattr(fd, TCSANOW, &config)){
+		printf("ERROR: can't set dsm uart attributes\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int read_dsm_frame(char* frame, uint64_t* frame_ns)
+*
+* Byte-level framing state machine for the serial_parser thread. Blocks in
+* poll() until a full DSM_PACKET_SIZE frame has been assembled, copies it to
+* frame and returns 0 with the time the last chunk of the frame arrived.
+* Returns -1 when the service is stopping or the port fails.
+*
+* Receivers send each frame as one back-to-back burst followed by a long idle
+* gap, so frames are delimited by time rather than content. When a chunk
+* arrives more than DSM_FRAME_GAP_NS after the previous one, any partial frame
+* collected so far was started mid-frame and is dropped, and the new chunk
+* begins a frame. Bytes already received are never flushed so a late read
+* that returns several frames at once stays aligned.
+*******************************************************************************/
+int read_dsm_frame(char* frame, uint64_t* frame_ns){
+	struct pollfd fdset[1];
+	int ret;
+
+	fdset[0].fd = rc_uart_fd(DSM_UART_BUS);
+	fdset[0].events = POLLIN;
+	if(fdset[0].fd<0) return -1;
+
+	while(running && rc_get_state()!=EXITING){
+		// assemble a frame from bytes already read
+		while(rx_pos<rx_len){
+			frame_buf[frame_len++] = rx_buf[rx_pos++];
+			if(frame_len==DSM_PACKET_SIZE){
+				frame_len = 0;
+				memcpy(frame, frame_buf, DSM_PACKET_SIZE);
+				*frame_ns = rx_buf_ns;
+				return 0;
+			}
+		}
+
+		// wait for more, timeout lets us check if the service should stop
+		ret = poll(fdset, 1, DSM_POLL_TIMEOUT_MS);
+		if(ret<0){
+			if(errno==EINTR) continue;
+			printf("ERROR: dsm uart poll() failed: %s\n", strerror(errno));
+			return -1;
+		}
+		if(ret==0) continue;
+		if(fdset[0].revents & (POLLERR|POLLHUP|POLLNVAL)){
+			printf("ERROR: dsm uart closed\n");
+			return -1;
+		}
+		ret = read(fdset[0].fd, rx_buf, DSM_READ_BUF_SIZE);
+		if(ret<=0) continue;
+		rx_buf_ns = rc_nanos_since_boot();
+		rx_len = ret;
+		rx_pos = 0;
+
+		// an idle gap before this chunk means it starts a new frame
+		if(frame_len>0 && rx_buf_ns-last_rx_ns>DSM_FRAME_GAP_NS){
+			#ifdef DEBUG
+			printf("WARNING: dropping partial dsm frame of %d bytes\n", frame_len);
+			#endif
+			frame_len = 0;
+			resync_count++;
+			rc_is_dsm_active_flag = 0;
+		}
+		last_rx_ns = rx_buf_ns;
+	}
+	return -1;
+}
+
+/*******************************************************************************
+* static void reset_framing()
+*
+* Drops the bytes and partial frame read_dsm_frame held when the service last
+* stopped so a restarted parser doesn't prepend them to the first new frame.
+* Called before the parser thread is started.
+*******************************************************************************/
+static void reset_framing(){
+	frame_len = 0;
+	last_rx_ns = 0;
+	rx_len = 0;
+	rx_pos = 0;
+	rx_buf_ns = 0;
+}
+
 /*******************************************************************************
 * @ void* serial_parser(void *ptr)
 * 
@@ -260,18 +413,29 @@ int rc_is_dsm_active(){
 *******************************************************************************/
 void* serial_parser( __unused void *ptr){
 	char buf[DSM_PACKET_SIZE];
-	int i, ret, available;
+	int i;
 	int new_values[MAX_DSM_CHANNELS]; // hold new values before committing
 	int detection_packets_left; // use first 4 packets just for detection
 	unsigned char ch_id;
 	int16_t value;
 	int is_complete;
+	uint64_t rx_ns;
 	unsigned char max_channel_id_1024 = 0; // max channel assuming 1024 decoding
 	unsigned char max_channel_id_2048 = 0; // max channel assuming 2048 decoding
 	char channels_detected_1024[MAX_DSM_CHANNELS];
 	char channels_detected_2048[MAX_DSM_CHANNELS];
 	memset(channels_detected_1024,0,MAX_DSM_CHANNELS);
 	memset(channels_detected_2048,0,MAX_DSM_CHANNELS);
+	memset(new_values,0,sizeof(new_values));
+
+	// picks up priority and affinity from the real-time profile if enabled
+	configure_rt_thread(RT_THREAD_DSM, 0);
+
+	if(configure_dsm_uart()){
+		printf("ERROR: can't configure uart%d for dsm\n", DSM_UART_BUS);
+		release_rt_thread();
+		return NULL;
+	}
 
 	/***************************************************************************
 	* First packets that come in are read just to detect resolution and channels
@@ -279,35 +443,10 @@ void* serial_parser( __unused void *ptr){
 	* to break 1024 mode then swap to 2048
 	***************************************************************************/
 DETECTION_START:
-	rc_uart_flush(DSM_UART_BUS); // flush first
 	detection_packets_left = 4;
 	while(detection_packets_left>0 && running && rc_get_state()!=EXITING){
-		rc_usleep(5000);
-		available = rc_uart_bytes_available(DSM_UART_BUS);
-
-		// nothing yet, go back to sleep
-		if(available == 0) continue;
-		// halfway through packet, sleep for 1ms
-		if(available <  DSM_PACKET_SIZE){
-			rc_usleep(1000);
-			available = rc_uart_bytes_available(DSM_UART_BUS);
-		}
-		// read or flush depending on bytes available		
-		if(available == DSM_PACKET_SIZE){
-			ret = rc_uart_read_bytes(DSM_UART_BUS, DSM_PACKET_SIZE, buf);
-			if(ret!=DSM_PACKET_SIZE){
-				#ifdef DEBUG
-					printf("WARNING: read the wrong number of bytes: %d\n", ret);
-				#endif
-				rc_uart_flush(DSM_UART_BUS); // flush
-				continue;
-			}
-		}
-		else{
-			// got out of sync or read nonsense, flush and try again
-			rc_uart_flush(DSM_UART_BUS); // flush
-			continue;
-		}
+		if(read_dsm_frame(buf, &rx_ns)) break;
+		TRACE_POINT(TRACE_DSM_PACKET, DSM_PACKET_SIZE);
 
 		// first check each channel id assuming 1024/22ms mode
 		// where the channel id lives in 0b01111000 mask
@@ -355,7 +494,7 @@ DETECTION_START:
 
 		// raw debug mode spits out all ones and zeros
 		#ifdef DEBUG
-		printf("ret=%d : ", ret);
+		printf("bytes : ");
 		for(i=0; i<(DSM_PACKET_SIZE/2); i++){
 			printf(rc_byte_to_binary(buf[2*i]));
 			printf(" ");
@@ -370,7 +509,10 @@ DETECTION_START:
 	}
 
 	// do an exit check here since there is a jump above this code
-	if(!running || rc_get_state()==EXITING) return 0;
+	if(detection_packets_left>0 || !running || rc_get_state()==EXITING){
+		release_rt_thread();
+		return 0;
+	}
 
 	/***************************************************************************
 	* now determine which mode from detection data
@@ -417,42 +559,13 @@ DETECTION_START:
 	***************************************************************************/
 START_NORMAL_LOOP:
 	while(running && rc_get_state()!=EXITING){
-		rc_usleep(5000);
-		available = rc_uart_bytes_available(DSM_UART_BUS);
-
-		// nothing yet, go back to sleep
-		if(available == 0) continue;
-		// halfway through packet, sleep for 1ms
-		if(available <  DSM_PACKET_SIZE){
-			rc_usleep(1000);
-			available = rc_uart_bytes_available(DSM_UART_BUS);
-		}
-
-		#ifdef DEBUG
-			printf("bytes available: %d\n", available);
-		#endif
-
-		// read or flush depending on bytes available		
-		if(available == DSM_PACKET_SIZE){
-			ret = rc_uart_read_bytes(DSM_UART_BUS, DSM_PACKET_SIZE, buf);
-			if(ret!=DSM_PACKET_SIZE){
-				#ifdef DEBUG
-					printf("WARNING: read the wrong number of bytes: %d\n", ret);
-				#endif
-				rc_is_dsm_active_flag=0;
-				rc_uart_flush(DSM_UART_BUS); // flush
-				continue;
-			}
-		}
-		else{
-			// got out of sync, flush and try again
-			rc_uart_flush(DSM_UART_BUS); // flush
-			continue;
-		}
+		// blocks until a full frame arrives, nonzero means stopping or error
+		if(read_dsm_frame(buf, &rx_ns)) break;
+		TRACE_POINT(TRACE_DSM_PACKET, DSM_PACKET_SIZE);
 
 		// raw debug mode spits out all ones and zeros
 		#ifdef DEBUG
-		printf("ret=%d : ", ret);
+		printf("bytes : ");
 		for(i=0; i<(DSM_PACKET_SIZE/2); i++){
 			printf(rc_byte_to_binary(buf[2*i]));
 			printf(" ");
@@ -488,6 +601,7 @@ START_NORMAL_LOOP:
 				}
 				else{
 					printf("ERROR: dsm resolution incorrect\n");
+					release_rt_thread();
 					return NULL;
 				}
 				
@@ -525,19 +639,23 @@ START_NORMAL_LOOP:
 			new_dsm_flag=1;
 			rc_is_dsm_active_flag=1;
 			last_time = rc_nanos_since_epoch();
+			last_frame_ns = rx_ns;
 			for(i=0;i<num_channels;i++){
 				rc_channels[i]=new_values[i];
 				new_values[i]=0;// put local values array back to 0
 			}
 			// run the dsm ready function.
 			// this is null unless user changed it
+			TRACE_POINT(TRACE_DSM_CALLBACK_START, num_channels);
 			dsm_ready_func();
+			TRACE_POINT(TRACE_DSM_CALLBACK_END, 0);
 		}
 		
 		#ifdef DEBUG
 		printf("\n");
 		#endif
 	}
+	release_rt_thread();
 	return NULL;
 }
 
@@ -771,7 +889,10 @@ int rc_calibrate_dsm_routine(){
 	running = 1; // lets uarts 4 thread know it can run
 	num_channels = 0;
 	last_time = 0;
+	last_frame_ns = 0;
+	resync_count = 0;
 	rc_is_dsm_active_flag = 0;
+	reset_framing();
 	rc_set_dsm_data_func(&rc_null_func);
 	
 	if(rc_uart_init(DSM_UART_BUS, DSM_BAUD_RATE, 0.1)){
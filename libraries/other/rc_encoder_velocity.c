@@ -0,0 +1,234 @@
+/*******************************************************************************
+* rc_encoder_velocity.c
+*
+* Encoder velocity from the eQEP hardware instead of differentiating positions
+* at loop rate. Two measurements are taken every unit period:
+*
+* - position change over the unit period (counts per fixed time), accurate at
+*   high speed but quantized to one count per period at low speed
+* - capture period between unit events (fixed counts per time), accurate at
+*   low speed but down to a few timer ticks per event at high speed
+*
+* and blended by speed. Channel 4 is counted by the PRU which has no such
+* hardware so it falls back to differencing positions over the unit period.
+*******************************************************************************/
+#include "../roboticscape.h"
+#include "../preprocessor_macros.h"
+#include "../mmap/rc_mmap_pwmss.h"
+#include "../mmap/rc_tipwmss.h"
+#include "rc_encoder_velocity.h"
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+#define ENCODER_CHANNELS	4
+#define EQEP_CHANNELS		3
+// beyond this many unit periods since the last read the position change is
+// too old to be useful and only the capture measurement is used
+#define MAX_UNIT_GAP		8
+
+/*******************************************************************************
+* Local Types
+*******************************************************************************/
+typedef struct velocity_state_t{
+	int configured;
+	int have_pos;			// pos/pos_time hold a valid previous sample
+	rc_encoder_velocity_config_t conf;
+	int32_t pos;			// position at the previous unit time-out
+	uint64_t pos_time;		// CLOCK_MONOTONIC time of that time-out
+	float velocity;			// latest estimate in counts per second
+} velocity_state_t;
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+static velocity_state_t state[ENCODER_CHANNELS];
+
+/*******************************************************************************
+* Local Function Declarations
+*******************************************************************************/
+static int configure_channel(int ch, rc_encoder_velocity_config_t conf);
+static void update_eqep(int ch);
+static void update_pru(int ch);
+static float capture_velocity(velocity_state_t* s, eqep_velocity_latch_t* l);
+static uint64_t monotonic_nanos();
+
+/*******************************************************************************
+* rc_encoder_velocity_config_t rc_default_encoder_velocity_config()
+*******************************************************************************/
+rc_encoder_velocity_config_t rc_default_encoder_velocity_config(){
+	rc_encoder_velocity_config_t conf;
+	conf.unit_period_us = 10000;
+	conf.capture_prescale = 6;	// 1.5625mhz, overflows after 42ms
+	conf.event_prescale = 2;	// one full quadrature cycle per event
+	conf.blend_low = 2000.0f;
+	conf.blend_high = 10000.0f;
+	return conf;
+}
+
+/*******************************************************************************
+* int rc_set_encoder_velocity_config(int ch, rc_encoder_velocity_config_t conf)
+*******************************************************************************/
+int rc_set_encoder_velocity_config(int ch, rc_encoder_velocity_config_t conf){
+	if(ch<1 || ch>ENCODER_CHANNELS){
+		fprintf(stderr,"Encoder Channel must be from 1 to 4\n");
+		return -1;
+	}
+	if(conf.unit_period_us<100 || conf.capture_prescale<0 \
+		|| conf.capture_prescale>7 || conf.event_prescale<0 \
+		|| conf.event_prescale>11 || conf.blend_low<0.0f \
+		|| conf.blend_high<conf.blend_low){
+		fprintf(stderr,"ERROR in rc_set_encoder_velocity_config, invalid config\n");
+		return -1;
+	}
+	return configure_channel(ch, conf);
+}
+
+/*******************************************************************************
+* float rc_get_encoder_velocity(int ch)
+*
+* Returns the latest velocity estimate in counts per second, updating it if a
+* unit period has finished since the last call. The first call on a channel
+* configures it with the defaults and returns 0 until two unit periods have
+* passed.
+*******************************************************************************/
+float rc_get_encoder_velocity(int ch){
+	if(ch<1 || ch>ENCODER_CHANNELS){
+		fprintf(stderr,"Encoder Channel must be from 1 to 4\n");
+		return 0.0f;
+	}
+	if(unlikely(!state[ch-1].configured)){
+		if(configure_channel(ch, rc_default_encoder_velocity_config())){
+			return 0.0f;
+		}
+	}
+	if(ch<=EQEP_CHANNELS) update_eqep(ch);
+	else update_pru(ch);
+	return state[ch-1].velocity;
+}
+
+/*******************************************************************************
+* void reset_encoder_velocity(int ch)
+*
+* Forgets the previous position sample so a jump from rc_set_encoder_pos()
+* isn't read as motion. The estimate restarts on the next unit period.
+*******************************************************************************/
+void reset_encoder_velocity(int ch){
+	if(ch<1 || ch>ENCODER_CHANNELS) return;
+	state[ch-1].have_pos = 0;
+}
+
+/*******************************************************************************
+* static int configure_channel(int ch, rc_encoder_velocity_config_t conf)
+*******************************************************************************/
+static int configure_channel(int ch, rc_encoder_velocity_config_t conf){
+	velocity_state_t* s = &state[ch-1];
+	if(ch<=EQEP_CHANNELS){
+		if(init_eqep_velocity(ch-1, conf.unit_period_us, \
+						conf.capture_prescale, conf.event_prescale)){
+			fprintf(stderr,"ERROR: failed to set up eQEP%d velocity\n", ch-1);
+			return -1;
+		}
+	}
+	s->conf = conf;
+	s->have_pos = 0;
+	s->velocity = 0.0f;
+	s->configured = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* static void update_eqep(int ch)
+*
+* Position latches are absolute counts so the change between any two of them
+* is exact. The number of unit periods between them comes from the unit timer
+* value, which says how long ago the latest latch happened.
+*******************************************************************************/
+static void update_eqep(int ch){
+	velocity_state_t* s = &state[ch-1];
+	eqep_velocity_latch_t l;
+	uint64_t now, t, unit_ns;
+	float v_pos, v_cap, w;
+	int periods;
+
+	read_eqep_velocity(ch-1, &l);
+	if(!l.new_unit) return;
+	now = monotonic_nanos();
+	t = now - (uint64_t)l.since_unit*(1000000000ULL/EQEP_SYSCLK_HZ);
+	unit_ns = (uint64_t)s->conf.unit_period_us*1000;
+
+	v_cap = capture_velocity(s, &l);
+	periods = 0;
+	if(s->have_pos){
+		periods = (int)((t - s->pos_time + unit_ns/2)/unit_ns);
+	}
+	if(periods<1 || periods>MAX_UNIT_GAP){
+		// no usable previous latch, the capture period is all we have
+		s->velocity = v_cap;
+	}
+	else{
+		v_pos = (float)(int32_t)(l.pos - s->pos) \
+				/ (periods * s->conf.unit_period_us * 1e-6f);
+		if(fabsf(v_pos)>=s->conf.blend_high) w = 1.0f;
+		else if(fabsf(v_pos)<=s->conf.blend_low) w = 0.0f;
+		else w = (fabsf(v_pos)-s->conf.blend_low) \
+						/ (s->conf.blend_high-s->conf.blend_low);
+		// the capture is invalid after an overflow or direction change
+		if(l.cap_error) w = 1.0f;
+		s->velocity = w*v_pos + (1.0f-w)*v_cap;
+	}
+	s->pos = l.pos;
+	s->pos_time = t;
+	s->have_pos = 1;
+}
+
+/*******************************************************************************
+* static float capture_velocity(velocity_state_t* s, eqep_velocity_latch_t* l)
+*
+* Speed from the time between unit events. If the last event is older than
+* the last full period, the encoder is slowing down and the true period is at
+* least that long. A capture overflow means slower than the timer can measure.
+*******************************************************************************/
+static float capture_velocity(velocity_state_t* s, eqep_velocity_latch_t* l){
+	uint32_t ticks;
+	float tick_s, counts;
+	if(l->cap_error || l->cap_period==0) return 0.0f;
+	ticks = (l->cap_timer>l->cap_period) ? l->cap_timer : l->cap_period;
+	if(ticks==0xFFFF) return 0.0f;
+	tick_s = (float)(1<<s->conf.capture_prescale) / EQEP_SYSCLK_HZ;
+	counts = (float)(1<<s->conf.event_prescale);
+	return (l->forward ? 1.0f : -1.0f) * counts / (ticks*tick_s);
+}
+
+/*******************************************************************************
+* static void update_pru(int ch)
+*
+* The PRU only provides a count, difference it once a unit period has passed
+*******************************************************************************/
+static void update_pru(int ch){
+	velocity_state_t* s = &state[ch-1];
+	uint64_t now = monotonic_nanos();
+	uint64_t unit_ns = (uint64_t)s->conf.unit_period_us*1000;
+	int32_t pos;
+	if(s->have_pos && now-s->pos_time<unit_ns) return;
+	pos = rc_get_encoder_pos(ch);
+	if(s->have_pos){
+		s->velocity = (float)(int32_t)(pos - s->pos) \
+								/ ((now - s->pos_time)*1e-9f);
+	}
+	s->pos = pos;
+	s->pos_time = now;
+	s->have_pos = 1;
+}
+
+/*******************************************************************************
+* static uint64_t monotonic_nanos()
+*
+* The eQEP timers run on the hardware clock so this stays on the real
+* CLOCK_MONOTONIC even when rc_nanos_since_boot() has been redirected.
+*******************************************************************************/
+static uint64_t monotonic_nanos(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec*1000000000ULL) + ts.tv_nsec;
+}
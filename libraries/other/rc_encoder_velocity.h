@@ -0,0 +1,13 @@
+/*******************************************************************************
+* rc_encoder_velocity.h
+*
+* internal hook used by rc_set_encoder_pos(), the velocity functions for the
+* user are in roboticscape.h
+*******************************************************************************/
+
+#ifndef RC_ENCODER_VELOCITY
+#define RC_ENCODER_VELOCITY
+
+void reset_encoder_velocity(int ch);
+
+#endif // RC_ENCODER_VELOCITY
@@ -0,0 +1,247 @@
+/*******************************************************************************
+* rc_imu_redundancy.c
+*
+* Combines two to four IMUs into one sample. Each source's latest two samples
+* are interpolated to a common time before a per-axis vote, the median with
+* three or more healthy sources and the mean with two. A source is dropped for
+* good once it keeps failing to read, stops delivering, repeats the exact same
+* output or, with three or more sources, keeps straying from the median. Two
+* sources that disagree can't tell which one is wrong so that is only flagged.
+*******************************************************************************/
+#include "../roboticscape.h"
+#include "../preprocessor_macros.h"
+#include <stdio.h>
+#include <math.h>
+
+#define READ_FAULT_COUNT	5	// consecutive failed reads
+#define STUCK_FAULT_COUNT	50	// consecutive identical samples
+#define OUTLIER_FAULT_COUNT	10	// consecutive samples away from the median
+#define STALE_NS			50000000ULL
+
+/*******************************************************************************
+* Local Function Declarations
+*******************************************************************************/
+static void align(rc_imu_redundancy_t* r, int i, uint64_t t_ns, float* out);
+static float vote(float* v, int n);
+static int same_output(rc_imu_sample_t* a, rc_imu_sample_t* b);
+
+/*******************************************************************************
+* int rc_imu_redundancy_init(rc_imu_redundancy_t* r, int n, float accel_tol,
+*															float gyro_tol)
+*
+* Prepares a manager for n sources. A source more than accel_tol m/s^2 or
+* gyro_tol deg/s away from the others on any axis counts as disagreeing.
+*******************************************************************************/
+int rc_imu_redundancy_init(rc_imu_redundancy_t* r, int n, float accel_tol, \
+															float gyro_tol){
+	int i;
+	if(r==NULL){
+		fprintf(stderr,"ERROR in rc_imu_redundancy_init, received NULL pointer\n");
+		return -1;
+	}
+	if(n<1 || n>RC_IMU_MAX_REDUNDANT){
+		fprintf(stderr,"ERROR in rc_imu_redundancy_init, n must be between 1 and %d\n",\
+														RC_IMU_MAX_REDUNDANT);
+		return -1;
+	}
+	if(accel_tol<=0.0f || gyro_tol<=0.0f){
+		fprintf(stderr,"ERROR in rc_imu_redundancy_init, tolerances must be positive\n");
+		return -1;
+	}
+	r->n = n;
+	r->accel_tol = accel_tol;
+	r->gyro_tol = gyro_tol;
+	r->start_ns = 0;
+	r->disagree = 0;
+	for(i=0;i<RC_IMU_MAX_REDUNDANT;i++){
+		r->count[i] = 0;
+		r->read_errors[i] = 0;
+		r->stuck[i] = 0;
+		r->outlier[i] = 0;
+		r->health[i] = 0;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_imu_redundancy_push(rc_imu_redundancy_t* r, int i, rc_imu_sample_t* s)
+*
+* Hands over a new sample from source i, NULL when reading it failed.
+*******************************************************************************/
+int rc_imu_redundancy_push(rc_imu_redundancy_t* r, int i, rc_imu_sample_t* s){
+	if(unlikely(r==NULL || i<0 || i>=r->n)){
+		fprintf(stderr,"ERROR in rc_imu_redundancy_push, invalid argument\n");
+		return -1;
+	}
+	if(s==NULL){
+		if(++r->read_errors[i]>=READ_FAULT_COUNT) r->health[i] |= RC_IMU_FAULT_READ;
+		return 0;
+	}
+	r->read_errors[i] = 0;
+	if(r->count[i]>0 && same_output(s, &r->last[i])){
+		if(++r->stuck[i]>=STUCK_FAULT_COUNT) r->health[i] |= RC_IMU_FAULT_STUCK;
+	}
+	else r->stuck[i] = 0;
+	r->prev[i] = r->last[i];
+	r->last[i] = *s;
+	r->count[i]++;
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_imu_redundancy_fuse(rc_imu_redundancy_t* r, uint64_t t_ns,
+*														rc_imu_sample_t* out)
+*
+* Aligns every healthy source to t_ns, votes and updates the health of each
+* source. Returns the number of sources that went into out, -1 if none.
+*******************************************************************************/
+int rc_imu_redundancy_fuse(rc_imu_redundancy_t* r, uint64_t t_ns, rc_imu_sample_t* out){
+	float v[RC_IMU_MAX_REDUNDANT][6], col[RC_IMU_MAX_REDUNDANT], med[6], tol;
+	int used[RC_IMU_MAX_REDUNDANT];
+	int i, j, k, n, n_mag, off;
+	if(unlikely(r==NULL || out==NULL)){
+		fprintf(stderr,"ERROR in rc_imu_redundancy_fuse, received NULL pointer\n");
+		return -1;
+	}
+	if(r->start_ns==0) r->start_ns = t_ns;
+	// pick healthy sources with a recent sample
+	n = 0;
+	for(i=0;i<r->n;i++){
+		if(r->health[i]) continue;
+		if(r->count[i]==0){
+			if(t_ns-r->start_ns>STALE_NS) r->health[i] |= RC_IMU_FAULT_STALE;
+			continue;
+		}
+		if(t_ns>r->last[i].t_ns && t_ns-r->last[i].t_ns>STALE_NS){
+			r->health[i] |= RC_IMU_FAULT_STALE;
+			continue;
+		}
+		align(r, i, t_ns, v[n]);
+		used[n++] = i;
+	}
+	if(n==0) return -1;
+
+	for(j=0;j<6;j++){
+		for(k=0;k<n;k++) col[k] = v[k][j];
+		med[j] = vote(col, n);
+	}
+	// With three or more the median belongs to the good ones. With two the
+	// mean sits halfway so either one half a tolerance off means they differ
+	// by all of it, but not which one is wrong.
+	r->disagree = 0;
+	for(k=0;k<n;k++){
+		off = 0;
+		for(j=0;j<6;j++){
+			tol = (j<3) ? r->accel_tol : r->gyro_tol;
+			if(n==2) tol *= 0.5f;
+			if(fabsf(v[k][j]-med[j])>tol) off = 1;
+		}
+		if(n==2) r->disagree |= off;
+		else if(n==1) continue;
+		else if(!off) r->outlier[used[k]] = 0;
+		else if(++r->outlier[used[k]]>=OUTLIER_FAULT_COUNT){
+			r->health[used[k]] |= RC_IMU_FAULT_DISAGREE;
+		}
+	}
+
+	out->t_ns = t_ns;
+	for(j=0;j<3;j++){
+		out->accel[j] = med[j];
+		out->gyro[j] = med[j+3];
+		out->mag[j] = 0.0f;
+	}
+	// temperature and the slow magnetometer are averaged without alignment
+	out->temp = 0.0f;
+	n_mag = 0;
+	for(k=0;k<n;k++){
+		i = used[k];
+		out->temp += r->last[i].temp/n;
+		if(!r->last[i].mag_valid) continue;
+		for(j=0;j<3;j++) out->mag[j] += r->last[i].mag[j];
+		n_mag++;
+	}
+	for(j=0;j<3 && n_mag>0;j++) out->mag[j] /= n_mag;
+	out->mag_valid = (n_mag>0);
+	return n;
+}
+
+/*******************************************************************************
+* int rc_imu_redundancy_update(rc_imu_redundancy_t* r, rc_imu_t* imus[],
+*														rc_imu_sample_t* out)
+*
+* Reads each of the n instances in imus, skipping NULL entries which are fed
+* with rc_imu_redundancy_push() instead, and fuses at the newest sample time.
+*******************************************************************************/
+int rc_imu_redundancy_update(rc_imu_redundancy_t* r, rc_imu_t* imus[], \
+														rc_imu_sample_t* out){
+	rc_imu_sample_t s;
+	uint64_t t = 0;
+	int i;
+	if(unlikely(r==NULL || imus==NULL)){
+		fprintf(stderr,"ERROR in rc_imu_redundancy_update, received NULL pointer\n");
+		return -1;
+	}
+	for(i=0;i<r->n;i++){
+		if(imus[i]==NULL || r->health[i]) continue;
+		if(rc_imu_read(imus[i], &s)) rc_imu_redundancy_push(r, i, NULL);
+		else rc_imu_redundancy_push(r, i, &s);
+	}
+	for(i=0;i<r->n;i++){
+		if(r->health[i]==0 && r->count[i]>0 && r->last[i].t_ns>t) t = r->last[i].t_ns;
+	}
+	if(t==0) t = rc_nanos_since_boot();
+	return rc_imu_redundancy_fuse(r, t, out);
+}
+
+/*******************************************************************************
+* static void align(rc_imu_redundancy_t* r, int i, uint64_t t_ns, float* out)
+*
+* Accel then gyro of source i at t_ns from a line through its last two
+* samples, going at most one sample interval past either end.
+*******************************************************************************/
+static void align(rc_imu_redundancy_t* r, int i, uint64_t t_ns, float* out){
+	rc_imu_sample_t* a = &r->prev[i];
+	rc_imu_sample_t* b = &r->last[i];
+	float f = 0.0f;
+	int j;
+	if(r->count[i]>1 && b->t_ns>a->t_ns){
+		f = ((double)t_ns - (double)b->t_ns)/(double)(b->t_ns - a->t_ns);
+		if(f>1.0f) f = 1.0f;
+		if(f<-1.0f) f = -1.0f;
+	}
+	for(j=0;j<3;j++){
+		out[j] = b->accel[j] + f*(b->accel[j]-a->accel[j]);
+		out[j+3] = b->gyro[j] + f*(b->gyro[j]-a->gyro[j]);
+	}
+}
+
+/*******************************************************************************
+* static float vote(float* v, int n)
+*
+* median of n values, mean of the middle two for even n, sorts v
+*******************************************************************************/
+static float vote(float* v, int n){
+	float tmp;
+	int i, j;
+	for(i=1;i<n;i++){
+		tmp = v[i];
+		for(j=i; j>0 && v[j-1]>tmp; j--) v[j] = v[j-1];
+		v[j] = tmp;
+	}
+	if(n%2) return v[n/2];
+	return 0.5f*(v[n/2-1] + v[n/2]);
+}
+
+/*******************************************************************************
+* static int same_output(rc_imu_sample_t* a, rc_imu_sample_t* b)
+*
+* sensor noise makes consecutive readings differ, an exact repeat of all six
+* values means the device or its bus is stuck
+*******************************************************************************/
+static int same_output(rc_imu_sample_t* a, rc_imu_sample_t* b){
+	int j;
+	for(j=0;j<3;j++){
+		if(a->accel[j]!=b->accel[j] || a->gyro[j]!=b->gyro[j]) return 0;
+	}
+	return 1;
+}
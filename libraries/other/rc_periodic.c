@@ -0,0 +1,342 @@
+/*******************************************************************************
+* rc_periodic.c
+*
+* Deadline-driven periodic loops. Instead of sleeping a fixed amount at the
+* end of each iteration, which makes the period drift by the loop body time,
+* each loop sleeps until an absolute release time on CLOCK_MONOTONIC. Every
+* loop keeps its own timing statistics so overruns and jitter can be seen.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include "../roboticscape.h"
+#include "../preprocessor_macros.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define MAX_PERIODIC_LOOPS	32
+#define JITTER_BIN_0_NS		10000 // upper edge of first histogram bin
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+static rc_periodic_t* registry[MAX_PERIODIC_LOOPS];
+static int num_registered = 0;
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*******************************************************************************
+* Local Function Declarations
+*******************************************************************************/
+static void sleep_until(uint64_t release_ns);
+static int jitter_bin(uint64_t jitter_ns);
+static void* periodic_task_func(void* ptr);
+
+/*******************************************************************************
+* int rc_periodic_init(rc_periodic_t* p, const char* name, double hz)
+*
+* Prepares a periodic loop running at hz and registers it for
+* rc_print_periodic_stats(). The first release is one period from now.
+*******************************************************************************/
+int rc_periodic_init(rc_periodic_t* p, const char* name, double hz){
+	int i;
+	if(p==NULL){
+		fprintf(stderr,"ERROR in rc_periodic_init, received NULL pointer\n");
+		return -1;
+	}
+	if(hz<=0.0){
+		fprintf(stderr,"ERROR in rc_periodic_init, hz must be >0\n");
+		return -1;
+	}
+	memset(p, 0, sizeof(rc_periodic_t));
+	strncpy(p->name, (name==NULL)?"unnamed":name, RC_PERIODIC_NAME_LEN-1);
+	p->period_ns = (uint64_t)(1000000000.0/hz);
+	p->next_release_ns = rc_nanos_since_boot() + p->period_ns;
+	p->running = 1;
+
+	// register, reusing the slot if this loop was initialized before
+	pthread_mutex_lock(&registry_mutex);
+	for(i=0;i<num_registered;i++){
+		if(registry[i]==p) break;
+	}
+	if(i==num_registered){
+		if(num_registered<MAX_PERIODIC_LOOPS) registry[num_registered++] = p;
+		else fprintf(stderr,"WARNING: too many periodic loops to track stats\n");
+	}
+	pthread_mutex_unlock(&registry_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_periodic_cleanup(rc_periodic_t* p)
+*
+* Removes a loop from the stats registry. Must be called before the memory
+* holding p goes away, for example when p is a local variable of a thread.
+*******************************************************************************/
+int rc_periodic_cleanup(rc_periodic_t* p){
+	int i;
+	if(p==NULL){
+		fprintf(stderr,"ERROR in rc_periodic_cleanup, received NULL pointer\n");
+		return -1;
+	}
+	pthread_mutex_lock(&registry_mutex);
+	for(i=0;i<num_registered;i++){
+		if(registry[i]!=p) continue;
+		// keep the order the loops were registered in for the stats table
+		num_registered--;
+		memmove(&registry[i], &registry[i+1], \
+					(num_registered-i)*sizeof(rc_periodic_t*));
+		break;
+	}
+	pthread_mutex_unlock(&registry_mutex);
+	p->running = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_periodic_wait(rc_periodic_t* p)
+*
+* Call once per loop iteration in place of rc_usleep(1000000/hz). Closes the
+* accounting for the job that just ran, sleeps until the next absolute release
+* time and records how late the wakeup was. If the job overran so far that
+* one or more releases already passed, those releases are skipped rather than
+* run back-to-back. Returns the number of skipped releases.
+*******************************************************************************/
+int rc_periodic_wait(rc_periodic_t* p){
+	uint64_t now, exec, late;
+	int skipped = 0;
+
+	now = rc_nanos_since_boot();
+
+	// account for the job that just finished, the first call has no job
+	if(p->job_start_ns!=0){
+		exec = now - p->job_start_ns;
+		p->stats.total_exec_ns += exec;
+		p->stats.last_exec_ns = exec;
+		if(exec>p->stats.wcet_ns) p->stats.wcet_ns = exec;
+		// implicit deadline is the next release
+		if(now>p->next_release_ns) p->stats.missed_deadlines++;
+	}
+
+	// skip any releases we are already too late for
+	while(now>=p->next_release_ns+p->period_ns){
+		p->next_release_ns += p->period_ns;
+		skipped++;
+	}
+	p->stats.skipped_releases += skipped;
+
+	sleep_until(p->next_release_ns);
+
+	// record release jitter
+	p->job_start_ns = rc_nanos_since_boot();
+	late = (p->job_start_ns>p->next_release_ns) ? \
+							(p->job_start_ns-p->next_release_ns) : 0;
+	if(late>p->stats.max_jitter_ns) p->stats.max_jitter_ns = late;
+	p->stats.jitter_hist[jitter_bin(late)]++;
+	p->stats.activations++;
+
+	p->next_release_ns += p->period_ns;
+	return skipped;
+}
+
+/*******************************************************************************
+* int rc_periodic_reset_stats(rc_periodic_t* p)
+*
+* zeros all timing statistics for a loop without changing its phase
+*******************************************************************************/
+int rc_periodic_reset_stats(rc_periodic_t* p){
+	if(p==NULL){
+		fprintf(stderr,"ERROR in rc_periodic_reset_stats, received NULL pointer\n");
+		return -1;
+	}
+	memset(&p->stats, 0, sizeof(rc_periodic_stats_t));
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_print_periodic_stats()
+*
+* prints one line of timing statistics for every registered periodic loop
+* followed by its jitter histogram
+*******************************************************************************/
+int rc_print_periodic_stats(){
+	int i, j;
+	rc_periodic_t* p;
+	rc_periodic_stats_t s;
+	uint64_t edge;
+
+	printf("\n%-16s %8s %10s %10s %10s %8s %8s %10s\n", "loop", "hz", \
+		"runs", "avg_us", "wcet_us", "missed", "skipped", "jitter_us");
+	pthread_mutex_lock(&registry_mutex);
+	for(i=0;i<num_registered;i++){
+		p = registry[i];
+		s = p->stats;
+		printf("%-16s %8.1f %10llu %10.1f %10.1f %8llu %8llu %10.1f\n", \
+			p->name, 1000000000.0/p->period_ns, \
+			(unsigned long long)s.activations, \
+			s.activations ? s.total_exec_ns/1000.0/s.activations : 0.0, \
+			s.wcet_ns/1000.0, \
+			(unsigned long long)s.missed_deadlines, \
+			(unsigned long long)s.skipped_releases, \
+			s.max_jitter_ns/1000.0);
+		printf("    jitter hist:");
+		edge = JITTER_BIN_0_NS;
+		for(j=0;j<RC_PERIODIC_JITTER_BINS;j++){
+			if(j<RC_PERIODIC_JITTER_BINS-1){
+				printf(" <%lluus:%u", (unsigned long long)edge/1000, \
+														s.jitter_hist[j]);
+			}
+			else printf(" more:%u", s.jitter_hist[j]);
+			edge *= 2;
+		}
+		printf("\n");
+	}
+	pthread_mutex_unlock(&registry_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_pthread_create_rt(pthread_t* thread, void*(*func)(void*), void* arg,
+*												int priority, int cpu)
+*
+* Starts a thread with an explicit SCHED_FIFO priority and CPU affinity. A
+* priority of 0 leaves the thread on SCHED_OTHER and a cpu of -1 leaves the
+* affinity alone. Failing to apply the priority or affinity (usually due to
+* missing privileges) prints a warning but still starts the thread.
+*******************************************************************************/
+int rc_pthread_create_rt(pthread_t* thread, void*(*func)(void*), void* arg, \
+													int priority, int cpu){
+	pthread_attr_t attr;
+	struct sched_param params;
+	cpu_set_t cpus;
+	int ret;
+
+	if(thread==NULL || func==NULL){
+		fprintf(stderr,"ERROR in rc_pthread_create_rt, received NULL pointer\n");
+		return -1;
+	}
+	if(priority<0 || priority>sched_get_priority_max(SCHED_FIFO)){
+		fprintf(stderr,"ERROR in rc_pthread_create_rt, invalid priority\n");
+		return -1;
+	}
+
+	pthread_attr_init(&attr);
+	if(priority>0){
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		params.sched_priority = priority;
+		pthread_attr_setschedparam(&attr, &params);
+	}
+	if(cpu>=0){
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+	}
+
+	ret = pthread_create(thread, &attr, func, arg);
+	// most likely lacking privileges, fall back to a normal thread
+	if(ret==EPERM || ret==EINVAL){
+		fprintf(stderr,"WARNING: can't apply priority %d / cpu %d to thread\n",\
+															priority, cpu);
+		ret = pthread_create(thread, NULL, func, arg);
+	}
+	pthread_attr_destroy(&attr);
+	if(ret){
+		fprintf(stderr,"ERROR in rc_pthread_create_rt, pthread_create failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_start_periodic_task(rc_periodic_t* p, const char* name, double hz,
+*						void (*func)(void), int priority, int cpu)
+*
+* Convenience wrapper that runs func at hz in its own thread with the given
+* SCHED_FIFO priority and CPU affinity until rc_stop_periodic_task() is called
+* or the program state becomes EXITING.
+*******************************************************************************/
+int rc_start_periodic_task(rc_periodic_t* p, const char* name, double hz, \
+							void (*func)(void), int priority, int cpu){
+	if(func==NULL){
+		fprintf(stderr,"ERROR in rc_start_periodic_task, received NULL pointer\n");
+		return -1;
+	}
+	if(rc_periodic_init(p, name, hz)) return -1;
+	p->func = func;
+	if(rc_pthread_create_rt(&p->thread, periodic_task_func, p, priority, cpu)){
+		p->running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_stop_periodic_task(rc_periodic_t* p)
+*
+* stops a task started with rc_start_periodic_task(), waits for its thread
+* to finish the current job and unregisters it
+*******************************************************************************/
+int rc_stop_periodic_task(rc_periodic_t* p){
+	if(p==NULL || p->func==NULL){
+		fprintf(stderr,"ERROR in rc_stop_periodic_task, task not started\n");
+		return -1;
+	}
+	p->running = 0;
+	pthread_join(p->thread, NULL);
+	p->func = NULL;
+	return rc_periodic_cleanup(p);
+}
+
+/*******************************************************************************
+* static void sleep_until(uint64_t release_ns)
+*
+* Sleeps until an absolute CLOCK_MONOTONIC time. When the library clock has
+* been swapped out (see rc_set_clock_virtual) the relative rc_nanosleep path
+* is used so periodic loops follow the simulated clock too.
+*******************************************************************************/
+static void sleep_until(uint64_t release_ns){
+	struct timespec ts;
+	uint64_t now;
+	if(likely(rc_get_clock_mode()==RC_CLOCK_REAL)){
+		ts.tv_sec = release_ns/1000000000;
+		ts.tv_nsec = release_ns%1000000000;
+		while(clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&ts,NULL)==EINTR);
+		return;
+	}
+	now = rc_nanos_since_boot();
+	if(release_ns>now) rc_nanosleep(release_ns-now);
+	return;
+}
+
+/*******************************************************************************
+* static int jitter_bin(uint64_t jitter_ns)
+*
+* Bin 0 holds wakeups less than 10us late, each following bin doubles in
+* width and the last bin catches everything else.
+*******************************************************************************/
+static int jitter_bin(uint64_t jitter_ns){
+	int bin = 0;
+	uint64_t edge = JITTER_BIN_0_NS;
+	while(jitter_ns>=edge && bin<RC_PERIODIC_JITTER_BINS-1){
+		edge *= 2;
+		bin++;
+	}
+	return bin;
+}
+
+/*******************************************************************************
+* static void* periodic_task_func(void* ptr)
+*
+* thread body for rc_start_periodic_task()
+*******************************************************************************/
+static void* periodic_task_func(void* ptr){
+	rc_periodic_t* p = (rc_periodic_t*)ptr;
+	while(1){
+		rc_periodic_wait(p);
+		if(!p->running || rc_get_state()==EXITING) break;
+		p->func();
+	}
+	return NULL;
+}
@@ -3,15 +3,22 @@
 * functions in the roboticscape library that use the pru are kept here for
 * organizational purposes.
 ******************************************************************************/
-
+#define _GNU_SOURCE
 #include "../roboticscape.h"
 #include "../rc_defs.h"
+#include "../preprocessor_macros.h"
 #include "rc_pru.h"
+#include "rc_trace.h"
+#include "../mmap/rc_mmap_gpio_adc.h"
 #include <stdio.h>
 #include <fcntl.h> // for open
 #include <unistd.h> // for close
 #include <sys/mman.h>	// mmap
 #include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
 
 #define PRU_UNBIND_PATH "/sys/bus/platform/drivers/pru-rproc/unbind"
 #define PRU_BIND_PATH "/sys/bus/platform/drivers/pru-rproc/bind"
@@ -26,7 +33,99 @@
 #define PRU_SHAREDMEM	0x10000			// Offset to shared memory
 #define CNT_OFFSET 		64
 
+// shared memory header, must match pru1-servo.asm and pru0-encoder.asm
+#define PRU_MAGIC_WORD		(0x80/4)
+#define PRU_VERSION_WORD	(0x84/4)
+#define PRU0_HEARTBEAT		(0x88/4)
+#define PRU1_HEARTBEAT		(0x8C/4)
+#define PRU_MAGIC			0x52435055
+#define PRU_FW_VERSION		1
+#define PRU_BOOT_TIMEOUT_US	1000000
+#define PRU_STALL_NS		500000000ULL	// heartbeat age before a PRU is hung
+#define PRU_CHECK_NS		100000000ULL	// how often to check on the PRUs
+#define PRU_RETRY_US		5000000			// wait after a failed restart
+
+// continuous servo mode blocks, must match pru1-servo.asm
+#define SERVO_PERIOD		(0x90/4)
+#define SERVO_TIMEOUT		(0x94/4)
+#define SERVO_SEQ			(0x98/4)
+#define SERVO_ACK			(0xA0/4)
+#define SERVO_FAILSAFE_ON	(0xA4/4)
+#define SERVO_FRAMES		(0xA8/4)
+#define SERVO_CMD0			(0xC0/4)		// 2 buffers of SERVO_CHANNELS
+#define SERVO_FAILSAFE		(0x100/4)
+#define SERVO_BLOCK_BYTES	(0x120-0x90)
+#define SERVO_MAX_FRAME_HZ	40000.0
+#define SERVO_MIN_FRAME_HZ	10.0
+
+// IEP timer, paces the sampler running on pru0
+#define PRU_IEP			0x2E000			// Offset to IEP registers
+#define IEP_GLB_CFG		(0x00/4)
+#define IEP_CNT			(0x0C/4)
+#define IEP_CMP_CFG		(0x40/4)
+#define IEP_CMP_STS		(0x44/4)
+#define IEP_CMP0		(0x48/4)
+#define IEP_CNT_ENABLE	0x01
+#define IEP_DEFAULT_INC	(0x01<<4)
+#define IEP_CMP0_RESET	0x01			// restart count on compare 0
+#define IEP_CMP0_ENABLE	(0x01<<1)
+#define PRU_CLK_HZ		200000000
+#define PRU_NS_PER_CLK	5
+
+// sampler ring layout, must match pru0-encoder.asm
+#define SAMPLER_HEAD		0x140
+#define SAMPLER_LATEST		0x148
+#define SAMPLER_RING		0x200
+#define SAMPLER_LEN			256
+#define SAMPLER_REC_WORDS	8
+#define SAMPLER_MIN_HZ		1.0
+#define SAMPLER_MAX_HZ		50000.0
+#define SAMPLER_CHECK_RECS	3				// records checked by the start up test
+#define SAMPLER_CHECK_NS	20000000ULL		// slack on top of their periods
+// keep the ADC sweeping a little faster than the sampler so each sample gets
+// a conversion newer than the previous sample
+#define SAMPLER_ADC_MARGIN	1.25
+#define ADC_SAMPLE_CLKS		15
+#define ADC_AVERAGES		8
+
 static unsigned int *prusharedMem_32int_ptr;
+static volatile unsigned int *pru_iep_ptr;
+static int pru_fw_ok = 0;
+static volatile int pru_stalled = 0;	// bit per PRU whose heartbeat stopped
+static int stall_warned = 0;
+static pthread_mutex_t check_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t watchdog_thread;
+static int watchdog_started = 0;
+static uint32_t last_heartbeat[2];
+static uint64_t heartbeat_ns[2];	// when each heartbeat last changed
+static uint64_t last_check_ns;
+static int servo_continuous = 0;
+static int servo_batch = 0;			// hold off publishing during _all updates
+static uint32_t servo_period;		// loops per continuous mode frame
+static uint32_t servo_timeout;		// frames without an update before failsafe
+static uint32_t servo_seq;
+static uint32_t servo_target[SERVO_CHANNELS];	// widths in loops
+static uint32_t servo_saved[SERVO_CHANNELS];	// targets before a batch
+static uint32_t servo_failsafe[SERVO_CHANNELS];
+static int sampler_running = 0;
+static uint32_t sampler_tail;
+static uint32_t sampler_period;		// PRU clocks per sample
+static uint64_t sampler_start_ns;
+static uint64_t sampler_dropped;
+
+static int wait_for_pru_boot(int wait_pru0);
+static int recover_pru();
+static void reset_heartbeats();
+static int detect_stall();
+static int maybe_check_pru();
+static int check_sampler();
+static void* watchdog_func(void* ptr);
+static int set_servo_width(uint32_t* table, int ch, int us);
+static void publish_servo_targets();
+static void write_servo_block();
+static void begin_servo_batch();
+static void end_servo_batch(int ok);
+static uint64_t monotonic_nanos();
 
 
 /*******************************************************************************
@@ -42,6 +141,7 @@ int initialize_pru(){
 	
 	// reset memory pointer to NULL so if init fails it doesn't point somewhere bad
 	prusharedMem_32int_ptr = NULL;
+	pru_iep_ptr = NULL;
 
 	// open file descriptors for pru rproc driver
 	bind_fd = open(PRU_BIND_PATH, O_WRONLY);
@@ -85,12 +185,33 @@ int initialize_pru(){
 
 	// set global shared memory pointer
 	prusharedMem_32int_ptr = pru + PRU_SHAREDMEM/4;	// Points to start of shared memory
+	pru_iep_ptr = pru + PRU_IEP/4;
 
 	// zero out the 8 servo channels and encoder channel
 	#ifdef DEBUG
 	printf("zeroing out PRU shared memory\n");
 	#endif
 	memset(prusharedMem_32int_ptr, 0, 9*4);
+	memset(prusharedMem_32int_ptr + SERVO_PERIOD, 0, SERVO_BLOCK_BYTES);
+	memset(servo_failsafe, 0, sizeof(servo_failsafe));
+	servo_continuous = 0;
+	servo_seq = 0;
+
+	// the PRUs may have only just been loaded, give them a moment to boot.
+	// Older firmware still handles plain servo pulses and the encoder.
+	pru_fw_ok = (wait_for_pru_boot(0)==0);
+	if(!pru_fw_ok){
+		printf("WARNING: PRU firmware doesn't match this library, reinstall it\n");
+	}
+	reset_heartbeats();
+
+	// restarts hung PRUs in the background so the servo calls never have to
+	if(pru_fw_ok && !watchdog_started){
+		if(pthread_create(&watchdog_thread, NULL, watchdog_func, NULL)){
+			printf("WARNING: failed to start PRU watchdog thread\n");
+		}
+		else watchdog_started = 1;
+	}
 
 	// zero out 4th encoder, eQEP encoders are already zero'd previously
 	rc_set_encoder_pos(4,0);
@@ -180,7 +301,11 @@ int set_pru_encoder_pos(int val){
 * 
 * Sends a single pulse of duration us (microseconds) to a single channel (ch)
 * This must be called regularly (>40hz) to keep servo or ESC awake.
-* returns -2 on fatal error (if the PRU is not set up or channel out of bounds)
+* In continuous mode it instead sets the width the PRU sends every frame from
+* the next frame on, and counts as the host checking in for the failsafe.
+* The _all functions update every channel for the same frame.
+* returns -2 on fatal error (if the PRU is not set up, has stopped responding
+* or channel out of bounds)
 * returns -1 if the pulse was not sent because a pulse is already going
 * returns 0 if all went well.
 *******************************************************************************/
@@ -194,6 +319,14 @@ int rc_send_servo_pulse_us(int ch, int us){
 		return -2;
 	}
 
+	if(servo_continuous){
+		if(maybe_check_pru()) return -2;
+		if(set_servo_width(servo_target, ch, us)) return -2;
+		if(!servo_batch) publish_servo_targets();
+		TRACE_POINT(TRACE_SERVO_WRITE, ch);
+		return 0;
+	}
+
 	// first check to make sure no pulse is currently being sent
 	if(prusharedMem_32int_ptr[ch-1] != 0){
 		printf("WARNING: Tried to start a new pulse amidst another\n");
@@ -204,6 +337,7 @@ int rc_send_servo_pulse_us(int ch, int us){
 	unsigned int num_loops = ((us*200.0)/PRU_SERVO_LOOP_INSTRUCTIONS); 
 	// write to PRU shared memory
 	prusharedMem_32int_ptr[ch-1] = num_loops;
+	TRACE_POINT(TRACE_SERVO_WRITE, ch);
 	return 0;
 }
 
@@ -216,11 +350,16 @@ int rc_send_servo_pulse_us(int ch, int us){
 int rc_send_servo_pulse_us_all(int us){
 	int i, ret_ch;
 	int ret = 0;
+	begin_servo_batch();
 	for(i=1;i<=SERVO_CHANNELS; i++){
 		ret_ch = rc_send_servo_pulse_us(i, us);
-		if(ret_ch == -2) return -2;
+		if(ret_ch == -2){
+			ret = -2;
+			break;
+		}
 		else if(ret_ch == -1) ret=-1;
 	}
+	end_servo_batch(ret!=-2);
 	return ret;
 }
 
@@ -250,11 +389,16 @@ int rc_send_servo_pulse_normalized(int ch, float input){
 int rc_send_servo_pulse_normalized_all(float input){
 	int i, ret_ch;
 	int ret = 0;
+	begin_servo_batch();
 	for(i=1;i<=SERVO_CHANNELS; i++){
 		ret_ch = rc_send_servo_pulse_normalized(i, input);
-		if(ret_ch == -2) return -2;
+		if(ret_ch == -2){
+			ret = -2;
+			break;
+		}
 		else if(ret_ch == -1) ret=-1;
 	}
+	end_servo_batch(ret!=-2);
 	return ret;
 }
 
@@ -285,11 +429,16 @@ int rc_send_esc_pulse_normalized(int ch, float input){
 int rc_send_esc_pulse_normalized_all(float input){
 	int i, ret_ch;
 	int ret = 0;
+	begin_servo_batch();
 	for(i=1;i<=SERVO_CHANNELS; i++){
 		ret_ch = rc_send_esc_pulse_normalized(i, input);
-		if(ret_ch == -2) return -2;
+		if(ret_ch == -2){
+			ret = -2;
+			break;
+		}
 		else if(ret_ch == -1) ret=-1;
 	}
+	end_servo_batch(ret!=-2);
 	return ret;
 }
 
@@ -321,10 +470,566 @@ int rc_send_oneshot_pulse_normalized(int ch, float input){
 int rc_send_oneshot_pulse_normalized_all(float input){
 	int i, ret_ch;
 	int ret = 0;
+	begin_servo_batch();
 	for(i=1;i<=SERVO_CHANNELS; i++){
 		ret_ch = rc_send_oneshot_pulse_normalized(i, input);
-		if(ret_ch == -2) return -2;
+		if(ret_ch == -2){
+			ret = -2;
+			break;
+		}
 		else if(ret_ch == -1) ret=-1;
 	}
+	end_servo_batch(ret!=-2);
+	return ret;
+}
+
+
+/*******************************************************************************
+* int rc_send_servo_pulses_us(const int us[8])
+*
+* Sends a different width to each channel, in continuous mode they all change
+* on the same frame or not at all if one of them is invalid.
+*******************************************************************************/
+int rc_send_servo_pulses_us(const int us[SERVO_CHANNELS]){
+	int i, ret_ch;
+	int ret = 0;
+	begin_servo_batch();
+	for(i=1;i<=SERVO_CHANNELS; i++){
+		ret_ch = rc_send_servo_pulse_us(i, us[i-1]);
+		if(ret_ch == -2){
+			ret = -2;
+			break;
+		}
+		else if(ret_ch == -1) ret=-1;
+	}
+	end_servo_batch(ret!=-2);
+	return ret;
+}
+
+/*******************************************************************************
+* int rc_servo_start_continuous(double frame_hz, int timeout_ms)
+*
+* Has the PRU send a pulse on every channel frame_hz times a second on its own
+* using the widths last given to rc_send_servo_pulse_us() and the functions
+* built on it. Channels start with no pulse. If those functions aren't called
+* for timeout_ms the PRU switches to the failsafe widths until they are, a
+* timeout of 0 disables this.
+*******************************************************************************/
+int rc_servo_start_continuous(double frame_hz, int timeout_ms){
+	int i;
+	uint32_t period;
+	if(prusharedMem_32int_ptr == NULL){
+		printf("ERROR: PRU servo Controller not initialized\n");
+		return -1;
+	}
+	if(!pru_fw_ok){
+		printf("ERROR: PRU firmware doesn't support continuous servo mode\n");
+		return -1;
+	}
+	if(frame_hz<SERVO_MIN_FRAME_HZ || frame_hz>SERVO_MAX_FRAME_HZ){
+		printf("ERROR: servo frame rate must be between %g and %g\n",\
+						SERVO_MIN_FRAME_HZ, SERVO_MAX_FRAME_HZ);
+		return -1;
+	}
+	if(timeout_ms<0){
+		printf("ERROR: servo failsafe timeout must be >=0\n");
+		return -1;
+	}
+	period = (uint32_t)((200000000.0/PRU_SERVO_LOOP_INSTRUCTIONS)/frame_hz);
+	for(i=0;i<SERVO_CHANNELS;i++){
+		if(servo_failsafe[i]+2>=period){
+			printf("ERROR: channel %d failsafe pulse doesn't fit in the frame\n",i+1);
+			return -1;
+		}
+	}
+	servo_period = period;
+	servo_timeout = (uint32_t)ceil(timeout_ms*frame_hz/1000.0);
+	memset(servo_target, 0, sizeof(servo_target));
+	write_servo_block();
+	servo_continuous = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_servo_stop_continuous()
+*
+* Goes back to single pulses from rc_send_servo_pulse_us(). The PRU may finish
+* the current frame.
+*******************************************************************************/
+int rc_servo_stop_continuous(){
+	if(!servo_continuous) return 0;
+	prusharedMem_32int_ptr[SERVO_PERIOD] = 0;
+	memset(servo_target, 0, sizeof(servo_target));
+	publish_servo_targets();
+	servo_continuous = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_servo_set_failsafe_us(int ch, int us)
+*
+* Width sent on a channel while in failsafe, 0 (the default) sends nothing
+* which most ESCs treat as signal loss and disarm.
+*******************************************************************************/
+int rc_servo_set_failsafe_us(int ch, int us){
+	if(ch<1 || ch>SERVO_CHANNELS){
+		printf("ERROR: Servo Channel must be between 1&%d\n", SERVO_CHANNELS);
+		return -1;
+	}
+	if(prusharedMem_32int_ptr == NULL){
+		printf("ERROR: PRU servo Controller not initialized\n");
+		return -1;
+	}
+	if(set_servo_width(servo_failsafe, ch, us)) return -1;
+	prusharedMem_32int_ptr[SERVO_FAILSAFE+ch-1] = servo_failsafe[ch-1];
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_servo_in_failsafe()
+*
+* returns 1 if the PRU is sending the failsafe widths, 0 if not
+*******************************************************************************/
+int rc_servo_in_failsafe(){
+	if(prusharedMem_32int_ptr == NULL || !servo_continuous) return 0;
+	return prusharedMem_32int_ptr[SERVO_FAILSAFE_ON]!=0;
+}
+
+/*******************************************************************************
+* int rc_pru_check()
+*
+* Restarts the PRUs if either heartbeat has stopped. PRU1 beats at least every
+* 100ms, PRU0 only beats on samples so it is only watched while the sampler
+* runs. Returns 0 if both are fine, 1 if they were restarted and -1 if the
+* firmware isn't usable or the restart failed. A restart blocks for up to
+* PRU_BOOT_TIMEOUT_US so this belongs in a slow loop, never a control loop.
+* The watchdog thread calls it every PRU_CHECK_NS.
+*******************************************************************************/
+int rc_pru_check(){
+	int stalled, ret = 0;
+	if(prusharedMem_32int_ptr == NULL || !pru_fw_ok) return -1;
+	pthread_mutex_lock(&check_mutex);
+	stalled = detect_stall();
+	if(stalled){
+		printf("WARNING: PRU%s stopped responding, restarting\n", \
+					stalled==3 ? "0 and PRU1" : (stalled==1 ? "0" : "1"));
+		ret = recover_pru() ? -1 : 1;
+	}
+	pthread_mutex_unlock(&check_mutex);
 	return ret;
 }
+
+/*******************************************************************************
+* int stop_pru_watchdog()
+*
+* Waits for the watchdog thread to see the EXITING state and leave, which
+* may take as long as a restart it is in the middle of.
+*******************************************************************************/
+int stop_pru_watchdog(){
+	int ret = 0;
+	if(!watchdog_started) return 0;
+
+	//allow up to 3 seconds for thread cleanup
+	struct timespec thread_timeout;
+	clock_gettime(CLOCK_REALTIME, &thread_timeout);
+	thread_timeout.tv_sec += 3;
+	int thread_err = 0;
+	thread_err = pthread_timedjoin_np(watchdog_thread, NULL, &thread_timeout);
+	if(thread_err == ETIMEDOUT){
+		printf("WARNING: PRU watchdog thread exit timeout\n");
+		ret = -1;
+	}
+	watchdog_started = 0;
+	return ret;
+}
+
+/*******************************************************************************
+* static void* watchdog_func(void* ptr)
+*
+* Background thread started by initialize_pru(). It runs at normal priority,
+* below the real-time threads, and restarts the PRUs when a heartbeat stops.
+* After a failed restart it waits PRU_RETRY_US before trying again.
+*******************************************************************************/
+static void* watchdog_func(__unused void* ptr){
+	while(rc_get_state()!=EXITING){
+		rc_usleep(PRU_CHECK_NS/1000);
+		if(rc_get_state()==EXITING) break;
+		if(rc_pru_check()<0 && pru_stalled) rc_usleep(PRU_RETRY_US);
+	}
+	return NULL;
+}
+
+/*******************************************************************************
+* static int detect_stall()
+*
+* Compares the heartbeats with the last look at them and returns the bits of
+* the PRUs that stopped. The bits stay set until recover_pru() succeeds.
+*******************************************************************************/
+static int detect_stall(){
+	uint64_t now, limit;
+	uint32_t hb;
+	int i;
+	now = monotonic_nanos();
+	last_check_ns = now;
+	for(i=0;i<2;i++){
+		hb = prusharedMem_32int_ptr[i ? PRU1_HEARTBEAT : PRU0_HEARTBEAT];
+		if(hb!=last_heartbeat[i] || (i==0 && !sampler_running)){
+			last_heartbeat[i] = hb;
+			heartbeat_ns[i] = now;
+			continue;
+		}
+		limit = PRU_STALL_NS;
+		// slow sample rates beat slowly
+		if(i==0 && 4ULL*sampler_period*PRU_NS_PER_CLK>limit){
+			limit = 4ULL*sampler_period*PRU_NS_PER_CLK;
+		}
+		if(now-heartbeat_ns[i]>limit) pru_stalled |= 1<<i;
+	}
+	return pru_stalled;
+}
+
+/*******************************************************************************
+* static int wait_for_pru_boot(int wait_pru0)
+*
+* Waits for PRU1 to write the header and optionally for PRU0 to clear the
+* heartbeat that was set to 0xFFFFFFFF before it was restarted.
+*******************************************************************************/
+static int wait_for_pru_boot(int wait_pru0){
+	volatile unsigned int* shm = prusharedMem_32int_ptr;
+	int waited;
+	for(waited=0; waited<PRU_BOOT_TIMEOUT_US; waited+=1000){
+		if(shm[PRU_MAGIC_WORD]==PRU_MAGIC && \
+			(!wait_pru0 || shm[PRU0_HEARTBEAT]!=0xFFFFFFFF)){
+			break;
+		}
+		usleep(1000);
+	}
+	if(shm[PRU_MAGIC_WORD]!=PRU_MAGIC) return -1;
+	if(shm[PRU_VERSION_WORD]!=PRU_FW_VERSION){
+		printf("ERROR: PRU firmware version %d, library needs %d\n", \
+					shm[PRU_VERSION_WORD], PRU_FW_VERSION);
+		return -1;
+	}
+	if(wait_pru0 && shm[PRU0_HEARTBEAT]==0xFFFFFFFF) return -1;
+	return 0;
+}
+
+/*******************************************************************************
+* static int recover_pru()
+*
+* Reloads both PRUs and puts back what their firmware resets on boot. The
+* sampler keeps going since its state is all in shared memory and the IEP.
+*******************************************************************************/
+static int recover_pru(){
+	int pos = get_pru_encoder_pos();
+	prusharedMem_32int_ptr[PRU_MAGIC_WORD] = 0;
+	prusharedMem_32int_ptr[PRU0_HEARTBEAT] = 0xFFFFFFFF;
+	if(restart_pru() || wait_for_pru_boot(1)){
+		printf("ERROR: PRU didn't come back after restart\n");
+		return -1;
+	}
+	set_pru_encoder_pos(pos);
+	if(servo_continuous) write_servo_block();
+	reset_heartbeats();
+	pru_stalled = 0;
+	stall_warned = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* static void reset_heartbeats()
+*******************************************************************************/
+static void reset_heartbeats(){
+	uint64_t now = monotonic_nanos();
+	last_heartbeat[0] = prusharedMem_32int_ptr[PRU0_HEARTBEAT];
+	last_heartbeat[1] = prusharedMem_32int_ptr[PRU1_HEARTBEAT];
+	heartbeat_ns[0] = now;
+	heartbeat_ns[1] = now;
+	last_check_ns = now;
+}
+
+/*******************************************************************************
+* static int maybe_check_pru()
+*
+* Called from the frequently used functions. The watchdog thread does the
+* detecting and restarting, this only returns -1 while a PRU it found hung
+* hasn't been brought back, so the hot paths never block on a restart.
+*******************************************************************************/
+static int maybe_check_pru(){
+	if(!pru_fw_ok || !pru_stalled) return 0;
+	if(!stall_warned){
+		printf("WARNING: PRU stopped responding, waiting for the watchdog to restart it\n");
+		stall_warned = 1;
+	}
+	return -1;
+}
+
+/*******************************************************************************
+* static int set_servo_width(uint32_t* table, int ch, int us)
+*
+* writes a width into the target or failsafe table. A pulse has to end with
+* at least one loop to spare in the frame or the PRU would still be sending it
+* when the next frame starts.
+*******************************************************************************/
+static int set_servo_width(uint32_t* table, int ch, int us){
+	unsigned int num_loops;
+	if(us<0){
+		printf("ERROR: servo pulse width must be >=0\n");
+		return -1;
+	}
+	num_loops = ((us*200.0)/PRU_SERVO_LOOP_INSTRUCTIONS);
+	if(servo_continuous && num_loops+2>=servo_period){
+		printf("ERROR: %dus servo pulse doesn't fit in the frame\n", us);
+		return -1;
+	}
+	table[ch-1] = num_loops;
+	return 0;
+}
+
+/*******************************************************************************
+* static void publish_servo_targets()
+*
+* Fills the command buffer the PRU isn't using and then bumps the sequence
+* number to hand it over. The PRU rechecks the sequence number after copying
+* a buffer so it never uses one that was being rewritten.
+*******************************************************************************/
+static void publish_servo_targets(){
+	uint32_t seq = servo_seq+1;
+	volatile unsigned int* buf = prusharedMem_32int_ptr + SERVO_CMD0 \
+										+ (seq&1)*SERVO_CHANNELS;
+	int i;
+	for(i=0;i<SERVO_CHANNELS;i++) buf[i] = servo_target[i];
+	__sync_synchronize();
+	prusharedMem_32int_ptr[SERVO_SEQ] = seq;
+	servo_seq = seq;
+}
+
+/*******************************************************************************
+* static void write_servo_block()
+*
+* writes all the continuous mode settings, the frame period goes last since
+* it turns continuous mode on
+*******************************************************************************/
+static void write_servo_block(){
+	int i;
+	prusharedMem_32int_ptr[SERVO_PERIOD] = 0;
+	prusharedMem_32int_ptr[SERVO_TIMEOUT] = servo_timeout;
+	for(i=0;i<SERVO_CHANNELS;i++){
+		prusharedMem_32int_ptr[SERVO_FAILSAFE+i] = servo_failsafe[i];
+	}
+	publish_servo_targets();
+	__sync_synchronize();
+	prusharedMem_32int_ptr[SERVO_PERIOD] = servo_period;
+}
+
+/*******************************************************************************
+* static void begin_servo_batch()
+* static void end_servo_batch(int ok)
+*
+* Collect the channel updates of one call into a single publish. If any
+* channel failed the targets are put back as they were.
+*******************************************************************************/
+static void begin_servo_batch(){
+	memcpy(servo_saved, servo_target, sizeof(servo_target));
+	servo_batch = 1;
+}
+
+static void end_servo_batch(int ok){
+	servo_batch = 0;
+	if(!servo_continuous) return;
+	if(ok) publish_servo_targets();
+	else memcpy(servo_target, servo_saved, sizeof(servo_target));
+}
+
+/*******************************************************************************
+* static uint64_t monotonic_nanos()
+*
+* heartbeat ages are real time even if rc_nanos_since_boot() is redirected
+*******************************************************************************/
+static uint64_t monotonic_nanos(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec*1000000000ULL) + ts.tv_nsec;
+}
+
+/*******************************************************************************
+* int rc_pru_sampler_start(double rate_hz)
+*
+* Has pru0 record the 4th encoder count and ADC channels 0-7 rate_hz times per
+* second into the shared memory ring. The PRU is paced by its IEP timer so
+* there is no ARM scheduling jitter. The ADC sequencer is put in continuous
+* mode to sweep the channels slightly faster than the sample rate and the PRU
+* empties FIFO1 on every sample, so this can't run together with
+* rc_adc_start_continuous(). Waits for the first few records to check the
+* firmware is filling them in, which takes about 3 sample periods.
+*******************************************************************************/
+int rc_pru_sampler_start(double rate_hz){
+	int clk, avg;
+	double sweep_hz, delay;
+	if(prusharedMem_32int_ptr == NULL){
+		printf("ERROR: PRU not initialized\n");
+		return -1;
+	}
+	if(!pru_fw_ok){
+		printf("ERROR: PRU firmware doesn't support the sampler\n");
+		return -1;
+	}
+	if(sampler_running){
+		printf("ERROR: PRU sampler already running\n");
+		return -1;
+	}
+	if(rate_hz<SAMPLER_MIN_HZ || rate_hz>SAMPLER_MAX_HZ){
+		printf("ERROR: PRU sampler rate must be between %g and %g\n",\
+						SAMPLER_MIN_HZ, SAMPLER_MAX_HZ);
+		return -1;
+	}
+
+	// average conversions only if the ADC is fast enough to do so
+	clk = mmap_adc_clock_hz();
+	if(clk<=0){
+		printf("ERROR: PRU sampler can't access ADC\n");
+		return -1;
+	}
+	sweep_hz = rate_hz*SAMPLER_ADC_MARGIN;
+	avg = (clk/(8*ADC_AVERAGES*ADC_SAMPLE_CLKS) >= sweep_hz);
+	delay = clk/(sweep_hz*8) - (avg ? ADC_AVERAGES : 1)*ADC_SAMPLE_CLKS;
+	if(delay<0.0) delay = 0.0;
+
+	// stop the timer before touching the ring so the PRU leaves it alone
+	pru_iep_ptr[IEP_GLB_CFG] = 0;
+	pru_iep_ptr[IEP_CMP_CFG] = 0;
+	pru_iep_ptr[IEP_CMP_STS] = 1;
+	memset(prusharedMem_32int_ptr + SAMPLER_HEAD/4, 0, SAMPLER_RING-SAMPLER_HEAD);
+	if(mmap_adc_start_continuous((uint32_t)delay, avg)) return -1;
+
+	sampler_period = (uint32_t)(PRU_CLK_HZ/rate_hz + 0.5);
+	sampler_tail = 0;
+	sampler_dropped = 0;
+	pru_iep_ptr[IEP_CNT] = 0;
+	// count runs 0 to CMP0 inclusive
+	pru_iep_ptr[IEP_CMP0] = sampler_period-1;
+	pru_iep_ptr[IEP_CMP_CFG] = IEP_CMP0_RESET | IEP_CMP0_ENABLE;
+	sampler_start_ns = rc_nanos_since_boot();
+	pru_iep_ptr[IEP_GLB_CFG] = IEP_DEFAULT_INC | IEP_CNT_ENABLE;
+	sampler_running = 1;
+	reset_heartbeats();
+	if(check_sampler()){
+		rc_pru_sampler_stop();
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* static int check_sampler()
+*
+* Start up test of the PRU0 sampler loop. The first records must be published
+* in order with their own sequence number, and from the second one on the PRU
+* must have drained ADC words from FIFO1. If it drained words but mapped none
+* of them to a channel the step id decoding in the firmware is wrong, which
+* only gets a warning as the inputs could all really read 0. The records stay
+* in the ring for rc_pru_sampler_read().
+*******************************************************************************/
+static int check_sampler(){
+	volatile uint32_t* shm = prusharedMem_32int_ptr;
+	volatile uint32_t* rec;
+	uint64_t deadline;
+	uint32_t i, latest = 0;
+	deadline = monotonic_nanos() + SAMPLER_CHECK_NS + \
+			(uint64_t)SAMPLER_CHECK_RECS*sampler_period*PRU_NS_PER_CLK;
+	while(shm[SAMPLER_HEAD/4]<SAMPLER_CHECK_RECS){
+		if(monotonic_nanos()>deadline){
+			printf("ERROR: PRU sampler isn't publishing samples, check the PRU firmware\n");
+			return -1;
+		}
+		rc_usleep(1000);
+	}
+	for(i=0;i<SAMPLER_CHECK_RECS;i++){
+		rec = shm + (SAMPLER_RING/4) + i*SAMPLER_REC_WORDS;
+		if(rec[0]!=i || (i>0 && rec[SAMPLER_REC_WORDS-1]==0)){
+			printf("ERROR: PRU sampler record %d is malformed, check the PRU firmware\n", i);
+			return -1;
+		}
+	}
+	for(i=0;i<4;i++) latest |= shm[SAMPLER_LATEST/4+i];
+	if(latest==0){
+		printf("WARNING: PRU sampler got ADC data but no channel was updated\n");
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_pru_sampler_stop()
+*******************************************************************************/
+int rc_pru_sampler_stop(){
+	if(!sampler_running) return 0;
+	pru_iep_ptr[IEP_GLB_CFG] = 0;
+	pru_iep_ptr[IEP_CMP_CFG] = 0;
+	pru_iep_ptr[IEP_CMP_STS] = 1;
+	sampler_running = 0;
+	return mmap_adc_stop_continuous();
+}
+
+/*******************************************************************************
+* int rc_pru_sampler_read(rc_pru_sample_t* buf, int max)
+*
+* Copies up to max samples the PRU has written since the last call, oldest
+* first, and returns how many were copied. The PRU only publishes a record
+* after writing all of it, and a record is only kept if the PRU hasn't come
+* back around the ring to overwrite it by the time it has been copied.
+* Samples lost either way are counted by rc_pru_sampler_get_dropped().
+* Returns -1 once the PRU stopped and every sample it took has been read.
+*******************************************************************************/
+int rc_pru_sampler_read(rc_pru_sample_t* buf, int max){
+	volatile uint32_t* head = prusharedMem_32int_ptr + SAMPLER_HEAD/4;
+	volatile uint32_t* rec;
+	uint32_t h, idx, w[SAMPLER_REC_WORDS];
+	int i, n = 0;
+	if(!sampler_running){
+		printf("ERROR: PRU sampler not running\n");
+		return -1;
+	}
+	if(buf==NULL || max<0){
+		printf("ERROR: in rc_pru_sampler_read, invalid argument\n");
+		return -1;
+	}
+	h = *head;
+	if(h-sampler_tail > SAMPLER_LEN){
+		sampler_dropped += h - sampler_tail - SAMPLER_LEN;
+		sampler_tail = h - SAMPLER_LEN;
+	}
+	__sync_synchronize();
+	while(sampler_tail!=h && n<max){
+		idx = sampler_tail++;
+		rec = prusharedMem_32int_ptr + (SAMPLER_RING/4) \
+						+ (idx%SAMPLER_LEN)*SAMPLER_REC_WORDS;
+		for(i=0;i<SAMPLER_REC_WORDS;i++) w[i] = rec[i];
+		__sync_synchronize();
+		// the slot is reused once the head reaches idx+SAMPLER_LEN
+		if(*head-idx >= SAMPLER_LEN || w[0]!=idx){
+			sampler_dropped++;
+			continue;
+		}
+		buf[n].seq = w[0];
+		buf[n].t_ns = sampler_start_ns + ((uint64_t)w[0]*sampler_period \
+						+ w[1])*PRU_NS_PER_CLK;
+		buf[n].encoder = (int32_t)w[2];
+		for(i=0;i<8;i++){
+			buf[n].adc[i] = (w[3+i/2] >> (16*(i%2))) & 0xFFF;
+		}
+		n++;
+	}
+	// samples taken before a stall are still good, hand those out first
+	if(maybe_check_pru() && n==0) return -1;
+	return n;
+}
+
+/*******************************************************************************
+* uint64_t rc_pru_sampler_get_dropped()
+*
+* number of samples that were overwritten before rc_pru_sampler_read() got to
+* them since rc_pru_sampler_start()
+*******************************************************************************/
+uint64_t rc_pru_sampler_get_dropped(){
+	return sampler_dropped;
+}
@@ -16,6 +16,14 @@ int initialize_pru();
 *******************************************************************************/
 int restart_pru();
 
+/*******************************************************************************
+* int stop_pru_watchdog()
+*
+* Joins the thread started by initialize_pru() that restarts hung PRUs. It
+* leaves once the state is EXITING. Return 0 on success, -1 on timeout.
+*******************************************************************************/
+int stop_pru_watchdog();
+
 /*******************************************************************************
 * int get_pru_encoder_pos();
 * 
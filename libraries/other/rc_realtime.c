@@ -0,0 +1,403 @@
+/*******************************************************************************
+* rc_realtime.c
+*
+* Optional real-time profile applied by rc_initialize(). Locks the process
+* memory, prefaults the heap and thread stacks so first-touch page faults
+* happen during initialization instead of while motors are running, pins the
+* cpu frequency and sets scheduling and affinity of the library threads.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include "../roboticscape.h"
+#include "../preprocessor_macros.h"
+#include "rc_realtime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#define GOVERNOR_PATH	"/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor"
+#define SETSPEED_PATH	"/sys/devices/system/cpu/cpu0/cpufreq/scaling_setspeed"
+#define SYSFS_WORD_LEN	32
+#define MAX_RT_THREADS	8
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+static rc_rt_profile_t profile;
+static int profile_enabled = 0;
+static int memory_locked = 0;
+static int governor_changed = 0;
+static char saved_governor[SYSFS_WORD_LEN];	// governor before the profile, "" if unknown
+static char saved_setspeed[SYSFS_WORD_LEN];	// its frequency when it was userspace
+static long minflt_base, majflt_base;
+
+typedef struct rt_thread_record_t{
+	rt_thread_t which;
+	pthread_t thread;
+	int priority;
+	int cpu;
+} rt_thread_record_t;
+
+static rt_thread_record_t threads[MAX_RT_THREADS];
+static int num_threads = 0;
+static pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* thread_names[] = {"imu", "dsm", "buttons", "uart"};
+
+/*******************************************************************************
+* Local Function Declarations
+*******************************************************************************/
+static void __noinline prefault_stack(int kb);
+static void touch_pages(volatile char* buf, size_t bytes);
+static void get_fault_counts(long* minflt, long* majflt);
+static int read_sysfs_word(const char* path, char* buf);
+static int write_sysfs_word(const char* path, const char* buf);
+
+/*******************************************************************************
+* rc_rt_profile_t rc_default_rt_profile()
+*
+* returns a profile suitable for a single-core Beaglebone running a control
+* loop off the IMU interrupt
+*******************************************************************************/
+rc_rt_profile_t rc_default_rt_profile(){
+	rc_rt_profile_t p;
+	p.lock_memory = 1;
+	p.prefault_stack_kb = 64;
+	p.prefault_heap_kb = 1024;
+	p.cpu = 0;
+	p.dsm_priority = sched_get_priority_max(SCHED_FIFO)-10;
+	p.button_priority = sched_get_priority_max(SCHED_FIFO)-20;
+	p.cpu_freq = FREQ_1000MHZ;
+	return p;
+}
+
+/*******************************************************************************
+* int rc_enable_rt_profile(rc_rt_profile_t p)
+*
+* Enables the profile. Must be called before rc_initialize() which applies it.
+*******************************************************************************/
+int rc_enable_rt_profile(rc_rt_profile_t p){
+	if(p.prefault_stack_kb<0 || p.prefault_heap_kb<0){
+		fprintf(stderr,"ERROR in rc_enable_rt_profile, prefault sizes must be >=0\n");
+		return -1;
+	}
+	if(p.dsm_priority<0 || p.dsm_priority>sched_get_priority_max(SCHED_FIFO) \
+		|| p.button_priority<0 \
+		|| p.button_priority>sched_get_priority_max(SCHED_FIFO)){
+		fprintf(stderr,"ERROR in rc_enable_rt_profile, invalid priority\n");
+		return -1;
+	}
+	profile = p;
+	profile_enabled = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_disable_rt_profile()
+*
+* Stops the profile from being applied by later calls to rc_initialize() and
+* to threads started from now on. Does not unlock memory already locked.
+*******************************************************************************/
+int rc_disable_rt_profile(){
+	profile_enabled = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int apply_rt_profile()
+*
+* see rc_realtime.h
+*******************************************************************************/
+int apply_rt_profile(){
+	char* heap;
+	size_t heap_bytes;
+	cpu_set_t cpus;
+	int ret = 0;
+
+	if(!profile_enabled) return 0;
+
+	// keep freed memory in the process instead of returning it to the kernel
+	// and use a single arena so the prefaulted heap serves every thread
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+	mallopt(M_ARENA_MAX, 1);
+
+	if(profile.lock_memory){
+		if(mlockall(MCL_CURRENT|MCL_FUTURE)){
+			perror("WARNING: mlockall failed");
+			ret = -1;
+		}
+		else memory_locked = 1;
+	}
+
+	// touch every page of a heap block then free it back to the arena
+	if(profile.prefault_heap_kb>0){
+		heap_bytes = (size_t)profile.prefault_heap_kb*1024;
+		heap = malloc(heap_bytes);
+		if(heap==NULL){
+			fprintf(stderr,"WARNING: failed to prefault heap\n");
+			ret = -1;
+		}
+		else{
+			touch_pages(heap, heap_bytes);
+			free(heap);
+		}
+	}
+	prefault_stack(profile.prefault_stack_kb);
+
+	if(profile.cpu>=0){
+		CPU_ZERO(&cpus);
+		CPU_SET(profile.cpu, &cpus);
+		if(sched_setaffinity(0, sizeof(cpu_set_t), &cpus)){
+			perror("WARNING: failed to set cpu affinity");
+			ret = -1;
+		}
+	}
+
+	// a governor changing frequency stalls the cpu, pin it for the run
+	if(profile.cpu_freq!=FREQ_ONDEMAND){
+		// remember what was running to put it back at cleanup
+		saved_setspeed[0] = 0;
+		if(read_sysfs_word(GOVERNOR_PATH, saved_governor)) saved_governor[0] = 0;
+		else if(!strcmp(saved_governor, "userspace")){
+			read_sysfs_word(SETSPEED_PATH, saved_setspeed);
+		}
+		if(rc_set_cpu_freq(profile.cpu_freq)) ret = -1;
+		else governor_changed = 1;
+	}
+
+	rc_rt_reset_fault_count();
+	return ret;
+}
+
+/*******************************************************************************
+* int cleanup_rt_profile()
+*
+* see rc_realtime.h
+*******************************************************************************/
+int cleanup_rt_profile(){
+	if(!governor_changed) return 0;
+	governor_changed = 0;
+	if(saved_governor[0]==0) return rc_set_cpu_freq(FREQ_ONDEMAND);
+	if(write_sysfs_word(GOVERNOR_PATH, saved_governor)){
+		fprintf(stderr,"ERROR in cleanup_rt_profile, failed to restore cpu governor %s\n",\
+															saved_governor);
+		return -1;
+	}
+	if(saved_setspeed[0] && write_sysfs_word(SETSPEED_PATH, saved_setspeed)){
+		fprintf(stderr,"ERROR in cleanup_rt_profile, failed to restore cpu frequency\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int configure_rt_thread(rt_thread_t which, int priority)
+*
+* see rc_realtime.h
+*******************************************************************************/
+int configure_rt_thread(rt_thread_t which, int priority){
+	struct sched_param params;
+	cpu_set_t cpus;
+	int cpu = -1;
+	int ret = 0;
+
+	// the profile overrides the library default for threads it covers
+	if(profile_enabled){
+		if(which==RT_THREAD_DSM) priority = profile.dsm_priority;
+		else if(which==RT_THREAD_BUTTONS) priority = profile.button_priority;
+	}
+
+	if(priority>0){
+		params.sched_priority = priority;
+		if(pthread_setschedparam(pthread_self(), SCHED_FIFO, &params)) ret=-1;
+	}
+	if(profile_enabled){
+		cpu = profile.cpu;
+		if(cpu>=0){
+			CPU_ZERO(&cpus);
+			CPU_SET(cpu, &cpus);
+			if(pthread_setaffinity_np(pthread_self(),sizeof(cpu_set_t),&cpus)){
+				ret = -1;
+			}
+		}
+		prefault_stack(profile.prefault_stack_kb);
+	}
+
+	pthread_mutex_lock(&threads_mutex);
+	if(num_threads<MAX_RT_THREADS){
+		threads[num_threads].which = which;
+		threads[num_threads].thread = pthread_self();
+		threads[num_threads].priority = priority;
+		threads[num_threads].cpu = cpu;
+		num_threads++;
+	}
+	pthread_mutex_unlock(&threads_mutex);
+	return ret;
+}
+
+/*******************************************************************************
+* int release_rt_thread()
+*
+* see rc_realtime.h
+*******************************************************************************/
+int release_rt_thread(){
+	int i;
+	pthread_mutex_lock(&threads_mutex);
+	for(i=0;i<num_threads;i++){
+		if(pthread_equal(threads[i].thread, pthread_self())){
+			threads[i] = threads[num_threads-1];
+			num_threads--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&threads_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_rt_reset_fault_count()
+*
+* Starts counting page faults from now. Call this when arming so that
+* rc_rt_report() shows faults taken while running.
+*******************************************************************************/
+int rc_rt_reset_fault_count(){
+	get_fault_counts(&minflt_base, &majflt_base);
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_rt_report()
+*
+* Prints the real-time state of the process and returns the number of
+* violations found: memory not locked, page faults since the last
+* rc_rt_reset_fault_count(), library threads not running with the expected
+* policy, priority or affinity, and a cpu governor that can change frequency.
+*******************************************************************************/
+int rc_rt_report(){
+	int i, policy, violations = 0;
+	long minflt, majflt;
+	struct sched_param params;
+	cpu_set_t cpus;
+	char governor[32];
+	FILE* fd;
+
+	printf("real-time profile: %s\n", profile_enabled ? "enabled":"disabled");
+
+	printf("  memory locked: %s\n", memory_locked ? "yes":"NO");
+	if(profile_enabled && profile.lock_memory && !memory_locked) violations++;
+
+	get_fault_counts(&minflt, &majflt);
+	printf("  page faults since reset: %ld minor, %ld major\n", \
+							minflt-minflt_base, majflt-majflt_base);
+	if(majflt>majflt_base || (memory_locked && minflt>minflt_base)){
+		violations++;
+	}
+
+	fd = fopen(GOVERNOR_PATH, "r");
+	if(fd!=NULL){
+		if(fscanf(fd, "%31s", governor)==1){
+			printf("  cpu governor: %s\n", governor);
+			if(profile_enabled && strcmp(governor,"userspace") && \
+										strcmp(governor,"performance")){
+				violations++;
+			}
+		}
+		fclose(fd);
+	}
+
+	pthread_mutex_lock(&threads_mutex);
+	for(i=0;i<num_threads;i++){
+		if(pthread_getschedparam(threads[i].thread, &policy, &params)) continue;
+		printf("  %-8s thread: %s prio %d", thread_names[threads[i].which], \
+			policy==SCHED_FIFO ? "FIFO":"OTHER", params.sched_priority);
+		if(threads[i].priority>0 && (policy!=SCHED_FIFO || \
+						params.sched_priority!=threads[i].priority)){
+			printf(" (expected FIFO prio %d)", threads[i].priority);
+			violations++;
+		}
+		if(threads[i].cpu>=0 && pthread_getaffinity_np(threads[i].thread, \
+								sizeof(cpu_set_t), &cpus)==0){
+			if(!CPU_ISSET(threads[i].cpu, &cpus) || CPU_COUNT(&cpus)!=1){
+				printf(" (not pinned to cpu %d)", threads[i].cpu);
+				violations++;
+			}
+		}
+		printf("\n");
+	}
+	pthread_mutex_unlock(&threads_mutex);
+
+	printf("  violations: %d\n", violations);
+	return violations;
+}
+
+/*******************************************************************************
+* static void prefault_stack(int kb)
+*
+* Touches kb kilobytes of the calling thread's stack so those pages are mapped
+* and, with mlockall(MCL_FUTURE), locked before the thread does real work.
+*******************************************************************************/
+static void __noinline prefault_stack(int kb){
+	if(kb<=0) return;
+	volatile char buf[kb*1024];
+	touch_pages(buf, sizeof(buf));
+	return;
+}
+
+/*******************************************************************************
+* static void touch_pages(volatile char* buf, size_t bytes)
+*
+* Writes one byte in every page of buf. A memset of memory that is freed or
+* goes out of scope right after is a dead store the compiler may delete, the
+* volatile stores here can't be.
+*******************************************************************************/
+static void touch_pages(volatile char* buf, size_t bytes){
+	size_t i, page = (size_t)sysconf(_SC_PAGESIZE);
+	for(i=0;i<bytes;i+=page) buf[i] = 0;
+	if(bytes>0) buf[bytes-1] = 0;
+	return;
+}
+
+/*******************************************************************************
+* static void get_fault_counts(long* minflt, long* majflt)
+*
+* reads the process page fault counters
+*******************************************************************************/
+static void get_fault_counts(long* minflt, long* majflt){
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	*minflt = usage.ru_minflt;
+	*majflt = usage.ru_majflt;
+	return;
+}
+
+/*******************************************************************************
+* static int read_sysfs_word(const char* path, char* buf)
+*
+* reads the first word of a sysfs attribute into buf of SYSFS_WORD_LEN bytes
+*******************************************************************************/
+static int read_sysfs_word(const char* path, char* buf){
+	FILE* fd = fopen(path, "r");
+	int ret;
+	if(fd==NULL) return -1;
+	ret = (fscanf(fd, "%31s", buf)==1) ? 0 : -1;
+	fclose(fd);
+	return ret;
+}
+
+/*******************************************************************************
+* static int write_sysfs_word(const char* path, const char* buf)
+*******************************************************************************/
+static int write_sysfs_word(const char* path, const char* buf){
+	FILE* fd = fopen(path, "w");
+	int ret;
+	if(fd==NULL) return -1;
+	ret = (fprintf(fd, "%s", buf)<0) ? -1 : 0;
+	if(fclose(fd)) ret = -1;
+	return ret;
+}
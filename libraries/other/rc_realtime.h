@@ -0,0 +1,58 @@
+/*******************************************************************************
+* rc_realtime.h
+*
+* function declarations used by rc_initialize() and the library's own
+* background threads to apply the optional real-time profile. The user-facing
+* functions are in roboticscape.h
+*******************************************************************************/
+
+#ifndef RC_REALTIME
+#define RC_REALTIME
+
+#include <pthread.h>
+
+// library threads that the real-time profile knows about
+typedef enum rt_thread_t{
+	RT_THREAD_IMU,
+	RT_THREAD_DSM,
+	RT_THREAD_BUTTONS,
+	RT_THREAD_UART
+} rt_thread_t;
+
+/*******************************************************************************
+* int apply_rt_profile()
+*
+* Called by rc_initialize(). If a profile was enabled with
+* rc_enable_rt_profile() this locks memory, prefaults the heap and the main
+* thread stack and pins the cpu frequency. Does nothing otherwise.
+*******************************************************************************/
+int apply_rt_profile();
+
+/*******************************************************************************
+* int cleanup_rt_profile()
+*
+* Called by rc_cleanup() to put back the cpu governor, and its frequency if
+* it was userspace, that was active before the profile changed it.
+*******************************************************************************/
+int cleanup_rt_profile();
+
+/*******************************************************************************
+* int configure_rt_thread(rt_thread_t which, int priority)
+*
+* Called at the top of each library thread. Registers the calling thread for
+* rc_rt_report() and applies SCHED_FIFO priority when priority>0. priority is
+* the library default for that thread which the profile overrides for the DSM
+* and button thread. When the profile is enabled this also applies the
+* profile's cpu affinity and prefaults the thread stack.
+*******************************************************************************/
+int configure_rt_thread(rt_thread_t which, int priority);
+
+/*******************************************************************************
+* int release_rt_thread()
+*
+* Called by a library thread right before it returns so rc_rt_report() no
+* longer looks at it.
+*******************************************************************************/
+int release_rt_thread();
+
+#endif // RC_REALTIME
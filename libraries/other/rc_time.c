@@ -6,11 +6,48 @@
 *******************************************************************************/
 
 #include "../roboticscape.h"
+#include "../preprocessor_macros.h"
+#include <stdio.h>
 #include <time.h>
 #include <sys/time.h> // for timeval
 #include <errno.h>
 #include <unistd.h> // for sysconf
 #include <stdint.h> // for uint64_t
+#include <pthread.h>
+
+#define MAX_VIRTUAL_SLEEPERS 32 // threads that may sit in rc_nanosleep at once
+
+/*******************************************************************************
+* Local Global Variables
+*
+* The active clock source. RC_CLOCK_REAL takes a fast path straight to the
+* kernel so the common case costs one predictable branch. The other modes
+* are described in roboticscape.h.
+*******************************************************************************/
+static rc_clock_mode_t clock_mode = RC_CLOCK_REAL;
+static rc_clock_t custom_clock;
+
+// accelerated mode, time = base + (real-real_base)*rate
+static double accel_rate = 1.0;
+static uint64_t accel_real_base_boot;
+static uint64_t accel_base_boot;
+static uint64_t accel_base_epoch;
+
+// virtual (discrete-event) mode, time only moves when the harness says so
+static pthread_mutex_t virt_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t virt_wake_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t virt_sleep_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t virt_now;
+static uint64_t virt_epoch_offset;
+static int virt_sleepers;
+static uint64_t virt_deadlines[MAX_VIRTUAL_SLEEPERS];
+
+/*******************************************************************************
+* Local Function Declarations
+*******************************************************************************/
+static void real_nanosleep(uint64_t ns);
+static uint64_t real_nanos(clockid_t clk);
+static void virtual_nanosleep(uint64_t ns);
 
 /*******************************************************************************
 * @ void rc_nanosleep(uint64_t ns)
@@ -21,14 +58,23 @@
 * by a signal. There is no upper limit on the time requested.
 *******************************************************************************/
 void rc_nanosleep(uint64_t ns){
-	struct timespec req,rem;
-	req.tv_sec = ns/1000000000;
-	req.tv_nsec = ns%1000000000;
-	// loop untill nanosleep sets an error or finishes successfully
-	errno=0; // reset errno to avoid false detection
-	while(nanosleep(&req, &rem) && errno==EINTR){
-		req.tv_sec = rem.tv_sec;
-		req.tv_nsec = rem.tv_nsec;
+	if(likely(clock_mode==RC_CLOCK_REAL)){
+		real_nanosleep(ns);
+		return;
+	}
+	switch(clock_mode){
+	case RC_CLOCK_ACCELERATED:
+		real_nanosleep((uint64_t)(ns/accel_rate));
+		break;
+	case RC_CLOCK_VIRTUAL:
+		virtual_nanosleep(ns);
+		break;
+	case RC_CLOCK_CUSTOM:
+		custom_clock.nanosleep(custom_clock.ctx, ns);
+		break;
+	default:
+		real_nanosleep(ns);
+		break;
 	}
 	return;
 }
@@ -44,7 +90,7 @@ void rc_nanosleep(uint64_t ns){
 * interrupted by a signal. There is no upper limit on the time requested.
 *******************************************************************************/
 void rc_usleep(unsigned int us){
-	rc_nanosleep(us*1000);
+	rc_nanosleep((uint64_t)us*1000);
 	return;
 }
 
@@ -96,9 +142,18 @@ uint64_t rc_timeval_to_millis(timeval tv){
 * circumstances.
 *******************************************************************************/
 uint64_t rc_nanos_since_epoch(){
-	struct timespec ts;
-	clock_gettime(CLOCK_REALTIME, &ts);
-	return ((uint64_t)ts.tv_sec*1000000000)+ts.tv_nsec;
+	if(likely(clock_mode==RC_CLOCK_REAL)) return real_nanos(CLOCK_REALTIME);
+	switch(clock_mode){
+	case RC_CLOCK_ACCELERATED:
+		return accel_base_epoch + (uint64_t)((real_nanos(CLOCK_MONOTONIC)\
+										- accel_real_base_boot)*accel_rate);
+	case RC_CLOCK_VIRTUAL:
+		return virt_epoch_offset + rc_nanos_since_boot();
+	case RC_CLOCK_CUSTOM:
+		return custom_clock.nanos_since_epoch(custom_clock.ctx);
+	default:
+		return real_nanos(CLOCK_REALTIME);
+	}
 }
 
 /*******************************************************************************
@@ -109,9 +164,22 @@ uint64_t rc_nanos_since_epoch(){
 * circumstances.
 *******************************************************************************/
 uint64_t rc_nanos_since_boot(){
-	struct timespec ts;
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	return ((uint64_t)ts.tv_sec*1000000000)+ts.tv_nsec;
+	uint64_t now;
+	if(likely(clock_mode==RC_CLOCK_REAL)) return real_nanos(CLOCK_MONOTONIC);
+	switch(clock_mode){
+	case RC_CLOCK_ACCELERATED:
+		return accel_base_boot + (uint64_t)((real_nanos(CLOCK_MONOTONIC)\
+										- accel_real_base_boot)*accel_rate);
+	case RC_CLOCK_VIRTUAL:
+		pthread_mutex_lock(&virt_mutex);
+		now = virt_now;
+		pthread_mutex_unlock(&virt_mutex);
+		return now;
+	case RC_CLOCK_CUSTOM:
+		return custom_clock.nanos_since_boot(custom_clock.ctx);
+	default:
+		return real_nanos(CLOCK_MONOTONIC);
+	}
 }
 
 /*******************************************************************************
@@ -186,4 +254,244 @@ void rc_timespec_add(timespec* start, double seconds){
 	return;
 }
 
+/*******************************************************************************
+* @ int rc_set_clock_real()
+*
+* Restores the normal kernel clocks. This is the default. Any threads parked
+* in a virtual sleep are released immediately.
+*******************************************************************************/
+int rc_set_clock_real(){
+	pthread_mutex_lock(&virt_mutex);
+	clock_mode = RC_CLOCK_REAL;
+	pthread_cond_broadcast(&virt_wake_cond);
+	pthread_mutex_unlock(&virt_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* @ int rc_set_clock_accelerated(double rate)
+*
+* Runs library time at rate times real time starting from the current time.
+* Sleeps are shortened by the same factor so timed loops keep their relative
+* timing while running faster than real time.
+*******************************************************************************/
+int rc_set_clock_accelerated(double rate){
+	if(rate<=0.0){
+		fprintf(stderr,"ERROR in rc_set_clock_accelerated, rate must be >0\n");
+		return -1;
+	}
+	// capture the base from whatever clock is currently active so time
+	// never jumps backwards when switching modes
+	accel_base_epoch = rc_nanos_since_epoch();
+	accel_base_boot = rc_nanos_since_boot();
+	accel_real_base_boot = real_nanos(CLOCK_MONOTONIC);
+	accel_rate = rate;
+	clock_mode = RC_CLOCK_ACCELERATED;
+	return 0;
+}
+
+/*******************************************************************************
+* @ int rc_set_clock_virtual(uint64_t start_ns)
+*
+* Switches to the discrete-event virtual clock. Time starts at start_ns
+* nanoseconds since boot and only moves forward when the caller advances it
+* with rc_virtual_clock_step() or rc_virtual_clock_advance(). Threads still
+* parked on an earlier virtual clock are released first and waited for, so
+* none of them is left with a deadline on the old timeline.
+*******************************************************************************/
+int rc_set_clock_virtual(uint64_t start_ns){
+	pthread_mutex_lock(&virt_mutex);
+	if(virt_sleepers>0){
+		clock_mode = RC_CLOCK_REAL;
+		pthread_cond_broadcast(&virt_wake_cond);
+		while(virt_sleepers>0) pthread_cond_wait(&virt_sleep_cond, &virt_mutex);
+	}
+	virt_epoch_offset = real_nanos(CLOCK_REALTIME) - start_ns;
+	virt_now = start_ns;
+	clock_mode = RC_CLOCK_VIRTUAL;
+	pthread_mutex_unlock(&virt_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* @ int rc_set_clock_custom(rc_clock_t clock)
+*
+* Installs a user-provided clock. All three function pointers must be set.
+*******************************************************************************/
+int rc_set_clock_custom(rc_clock_t clock){
+	if(clock.nanos_since_epoch==NULL || clock.nanos_since_boot==NULL || \
+												clock.nanosleep==NULL){
+		fprintf(stderr,"ERROR in rc_set_clock_custom, NULL function pointer\n");
+		return -1;
+	}
+	custom_clock = clock;
+	clock_mode = RC_CLOCK_CUSTOM;
+	return 0;
+}
 
+/*******************************************************************************
+* @ rc_clock_mode_t rc_get_clock_mode()
+*
+* Returns the currently active clock source.
+*******************************************************************************/
+rc_clock_mode_t rc_get_clock_mode(){
+	return clock_mode;
+}
+
+/*******************************************************************************
+* @ uint64_t rc_virtual_clock_next_event()
+*
+* Returns the earliest wake time of all threads parked in a virtual sleep, or
+* UINT64_MAX if no thread is sleeping.
+*******************************************************************************/
+uint64_t rc_virtual_clock_next_event(){
+	int i;
+	uint64_t next = UINT64_MAX;
+	pthread_mutex_lock(&virt_mutex);
+	for(i=0;i<virt_sleepers;i++){
+		if(virt_deadlines[i]<next) next = virt_deadlines[i];
+	}
+	pthread_mutex_unlock(&virt_mutex);
+	return next;
+}
+
+/*******************************************************************************
+* @ int rc_virtual_clock_step()
+*
+* Jumps virtual time to the next pending wake time and releases every thread
+* due at that time. Returns the number of threads released, 0 if nothing was
+* sleeping, or -1 if the virtual clock is not active.
+*******************************************************************************/
+int rc_virtual_clock_step(){
+	int i, woken = 0;
+	uint64_t next = UINT64_MAX;
+	if(clock_mode!=RC_CLOCK_VIRTUAL){
+		fprintf(stderr,"ERROR in rc_virtual_clock_step, virtual clock not active\n");
+		return -1;
+	}
+	pthread_mutex_lock(&virt_mutex);
+	for(i=0;i<virt_sleepers;i++){
+		if(virt_deadlines[i]<next) next = virt_deadlines[i];
+	}
+	if(next!=UINT64_MAX){
+		if(next>virt_now) virt_now = next;
+		for(i=0;i<virt_sleepers;i++){
+			if(virt_deadlines[i]<=virt_now) woken++;
+		}
+		pthread_cond_broadcast(&virt_wake_cond);
+	}
+	pthread_mutex_unlock(&virt_mutex);
+	return woken;
+}
+
+/*******************************************************************************
+* @ int rc_virtual_clock_advance(uint64_t ns)
+*
+* Moves virtual time forward by ns nanoseconds and releases every thread whose
+* wake time has passed. Returns -1 if the virtual clock is not active.
+*******************************************************************************/
+int rc_virtual_clock_advance(uint64_t ns){
+	if(clock_mode!=RC_CLOCK_VIRTUAL){
+		fprintf(stderr,"ERROR in rc_virtual_clock_advance, virtual clock not active\n");
+		return -1;
+	}
+	pthread_mutex_lock(&virt_mutex);
+	virt_now += ns;
+	pthread_cond_broadcast(&virt_wake_cond);
+	pthread_mutex_unlock(&virt_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* @ int rc_virtual_clock_wait_for_sleepers(int n, uint64_t timeout_ns)
+*
+* Blocks the calling harness thread until at least n threads are parked in a
+* virtual sleep, or until timeout_ns of real time has passed. Use this between
+* steps to run background threads in lock-step with the test. Returns the
+* number of sleeping threads or -1 on timeout.
+*******************************************************************************/
+int rc_virtual_clock_wait_for_sleepers(int n, uint64_t timeout_ns){
+	int ret;
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	rc_timespec_add(&deadline, timeout_ns/1000000000.0);
+	pthread_mutex_lock(&virt_mutex);
+	while(virt_sleepers<n){
+		if(pthread_cond_timedwait(&virt_sleep_cond, &virt_mutex, &deadline)\
+															==ETIMEDOUT){
+			pthread_mutex_unlock(&virt_mutex);
+			return -1;
+		}
+	}
+	ret = virt_sleepers;
+	pthread_mutex_unlock(&virt_mutex);
+	return ret;
+}
+
+/*******************************************************************************
+* static void real_nanosleep(uint64_t ns)
+*
+* nanosleep on the kernel clock, restarting with the remaining time in the
+* event that nanosleep is interrupted by a signal.
+*******************************************************************************/
+static void real_nanosleep(uint64_t ns){
+	struct timespec req,rem;
+	req.tv_sec = ns/1000000000;
+	req.tv_nsec = ns%1000000000;
+	// loop untill nanosleep sets an error or finishes successfully
+	errno=0; // reset errno to avoid false detection
+	while(nanosleep(&req, &rem) && errno==EINTR){
+		req.tv_sec = rem.tv_sec;
+		req.tv_nsec = rem.tv_nsec;
+	}
+	return;
+}
+
+/*******************************************************************************
+* static uint64_t real_nanos(clockid_t clk)
+*
+* reads a kernel clock in nanoseconds
+*******************************************************************************/
+static uint64_t real_nanos(clockid_t clk){
+	struct timespec ts;
+	clock_gettime(clk, &ts);
+	return ((uint64_t)ts.tv_sec*1000000000)+ts.tv_nsec;
+}
+
+/*******************************************************************************
+* static void virtual_nanosleep(uint64_t ns)
+*
+* Parks the calling thread until virtual time reaches now+ns. The deadline is
+* registered so the harness can see when every thread is idle and which one
+* is due next. Returns early if the clock is switched out of virtual mode.
+*******************************************************************************/
+static void virtual_nanosleep(uint64_t ns){
+	int i, slot;
+	uint64_t deadline;
+	pthread_mutex_lock(&virt_mutex);
+	if(virt_sleepers>=MAX_VIRTUAL_SLEEPERS){
+		pthread_mutex_unlock(&virt_mutex);
+		fprintf(stderr,"ERROR in rc_nanosleep, too many virtual sleepers\n");
+		return;
+	}
+	deadline = virt_now + ns;
+	slot = virt_sleepers;
+	virt_deadlines[slot] = deadline;
+	virt_sleepers++;
+	pthread_cond_broadcast(&virt_sleep_cond);
+	while(virt_now<deadline && clock_mode==RC_CLOCK_VIRTUAL){
+		pthread_cond_wait(&virt_wake_cond, &virt_mutex);
+	}
+	// remove our deadline, other sleepers may have shuffled our slot
+	for(i=0;i<virt_sleepers;i++){
+		if(virt_deadlines[i]==deadline){
+			virt_deadlines[i] = virt_deadlines[virt_sleepers-1];
+			break;
+		}
+	}
+	virt_sleepers--;
+	// rc_set_clock_virtual() may be waiting for the table to empty
+	pthread_cond_broadcast(&virt_sleep_cond);
+	pthread_mutex_unlock(&virt_mutex);
+	return;
+}
@@ -0,0 +1,396 @@
+/*******************************************************************************
+* rc_trace.c
+*
+* Latency tracing for the library threads. Each thread that hits a trace
+* point claims its own ring of timestamped events on first use, so recording
+* needs no locks: the owning thread is the only writer and publishes each
+* event by advancing the ring head. Readers merge all rings by timestamp to
+* build per-stage latency histograms or a Chrome trace JSON file which can be
+* opened in chrome://tracing or ui.perfetto.dev.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include "../roboticscape.h"
+#include "../preprocessor_macros.h"
+#include "rc_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define MAX_TRACE_THREADS		16
+#define DEFAULT_TRACE_EVENTS	4096
+#define LATENCY_BINS			14
+#define LATENCY_BIN_0_NS		5000 // upper edge of first histogram bin
+
+typedef struct trace_entry_t{
+	uint64_t t_ns;
+	uint32_t arg;
+	uint16_t event;
+	uint16_t thread; // filled in when merging, index of the owning ring
+} trace_entry_t;
+
+typedef struct trace_ring_t{
+	trace_entry_t* entries;
+	uint32_t head; // total events written, only the owner writes this
+	pid_t tid;
+} trace_ring_t;
+
+// a stage is the time from a start event to the next end event
+typedef struct trace_stage_t{
+	const char* name;
+	trace_event_t start;
+	trace_event_t end;
+} trace_stage_t;
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+volatile int rc_trace_enabled = 0;
+static trace_ring_t rings[MAX_TRACE_THREADS];
+static uint32_t ring_size = 0; // power of 2
+static uint32_t num_rings = 0;
+static volatile uint32_t generation = 0;
+static __thread int my_ring = -1;
+static __thread uint32_t my_generation = 0;
+
+// name, chrome trace phase, and thread label of each event
+static const struct{
+	const char* name;
+	char phase;
+	const char* thread;
+} event_info[TRACE_NUM_EVENTS] = {
+	{"imu_interrupt",		'i', "imu"},
+	{"read_dmp_fifo",		'B', "imu"},
+	{"read_dmp_fifo",		'E', "imu"},
+	{"imu_callback",		'B', "imu"},
+	{"imu_callback",		'E', "imu"},
+	{"rc_set_motor",		'i', "user"},
+	{"rc_send_servo_pulse_us",'i', "user"},
+	{"dsm_packet",			'i', "dsm"},
+	{"dsm_callback",		'B', "dsm"},
+	{"dsm_callback",		'E', "dsm"}
+};
+
+static const trace_stage_t stages[] = {
+	{"irq->fifo read",		TRACE_IMU_INTERRUPT,		TRACE_IMU_READ_START},
+	{"fifo read",			TRACE_IMU_READ_START,		TRACE_IMU_READ_END},
+	{"read->callback",		TRACE_IMU_READ_END,			TRACE_IMU_CALLBACK_START},
+	{"imu callback",		TRACE_IMU_CALLBACK_START,	TRACE_IMU_CALLBACK_END},
+	{"irq->motor",			TRACE_IMU_INTERRUPT,		TRACE_MOTOR_WRITE},
+	{"irq->servo",			TRACE_IMU_INTERRUPT,		TRACE_SERVO_WRITE},
+	{"dsm packet->ready",	TRACE_DSM_PACKET,			TRACE_DSM_CALLBACK_START},
+	{"dsm callback",		TRACE_DSM_CALLBACK_START,	TRACE_DSM_CALLBACK_END}
+};
+#define NUM_STAGES (int)(sizeof(stages)/sizeof(stages[0]))
+
+/*******************************************************************************
+* Local Function Declarations
+*******************************************************************************/
+static int claim_ring();
+static int merge_rings(trace_entry_t** out);
+static int compare_entries(const void* a, const void* b);
+static int compare_u64(const void* a, const void* b);
+static int latency_bin(uint64_t ns);
+
+/*******************************************************************************
+* int rc_trace_enable(int events_per_thread)
+*
+* Starts recording. Each thread gets a ring holding the most recent
+* events_per_thread events, rounded up to a power of 2. Pass 0 for the
+* default of 4096.
+*******************************************************************************/
+int rc_trace_enable(int events_per_thread){
+	uint32_t size;
+	int i;
+
+	if(rc_trace_enabled){
+		fprintf(stderr,"ERROR in rc_trace_enable, tracing already enabled\n");
+		return -1;
+	}
+	if(events_per_thread<0){
+		fprintf(stderr,"ERROR in rc_trace_enable, events_per_thread must be >=0\n");
+		return -1;
+	}
+	if(events_per_thread==0) events_per_thread = DEFAULT_TRACE_EVENTS;
+	size = 1;
+	while(size<(uint32_t)events_per_thread) size*=2;
+
+	// allocate everything here so recording never allocates
+	if(size!=ring_size){
+		for(i=0;i<MAX_TRACE_THREADS;i++){
+			free(rings[i].entries);
+			rings[i].entries = malloc(size*sizeof(trace_entry_t));
+			if(rings[i].entries==NULL){
+				fprintf(stderr,"ERROR in rc_trace_enable, out of memory\n");
+				ring_size = 0;
+				return -1;
+			}
+			// touch now so the first events don't page fault
+			memset(rings[i].entries, 0, size*sizeof(trace_entry_t));
+		}
+		ring_size = size;
+	}
+	rc_trace_reset();
+	rc_trace_enabled = 1;
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_trace_disable()
+*
+* Stops recording. Recorded events are kept for printing and writing.
+*******************************************************************************/
+int rc_trace_disable(){
+	rc_trace_enabled = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_trace_reset()
+*
+* Discards all recorded events. Threads claim a fresh ring on their next event.
+*******************************************************************************/
+int rc_trace_reset(){
+	int i;
+	for(i=0;i<MAX_TRACE_THREADS;i++){
+		__atomic_store_n(&rings[i].head, 0, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&num_rings, 0, __ATOMIC_RELEASE);
+	__sync_fetch_and_add(&generation, 1);
+	return 0;
+}
+
+/*******************************************************************************
+* void record_trace_event(trace_event_t event, uint32_t arg)
+*
+* see rc_trace.h
+*******************************************************************************/
+void record_trace_event(trace_event_t event, uint32_t arg){
+	trace_ring_t* r;
+	trace_entry_t* e;
+	uint32_t head;
+
+	if(unlikely(my_generation!=generation)){
+		my_generation = generation;
+		my_ring = claim_ring();
+	}
+	if(unlikely(my_ring<0)) return;
+
+	r = &rings[my_ring];
+	head = r->head;
+	e = &r->entries[head&(ring_size-1)];
+	e->t_ns = rc_nanos_since_boot();
+	e->arg = arg;
+	e->event = event;
+	// publish the entry after it is fully written
+	__atomic_store_n(&r->head, head+1, __ATOMIC_RELEASE);
+	return;
+}
+
+/*******************************************************************************
+* int rc_print_trace_latencies()
+*
+* Prints count, min, average, 99th percentile and max of every stage that has
+* samples, followed by its latency histogram. A stage sample is the time from
+* the most recent start event to the next end event, so irq->motor is the
+* time from an IMU interrupt edge to the first motor write that follows it.
+*******************************************************************************/
+int rc_print_trace_latencies(){
+	trace_entry_t* all;
+	uint64_t* samples;
+	uint64_t start, sum, edge;
+	uint32_t hist[LATENCY_BINS];
+	int n, s, i, j, count;
+
+	n = merge_rings(&all);
+	if(n<0) return -1;
+	samples = malloc((n+1)*sizeof(uint64_t));
+	if(samples==NULL){
+		fprintf(stderr,"ERROR in rc_print_trace_latencies, out of memory\n");
+		free(all);
+		return -1;
+	}
+
+	printf("\n%d events from %u threads\n", n, \
+		(num_rings<MAX_TRACE_THREADS) ? num_rings : MAX_TRACE_THREADS);
+	printf("%-18s %8s %10s %10s %10s %10s\n", "stage", "count", "min_us", \
+									"avg_us", "p99_us", "max_us");
+	for(s=0;s<NUM_STAGES;s++){
+		count = 0;
+		start = 0;
+		for(i=0;i<n;i++){
+			if(all[i].event==stages[s].start) start = all[i].t_ns;
+			else if(all[i].event==stages[s].end && start!=0){
+				samples[count++] = all[i].t_ns - start;
+				start = 0;
+			}
+		}
+		if(count==0) continue;
+		qsort(samples, count, sizeof(uint64_t), compare_u64);
+		sum = 0;
+		memset(hist, 0, sizeof(hist));
+		for(i=0;i<count;i++){
+			sum += samples[i];
+			hist[latency_bin(samples[i])]++;
+		}
+		printf("%-18s %8d %10.1f %10.1f %10.1f %10.1f\n", stages[s].name, \
+			count, samples[0]/1000.0, sum/1000.0/count, \
+			samples[(count*99)/100]/1000.0, samples[count-1]/1000.0);
+		printf("    hist:");
+		edge = LATENCY_BIN_0_NS;
+		for(j=0;j<LATENCY_BINS;j++){
+			if(hist[j]==0){
+				edge *= 2;
+				continue;
+			}
+			if(j<LATENCY_BINS-1){
+				printf(" <%lluus:%u", (unsigned long long)edge/1000, hist[j]);
+			}
+			else printf(" more:%u", hist[j]);
+			edge *= 2;
+		}
+		printf("\n");
+	}
+	free(samples);
+	free(all);
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_write_trace_json(const char* path)
+*
+* Writes all recorded events in Chrome trace event format with timestamps in
+* microseconds since boot and one track per thread.
+*******************************************************************************/
+int rc_write_trace_json(const char* path){
+	trace_entry_t* all;
+	FILE* fd;
+	int n, i, first = 1;
+	uint32_t r;
+	int named[MAX_TRACE_THREADS];
+	pid_t pid = getpid();
+
+	if(path==NULL){
+		fprintf(stderr,"ERROR in rc_write_trace_json, received NULL pointer\n");
+		return -1;
+	}
+	n = merge_rings(&all);
+	if(n<0) return -1;
+	fd = fopen(path, "w");
+	if(fd==NULL){
+		fprintf(stderr,"ERROR in rc_write_trace_json, can't open %s\n", path);
+		free(all);
+		return -1;
+	}
+
+	fprintf(fd, "{\"traceEvents\":[\n");
+	memset(named, 0, sizeof(named));
+	for(i=0;i<n;i++){
+		r = all[i].thread;
+		// label each thread track after the first event seen on it
+		if(!named[r]){
+			named[r] = 1;
+			fprintf(fd, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+				"\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}", first?"":",\n",
+				pid, rings[r].tid, event_info[all[i].event].thread,
+				rings[r].tid);
+			first = 0;
+		}
+		fprintf(fd, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,"
+			"\"tid\":%d", event_info[all[i].event].name,
+			event_info[all[i].event].phase, all[i].t_ns/1000.0, pid,
+			rings[r].tid);
+		if(event_info[all[i].event].phase=='i') fprintf(fd, ",\"s\":\"t\"");
+		fprintf(fd, ",\"args\":{\"arg\":%u}}", all[i].arg);
+	}
+	fprintf(fd, "\n],\"displayTimeUnit\":\"ns\"}\n");
+	fclose(fd);
+	free(all);
+	return 0;
+}
+
+/*******************************************************************************
+* static int claim_ring()
+*
+* Gives the calling thread the next free ring. Returns -1 when all rings are
+* taken in which case the thread's events are dropped.
+*******************************************************************************/
+static int claim_ring(){
+	uint32_t i = __sync_fetch_and_add(&num_rings, 1);
+	if(i>=MAX_TRACE_THREADS || ring_size==0) return -1;
+	rings[i].tid = syscall(SYS_gettid);
+	rings[i].head = 0;
+	return i;
+}
+
+/*******************************************************************************
+* static int merge_rings(trace_entry_t** out)
+*
+* Copies the events still held in every ring into one newly allocated array
+* sorted by time. Returns the number of events or -1 on error. Best called
+* after rc_trace_disable() so no ring wraps while it is being copied.
+*******************************************************************************/
+static int merge_rings(trace_entry_t** out){
+	uint32_t r, rings_used, head, count, k;
+	int n = 0;
+	trace_entry_t* all;
+
+	rings_used = __atomic_load_n(&num_rings, __ATOMIC_ACQUIRE);
+	if(rings_used>MAX_TRACE_THREADS) rings_used = MAX_TRACE_THREADS;
+	all = malloc((rings_used*ring_size+1)*sizeof(trace_entry_t));
+	if(all==NULL){
+		fprintf(stderr,"ERROR: out of memory merging trace buffers\n");
+		return -1;
+	}
+	for(r=0;r<rings_used;r++){
+		head = __atomic_load_n(&rings[r].head, __ATOMIC_ACQUIRE);
+		count = (head<ring_size) ? head : ring_size;
+		for(k=head-count;k!=head;k++){
+			all[n] = rings[r].entries[k&(ring_size-1)];
+			all[n].thread = r;
+			n++;
+		}
+	}
+	qsort(all, n, sizeof(trace_entry_t), compare_entries);
+	*out = all;
+	return n;
+}
+
+/*******************************************************************************
+* static int compare_entries(const void* a, const void* b)
+*
+* qsort comparison by timestamp
+*******************************************************************************/
+static int compare_entries(const void* a, const void* b){
+	uint64_t ta = ((const trace_entry_t*)a)->t_ns;
+	uint64_t tb = ((const trace_entry_t*)b)->t_ns;
+	return (ta>tb) - (ta<tb);
+}
+
+/*******************************************************************************
+* static int compare_u64(const void* a, const void* b)
+*
+* qsort comparison for latency samples
+*******************************************************************************/
+static int compare_u64(const void* a, const void* b){
+	uint64_t va = *(const uint64_t*)a;
+	uint64_t vb = *(const uint64_t*)b;
+	return (va>vb) - (va<vb);
+}
+
+/*******************************************************************************
+* static int latency_bin(uint64_t ns)
+*
+* Bin 0 holds latencies under 5us, each following bin doubles in width and
+* the last bin catches everything else.
+*******************************************************************************/
+static int latency_bin(uint64_t ns){
+	int bin = 0;
+	uint64_t edge = LATENCY_BIN_0_NS;
+	while(ns>=edge && bin<LATENCY_BINS-1){
+		edge *= 2;
+		bin++;
+	}
+	return bin;
+}
@@ -0,0 +1,44 @@
+/*******************************************************************************
+* rc_trace.h
+*
+* Trace points used inside the library. When tracing is off a trace point
+* costs one load and a not-taken branch. The user-facing functions are in
+* roboticscape.h
+*******************************************************************************/
+
+#ifndef RC_TRACE
+#define RC_TRACE
+
+#include <stdint.h>
+#include "../preprocessor_macros.h"
+
+// events recorded by the library, see event_info in rc_trace.c for names
+typedef enum trace_event_t{
+	TRACE_IMU_INTERRUPT,
+	TRACE_IMU_READ_START,
+	TRACE_IMU_READ_END,
+	TRACE_IMU_CALLBACK_START,
+	TRACE_IMU_CALLBACK_END,
+	TRACE_MOTOR_WRITE,
+	TRACE_SERVO_WRITE,
+	TRACE_DSM_PACKET,
+	TRACE_DSM_CALLBACK_START,
+	TRACE_DSM_CALLBACK_END,
+	TRACE_NUM_EVENTS
+} trace_event_t;
+
+extern volatile int rc_trace_enabled;
+
+/*******************************************************************************
+* void record_trace_event(trace_event_t event, uint32_t arg)
+*
+* Appends one timestamped event to the calling thread's trace buffer. Don't
+* call this directly, use TRACE_POINT so the disabled case stays cheap.
+*******************************************************************************/
+void record_trace_event(trace_event_t event, uint32_t arg);
+
+#define TRACE_POINT(event, arg) do{ \
+	if(unlikely(rc_trace_enabled)) record_trace_event((event), (uint32_t)(arg)); \
+}while(0)
+
+#endif // RC_TRACE
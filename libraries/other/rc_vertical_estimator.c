@@ -0,0 +1,143 @@
+/*******************************************************************************
+* rc_vertical_estimator.c
+*
+* Altitude, vertical velocity and accelerometer bias from a three state
+* Kalman filter. Body acceleration rotated into the earth frame drives the
+* prediction at IMU rate and barometer altitude corrects it whenever a new
+* sample arrives. Both steps are a fixed handful of float operations with no
+* allocation or matrix inversion.
+*******************************************************************************/
+#include "../roboticscape.h"
+#include "../preprocessor_macros.h"
+#include <stdio.h>
+
+#define GRAVITY_MS2		9.80665f
+// initial uncertainty of velocity (m/s) and bias (m/s^2) before any motion
+#define INIT_VEL_VAR	1.0f
+#define INIT_BIAS_VAR	0.25f
+
+/*******************************************************************************
+* int rc_vertical_estimator_init(rc_vertical_estimator_t* e, float accel_std,
+*											float bias_std, float baro_std)
+*
+* accel_std is the noise on the vertical acceleration in m/s^2, bias_std how
+* fast the accelerometer bias wanders in m/s^2 per root second and baro_std
+* the barometer altitude noise in m. The estimate starts on the first
+* barometer sample.
+*******************************************************************************/
+int rc_vertical_estimator_init(rc_vertical_estimator_t* e, float accel_std, \
+											float bias_std, float baro_std){
+	int i, j;
+	if(e==NULL){
+		fprintf(stderr,"ERROR in rc_vertical_estimator_init, received NULL pointer\n");
+		return -1;
+	}
+	if(accel_std<=0.0f || bias_std<0.0f || baro_std<=0.0f){
+		fprintf(stderr,"ERROR in rc_vertical_estimator_init, invalid noise setting\n");
+		return -1;
+	}
+	e->accel_var = accel_std*accel_std;
+	e->bias_var = bias_std*bias_std;
+	e->baro_var = baro_std*baro_std;
+	e->alt_m = 0.0f;
+	e->vel_ms = 0.0f;
+	e->accel_bias = 0.0f;
+	e->accel_up = 0.0f;
+	for(i=0;i<3;i++) for(j=0;j<3;j++) e->P[i][j] = 0.0f;
+	e->initialized = 0;
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_vertical_estimator_predict(rc_vertical_estimator_t* e, float accel[3],
+*											float quat[4], float dt)
+*
+* Propagates the estimate dt seconds with one accelerometer reading in m/s^2
+* and the orientation quaternion from the same IMU sample, such as accel and
+* dmp_quat from rc_imu_data_t. Does nothing but record the acceleration
+* until the first barometer sample has been given.
+*******************************************************************************/
+int rc_vertical_estimator_predict(rc_vertical_estimator_t* e, float accel[3], \
+											float quat[4], float dt){
+	float v[3], a, dt2, q_a, q_b;
+	float P00, P01, P02, P11, P12, P22;
+	float A00, A01, A02, A11, A12;
+	if(unlikely(e==NULL || dt<=0.0f)){
+		fprintf(stderr,"ERROR in rc_vertical_estimator_predict, invalid argument\n");
+		return -1;
+	}
+	// specific force in the earth frame, z is up when the quaternion is
+	// identity so gravity shows up as +1g there
+	v[0] = accel[0];
+	v[1] = accel[1];
+	v[2] = accel[2];
+	rc_quaternion_rotate_vector_array(v, quat);
+	e->accel_up = v[2] - GRAVITY_MS2;
+	if(!e->initialized) return 0;
+
+	// x = F x + G u with state (alt, vel, bias)
+	a = e->accel_up - e->accel_bias;
+	dt2 = 0.5f*dt*dt;
+	e->alt_m += e->vel_ms*dt + a*dt2;
+	e->vel_ms += a*dt;
+
+	// P = F P F' + Q, written out since F is mostly ones and zeros
+	P00 = e->P[0][0]; P01 = e->P[0][1]; P02 = e->P[0][2];
+	P11 = e->P[1][1]; P12 = e->P[1][2]; P22 = e->P[2][2];
+	// rows of F P
+	A00 = P00 + dt*P01 - dt2*P02;
+	A01 = P01 + dt*P11 - dt2*P12;
+	A02 = P02 + dt*P12 - dt2*P22;
+	A11 = P11 - dt*P12;
+	A12 = P12 - dt*P22;
+	q_a = e->accel_var;
+	q_b = e->bias_var*dt;
+	e->P[0][0] = A00 + dt*A01 - dt2*A02 + q_a*dt2*dt2;
+	e->P[0][1] = A01 - dt*A02 + q_a*dt2*dt;
+	e->P[0][2] = A02;
+	e->P[1][1] = A11 - dt*A12 + q_a*dt*dt;
+	e->P[1][2] = A12;
+	e->P[2][2] = P22 + q_b;
+	e->P[1][0] = e->P[0][1];
+	e->P[2][0] = e->P[0][2];
+	e->P[2][1] = e->P[1][2];
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_vertical_estimator_correct(rc_vertical_estimator_t* e, float alt_m)
+*
+* Corrects the estimate with a barometer altitude, for example alt_m from
+* rc_bmp_get_sample(). Call it once per new barometer sample.
+*******************************************************************************/
+int rc_vertical_estimator_correct(rc_vertical_estimator_t* e, float alt_m){
+	float S, K[3], r, P0[3];
+	int i, j;
+	if(unlikely(e==NULL)){
+		fprintf(stderr,"ERROR in rc_vertical_estimator_correct, received NULL pointer\n");
+		return -1;
+	}
+	if(!e->initialized){
+		e->alt_m = alt_m;
+		e->vel_ms = 0.0f;
+		e->accel_bias = 0.0f;
+		for(i=0;i<3;i++) for(j=0;j<3;j++) e->P[i][j] = 0.0f;
+		e->P[0][0] = e->baro_var;
+		e->P[1][1] = INIT_VEL_VAR;
+		e->P[2][2] = INIT_BIAS_VAR;
+		e->initialized = 1;
+		return 0;
+	}
+	// scalar update, H = [1 0 0]
+	S = e->P[0][0] + e->baro_var;
+	for(i=0;i<3;i++){
+		P0[i] = e->P[0][i];
+		K[i] = e->P[i][0]/S;
+	}
+	r = alt_m - e->alt_m;
+	e->alt_m += K[0]*r;
+	e->vel_ms += K[1]*r;
+	e->accel_bias += K[2]*r;
+	for(i=0;i<3;i++) for(j=0;j<3;j++) e->P[i][j] -= K[i]*P0[j];
+	return 0;
+}
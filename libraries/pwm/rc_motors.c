@@ -4,11 +4,29 @@
 #include <stdio.h>
 #include "../roboticscape.h"
 #include "../rc_defs.h"
+#include "../preprocessor_macros.h"
+#include "../other/rc_trace.h"
+#include "../other/rc_battery.h"
+#include "../mmap/rc_mmap_gpio_adc.h"
+#include "../mmap/rc_mmap_pwmss.h"
+
+#define GPIO_BANKS 4
 
 // global variables
 int mdir1a, mdir2b; // variable gpio pin assignments
 int motors_initialized = 0;
 
+// H-bridge inputs of each motor as bank and bit mask. The forward pin is
+// driven high and the reverse pin low for positive duty.
+static int fwd_bank[MOTOR_CHANNELS], rev_bank[MOTOR_CHANNELS];
+static uint32_t fwd_mask[MOTOR_CHANNELS], rev_mask[MOTOR_CHANNELS];
+// pwm subsystem and channel of each motor, channel 0 is A and 1 is B
+static const int motor_ss[MOTOR_CHANNELS] = {1, 1, 2, 2};
+static const int motor_ch[MOTOR_CHANNELS] = {0, 1, 0, 1};
+
+static void write_motor_outputs(const int* fwd, const int* rev, \
+															const float* duty);
+
 
 /*******************************************************************************
 * int initialize_motors()
@@ -39,6 +57,26 @@ int initialize_motors(){
 		return -1;
 	}
 
+	// map everything now so rc_set_motors() doesn't need to check on each call
+	if(initialize_mmap_gpio() || map_pwmss(1) || map_pwmss(2)){
+		printf("ERROR: failed to map motor gpio and pwm registers\n");
+		return -1;
+	}
+	const int fwd_pin[MOTOR_CHANNELS] = {mdir1a, mdir2b, MDIR3B, MDIR4A};
+	const int rev_pin[MOTOR_CHANNELS] = {MDIR1B, MDIR2A, MDIR3A, MDIR4B};
+	int i;
+	for(i=0;i<MOTOR_CHANNELS;i++){
+		fwd_bank[i] = fwd_pin[i]/32;
+		fwd_mask[i] = 1u<<(fwd_pin[i]%32);
+		rev_bank[i] = rev_pin[i]/32;
+		rev_mask[i] = 1u<<(rev_pin[i]%32);
+	}
+	// both subsystems run at the same frequency, align their periods so
+	// left and right motors change duty on the same edge
+	rc_pwm_sync_counters();
+	// share duty cycles with the battery monitor if it's running
+	battery_shm_open(0);
+
 	motors_initialized = 1;
 	rc_disable_motors();
 	return 0;
@@ -132,6 +170,44 @@ int rc_set_motor(int motor, float duty){
 			printf("enter a motor value between 1 and 4\n");
 			return -1;
 	}
+	battery_report_duty(motor-1, duty);
+	TRACE_POINT(TRACE_MOTOR_WRITE, motor);
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_set_motors(const float duty[4])
+* 
+* Sets all 4 motors at once, duty[0] is motor 1. The direction pins of every
+* H-bridge are collected into one clear and one set mask per GPIO bank and
+* each PWM subsystem has both compare registers written together, so all
+* motors change within a few register stores of each other.
+*******************************************************************************/
+int rc_set_motors(const float duty[4]){
+	int fwd[MOTOR_CHANNELS], rev[MOTOR_CHANNELS];
+	float d[MOTOR_CHANNELS];
+	int i;
+	if(unlikely(motors_initialized==0)){
+		printf("ERROR: trying to rc_set_motors before they have been initialized\n");
+		return -1;
+	}
+	for(i=0;i<MOTOR_CHANNELS;i++){
+		d[i] = duty[i];
+		//check that the duty cycle is within +-1
+		if(d[i]>1.0f) d[i] = 1.0f;
+		else if(d[i]<-1.0f) d[i] = -1.0f;
+		if(d[i]>=0.0f){
+			fwd[i] = HIGH;
+			rev[i] = LOW;
+		}
+		else{
+			fwd[i] = LOW;
+			rev[i] = HIGH;
+			d[i] = -d[i];
+		}
+	}
+	write_motor_outputs(fwd, rev, d);
+	TRACE_POINT(TRACE_MOTOR_WRITE, 0);
 	return 0;
 }
 
@@ -141,15 +217,12 @@ int rc_set_motor(int motor, float duty){
 * applies the same duty cycle argument to all 4 motors
 *******************************************************************************/
 int rc_set_motor_all(float duty){
-	int i;
+	const float d[MOTOR_CHANNELS] = {duty, duty, duty, duty};
 	if(motors_initialized==0){
 		printf("ERROR: trying to rc_set_motor_all before they have been initialized\n");
 		return -1;
 	}
-	for(i=1;i<=MOTOR_CHANNELS; i++){
-		rc_set_motor(i, duty);
-	}
-	return 0;
+	return rc_set_motors(d);
 }
 
 /*******************************************************************************
@@ -189,6 +262,7 @@ int rc_set_motor_free_spin(int motor){
 			printf("enter a motor value between 1 and 4\n");
 			return -1;
 	}
+	battery_report_duty(motor-1, 0.0f);
 	return 0;
 }
 
@@ -196,14 +270,13 @@ int rc_set_motor_free_spin(int motor){
 * @ int rc_set_motor_free_spin_all()
 *******************************************************************************/
 int rc_set_motor_free_spin_all(){
-	int i;
+	const int low[MOTOR_CHANNELS] = {LOW, LOW, LOW, LOW};
+	const float zero[MOTOR_CHANNELS] = {0.0f, 0.0f, 0.0f, 0.0f};
 	if(motors_initialized==0){
 		printf("ERROR: trying to rc_set_motor_free_spin_all before they have been initialized\n");
 		return -1;
 	}
-	for(i=1;i<=MOTOR_CHANNELS; i++){
-		rc_set_motor_free_spin(i);
-	}
+	write_motor_outputs(low, low, zero);
 	return 0;
 }
 
@@ -244,6 +317,7 @@ int rc_set_motor_brake(int motor){
 			printf("enter a motor value between 1 and 4\n");
 			return -1;
 	}
+	battery_report_duty(motor-1, 0.0f);
 	return 0;
 }
 
@@ -251,13 +325,48 @@ int rc_set_motor_brake(int motor){
 * @ int rc_set_motor_brake_all()
 *******************************************************************************/
 int rc_set_motor_brake_all(){
-	int i;
+	const int high[MOTOR_CHANNELS] = {HIGH, HIGH, HIGH, HIGH};
+	const float zero[MOTOR_CHANNELS] = {0.0f, 0.0f, 0.0f, 0.0f};
 	if(motors_initialized==0){
 		printf("ERROR: trying to rc_set_motor_brake_all before they have been initialized\n");
 		return -1;
 	}
-	for(i=1;i<=MOTOR_CHANNELS; i++){
-		rc_set_motor_brake(i);
-	}
+	write_motor_outputs(high, high, zero);
 	return 0;
 }
+
+/*******************************************************************************
+* static void write_motor_outputs(const int* fwd, const int* rev,
+*															const float* duty)
+*
+* Drives the forward and reverse H-bridge inputs and the pwm duty of all
+* motors. Every bank is cleared before any is set so a motor changing
+* direction passes through free spin rather than brake. Direction pins go
+* before duty, as in rc_set_motor(). duty must already be within 0 to 1.
+*******************************************************************************/
+static void write_motor_outputs(const int* fwd, const int* rev, \
+															const float* duty){
+	uint32_t set[GPIO_BANKS] = {0, 0, 0, 0};
+	uint32_t clear[GPIO_BANKS] = {0, 0, 0, 0};
+	float ss_duty[3][2];
+	int i;
+	for(i=0;i<MOTOR_CHANNELS;i++){
+		if(fwd[i]) set[fwd_bank[i]] |= fwd_mask[i];
+		else clear[fwd_bank[i]] |= fwd_mask[i];
+		if(rev[i]) set[rev_bank[i]] |= rev_mask[i];
+		else clear[rev_bank[i]] |= rev_mask[i];
+		ss_duty[motor_ss[i]][motor_ch[i]] = duty[i];
+		battery_report_duty(i, duty[i]);
+	}
+	for(i=0;i<GPIO_BANKS;i++){
+		if(clear[i]) mmap_gpio_write_bank(i, 0, clear[i]);
+	}
+	for(i=0;i<GPIO_BANKS;i++){
+		if(set[i]) mmap_gpio_write_bank(i, set[i], 0);
+	}
+	// hold the compare loads so both subsystems change on the same period
+	rc_pwm_begin_update();
+	mmap_pwm_write_duty_pair(1, ss_duty[1][0], ss_duty[1][1]);
+	mmap_pwm_write_duty_pair(2, ss_duty[2][0], ss_duty[2][1]);
+	rc_pwm_commit_update();
+}
@@ -12,6 +12,8 @@
 // I2C bus associations
 #define IMU_BUS 	2
 #define BMP_BUS 	2
+// IMU transactions go first when the bus is contended, others default to 0
+#define IMU_I2C_PRIORITY	10
 
 // Calibration File Locations
 #define CONFIG_DIRECTORY "/var/lib/roboticscape/"
@@ -88,7 +90,7 @@
 // PRU Servo & encoder Control parameters
 #define SERVO_PRU_NUM 	 1
 #define ENCODER_PRU_NUM 	 0
-#define PRU_SERVO_LOOP_INSTRUCTIONS	48	// instructions per PRU servo timer loop 
+#define PRU_SERVO_LOOP_INSTRUCTIONS	50	// instructions per PRU servo timer loop 
 
 
 #endif //ROBOTICS_CAPE_DEFS
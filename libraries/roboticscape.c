@@ -16,6 +16,9 @@
 #include "other/rc_pru.h"
 #include "gpio/rc_buttons.h"
 #include "pwm/rc_motors.h"
+#include "other/rc_realtime.h"
+#include "other/rc_encoder_velocity.h"
+#include "other/rc_adc_stream.h"
 #include <sys/capability.h>		//used for testing capabilities
 
 #define CAPE_NAME	"RoboticsCape"
@@ -77,6 +80,14 @@ int rc_initialize(){
 
 	// start state as Uninitialized
 	rc_set_state(UNINITIALIZED);
+
+	// lock memory and prefault before any threads start so they inherit it
+	#ifdef DEBUG
+	printf("Applying real-time profile\n");
+	#endif
+	if(apply_rt_profile()){
+		fprintf(stderr,"WARNING: real-time profile only partially applied\n");
+	}
 	
 	// Start Signal Handler
 	#ifdef DEBUG
@@ -146,7 +157,7 @@ int rc_initialize(){
 	printf("Initializing: Buttons\n");
 	#endif
 	if(initialize_button_handlers()<0){
-		fprintf(stderr,"ERROR: failed to start button threads\n");
+		fprintf(stderr,"ERROR: failed to start button thread\n");
 		return -1;
 	}
 
@@ -187,6 +198,7 @@ int rc_initialize(){
 *	you should call this before your main() function returns
 *******************************************************************************/
 int rc_cleanup(){
+	int i;
 	// just in case the user forgot, set state to exiting
 	rc_set_state(EXITING);
 
@@ -224,6 +236,41 @@ int rc_cleanup(){
 	printf("Stopping dsm service\n");
 	#endif
 	rc_stop_dsm_service();	
+
+	#ifdef DEBUG
+	printf("Stopping continuous adc\n");
+	#endif
+	rc_adc_stop_continuous();
+
+	#ifdef DEBUG
+	printf("Stopping continuous servo pulses\n");
+	#endif
+	rc_servo_stop_continuous();
+
+	#ifdef DEBUG
+	printf("Stopping PRU sampler\n");
+	#endif
+	rc_pru_sampler_stop();
+
+	#ifdef DEBUG
+	printf("Stopping PRU watchdog\n");
+	#endif
+	stop_pru_watchdog();
+
+	#ifdef DEBUG
+	printf("Stopping barometer service\n");
+	#endif
+	rc_bmp_stop_service();
+
+	#ifdef DEBUG
+	printf("Stopping uart I/O thread\n");
+	#endif
+	for(i=0;i<6;i++) rc_uart_io_stop(i);
+
+	#ifdef DEBUG
+	printf("Restoring cpu governor\n");
+	#endif
+	cleanup_rt_profile();
 	
 	#ifdef DEBUG
 	printf("Deleting PID file\n");
@@ -383,6 +430,8 @@ int rc_set_encoder_pos(int ch, int val){
 		fprintf(stderr,"Encoder Channel must be from 1 to 4\n");
 		return -1;
 	}
+	// a jump in position isn't motion
+	reset_encoder_velocity(ch);
 	// 4th channel is counted by the PRU not eQEP
 	if(ch==4) return set_pru_encoder_pos(val);
 	// else write to eQEP
@@ -419,10 +468,13 @@ float rc_dc_jack_voltage(){
 * returns the raw adc reading
 *******************************************************************************/
 int rc_adc_raw(int ch){
+	int raw;
 	if(ch<0 || ch>6){
 		fprintf(stderr,"ERROR: analog pin must be in 0-6\n");
 		return -1;
 	}
+	// no need to wait on a conversion if the sequencer is already sampling
+	if(adc_stream_latest(ch, &raw)==0) return raw;
 	return mmap_adc_read_raw((uint8_t)ch);
 }
 
@@ -436,7 +488,7 @@ float rc_adc_volt(int ch){
 		fprintf(stderr,"ERROR: analog pin must be in 0-6\n");
 		return -1;
 	}
-	int raw_adc = mmap_adc_read_raw((uint8_t)ch);
+	int raw_adc = rc_adc_raw(ch);
 	return raw_adc * 1.8 / 4095.0;
 }
 
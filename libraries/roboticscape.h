@@ -240,6 +240,28 @@ int rc_blink_led(rc_led_t led, float hz, float period);
 * For simple tasks like pausing the robot, the user is encouraged to assign
 * their function to be called when the button is released as this provides 
 * a more natural user experience aligning with consumer product functionality.
+*
+* @ int rc_set_pause_long_press_func(void (*func)(void))
+* @ int rc_set_pause_double_click_func(void (*func)(void))
+* @ int rc_set_mode_long_press_func(void (*func)(void))
+* @ int rc_set_mode_double_click_func(void (*func)(void))
+*
+* A long-press function is called once while the button is still held after
+* it has been down for the long-press time. A double-click function is called
+* on the second press when it comes within the double-click time of the first,
+* right after that press's pressed function. The pressed and released
+* functions are still called for every press.
+*
+* @ int rc_set_button_timing(int debounce_us, int long_press_ms,
+*													int double_click_ms)
+*
+* Changes the debounce window (default 5000us), long-press time (default
+* 1000ms) and double-click window (default 400ms). The first edge of a press
+* or release is acted on immediately, further edges within the debounce
+* window are treated as contact bounce.
+*
+* All button functions are called from one background thread, so a function
+* that takes a long time delays the handling of the other button.
 * 
 * The user can also just do a basic call to rc_get_pause_button_state() or
 * rc_get_mode_buttom_state() which returns the enumerated type RELEASED or 
@@ -255,6 +277,12 @@ int rc_set_pause_pressed_func(void (*func)(void));
 int rc_set_pause_released_func(void (*func)(void));
 int rc_set_mode_pressed_func(void (*func)(void));
 int rc_set_mode_released_func(void (*func)(void));
+int rc_set_pause_long_press_func(void (*func)(void));
+int rc_set_pause_double_click_func(void (*func)(void));
+int rc_set_mode_long_press_func(void (*func)(void));
+int rc_set_mode_double_click_func(void (*func)(void));
+int rc_set_button_timing(int debounce_us, int long_press_ms, \
+													int double_click_ms);
 rc_button_state_t rc_get_pause_button();
 rc_button_state_t rc_get_mode_button();
 
@@ -283,6 +311,14 @@ rc_button_state_t rc_get_mode_button();
 * corresponding to full power reverse to full power forward.
 * rc_set_motor_all() applies the same duty cycle to all 4 motor channels.
 *
+* @ int rc_set_motors(const float duty[4])
+*
+* Sets all 4 motors in one call, duty[0] being motor 1. The direction pins of
+* all H-bridges are written with one register store per GPIO bank and each
+* PWM subsystem has both channels written together. Prefer this over 4 calls
+* to rc_set_motor() in a control loop as the motors change together and it
+* does a fraction of the work.
+*
 * @ int rc_set_motor_free_spin(int motor)
 * @ int set motor_free_spin_all()
 *
@@ -301,6 +337,7 @@ int rc_enable_motors();
 int rc_disable_motors();
 int rc_set_motor(int motor, float duty);
 int rc_set_motor_all(float duty);
+int rc_set_motors(const float duty[4]);
 int rc_set_motor_free_spin(int motor);
 int rc_set_motor_free_spin_all();
 int rc_set_motor_brake(int motor);
@@ -327,10 +364,46 @@ int rc_set_motor_brake_all();
 * reset to 0 when initialize_cape() is called. However, the user can reset
 * the counter to zero or any other signed 32 bit value with rc_set_encoder_pos().
 *
+* @ float rc_get_encoder_velocity(int ch)
+*
+* Returns the speed of a channel in counts per second, positive when counting
+* up. Channels 1-3 are measured by the eQEP hardware every unit period: the
+* change in count over the period, which is precise at high speed, and the
+* time between groups of counts, which is precise at low speed. The two are
+* blended between blend_low and blend_high counts per second. This is far
+* less noisy at low speed than differentiating rc_get_encoder_pos() in a
+* control loop. Channel 4 is counted by the PRU and only gets the change in
+* count. The estimate updates once per unit period, call at any rate.
+*
+* @ typedef struct rc_encoder_velocity_config_t
+* @ rc_encoder_velocity_config_t rc_default_encoder_velocity_config()
+* @ int rc_set_encoder_velocity_config(int ch, rc_encoder_velocity_config_t conf)
+*
+* unit_period_us: measurement window, default 10000
+* capture_prescale: time between events is counted at 100mhz/2^n, 0-7,
+*		default 6 which reads as 0 below 2^event_prescale counts per 42ms
+* event_prescale: time is measured across 2^n counts, 0-11, default 2 for one
+*		full quadrature cycle which cancels uneven A/B duty
+* blend_low, blend_high: counts/s, default 2000 and 10000
+*
+* Channels are configured with the defaults on the first call to
+* rc_get_encoder_velocity().
+*
 * See the test_encoders example for sample use case.
 ******************************************************************************/
+typedef struct rc_encoder_velocity_config_t{
+	int unit_period_us;
+	int capture_prescale;
+	int event_prescale;
+	float blend_low;
+	float blend_high;
+} rc_encoder_velocity_config_t;
+
 int rc_get_encoder_pos(int ch);
 int rc_set_encoder_pos(int ch, int value);
+float rc_get_encoder_velocity(int ch);
+rc_encoder_velocity_config_t rc_default_encoder_velocity_config();
+int rc_set_encoder_velocity_config(int ch, rc_encoder_velocity_config_t conf);
 
 /******************************************************************************
 * ANALOG VOLTAGE SIGNALS
@@ -362,12 +435,87 @@ int rc_set_encoder_pos(int ch, int value);
 * 12-bit ADC. rc_adc_volt(int ch) additionally converts this raw value to 
 * a voltage. ch must be from 0 to 6.
 *
+* @ int rc_adc_start_continuous(double rate_hz)
+* @ int rc_adc_stop_continuous()
+*
+* By default each read starts a conversion and spins until it finishes.
+* rc_adc_start_continuous() instead has the ADC sequencer sample all 8
+* channels rate_hz times per second on its own while a background task
+* collects the results into a buffer holding the last 512 samples of each
+* channel. rc_adc_raw(), rc_adc_volt() and the battery functions then return
+* the latest sample immediately. The rate is approximate and limited by the
+* ADC clock, about 3khz with the usual 3mhz clock.
+*
+* @ int rc_adc_get_latest(int ch, int* raw, uint64_t* t_ns)
+* @ int rc_adc_get_window(int ch, int n, int* raw, uint64_t* t_ns)
+*
+* Read the newest sample, or up to n of the most recent samples oldest first,
+* of channel 0-7 along with the rc_nanos_since_boot() time of each
+* conversion. t_ns may be NULL. rc_adc_get_window() returns how many samples
+* were copied.
+*
+* @ uint64_t rc_adc_get_overruns()
+*
+* Counts how many times samples were lost because the background task didn't
+* empty the ADC FIFO in time.
+*
 * See the test_adc example for sample use case.
 ******************************************************************************/
 float rc_battery_voltage();
 float rc_dc_jack_voltage();
 int   rc_adc_raw(int ch);
 float rc_adc_volt(int ch);
+int rc_adc_start_continuous(double rate_hz);
+int rc_adc_stop_continuous();
+int rc_adc_get_latest(int ch, int* raw, uint64_t* t_ns);
+int rc_adc_get_window(int ch, int n, int* raw, uint64_t* t_ns);
+uint64_t rc_adc_get_overruns();
+
+
+/******************************************************************************
+* BATTERY STATE
+*
+* The rc_battery_monitor service estimates the state of charge of whichever
+* battery it is showing on the LEDs and shares it with every process. A
+* voltage threshold alone reads a battery as empty whenever the motors pull
+* its voltage down, so the monitor counts the charge drawn and subtracts the
+* sag across the internal resistance of the pack, which it learns from how
+* the voltage steps when the current does. The current comes from the duty
+* cycles of the motors, which rc_set_motor() and friends share automatically,
+* or from a current sensor if the program has one. Duties set by a program
+* that crashed stop counting once it is gone. Sharing needs root or the group
+* of /dev/shm/rc_battery.
+*
+* @ int rc_battery_get_state(rc_battery_state_t* s)
+*
+* Copies the monitor's latest estimate into s. Returns -1 if the monitor isn't
+* running. It updates about 20 times a second, compare t_ns with
+* rc_nanos_since_boot() to tell if it stopped. remaining_s is at the average
+* current of the last half minute or so. soc is the fraction of charge left
+* and soc_std its uncertainty, large right after the battery is connected.
+*
+* @ int rc_battery_report_current(float amps)
+*
+* Programs with a sensor measuring the battery discharge current report it
+* here, at least once a second, and the monitor uses it instead of the motor
+* duty cycles. Requires root or the group of /dev/shm/rc_battery.
+******************************************************************************/
+typedef struct rc_battery_state_t{
+	uint64_t t_ns;			// rc_nanos_since_boot() of the estimate
+	int cells;				// 0 if no battery was found
+	int charging;
+	int current_measured;	// 1 if current_a came from a sensor
+	float voltage;			// measured battery voltage
+	float ocv;				// voltage with the sag under load added back
+	float current_a;		// discharge current
+	float resistance;		// internal resistance of the pack, ohms
+	float soc;				// state of charge from 0 to 1
+	float soc_std;
+	float remaining_s;		// time until empty, -1 if unknown
+} rc_battery_state_t;
+
+int rc_battery_get_state(rc_battery_state_t* s);
+int rc_battery_report_current(float amps);
 
 
 /******************************************************************************
@@ -438,6 +586,30 @@ float rc_adc_volt(int ch);
 * 10hz to prevent timing out. The timing accuracy of this loop is not critical
 * and the user can choose to update at whatever frequency they wish.
 *
+* @ int rc_servo_start_continuous(double frame_hz, int timeout_ms)
+* @ int rc_servo_stop_continuous()
+*
+* Alternatively the PRU can keep sending pulses on its own. After
+* rc_servo_start_continuous() it sends a pulse on every channel frame_hz
+* times per second, from 10hz up to 40khz for Multishot ESCs, and the
+* functions above only set the width used from the next frame on. Channels
+* send nothing until given a width. No pulse may be longer than the frame,
+* OneShot125 for example runs up to about 3khz.
+*
+* @ int rc_send_servo_pulses_us(const int us[8])
+*
+* Sets a different width for each channel. In continuous mode this and the
+* _all functions change every channel on the same frame, or none of them if
+* one of the widths is invalid.
+*
+* @ int rc_servo_set_failsafe_us(int ch, int us)
+* @ int rc_servo_in_failsafe()
+*
+* If none of the pulse functions are called for timeout_ms, the PRU switches
+* every channel to its failsafe width until they are called again. The
+* failsafe width defaults to 0 which sends no pulses at all. A timeout of 0
+* disables the failsafe. rc_cleanup() stops continuous mode.
+*
 * See the test_servos, sweep_servos, and calibrate_escs examples.
 ******************************************************************************/
 int rc_enable_servo_power_rail();
@@ -450,6 +622,74 @@ int rc_send_esc_pulse_normalized(int ch, float input);
 int rc_send_esc_pulse_normalized_all(float input);
 int rc_send_oneshot_pulse_normalized(int ch, float input);
 int rc_send_oneshot_pulse_normalized_all(float input);
+int rc_send_servo_pulses_us(const int us[8]);
+int rc_servo_start_continuous(double frame_hz, int timeout_ms);
+int rc_servo_stop_continuous();
+int rc_servo_set_failsafe_us(int ch, int us);
+int rc_servo_in_failsafe();
+
+
+/******************************************************************************
+* PRU SAMPLER
+*
+* @ int rc_pru_sampler_start(double rate_hz)
+* @ int rc_pru_sampler_stop()
+*
+* For fast control loops such as motor current control, PRU0 can sample the
+* 4th encoder channel and ADC channels 0-7 at a fixed rate from 1hz to 50khz
+* with no involvement from the ARM core. Samples are timed by the PRU's own
+* timer so they are free of scheduling jitter and are kept in a ring of the
+* last 256 samples in PRU shared memory. The ADC values are the newest
+* conversion at the time of each sample, with 8x averaging when the ADC clock
+* allows it at the requested rate. This takes over the ADC's continuous mode
+* so it can't be used together with rc_adc_start_continuous().
+* rc_pru_sampler_start() waits about 3 sample periods to check the first
+* samples come back well formed and fails if they don't.
+*
+* @ typedef struct rc_pru_sample_t
+* @ int rc_pru_sampler_read(rc_pru_sample_t* buf, int max)
+*
+* Copies up to max of the samples taken since the last call, oldest first,
+* and returns how many were copied. Call it often enough to keep up with the
+* ring, at 10khz that is at least every 25ms.
+*
+* @ uint64_t rc_pru_sampler_get_dropped()
+*
+* Counts samples that were overwritten before they could be read.
+******************************************************************************/
+typedef struct rc_pru_sample_t{
+	uint32_t seq;		// sample number since rc_pru_sampler_start()
+	uint64_t t_ns;		// rc_nanos_since_boot() time of the sample
+	int32_t encoder;	// encoder channel 4 position
+	uint16_t adc[8];	// raw 12-bit ADC channels 0-7
+} rc_pru_sample_t;
+
+int rc_pru_sampler_start(double rate_hz);
+int rc_pru_sampler_stop();
+int rc_pru_sampler_read(rc_pru_sample_t* buf, int max);
+uint64_t rc_pru_sampler_get_dropped();
+
+
+/******************************************************************************
+* PRU HEALTH
+*
+* @ int rc_pru_check()
+*
+* The PRU firmware reports its version and a heartbeat for each PRU in shared
+* memory. rc_pru_check() restarts both PRUs if a heartbeat has stopped for
+* half a second, then restores the 4th encoder position and the continuous
+* servo settings. It returns 1 if it restarted them, 0 if all is well and -1
+* if the firmware doesn't match the library or the restart failed. PRU0 only
+* beats while the sampler runs. A restart can take up to a second.
+*
+* rc_initialize() starts a watchdog thread at normal priority that calls
+* rc_pru_check() every 100ms, so a hung PRU comes back without the program
+* doing anything. Calling it yourself is still allowed. The servo functions in
+* continuous mode and rc_pru_sampler_read() never restart anything. While a
+* PRU is down they print a warning and return an error, -2 from
+* rc_send_servo_pulse_us() and -1 from rc_pru_sampler_read().
+******************************************************************************/
+int rc_pru_check();
 
 
 /******************************************************************************
@@ -495,6 +735,21 @@ int rc_send_oneshot_pulse_normalized_all(float input);
 * returns the number of nanoseconds since the last dsm packet was received.
 * if no packet has ever been received, returns UINT64_MAX;
 *
+* @ uint64_t rc_get_dsm_frame_timestamp()
+*
+* The parser thread sleeps in poll() on the UART and wakes as soon as bytes
+* arrive, so a frame is decoded within microseconds of its last byte. This
+* returns the rc_nanos_since_boot() time at which the frame completing the
+* current channel data was received, or 0 if none has been. Subtract it from
+* rc_nanos_since_boot() to get the age of the pilot's input.
+*
+* @ uint64_t rc_get_dsm_resync_count()
+*
+* Frames are delimited by the idle gap the receiver leaves between them. When
+* the parser finds itself mid-frame, for example on startup, it drops the
+* partial frame and resynchronizes on the next gap instead of flushing the
+* UART. This returns how many partial frames were dropped.
+*
 * @ int rc_stop_dsm_service()
 *
 * stops the background thread. Not necessary to be called by the user as
@@ -519,6 +774,8 @@ int   rc_is_new_dsm_data();
 int   rc_set_dsm_data_func(void (*func)(void));
 int   rc_is_dsm_active();
 uint64_t rc_nanos_since_last_dsm_packet();
+uint64_t rc_get_dsm_frame_timestamp();
+uint64_t rc_get_dsm_resync_count();
 int   rc_get_dsm_resolution();
 int   rc_num_dsm_channels();
 int   rc_bind_dsm();
@@ -562,7 +819,11 @@ int   rc_calibrate_dsm_routine();
 *
 * Configuration struct passed to rc_initialize_imu and rc_initialize_imu_dmp. It is 
 * best to get the default config with rc_default_imu_config() function and
-* modify from there.
+* modify from there. spi_slave selects the bus, 0 for I2C at i2c_bus and
+* i2c_addr which default to the onboard IMU, or SPI slave 1 or 2 for an external
+* MPU9250 wired to the SPI header, which is read at spi_speed_hz. Over SPI the
+* magnetometer is reached through the MPU9250's own I2C master so it works in
+* both random-read and DMP mode.
 *
 * @ struct rc_imu_data_t 
 *
@@ -667,6 +928,11 @@ typedef struct rc_imu_config_t{
 	int dmp_interrupt_priority; // scheduler priority for handler
 	int show_warnings;	// set to 1 to enable showing of rc_i2c_bus warnings
 
+	// bus the IMU is on
+	int spi_slave;		// 0 for I2C, 1 or 2 for SPI
+	int spi_speed_hz;	// sensor and fifo read speed on SPI, max 20mhz
+	int i2c_bus;		// I2C bus and address when spi_slave is 0,
+	int i2c_addr;		// default the onboard IMU
 } rc_imu_config_t;
 
 typedef struct rc_imu_data_t{
@@ -736,6 +1002,119 @@ int rc_calibrate_mag_routine();
 int rc_is_gyro_calibrated();
 int rc_is_mag_calibrated();
 
+/*******************************************************************************
+* IMU Instances
+*
+* The functions above drive the onboard IMU and keep its state inside the
+* library. rc_imu_open() instead sets up any MPU9250, the onboard one or
+* external ones on I2C or SPI, in random-read mode behind its own rc_imu_t so
+* several can be sampled side by side in one process. The bus comes from
+* spi_slave, i2c_bus and i2c_addr in the config. DMP mode remains with the
+* onboard driver above and the two should not be used on the same device.
+*
+* @ int rc_imu_open(rc_imu_t* imu, rc_imu_config_t conf)
+*
+* Resets and configures the device. The onboard IMU picks up its gyro and
+* magnetometer calibration from disk. Others start with zero gyro_offset and
+* mag_offset and unity mag_scale which may be filled in afterwards.
+*
+* @ int rc_imu_read(rc_imu_t* imu, rc_imu_sample_t* s)
+*
+* Reads accel, temperature and gyro in one burst, plus the magnetometer when
+* enabled, and stamps the sample with rc_nanos_since_boot() at the middle of
+* the transfer. The magnetometer only updates at 100hz, mag holds the newest
+* reading and mag_valid is set once there has been one.
+*
+* @ int rc_imu_close(rc_imu_t* imu)
+*
+* Puts the device to sleep and releases its bus.
+*
+* IMU Redundancy
+*
+* Combines up to RC_IMU_MAX_REDUNDANT IMUs into one sample and watches each
+* for failure. Sources are rc_imu_t instances read by
+* rc_imu_redundancy_update() or samples handed over with
+* rc_imu_redundancy_push(), for example ones built from the onboard
+* rc_imu_data_t in DMP mode. All must be mounted with the same orientation.
+*
+* @ int rc_imu_redundancy_init(rc_imu_redundancy_t* r, int n, float accel_tol, float gyro_tol)
+*
+* Prepares a manager for n sources. A source more than accel_tol m/s^2 or
+* gyro_tol deg/s away from the others on any axis counts as disagreeing.
+* Faults latch until the manager is initialized again.
+*
+* @ int rc_imu_redundancy_push(rc_imu_redundancy_t* r, int i, rc_imu_sample_t* s)
+*
+* Hands over a new sample from source i, or NULL when reading it failed.
+*
+* @ int rc_imu_redundancy_fuse(rc_imu_redundancy_t* r, uint64_t t_ns, rc_imu_sample_t* out)
+*
+* Brings the latest two samples of every healthy source to time t_ns with a
+* straight line, then takes the per-axis median of three or more sources or
+* the mean of two as out. Also updates health[] with the RC_IMU_FAULT flags
+* of each source: READ after repeated failed reads, STALE with no sample for
+* 50ms, STUCK when the output repeats exactly and DISAGREE when one of three
+* or more keeps straying from the median. Two sources that differ by more
+* than the tolerance set disagree instead since either could be at fault.
+* Returns the number of sources used, -1 if none is healthy.
+*
+* @ int rc_imu_redundancy_update(rc_imu_redundancy_t* r, rc_imu_t* imus[], rc_imu_sample_t* out)
+*
+* Reads the instances in imus, n of them with NULL for sources given with
+* rc_imu_redundancy_push(), and fuses at the time of the newest sample.
+*******************************************************************************/
+#define RC_IMU_MAX_REDUNDANT	4
+#define RC_IMU_FAULT_READ		0x01
+#define RC_IMU_FAULT_STALE		0x02
+#define RC_IMU_FAULT_STUCK		0x04
+#define RC_IMU_FAULT_DISAGREE	0x08
+
+typedef struct rc_imu_sample_t{
+	uint64_t t_ns;		// rc_nanos_since_boot() time of the sample
+	float accel[3];		// m/s^2
+	float gyro[3];		// degrees/s
+	float mag[3];		// uT, only if mag_valid
+	float temp;			// degrees Celsius
+	int mag_valid;
+} rc_imu_sample_t;
+
+typedef struct rc_imu_t{
+	rc_imu_config_t conf;
+	void* bus;				// bus state, internal
+	float accel_to_ms2;
+	float gyro_to_degs;
+	float gyro_offset[3];	// subtracted from gyro, degrees/s
+	float mag_adjust[3];	// factory sensitivity adjustment
+	float mag_offset[3];	// calibration, subtracted in uT
+	float mag_scale[3];		// calibration, applied after the offset
+	float mag[3];			// newest magnetometer reading in uT
+	int mag_valid;
+} rc_imu_t;
+
+typedef struct rc_imu_redundancy_t{
+	int n;
+	float accel_tol;
+	float gyro_tol;
+	uint64_t start_ns;
+	rc_imu_sample_t last[RC_IMU_MAX_REDUNDANT];
+	rc_imu_sample_t prev[RC_IMU_MAX_REDUNDANT];
+	int count[RC_IMU_MAX_REDUNDANT];		// samples received
+	int read_errors[RC_IMU_MAX_REDUNDANT];	// consecutive failed reads
+	int stuck[RC_IMU_MAX_REDUNDANT];		// consecutive repeated samples
+	int outlier[RC_IMU_MAX_REDUNDANT];		// consecutive samples off the median
+	int health[RC_IMU_MAX_REDUNDANT];		// RC_IMU_FAULT flags, 0 if healthy
+	int disagree;	// two healthy sources differ by more than the tolerance
+} rc_imu_redundancy_t;
+
+int rc_imu_open(rc_imu_t* imu, rc_imu_config_t conf);
+int rc_imu_read(rc_imu_t* imu, rc_imu_sample_t* s);
+int rc_imu_close(rc_imu_t* imu);
+
+int rc_imu_redundancy_init(rc_imu_redundancy_t* r, int n, float accel_tol, float gyro_tol);
+int rc_imu_redundancy_push(rc_imu_redundancy_t* r, int i, rc_imu_sample_t* s);
+int rc_imu_redundancy_fuse(rc_imu_redundancy_t* r, uint64_t t_ns, rc_imu_sample_t* out);
+int rc_imu_redundancy_update(rc_imu_redundancy_t* r, rc_imu_t* imus[], rc_imu_sample_t* out);
+
 /*******************************************************************************
 * BMP280 Barometer
 *
@@ -790,6 +1169,38 @@ int rc_is_mag_calibrated();
 * If you know the current sea level pressure for your region and weather, you 
 * can use this to correct the altititude reading. This is not necessary if you
 * only care about differential altitude from a starting point.
+*
+* @ int rc_bmp_start_service(rc_bmp_oversample_t oversample, double rate_hz,
+*														float filter_tc)
+* @ int rc_bmp_stop_service()
+* Instead of calling rc_read_barometer from your own loop, this samples the
+* barometer at rate_hz in the background. Each conversion is started by the
+* service (forced mode) so its timestamp is known, and the I2C reads are done
+* right after an IMU read so they don't delay it. The conversion time limits
+* the rate, for 50hz use BMP_OVERSAMPLE_4 or less. If filter_tc is greater
+* than 0 the altitude is also filtered with that time constant in seconds to
+* estimate vertical speed. The rc_bmp_get functions above keep working.
+* Stopping the service returns the barometer to the rc_initialize_barometer
+* settings.
+*
+* @ int rc_bmp_get_sample(rc_bmp_sample_t* sample)
+* Copies the newest sample. t_ns is rc_nanos_since_boot() at the middle of
+* the conversion and seq increases by one for each new sample. The filtered
+* values are only set while the service runs with a filter. Returns -1 if
+* nothing has been read yet.
+*
+* @ int rc_read_barometer_burst(int n, rc_bmp_burst_t* burst)
+* Reads n consecutive conversions, 2 to RC_BMP_MAX_BURST, at the fastest
+* rate the oversample given to rc_initialize_barometer() allows and averages
+* them, so this blocks for n conversion times. The batch is compensated
+* together in single precision, which costs a fraction of the 64 bit integer
+* divide rc_read_barometer() does per sample and agrees with it to well
+* under 0.1 Pa. The spread of the samples gives the noise: pressure_std_pa
+* is that of one sample and alt_std_m that of the averaged altitude. The IIR
+* filter would make the samples correlated and the noise look too low, so it
+* is turned off for the burst and back on after, which restarts it. The
+* rc_bmp_get functions return the averaged values afterwards.
+* Not available while the service runs.
 *******************************************************************************/
 typedef enum rc_bmp_oversample_t{
 	BMP_OVERSAMPLE_1  =	(0x01<<2), // update rate 182 HZ
@@ -815,6 +1226,82 @@ float rc_bmp_get_pressure_pa();
 float rc_bmp_get_altitude_m();
 int rc_set_sea_level_pressure_pa(float pa);
 
+typedef struct rc_bmp_sample_t{
+	uint64_t t_ns;
+	uint32_t seq;
+	float temp_c;
+	float pressure_pa;
+	float alt_m;
+	float filtered_alt_m;
+	float vertical_speed_ms;
+} rc_bmp_sample_t;
+
+int rc_bmp_start_service(rc_bmp_oversample_t oversample, double rate_hz, \
+														float filter_tc);
+int rc_bmp_stop_service();
+int rc_bmp_get_sample(rc_bmp_sample_t* sample);
+
+#define RC_BMP_MAX_BURST	64
+
+typedef struct rc_bmp_burst_t{
+	uint64_t t_ns;			// middle of the burst
+	int n;
+	float temp_c;
+	float pressure_pa;		// mean of the burst
+	float pressure_std_pa;	// standard deviation of one sample
+	float alt_m;
+	float alt_std_m;		// standard deviation of alt_m
+} rc_bmp_burst_t;
+
+int rc_read_barometer_burst(int n, rc_bmp_burst_t* burst);
+
+/*******************************************************************************
+* VERTICAL ESTIMATOR
+*
+* Fuses the accelerometer and barometer into altitude, vertical velocity and
+* an estimate of the accelerometer's vertical bias with a small Kalman filter.
+* The accelerometer provides the fast response and the barometer stops the
+* drift, so the output has neither the lag of a filtered barometer nor the
+* drift of integrated acceleration.
+*
+* @ int rc_vertical_estimator_init(rc_vertical_estimator_t* e, float accel_std,
+*											float bias_std, float baro_std)
+* Sets the noise levels: accel_std in m/s^2, bias_std is how fast the bias
+* can wander in m/s^2 per root second and baro_std in m. Something like 0.5,
+* 0.01 and 0.5 is a reasonable start for the cape's sensors.
+*
+* @ int rc_vertical_estimator_predict(rc_vertical_estimator_t* e, float accel[3],
+*											float quat[4], float dt)
+* Call at IMU rate, for example from the IMU interrupt function with accel
+* and dmp_quat from rc_imu_data_t and dt the IMU sample period. The
+* acceleration is rotated into the earth frame with the quaternion.
+*
+* @ int rc_vertical_estimator_correct(rc_vertical_estimator_t* e, float alt_m)
+* Call once for each new barometer altitude, see rc_bmp_get_sample(). The
+* first call sets the starting altitude, predict does nothing before it.
+*
+* The estimate is read straight from alt_m, vel_ms and accel_bias. Both steps
+* take a fixed time and allocate nothing so they are safe in a control loop.
+*******************************************************************************/
+typedef struct rc_vertical_estimator_t{
+	float alt_m;		// estimated altitude
+	float vel_ms;		// estimated vertical velocity, positive up
+	float accel_bias;	// estimated vertical accelerometer bias
+	float accel_up;		// latest vertical acceleration before bias removal
+	// filter internals
+	float P[3][3];
+	float accel_var;
+	float bias_var;
+	float baro_var;
+	int initialized;
+} rc_vertical_estimator_t;
+
+int rc_vertical_estimator_init(rc_vertical_estimator_t* e, float accel_std, \
+											float bias_std, float baro_std);
+int rc_vertical_estimator_predict(rc_vertical_estimator_t* e, float accel[3], \
+											float quat[4], float dt);
+int rc_vertical_estimator_correct(rc_vertical_estimator_t* e, float alt_m);
+
 /*******************************************************************************
 * I2C functions
 *
@@ -830,7 +1317,9 @@ int rc_set_sea_level_pressure_pa(float pa);
 * without initializing. rc_i2c_init only needs to be called once per bus.
 * 
 * @ int set_device_address(int bus, uint8_t devAddr)
-* Use this to change to another device address after initialization.
+* Use this to change to another device address after initialization. The
+* address is kept per thread so threads talking to different devices on the
+* same bus don't need to coordinate.
 * 
 * @ int rc_i2c_close(int bus) 
 * Closes the bus and device file descriptors.
@@ -838,9 +1327,31 @@ int rc_set_sea_level_pressure_pa(float pa);
 * @int rc_i2c_claim_bus(int bus)
 * @int rc_i2c_release_bus(int bus)
 * @int rc_i2c_get_in_use_state(int bus)
-* Claim and release bus are purely for the convenience of the user and are not 
-* necessary. They simply set a flag indicating that the bus is in use to help 
-* manage multiple device access in multithreaded applications.
+* Every transaction waits its turn for the bus so these are not needed for
+* single reads and writes. Claiming keeps the bus for the calling thread
+* across several transactions, other threads wait in rc_i2c_claim_bus or in
+* their next transaction until it is released. Claims nest and releasing a
+* bus the thread hasn't claimed does nothing. rc_i2c_get_in_use_state returns
+* 1 if another thread is using the bus at that moment.
+*
+* @ int rc_i2c_set_device_priority(int bus, uint8_t devAddr, int priority)
+* When several threads are waiting for the bus, the one talking to the device
+* with the highest priority goes first. Default is 0 for all devices. Among
+* equal priorities a device already selected on the bus goes first to save
+* an address change, then the earliest deadline, then in order of arrival.
+*
+* @ int rc_i2c_transfer(int bus, rc_i2c_transfer_t* t)
+* Reads or writes length bytes at register reg of device addr in one
+* scheduled transaction without touching the thread's device address. If
+* deadline_ns is not 0 and the bus doesn't become free before that
+* rc_nanos_since_boot() time, the transaction is dropped and -2 is returned.
+*
+* @ int rc_i2c_get_stats(int bus, uint8_t devAddr, rc_i2c_stats_t* stats)
+* @ int rc_i2c_reset_stats(int bus)
+* Per device counts of transactions, time spent on the bus, time spent
+* queued for it and deadlines missed since the bus was opened or the stats
+* were reset. Utilization is the fraction of that time the device held the
+* bus.
 *
 * @ int rc_i2c_read_byte(int bus, uint8_t regAddr, uint8_t *data)
 * @ int rc_i2c_read_bytes(int bus, uint8_t regAddr, uint8_t length, uint8_t *data)
@@ -866,6 +1377,26 @@ int rc_set_sea_level_pressure_pa(float pa);
 * send only the data given by the data argument. This is useful for more
 * complicated IO such as uploading firmware to a device.
 *******************************************************************************/
+typedef struct rc_i2c_transfer_t{
+	uint8_t addr;		// device address
+	uint8_t reg;		// register to read from or write to
+	uint8_t* data;
+	uint8_t length;
+	int write;			// 1 to write data, 0 to read into it
+	int priority;		// higher goes first when the bus is contended
+	uint64_t deadline_ns;// rc_nanos_since_boot() time, 0 for none
+} rc_i2c_transfer_t;
+
+typedef struct rc_i2c_stats_t{
+	uint64_t transactions;
+	uint64_t busy_ns;		// time spent on the bus
+	uint64_t wait_ns;		// time spent queued for the bus
+	uint64_t max_wait_ns;
+	uint64_t missed;		// transfers dropped at their deadline
+	float mean_wait_ns;
+	float utilization;		// busy_ns over the time since the stats started
+} rc_i2c_stats_t;
+
 int rc_i2c_init(int bus, uint8_t devAddr);
 int rc_i2c_close(int bus);
 int rc_i2c_set_device_address(int bus, uint8_t devAddr);
@@ -874,6 +1405,11 @@ int rc_i2c_claim_bus(int bus);
 int rc_i2c_release_bus(int bus);
 int rc_i2c_get_in_use_state(int bus);
 
+int rc_i2c_set_device_priority(int bus, uint8_t devAddr, int priority);
+int rc_i2c_transfer(int bus, rc_i2c_transfer_t* t);
+int rc_i2c_get_stats(int bus, uint8_t devAddr, rc_i2c_stats_t* stats);
+int rc_i2c_reset_stats(int bus);
+
 int rc_i2c_read_byte(int bus, uint8_t regAddr, uint8_t *data);
 int rc_i2c_read_bytes(int bus, uint8_t regAddr, uint8_t length,  uint8_t *data);
 int rc_i2c_read_word(int bus, uint8_t regAddr, uint16_t *data);
@@ -900,6 +1436,23 @@ int rc_i2c_send_byte(int bus, uint8_t data);
 * with select/deselect_spi_slave() functions. On the Robotics Cape, slave 1
 * can be used in either mode, but slave 2 must be selected manually. On the
 * BB Blue either slave can be used in manual or automatic modes. 
+*
+* All functions here are safe to call from several threads at once. While
+* either slave is in manual mode, messages to both slaves take turns with the
+* select and deselect around each one, so a device like an MPU9250 on manual
+* slave 2 is never deselected by traffic to slave 1. Calls to
+* rc_manual_select_spi_slave() made by the program itself are not covered.
+*
+* @ int rc_spi_transfer_list(int slave, rc_spi_xfer_t* list, int n)
+* Submits up to RC_SPI_MAX_XFERS transfers in one system call, for example a
+* register address followed by a burst read, or several register reads in a
+* row. Each transfer sends tx (zeros if NULL) while receiving into rx (if not
+* NULL), len bytes of each. The slave stays selected from the first transfer
+* to the last unless cs_change is set on a transfer, which deselects it
+* briefly after that one. delay_us waits after a transfer and speed_hz
+* overrides the speed given to rc_spi_init for it when not 0. In manual mode
+* the slave select is driven around the whole list. Returns the total number
+* of bytes transferred or -1 on error.
 *******************************************************************************/
 typedef enum ss_mode_t{
 	SS_MODE_AUTO,
@@ -911,6 +1464,17 @@ typedef enum ss_mode_t{
 #define SPI_MODE_CPOL1_CPHA0 2
 #define SPI_MODE_CPOL1_CPHA1 3
 
+#define RC_SPI_MAX_XFERS	32
+
+typedef struct rc_spi_xfer_t{
+	const uint8_t* tx;	// bytes to send, NULL to send zeros
+	uint8_t* rx;		// received bytes, NULL to discard
+	uint32_t len;
+	int cs_change;		// deselect the slave after this transfer
+	uint16_t delay_us;	// wait after this transfer
+	uint32_t speed_hz;	// 0 for the rc_spi_init speed
+} rc_spi_xfer_t;
+
 int rc_spi_init(ss_mode_t ss_mode, int spi_mode, int speed_hz, int slave);
 int rc_spi_fd(int slave);
 int rc_spi_close(int slave);
@@ -922,12 +1486,103 @@ int rc_spi_transfer(char* tx_data, int tx_bytes, char* rx_data, int slave);
 int rc_spi_write_reg_byte(char reg_addr, char data, int slave);
 char rc_spi_read_reg_byte(char reg_addr, int slave);
 int rc_spi_read_reg_bytes(char reg_addr, char* data, int bytes, int slave);
+int rc_spi_transfer_list(int slave, rc_spi_xfer_t* list, int n);
 
 
 
 /*******************************************************************************
 * UART
+*
+* The functions below rc_uart_bytes_available() hand ports to one shared I/O
+* thread which waits on all of them with epoll and keeps an RX and a TX ring
+* buffer per port, so GPS, telemetry and other serial devices don't each need
+* a thread blocking in read(). Calls on those ports never wait. The blocking
+* reads above refuse a port owned by the I/O thread and rc_uart_send_bytes()
+* queues to its TX ring instead.
+*
+* @ int rc_uart_io_start(int bus, int rx_size, int tx_size)
+*
+* Hands an initialized port to the I/O thread with rings of the given sizes,
+* 0 for 4096 bytes. rc_uart_io_stop() or rc_uart_close() give it back.
+*
+* @ int rc_uart_io_read(int bus, int max_bytes, char* buf)
+* @ int rc_uart_io_peek(int bus, int max_bytes, char* buf)
+* @ int rc_uart_io_available(int bus)
+*
+* Copy up to max_bytes already received and return how many, 0 if none. Peek
+* leaves them in the ring. Available gives how many are waiting.
+*
+* @ int rc_uart_io_write(int bus, int bytes, const char* data)
+*
+* Queues bytes to be sent and returns how many fit in the TX ring.
+*
+* @ int rc_uart_io_reserve(int bus, int bytes, rc_uart_span_t* span)
+* @ int rc_uart_io_commit(int bus, int bytes)
+*
+* Zero-copy alternative to rc_uart_io_write(). Reserve hands out bytes of
+* free TX ring space as up to two pieces in span and keeps the ring locked,
+* so encode the message into them quickly and without calling other
+* rc_uart_io functions, then commit to queue it. Reserve returns 0 when
+* there isn't room, in which case there is nothing to commit.
+*
+* @ int rc_uart_io_wait(int bus, int min_bytes, int timeout_ms)
+*
+* Blocks until min_bytes are available or timeout_ms passes, for callers
+* that want to. Returns the number available.
+*
+* @ int rc_uart_io_set_framing(int bus, rc_uart_framing_t* framing)
+*
+* Instead of the RX ring, received bytes are assembled into frames and each
+* whole frame is passed to framing->func from the I/O thread, which should
+* return quickly. length is the frame size for UART_FRAME_FIXED and the most
+* bytes a frame may have otherwise, up to RC_UART_MAX_FRAME.
+* UART_FRAME_DELIMITER ends a frame with the delimiter byte, which is kept.
+* UART_FRAME_LENGTH_PREFIX takes the frame length from a 1 or 2 byte little
+* endian field at len_offset plus len_adjust, for example len_offset 1,
+* len_bytes 1 and len_adjust 8 for MAVLink 1 with sync 0xFE. With has_sync
+* set, bytes are skipped until sync starts a frame. Bytes that can't form a
+* frame are dropped and counted in frame_errors. NULL goes back to the ring.
+*
+* @ int rc_uart_io_get_stats(int bus, rc_uart_stats_t* stats)
+*
+* Byte, frame and overrun counters since rc_uart_io_start().
 *******************************************************************************/
+#define RC_UART_MAX_FRAME	1024
+
+typedef enum rc_uart_frame_mode_t{
+	UART_FRAME_NONE,
+	UART_FRAME_DELIMITER,
+	UART_FRAME_FIXED,
+	UART_FRAME_LENGTH_PREFIX
+} rc_uart_frame_mode_t;
+
+typedef struct rc_uart_framing_t{
+	rc_uart_frame_mode_t mode;
+	int length;			// fixed frame size or the largest frame allowed
+	char delimiter;		// last byte of a frame for UART_FRAME_DELIMITER
+	int len_offset;		// position of the length field
+	int len_bytes;		// size of the length field, 1 or 2
+	int len_adjust;		// added to the field to give the whole frame length
+	int has_sync;		// frames start with sync
+	uint8_t sync;
+	void (*func)(int bus, char* frame, int len);
+} rc_uart_framing_t;
+
+typedef struct rc_uart_stats_t{
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_overruns;	// bytes dropped because the RX ring was full
+	uint64_t tx_overruns;	// bytes not queued because the TX ring was full
+	uint64_t frames;
+	uint64_t frame_errors;	// bytes or frames dropped by the framer
+	uint64_t driver_overruns;	// lost in the serial driver or UART FIFO
+} rc_uart_stats_t;
+
+typedef struct rc_uart_span_t{
+	char* data[2];	// second piece starts at the beginning of the ring
+	int len[2];
+} rc_uart_span_t;
+
 int rc_uart_init(int bus, int speed, float timeout);
 int rc_uart_close(int bus);
 int rc_uart_fd(int bus);
@@ -938,6 +1593,183 @@ int rc_uart_read_line(int bus, int max_bytes, char* buf);
 int rc_uart_flush(int bus);
 int rc_uart_bytes_available(int bus);
 
+int rc_uart_io_start(int bus, int rx_size, int tx_size);
+int rc_uart_io_stop(int bus);
+int rc_uart_io_read(int bus, int max_bytes, char* buf);
+int rc_uart_io_peek(int bus, int max_bytes, char* buf);
+int rc_uart_io_write(int bus, int bytes, const char* data);
+int rc_uart_io_reserve(int bus, int bytes, rc_uart_span_t* span);
+int rc_uart_io_commit(int bus, int bytes);
+int rc_uart_io_available(int bus);
+int rc_uart_io_wait(int bus, int min_bytes, int timeout_ms);
+int rc_uart_io_set_framing(int bus, rc_uart_framing_t* framing);
+int rc_uart_io_get_stats(int bus, rc_uart_stats_t* stats);
+
+/*******************************************************************************
+* TELEMETRY
+*
+* A compact binary link for streaming robot state to a ground station over a
+* port serviced by the UART I/O thread. The latest IMU, encoder, battery and
+* controller state is handed over with the set functions whenever it is
+* available and rc_telemetry_update() decides what goes out. Each stream has
+* its own rate and priority, and a message is only sent when the link budget
+* has room for it so a slow radio drops low priority streams rather than
+* falling behind. Messages are encoded straight into the TX ring.
+*
+* Every frame is little endian:
+*
+*	0xA5, payload length, message id, sequence, time in ms (4 bytes),
+*	payload, CRC-16/CCITT of everything after 0xA5 (2 bytes)
+*
+* Payloads are compressed by field. IMU accel is in units of 0.01 m/s^2,
+* gyro 0.1 deg/s and the quaternion 1/32767, all int16. Encoder positions are
+* zigzag varints. Battery voltages are uint16 mV with a charge percentage
+* byte, 255 when unknown. Controller values are IEEE half floats.
+*
+* @ int rc_telemetry_init(rc_telemetry_t* t, int bus, float bytes_per_s)
+*
+* Sets up a link on a port already given to rc_uart_io_start(). bytes_per_s
+* is how much of the link telemetry may use, around baudrate/10 for a wire
+* and less for a radio whose air rate is below its UART rate. All streams
+* start disabled.
+*
+* @ int rc_telemetry_set_rate(rc_telemetry_t* t, rc_tlm_stream_t stream,
+*											float hz, int priority)
+*
+* Sends stream at up to hz, 0 to disable it. When the budget is short the
+* streams with higher priority go first.
+*
+* @ int rc_telemetry_set_imu(rc_telemetry_t* t, rc_imu_data_t* data)
+* @ int rc_telemetry_set_encoders(rc_telemetry_t* t, int n, int* pos)
+* @ int rc_telemetry_set_battery(rc_telemetry_t* t, float pack_v,
+*											float jack_v, int percent)
+* @ int rc_telemetry_set_controller(rc_telemetry_t* t, int mode, int n,
+*							float* setpoint, float* measured, float* output)
+*
+* Update the state a stream sends, from any thread. The IMU stream uses
+* accel, gyro and dmp_quat. A stream only sends when its state was updated
+* since the last time it went out.
+*
+* @ int rc_telemetry_update(rc_telemetry_t* t)
+*
+* Sends whatever streams are due and fit, call it at least as fast as the
+* fastest stream, for example from an rc_periodic_t loop. Returns the number
+* of messages sent.
+*
+* @ int rc_telemetry_decoder_init(rc_telemetry_decoder_t* d)
+* @ int rc_telemetry_decode_byte(rc_telemetry_decoder_t* d, uint8_t c,
+*											rc_telemetry_msg_t* msg)
+* @ int rc_telemetry_decode_frame(const uint8_t* frame, int len,
+*											rc_telemetry_msg_t* msg)
+*
+* The receiving side. These are in rc_telemetry_decode.c which needs nothing
+* else from the library so it can be built into a ground station program on
+* any machine. decode_byte takes the stream one byte at a time and returns 1
+* when msg holds a new message. decode_frame takes one whole frame, for
+* example from rc_uart_io_set_framing() with RC_TLM_FRAMING, and returns 0 or
+* -1 if it is corrupt.
+*******************************************************************************/
+#define RC_TLM_SYNC				0xA5
+#define RC_TLM_OVERHEAD			10	// header and CRC around the payload
+#define RC_TLM_MAX_PAYLOAD		255
+#define RC_TLM_MAX_ENCODERS		4
+#define RC_TLM_MAX_CONTROLLER	8
+// length prefixed framing for rc_uart_io_set_framing(), add the callback
+#define RC_TLM_FRAMING {UART_FRAME_LENGTH_PREFIX, RC_TLM_MAX_PAYLOAD+RC_TLM_OVERHEAD, \
+						0, 1, 1, RC_TLM_OVERHEAD, 1, RC_TLM_SYNC, NULL}
+
+typedef enum rc_tlm_stream_t{
+	RC_TLM_IMU,
+	RC_TLM_ENCODERS,
+	RC_TLM_BATTERY,
+	RC_TLM_CONTROLLER,
+	RC_TLM_STREAMS
+} rc_tlm_stream_t;
+
+typedef struct rc_tlm_imu_t{
+	float accel[3];		// m/s^2
+	float gyro[3];		// deg/s
+	float quat[4];
+} rc_tlm_imu_t;
+
+typedef struct rc_tlm_encoders_t{
+	int n;
+	int32_t pos[RC_TLM_MAX_ENCODERS];
+} rc_tlm_encoders_t;
+
+typedef struct rc_tlm_battery_t{
+	float pack_v;
+	float jack_v;
+	int percent;		// -1 when unknown
+} rc_tlm_battery_t;
+
+typedef struct rc_tlm_controller_t{
+	int mode;
+	int n;
+	float setpoint[RC_TLM_MAX_CONTROLLER];
+	float measured[RC_TLM_MAX_CONTROLLER];
+	float output[RC_TLM_MAX_CONTROLLER];
+} rc_tlm_controller_t;
+
+typedef struct rc_tlm_stream_state_t{
+	uint64_t period_ns;		// 0 when disabled
+	uint64_t next_ns;
+	int priority;
+	int fresh;				// state changed since it was last sent
+	uint64_t sent;
+	uint64_t skipped;		// sends missed for lack of new state or budget
+} rc_tlm_stream_state_t;
+
+typedef struct rc_telemetry_t{
+	int bus;
+	float budget;			// bytes per second
+	float tokens;			// bytes that may be sent right now
+	uint64_t last_ns;
+	uint8_t seq;
+	rc_tlm_stream_state_t stream[RC_TLM_STREAMS];
+	rc_tlm_imu_t imu;
+	rc_tlm_encoders_t encoders;
+	rc_tlm_battery_t battery;
+	rc_tlm_controller_t controller;
+	pthread_mutex_t mutex;
+} rc_telemetry_t;
+
+typedef struct rc_telemetry_msg_t{
+	rc_tlm_stream_t id;
+	uint8_t seq;
+	uint32_t t_ms;			// sender's rc_nanos_since_boot() in ms
+	rc_tlm_imu_t imu;		// only the one matching id is filled in
+	rc_tlm_encoders_t encoders;
+	rc_tlm_battery_t battery;
+	rc_tlm_controller_t controller;
+} rc_telemetry_msg_t;
+
+typedef struct rc_telemetry_decoder_t{
+	uint8_t frame[RC_TLM_MAX_PAYLOAD+RC_TLM_OVERHEAD];
+	int len;
+	int started;			// a sequence number has been seen
+	uint8_t last_seq;
+	uint64_t frames;
+	uint64_t bad_frames;		// failed the CRC or didn't make sense
+	uint64_t lost;			// frames missing from the sequence
+} rc_telemetry_decoder_t;
+
+int rc_telemetry_init(rc_telemetry_t* t, int bus, float bytes_per_s);
+int rc_telemetry_set_rate(rc_telemetry_t* t, rc_tlm_stream_t stream, \
+												float hz, int priority);
+int rc_telemetry_set_imu(rc_telemetry_t* t, rc_imu_data_t* data);
+int rc_telemetry_set_encoders(rc_telemetry_t* t, int n, int* pos);
+int rc_telemetry_set_battery(rc_telemetry_t* t, float pack_v, float jack_v, \
+																int percent);
+int rc_telemetry_set_controller(rc_telemetry_t* t, int mode, int n, \
+							float* setpoint, float* measured, float* output);
+int rc_telemetry_update(rc_telemetry_t* t);
+int rc_telemetry_decoder_init(rc_telemetry_decoder_t* d);
+int rc_telemetry_decode_byte(rc_telemetry_decoder_t* d, uint8_t c, \
+												rc_telemetry_msg_t* msg);
+int rc_telemetry_decode_frame(const uint8_t* frame, int len, \
+												rc_telemetry_msg_t* msg);
+
 /*******************************************************************************
 * CPU Frequency Control
 *
@@ -1048,6 +1880,64 @@ int rc_set_default_pinmux();
 
 /*******************************************************************************
 * GPIO
+*
+* rc_gpio_set_value() and rc_gpio_get_value() use the sysfs interface. The
+* value file of each pin is opened on first use and kept open until the pin
+* is unexported, so each call costs one syscall.
+*
+* @ typedef struct rc_gpio_handle_t
+* @ int rc_gpio_handle_open(rc_gpio_handle_t* h, int pin)
+* @ int rc_gpio_handle_set(rc_gpio_handle_t* h, int value)
+* @ int rc_gpio_handle_get(rc_gpio_handle_t* h)
+* @ int rc_gpio_handle_close(rc_gpio_handle_t* h)
+*
+* A handle resolves a pin once for fast repeated access, for example a chip
+* select or status LED toggled in a loop. After rc_initialize() handles write
+* the GPIO bank registers through mmap which takes well under a microsecond.
+* Without mmap they fall back to the cached sysfs value file. The pin must
+* already be exported and set to the right direction.
+*
+* @ int rc_gpio_set_values(int n, const int* pins, const int* values)
+*
+* Sets n output pins in one call. Pins are grouped by GPIO bank and with mmap
+* every bank touched takes one register write, so pins in the same bank
+* change at the same instant.
+*
+* GPIO character device
+*
+* The functions below use /dev/gpiochipN instead of /sys/class/gpio. Lines
+* don't need to be exported, but a line exported through sysfs can't be
+* requested here until it is unexported. rc_initialize_imu_dmp() uses this
+* for the IMU interrupt line when available.
+*
+* @ int rc_gpio_chardev_available()
+*
+* Returns 1 if the kernel provides GPIO character devices, otherwise 0.
+*
+* @ typedef struct rc_gpio_lines_t
+* @ int rc_gpio_lines_request(rc_gpio_lines_t* l, int n, const int* pins,
+*			rc_pin_direction_t dir, const int* defaults, const char* label)
+* @ int rc_gpio_lines_get(rc_gpio_lines_t* l, int* values)
+* @ int rc_gpio_lines_set(rc_gpio_lines_t* l, const int* values)
+* @ int rc_gpio_lines_release(rc_gpio_lines_t* l)
+*
+* Requests up to RC_GPIO_MAX_LINES pins, which must all be on the same GPIO
+* bank (same pin/32), as inputs or outputs. All lines of a request are read
+* or written with a single ioctl. defaults holds initial output values and
+* may be NULL. label names the consumer shown by gpioinfo and may be NULL.
+*
+* @ typedef struct rc_gpio_event_t
+* @ int rc_gpio_event_request(rc_gpio_lines_t* l, int pin, rc_pin_edge_t edge,
+*														const char* label)
+* @ int rc_gpio_event_read(rc_gpio_lines_t* l, rc_gpio_event_t* ev)
+*
+* Requests an input line that queues an event for each rising, falling or
+* both edges. l->fd becomes readable (POLLIN) while events are queued so any
+* number of event lines can be serviced by one thread with poll() or epoll.
+* rc_gpio_event_read() blocks until an event is available unless l->fd was
+* set O_NONBLOCK. Each event carries the edge direction and the time the
+* kernel saw it, converted to CLOCK_MONOTONIC nanoseconds to match
+* rc_nanos_since_boot(). Release with rc_gpio_lines_release().
 *******************************************************************************/
 #define HIGH 1
 #define LOW 0
@@ -1075,6 +1965,43 @@ int rc_gpio_fd_close(int fd);
 int rc_gpio_set_value_mmap(int pin, int state);
 int rc_gpio_get_value_mmap(int pin);
 
+typedef struct rc_gpio_handle_t{
+	int pin;
+	int bank;		// GPIO bank 0-3
+	uint32_t mask;	// bit of the pin within its bank
+	int fd;			// sysfs value file when mmap isn't available, else -1
+} rc_gpio_handle_t;
+
+int rc_gpio_handle_open(rc_gpio_handle_t* h, int pin);
+int rc_gpio_handle_set(rc_gpio_handle_t* h, int value);
+int rc_gpio_handle_get(rc_gpio_handle_t* h);
+int rc_gpio_handle_close(rc_gpio_handle_t* h);
+int rc_gpio_set_values(int n, const int* pins, const int* values);
+
+#define RC_GPIO_MAX_LINES 32
+
+typedef struct rc_gpio_lines_t{
+	int fd;			// line handle or event file descriptor, -1 when released
+	int num_lines;
+	int pins[RC_GPIO_MAX_LINES];
+} rc_gpio_lines_t;
+
+typedef struct rc_gpio_event_t{
+	int pin;
+	rc_pin_edge_t edge;		// EDGE_RISING or EDGE_FALLING
+	uint64_t timestamp_ns;	// CLOCK_MONOTONIC time of the edge
+} rc_gpio_event_t;
+
+int rc_gpio_chardev_available();
+int rc_gpio_lines_request(rc_gpio_lines_t* l, int n, const int* pins, \
+			rc_pin_direction_t dir, const int* defaults, const char* label);
+int rc_gpio_lines_get(rc_gpio_lines_t* l, int* values);
+int rc_gpio_lines_set(rc_gpio_lines_t* l, const int* values);
+int rc_gpio_lines_release(rc_gpio_lines_t* l);
+int rc_gpio_event_request(rc_gpio_lines_t* l, int pin, rc_pin_edge_t edge, \
+														const char* label);
+int rc_gpio_event_read(rc_gpio_lines_t* l, rc_gpio_event_t* ev);
+
 
 /*******************************************************************************
 * PWM
@@ -1123,12 +2050,42 @@ int rc_gpio_get_value_mmap(int pin);
 * 1 and 2 are used by the motor H bridges. Channel 'ch' must be 'A' or 'B' and
 * duty must be from 0.0f to 1.0f. The subsystem must be intialized with
 * rc_pwm_init() before use. Returns 0 on success or -1 on failure.
+*
+* @ int rc_pwm_begin_update()
+* @ int rc_pwm_commit_update()
+*
+* Duty writes with rc_pwm_set_duty_mmap() go to shadow registers which the
+* hardware copies to the active compare registers at the next counter zero.
+* Between rc_pwm_begin_update() and rc_pwm_commit_update() those copies are
+* held on every subsystem, so any number of channel updates take effect
+* together on the next period after the commit. rc_set_motors() does this
+* internally. Calls may be nested, only the outermost commit releases.
+*
+* @ int rc_pwm_sync_counters()
+*
+* Aligns the periods of all running subsystems, which must be set to the same
+* frequency, so a committed batch lands on the same PWM edge on every
+* subsystem and not just within one period of each other. The motor
+* subsystems are synced when the motors are initialized. Call again after
+* changing frequency with rc_pwm_init().
+*
+* @ int rc_pwm_set_high_res(int ss, int enable)
+*
+* Enables the high-resolution PWM extension on channel A of a subsystem. The
+* falling edge is then placed in steps of roughly 150ps instead of the 10ns
+* TBCLK, about 6 bits of extra duty resolution at the 25khz motor frequency.
+* Only available when the time-base clock is undivided, which holds for
+* frequencies above about 1.5khz. Channel B is unaffected.
 *******************************************************************************/
 int rc_pwm_init(int ss, int frequency);
 int rc_pwm_close(int ss);
 int rc_pwm_set_duty(int ss, char ch, float duty);
 int rc_pwm_set_duty_ns(int ss, char ch, int duty_ns);
 int rc_pwm_set_duty_mmap(int ss, char ch, float duty);
+int rc_pwm_begin_update();
+int rc_pwm_commit_update();
+int rc_pwm_sync_counters();
+int rc_pwm_set_high_res(int ss, int enable);
 
 /*******************************************************************************
 * time
@@ -1202,7 +2159,83 @@ int rc_pwm_set_duty_mmap(int ss, char ch, float duty);
 * floating point value to make respresenting fractions of a second easier.
 * the timespec is passed as a pointer so it can be modified in place.
 * Seconds may be negative.
+*
+* @ typedef enum rc_clock_mode_t
+*
+* Every timed loop in the library (IMU initialization and calibration,
+* the battery monitor) sleeps and reads time
+* through rc_nanosleep(), rc_usleep(), rc_nanos_since_epoch() and
+* rc_nanos_since_boot(). These functions can be redirected to a different
+* clock source so the library can run faster than real time under test.
+* RC_CLOCK_REAL is the default and costs only a single predictable branch
+* over calling the kernel directly. rc_nanos_thread_time() and the thread
+* join timeouts used during cleanup always use the real clock.
+*
+* @ int rc_set_clock_real()
+*
+* Restores the normal kernel clocks. Threads parked in a virtual sleep are
+* released immediately.
+*
+* @ int rc_set_clock_accelerated(double rate)
+*
+* Time runs at 'rate' times real time from the moment this is called and all
+* sleeps are shortened by the same factor. A rate of 10 runs a 100hz
+* periodic loop every 1ms of wall time.
+*
+* @ int rc_set_clock_virtual(uint64_t start_ns)
+*
+* Switches to a deterministic discrete-event clock starting at start_ns
+* nanoseconds since boot. Time only moves forward when the caller advances
+* it. Threads calling rc_nanosleep() are parked with their wake time
+* registered until the clock reaches it. Calling it again while threads are
+* parked releases them early, as switching to the real clock would, before
+* the new timeline starts.
+*
+* @ int rc_set_clock_custom(rc_clock_t clock)
+*
+* Installs a user provided clock. All three function pointers in the struct
+* must be valid and ctx is passed back to each of them.
+*
+* @ rc_clock_mode_t rc_get_clock_mode()
+*
+* Returns the clock source currently in use.
+*
+* @ uint64_t rc_virtual_clock_next_event()
+*
+* Returns the earliest wake time of all threads sleeping on the virtual clock
+* or UINT64_MAX if no thread is sleeping.
+*
+* @ int rc_virtual_clock_step()
+*
+* Jumps virtual time to the next pending wake time and releases every thread
+* due at that time. Returns the number of threads released.
+*
+* @ int rc_virtual_clock_advance(uint64_t ns)
+*
+* Moves virtual time forward by ns nanoseconds, releasing every thread whose
+* wake time has passed.
+*
+* @ int rc_virtual_clock_wait_for_sleepers(int n, uint64_t timeout_ns)
+*
+* Blocks until at least n threads are sleeping on the virtual clock or until
+* timeout_ns of real time passes. Calling this between steps runs the
+* library's background threads in lock-step with the test harness. Returns
+* the number of sleeping threads or -1 on timeout.
 *******************************************************************************/
+typedef enum rc_clock_mode_t{
+	RC_CLOCK_REAL,
+	RC_CLOCK_ACCELERATED,
+	RC_CLOCK_VIRTUAL,
+	RC_CLOCK_CUSTOM
+} rc_clock_mode_t;
+
+typedef struct rc_clock_t{
+	uint64_t (*nanos_since_epoch)(void* ctx);
+	uint64_t (*nanos_since_boot)(void* ctx);
+	void (*nanosleep)(void* ctx, uint64_t ns);
+	void* ctx;
+} rc_clock_t;
+
 void rc_nanosleep(uint64_t ns);
 void rc_usleep(unsigned int us);
 uint64_t rc_timespec_to_micros(timespec ts);
@@ -1214,6 +2247,213 @@ uint64_t rc_nanos_since_boot();
 uint64_t rc_nanos_thread_time();
 timespec rc_timespec_diff(timespec A, timespec B);
 void rc_timespec_add(timespec* start, double seconds);
+int rc_set_clock_real();
+int rc_set_clock_accelerated(double rate);
+int rc_set_clock_virtual(uint64_t start_ns);
+int rc_set_clock_custom(rc_clock_t clock);
+rc_clock_mode_t rc_get_clock_mode();
+uint64_t rc_virtual_clock_next_event();
+int rc_virtual_clock_step();
+int rc_virtual_clock_advance(uint64_t ns);
+int rc_virtual_clock_wait_for_sleepers(int n, uint64_t timeout_ns);
+
+/*******************************************************************************
+* PERIODIC LOOPS
+*
+* Loops written as "do work, then rc_usleep(1000000/hz)" drift by the time the
+* loop body takes and nobody notices when they overrun. The functions here
+* replace that sleep with one until an absolute release time on
+* CLOCK_MONOTONIC using clock_nanosleep(TIMER_ABSTIME), and keep per-loop
+* timing statistics so the timing of every loop can be proven and the loop
+* eating the CPU can be found.
+*
+* @ typedef struct rc_periodic_t
+*
+* Holds the period, next release time and statistics of one loop. Declare
+* one per loop and treat the contents as read only except for stats.
+*
+* @ int rc_periodic_init(rc_periodic_t* p, const char* name, double hz)
+*
+* Prepares a loop to run at hz and registers it by name for
+* rc_print_periodic_stats(). The first release is one period from now.
+*
+* @ int rc_periodic_cleanup(rc_periodic_t* p)
+*
+* Unregisters a loop. The registry keeps a pointer to p, so call this before
+* p goes out of scope or is freed.
+*
+* @ int rc_periodic_wait(rc_periodic_t* p)
+*
+* Call this once per iteration where rc_usleep() used to be. It closes the
+* execution time accounting for the iteration that just ran, sleeps until
+* the next release and records how late the wakeup was. A job that finishes
+* after the next release counts as a missed deadline. If a job overran past
+* whole periods those releases are skipped instead of run back-to-back, and
+* the number skipped is returned.
+*
+* @ int rc_periodic_reset_stats(rc_periodic_t* p)
+*
+* Zeros the statistics of a loop, for example after initialization is done.
+*
+* @ int rc_print_periodic_stats()
+*
+* Prints activations, average and worst-case execution time, missed
+* deadlines, skipped releases, worst release jitter and the jitter histogram
+* of every registered loop. Histogram bin 0 counts wakeups less than 10us
+* late and each following bin doubles in width.
+*
+* @ int rc_pthread_create_rt(pthread_t* thread, void*(*func)(void*),
+*									void* arg, int priority, int cpu)
+*
+* Like pthread_create() but applies a SCHED_FIFO priority (1-99, or 0 to stay
+* on SCHED_OTHER) and pins the thread to a cpu (or -1 for no affinity). If the
+* process lacks the privileges, a warning is printed and a normal thread is
+* started instead.
+*
+* @ int rc_start_periodic_task(rc_periodic_t* p, const char* name, double hz,
+*						void (*func)(void), int priority, int cpu)
+* @ int rc_stop_periodic_task(rc_periodic_t* p)
+*
+* Runs func at hz in its own thread with the given priority and affinity
+* until stopped or until the flow state becomes EXITING. Stopping the task
+* also unregisters it.
+*******************************************************************************/
+#define RC_PERIODIC_NAME_LEN	16
+#define RC_PERIODIC_JITTER_BINS	12
+
+typedef struct rc_periodic_stats_t{
+	uint64_t activations;		// number of times the loop was released
+	uint64_t missed_deadlines;	// jobs that finished after the next release
+	uint64_t skipped_releases;	// releases dropped because of overruns
+	uint64_t wcet_ns;			// worst case execution time
+	uint64_t last_exec_ns;		// execution time of the most recent job
+	uint64_t total_exec_ns;		// sum of all execution times
+	uint64_t max_jitter_ns;		// worst lateness of a release
+	uint32_t jitter_hist[RC_PERIODIC_JITTER_BINS];
+} rc_periodic_stats_t;
+
+typedef struct rc_periodic_t{
+	char name[RC_PERIODIC_NAME_LEN];
+	uint64_t period_ns;
+	uint64_t next_release_ns;
+	uint64_t job_start_ns;
+	rc_periodic_stats_t stats;
+	// used by rc_start_periodic_task only
+	void (*func)(void);
+	pthread_t thread;
+	volatile int running;
+} rc_periodic_t;
+
+int rc_periodic_init(rc_periodic_t* p, const char* name, double hz);
+int rc_periodic_cleanup(rc_periodic_t* p);
+int rc_periodic_wait(rc_periodic_t* p);
+int rc_periodic_reset_stats(rc_periodic_t* p);
+int rc_print_periodic_stats();
+int rc_pthread_create_rt(pthread_t* thread, void*(*func)(void*), void* arg, \
+													int priority, int cpu);
+int rc_start_periodic_task(rc_periodic_t* p, const char* name, double hz, \
+							void (*func)(void), int priority, int cpu);
+int rc_stop_periodic_task(rc_periodic_t* p);
+
+/*******************************************************************************
+* REAL-TIME PROFILE
+*
+* By default the library only raises the priority of the IMU interrupt
+* thread. Nothing locks memory or prefaults stacks, so the first time a code
+* path touches a new page after arming the kernel has to fault it in, and the
+* ondemand cpu governor may change frequency mid-loop. Both show up as
+* latency spikes in control loops. The optional real-time profile fixes this
+* and is applied by rc_initialize().
+*
+* @ typedef struct rc_rt_profile_t
+*
+* lock_memory: call mlockall(MCL_CURRENT|MCL_FUTURE) so nothing is paged out
+* prefault_stack_kb: stack touched in main and in every library thread
+* prefault_heap_kb: heap touched and kept in a single malloc arena
+* cpu: cpu to pin the process and library threads to, -1 for no affinity
+* dsm_priority: SCHED_FIFO priority of the DSM parser thread, 0 for none
+* button_priority: SCHED_FIFO priority of the button thread, 0 for none
+* cpu_freq: frequency to pin the cpu to, FREQ_ONDEMAND leaves it alone
+*
+* The IMU interrupt thread keeps using dmp_interrupt_priority from
+* rc_imu_config_t but also receives the affinity and stack prefaulting.
+*
+* @ rc_rt_profile_t rc_default_rt_profile()
+*
+* Returns a profile with memory locked, 64kB stacks, 1MB heap, cpu 0, and the
+* cpu pinned at 1GHz.
+*
+* @ int rc_enable_rt_profile(rc_rt_profile_t profile)
+* @ int rc_disable_rt_profile()
+*
+* Enable the profile before calling rc_initialize(). rc_cleanup() puts back
+* the cpu governor that was active before if the profile changed it.
+*
+* @ int rc_rt_reset_fault_count()
+*
+* Starts counting page faults from now, call this when arming motors.
+*
+* @ int rc_rt_report()
+*
+* Prints whether memory is locked, page faults since the last reset, the cpu
+* governor and the actual policy, priority and affinity of each library
+* thread. Returns the number of violations of the profile found.
+*******************************************************************************/
+typedef struct rc_rt_profile_t{
+	int lock_memory;
+	int prefault_stack_kb;
+	int prefault_heap_kb;
+	int cpu;
+	int dsm_priority;
+	int button_priority;
+	rc_cpu_freq_t cpu_freq;
+} rc_rt_profile_t;
+
+rc_rt_profile_t rc_default_rt_profile();
+int rc_enable_rt_profile(rc_rt_profile_t profile);
+int rc_disable_rt_profile();
+int rc_rt_reset_fault_count();
+int rc_rt_report();
+
+/*******************************************************************************
+* LATENCY TRACING
+*
+* Trace points in the IMU interrupt thread, around read_dmp_fifo() and the
+* user's IMU callback, in rc_set_motor(), rc_send_servo_pulse_us() and the
+* DSM parser record a timestamp and event id into a lock-free ring owned by
+* the calling thread. This answers questions like "how long from the IMU
+* interrupt edge to the motor PWM write?". When tracing is disabled each trace
+* point is a single predictable branch.
+*
+* @ int rc_trace_enable(int events_per_thread)
+* @ int rc_trace_disable()
+* @ int rc_trace_reset()
+*
+* Start and stop recording, or discard what was recorded. Each thread keeps
+* the most recent events_per_thread events (0 for the default of 4096). All
+* memory is allocated by rc_trace_enable() so recording never allocates.
+*
+* @ int rc_print_trace_latencies()
+*
+* Prints count, min, average, 99th percentile and max latency of each stage:
+* interrupt to fifo read, fifo read, read to callback, the callback itself,
+* interrupt to first motor write, interrupt to first servo pulse, DSM packet
+* to complete frame and the DSM callback. Each stage is followed by a
+* histogram whose first bin is under 5us and each following bin doubles.
+*
+* @ int rc_write_trace_json(const char* path)
+*
+* Writes every recorded event in Chrome trace event format to be opened in
+* chrome://tracing or ui.perfetto.dev. See the rc_trace_latency example.
+*
+* Call the print and write functions after rc_trace_disable() so the rings
+* don't wrap while they are being read.
+*******************************************************************************/
+int rc_trace_enable(int events_per_thread);
+int rc_trace_disable();
+int rc_trace_reset();
+int rc_print_trace_latencies();
+int rc_write_trace_json(const char* path);
 
 /*******************************************************************************
 * Other Functions
@@ -1,5 +1,12 @@
 /*******************************************************************************
 * rc_i2c.c
+*
+* Each bus is owned by this file and shared between threads by a small
+* scheduler. A thread wanting the bus either gets it straight away or queues
+* and sleeps. When the bus is freed it is handed directly to the best waiter:
+* highest priority first, then one talking to the device already selected on
+* the bus, then the earliest deadline, then first come first served. A thread
+* holding a claim runs its transactions without queueing again.
 *******************************************************************************/
 
 // #define DEBUG
@@ -8,8 +15,12 @@
 #include <stdint.h> // for uint8_t types etc
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <linux/i2c-dev.h> //for IOCTL defs
 
@@ -21,68 +32,126 @@
 #define I2C1_FILE "/dev/i2c-1"
 #define I2C2_FILE "/dev/i2c-2"
 #define MAX_I2C_LENGTH   128
+#define I2C_ADDRESSES	128
+
+/*******************************************************************************
+* Local Types
+*******************************************************************************/
+// a thread queued for the bus, lives on the waiting thread's stack
+typedef struct i2c_waiter_t{
+	pthread_cond_t cond;
+	int priority;
+	uint8_t addr;
+	uint64_t deadline;		// CLOCK_MONOTONIC ns, 0 for none
+	uint64_t order;			// arrival order
+	int granted;
+	struct i2c_waiter_t* next;
+} i2c_waiter_t;
+
+typedef struct i2c_dev_stats_t{
+	uint64_t transactions;
+	uint64_t busy_ns;
+	uint64_t wait_ns;
+	uint64_t max_wait_ns;
+	uint64_t missed;
+} i2c_dev_stats_t;
 
 /******************************************************************
-* struct rc_i2c_t 
+* struct rc_i2c_t
 * contains the current state of a bus.
 * you don't need to create your own instance of this,
 * one for each bus is allocated here
 ******************************************************************/
 typedef struct rc_i2c_t {
 	/* data */
-	uint8_t devAddr;
+	uint8_t devAddr;		// address currently selected on the file
+	uint8_t defaultAddr;	// address for threads that never set their own
 	int bus;
 	int file;
 	int initialized;
-	int in_use;
+	pthread_mutex_t lock;
+	int busy;				// a transaction or claim holds the bus
+	int claimed;
+	pthread_t owner;		// thread holding the claim
+	int claim_depth;
+	i2c_waiter_t* waiters;
+	uint64_t next_order;
+	int priority[I2C_ADDRESSES];
+	i2c_dev_stats_t stats[I2C_ADDRESSES];
+	uint64_t stats_start;
 } rc_i2c_t;
 
-rc_i2c_t i2c[3]; 
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+static rc_i2c_t i2c[3] = {
+	{.lock = PTHREAD_MUTEX_INITIALIZER},
+	{.lock = PTHREAD_MUTEX_INITIALIZER},
+	{.lock = PTHREAD_MUTEX_INITIALIZER}
+};
+// each thread talks to its own device so threads can't change the address
+// out from under each other between set_device_address and a read
+static __thread uint8_t thread_addr[3];
+static __thread int thread_addr_set[3];
+static pthread_condattr_t cond_attr;
+static pthread_once_t cond_attr_once = PTHREAD_ONCE_INIT;
+
+/*******************************************************************************
+* Local Function Declarations
+*******************************************************************************/
+static int check_bus(int bus);
+static uint8_t current_addr(int bus);
+static int owns_claim(rc_i2c_t* b);
+static int acquire_bus(int bus, uint8_t addr, int priority, uint64_t deadline);
+static void release_bus(int bus);
+static int transfer(int bus, uint8_t addr, int priority, uint64_t deadline,\
+			const uint8_t* wdata, int wlen, uint8_t* rdata, int rlen);
+static uint64_t monotonic_nanos();
+static void init_cond_attr();
 
 
 /******************************************************************
 * rc_i2c_init
+*
+* Opens the bus the first time, later calls only select devAddr for the
+* calling thread so a second driver can't pull the file out from under a
+* thread that is using it.
 ******************************************************************/
 int rc_i2c_init(int bus, uint8_t devAddr){
+	rc_i2c_t* b;
 	if(bus!=1 && bus!=2){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
-	// claim the bus during this operation
-	int old_in_use = i2c[bus].in_use;
-	i2c[bus].in_use = 1;
-	
-	// start filling in the i2c state struct
-	i2c[bus].file = 0;
-	i2c[bus].devAddr = devAddr;
-	i2c[bus].bus     = bus;
-	i2c[bus].initialized = 1;
-	switch(bus){
-	case 1:
-		i2c[bus].file = open(I2C1_FILE, O_RDWR);
-		break;
-	case 2:
-		i2c[bus].file = open(I2C2_FILE, O_RDWR);
-		break;
-	default:
-		printf("i2c bus must be 1 or 2\n");
-		return -1;
-	}
-	if(i2c[bus].file==-1){
-		printf("failed to open /dev/i2c\n");
-		return -1;
-	}
-	#ifdef DEBUG
-	printf("calling ioctl slave address change\n");
-	#endif
-	if(ioctl(i2c[bus].file, I2C_SLAVE, devAddr) < 0){
-		printf("ioctl slave address change failed\n");
-		return -1;
+	b = &i2c[bus];
+	pthread_mutex_lock(&b->lock);
+	if(!b->initialized){
+		// start filling in the i2c state struct
+		b->bus = bus;
+		b->file = open(bus==1 ? I2C1_FILE : I2C2_FILE, O_RDWR);
+		if(b->file==-1){
+			pthread_mutex_unlock(&b->lock);
+			printf("failed to open /dev/i2c\n");
+			return -1;
+		}
+		#ifdef DEBUG
+		printf("calling ioctl slave address change\n");
+		#endif
+		if(ioctl(b->file, I2C_SLAVE, devAddr) < 0){
+			close(b->file);
+			pthread_mutex_unlock(&b->lock);
+			printf("ioctl slave address change failed\n");
+			return -1;
+		}
+		b->devAddr = devAddr;
+		b->stats_start = monotonic_nanos();
+		b->initialized = 1;
 	}
-	i2c[bus].devAddr = devAddr;
-	// return the in_use state to previous state.
-	i2c[bus].in_use = old_in_use;
-	
+	b->defaultAddr = devAddr;
+	pthread_mutex_unlock(&b->lock);
+	thread_addr[bus] = devAddr;
+	thread_addr_set[bus] = 1;
+
 	#ifdef DEBUG
 	printf("successfully initialized rc_i2c_%d\n", bus);
 	#endif
@@ -91,25 +160,20 @@ int rc_i2c_init(int bus, uint8_t devAddr){
 
 /******************************************************************
 * rc_i2c_set_device_address
+*
+* selects the device for the calling thread, the bus itself is only switched
+* when a transaction needs it
 ******************************************************************/
 int rc_i2c_set_device_address(int bus, uint8_t devAddr){
 	if(bus!=1 && bus!=2){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
-	// if the device address is already correct, just return
-	if(i2c[bus].devAddr == devAddr){
-		return 0;
-	}
-	// if not, change it with ioctl
-	#ifdef DEBUG
-	printf("calling ioctl slave address change\n");
-	#endif
-	if(ioctl(i2c[bus].file, I2C_SLAVE, devAddr) < 0){
-		printf("ioctl slave address change failed\n");
-		return -1;
-	}
-	i2c[bus].devAddr = devAddr;
+	thread_addr[bus] = devAddr;
+	thread_addr_set[bus] = 1;
+	pthread_mutex_lock(&i2c[bus].lock);
+	i2c[bus].defaultAddr = devAddr;
+	pthread_mutex_unlock(&i2c[bus].lock);
 	return 0;
 }
 
@@ -117,88 +181,218 @@ int rc_i2c_set_device_address(int bus, uint8_t devAddr){
 * rc_i2c_close
 ******************************************************************/
 int rc_i2c_close(int bus){
+	int ret;
 	if(bus!=1 && bus!=2){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
+	pthread_mutex_lock(&i2c[bus].lock);
 	i2c[bus].devAddr = 0;
-	if(close(i2c[bus].file) < 0) return -1;
 	i2c[bus].initialized = 0;
+	ret = close(i2c[bus].file);
+	pthread_mutex_unlock(&i2c[bus].lock);
+	if(ret < 0) return -1;
 	return 0;
 }
 
 /******************************************************************
 * rc_i2c_claim_bus(int bus)
+*
+* Waits for the bus like any transaction would and then keeps it for the
+* calling thread until rc_i2c_release_bus(). Claims nest.
 ******************************************************************/
 int rc_i2c_claim_bus(int bus){
+	rc_i2c_t* b;
+	uint8_t addr;
 	if(bus!=1 && bus!=2){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
-	i2c[bus].in_use=1;
+	b = &i2c[bus];
+	pthread_mutex_lock(&b->lock);
+	if(owns_claim(b)){
+		b->claim_depth++;
+		pthread_mutex_unlock(&b->lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&b->lock);
+	addr = current_addr(bus);
+	if(acquire_bus(bus, addr, b->priority[addr&0x7F], 0)) return -1;
+	pthread_mutex_lock(&b->lock);
+	b->claimed = 1;
+	b->owner = pthread_self();
+	b->claim_depth = 1;
+	pthread_mutex_unlock(&b->lock);
 	return 0;
 }
 
 /******************************************************************
 * rc_i2c_release_bus(int bus)
+*
+* does nothing unless the calling thread holds a claim
 ******************************************************************/
 int rc_i2c_release_bus(int bus){
+	rc_i2c_t* b;
 	if(bus!=1 && bus!=2){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
-	i2c[bus].in_use=0;
+	b = &i2c[bus];
+	pthread_mutex_lock(&b->lock);
+	if(!owns_claim(b)){
+		pthread_mutex_unlock(&b->lock);
+		return 0;
+	}
+	b->claim_depth--;
+	if(b->claim_depth>0){
+		pthread_mutex_unlock(&b->lock);
+		return 0;
+	}
+	b->claimed = 0;
+	pthread_mutex_unlock(&b->lock);
+	release_bus(bus);
 	return 0;
 }
 
 /******************************************************************
 * rc_i2c_get_in_use_state(int bus)
+*
+* returns 1 if another thread is using the bus right now
 ******************************************************************/
 int rc_i2c_get_in_use_state(int bus){
+	int ret;
 	if(bus!=1 && bus!=2){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
-	return i2c[bus].in_use;
+	pthread_mutex_lock(&i2c[bus].lock);
+	ret = i2c[bus].busy && !owns_claim(&i2c[bus]);
+	pthread_mutex_unlock(&i2c[bus].lock);
+	return ret;
 }
 
 /******************************************************************
-* rc_i2c_read_bytes
+* rc_i2c_set_device_priority(int bus, uint8_t devAddr, int priority)
 ******************************************************************/
-int rc_i2c_read_bytes(int bus, uint8_t regAddr, uint8_t length,\
-												uint8_t *data) {
+int rc_i2c_set_device_priority(int bus, uint8_t devAddr, int priority){
+	if(bus!=1 && bus!=2){
+		printf("i2c bus must be 1 or 2\n");
+		return -1;
+	}
+	i2c[bus].priority[devAddr&0x7F] = priority;
+	return 0;
+}
+
+/******************************************************************
+* rc_i2c_transfer(int bus, rc_i2c_transfer_t* t)
+*
+* returns 0 on success, -1 on bus error or if fewer bytes than t->length
+* were read and -2 if the deadline passed before the bus was free
+******************************************************************/
+int rc_i2c_transfer(int bus, rc_i2c_transfer_t* t){
+	uint8_t wdata[MAX_I2C_LENGTH+1];
+	uint64_t deadline = 0;
+	int64_t left;
 	int ret;
-	
-	// Boundary checks
+	if(check_bus(bus)) return -1;
+	if(t==NULL || t->data==NULL || t->length>MAX_I2C_LENGTH){
+		printf("ERROR: in rc_i2c_transfer, invalid argument\n");
+		return -1;
+	}
+	// the deadline is on the rc_nanos_since_boot() clock
+	if(t->deadline_ns){
+		left = (int64_t)(t->deadline_ns - rc_nanos_since_boot());
+		if(left<=0){
+			pthread_mutex_lock(&i2c[bus].lock);
+			i2c[bus].stats[t->addr&0x7F].missed++;
+			pthread_mutex_unlock(&i2c[bus].lock);
+			return -2;
+		}
+		deadline = monotonic_nanos() + left;
+	}
+	wdata[0] = t->reg;
+	if(t->write){
+		memcpy(&wdata[1], t->data, t->length);
+		ret = transfer(bus, t->addr, t->priority, deadline, \
+										wdata, t->length+1, NULL, 0);
+	}
+	else{
+		ret = transfer(bus, t->addr, t->priority, deadline, \
+										wdata, 1, t->data, t->length);
+	}
+	if(ret==-2) return -2;
+	// a short read would leave the end of data holding old contents
+	if(ret<0 || (!t->write && ret!=t->length)) return -1;
+	return 0;
+}
+
+/******************************************************************
+* rc_i2c_get_stats(int bus, uint8_t devAddr, rc_i2c_stats_t* stats)
+******************************************************************/
+int rc_i2c_get_stats(int bus, uint8_t devAddr, rc_i2c_stats_t* stats){
+	i2c_dev_stats_t* s;
+	uint64_t elapsed;
+	if(bus!=1 && bus!=2){
+		printf("i2c bus must be 1 or 2\n");
+		return -1;
+	}
+	if(stats==NULL){
+		printf("ERROR: in rc_i2c_get_stats, received NULL pointer\n");
+		return -1;
+	}
+	pthread_mutex_lock(&i2c[bus].lock);
+	s = &i2c[bus].stats[devAddr&0x7F];
+	stats->transactions = s->transactions;
+	stats->busy_ns = s->busy_ns;
+	stats->wait_ns = s->wait_ns;
+	stats->max_wait_ns = s->max_wait_ns;
+	stats->missed = s->missed;
+	elapsed = monotonic_nanos() - i2c[bus].stats_start;
+	pthread_mutex_unlock(&i2c[bus].lock);
+	stats->utilization = elapsed ? (float)s->busy_ns/elapsed : 0.0f;
+	stats->mean_wait_ns = s->transactions ? (float)s->wait_ns/s->transactions : 0.0f;
+	return 0;
+}
+
+/******************************************************************
+* rc_i2c_reset_stats(int bus)
+******************************************************************/
+int rc_i2c_reset_stats(int bus){
 	if(bus!=1 && bus!=2){
 		printf("i2c bus must be 1 or 2\n");
 		return -1;
 	}
+	pthread_mutex_lock(&i2c[bus].lock);
+	memset(i2c[bus].stats, 0, sizeof(i2c[bus].stats));
+	i2c[bus].stats_start = monotonic_nanos();
+	pthread_mutex_unlock(&i2c[bus].lock);
+	return 0;
+}
+
+/******************************************************************
+* rc_i2c_read_bytes
+******************************************************************/
+int rc_i2c_read_bytes(int bus, uint8_t regAddr, uint8_t length,\
+												uint8_t *data) {
+	uint8_t addr;
+	int ret;
+
+	// Boundary checks
+	if(check_bus(bus)) return -1;
 	if(length > MAX_I2C_LENGTH){
 		printf("rc_i2c_read_byte data length is enforced as MAX_I2C_LENGTH!\n");
 	}
-	// claim the bus during this operation
-	int old_in_use = i2c[bus].in_use;
-	i2c[bus].in_use = 1;
-	
+	addr = current_addr(bus);
+
 	#ifdef DEBUG
-	printf("i2c devAddr:0x%x  ", i2c[bus].devAddr);
+	printf("i2c devAddr:0x%x  ", addr);
 	printf("reading %d bytes from 0x%x\n", length, regAddr);
 	#endif
-	
-	// write register to device 
-	ret = write(i2c[bus].file, &regAddr, 1);
-	if(ret!=1){ 
-		printf("write to i2c bus failed\n");
-		return -1;
-	}
-	
-	// then read the response
-	//usleep(300);
-	ret = read(i2c[bus].file, data, length);
 
-	// return the in_use state to previous state.
-	i2c[bus].in_use = old_in_use;
+	// write register to device then read the response
+	ret = transfer(bus, addr, i2c[bus].priority[addr&0x7F], 0, \
+											&regAddr, 1, data, length);
+	if(ret==-1) printf("write to i2c bus failed\n");
 	return ret;
 }
 
@@ -215,49 +409,31 @@ int rc_i2c_read_byte(int bus, uint8_t regAddr, uint8_t *data) {
 int rc_i2c_read_words(int bus, uint8_t regAddr, uint8_t length,\
 												uint16_t *data) {
 	int ret,i;
-	char buf[MAX_I2C_LENGTH];
+	uint8_t buf[MAX_I2C_LENGTH];
 
 	// Boundary checks
-	if(bus!=1 && bus!=2){
-		printf("i2c bus must be 1 or 2\n");
-		return -1;
-	}
+	if(check_bus(bus)) return -1;
 	if(length>(MAX_I2C_LENGTH/2)){
-		printf("rc_i2c_read_words length must be less than MAX_I2C_LENGTH/2\n"); 
+		printf("rc_i2c_read_words length must be less than MAX_I2C_LENGTH/2\n");
 		return -1;
 	}
-	// claim the bus during this operation
-	int old_in_use = i2c[bus].in_use;
-	i2c[bus].in_use = 1;
-	
+
 	#ifdef DEBUG
-	printf("i2c devAddr:0x%x  ", i2c[bus].devAddr);
+	printf("i2c devAddr:0x%x  ", current_addr(bus));
 	printf("reading %d words from 0x%x\n", length, regAddr);
 	#endif
 
-	// write first 
-	ret = write(i2c[bus].file, &regAddr, 1);
-	if(ret!=1){
-		printf("write to i2c bus failed\n");
-		return -1;
-	}
-
-	// then read the response
-	ret = read(i2c[bus].file, buf, length*2);
+	ret = rc_i2c_read_bytes(bus, regAddr, length*2, buf);
 	if(ret!=(length*2)){
 		printf("i2c device returned %d bytes\n",ret);
 		printf("expected %d bytes instead\n",length);
 		return -1;
 	}
-	
+
 	// form words from bytes and put into user's data array
 	for(i=0;i<length;i++){
-		data[i] = (((uint16_t)buf[0])<<8 | buf[1]); 
+		data[i] = (((uint16_t)buf[2*i])<<8 | buf[2*i+1]);
 	}
-	
-	// return the in_use state to previous state.
-	i2c[bus].in_use = old_in_use;
-	
 	return 0;
 }
 
@@ -284,43 +460,32 @@ int rc_i2c_read_bit(int bus, uint8_t regAddr, uint8_t bitNum,\
 ******************************************************************/
 int rc_i2c_write_bytes(int bus, uint8_t regAddr, uint8_t length,\
 												uint8_t* data){
-	int i,ret;
-	uint8_t writeData[length+1]; 
+	int i;
+	uint8_t writeData[length+1];
+
+	if(check_bus(bus)) return -1;
 
-	if(bus!=1 && bus!=2){
-		printf("i2c bus must be 1 or 2\n");
-		return -1;
-	}
-	
-	// claim the bus during this operation
-	int old_in_use = i2c[bus].in_use;
-	i2c[bus].in_use = 1;
-	
 	// assemble array to send, starting with the register address
-	writeData[0] = regAddr; 
+	writeData[0] = regAddr;
 	for(i=0; i<length; i++){
-		writeData[i+1] = data[i]; 
+		writeData[i+1] = data[i];
 	}
-	
+
 	#ifdef DEBUG
-	printf("i2c devAddr:0x%x  ", i2c[bus].devAddr);
+	printf("i2c devAddr:0x%x  ", current_addr(bus));
 	printf("writing %d bytes to 0x%x\n", length, regAddr);
 	printf("0x");
 	for (i=0; i<length; i++){
 		printf("%x\t", data[i]);
 	}
 	printf("\n");
-	#endif 
-	
+	#endif
+
 	// send the bytes
-	ret = write(i2c[bus].file, writeData, length+1);
-	// write should have returned the correct # bytes written
-	if( ret!=(length+1)){
+	if(rc_i2c_send_bytes(bus, length+1, writeData)){
 		printf("rc_i2c_write failed\n");
 		return -1;
 	}
-	// return the in_use state to previous state.
-	i2c[bus].in_use = old_in_use;
 	return 0;
 }
 
@@ -337,13 +502,11 @@ int rc_i2c_write_byte(int bus, uint8_t regAddr, uint8_t data) {
 ******************************************************************/
 int rc_i2c_write_words(int bus, uint8_t regAddr, uint8_t length,\
 												uint16_t* data){
-	int i,ret;
+	int i;
 	uint8_t writeData[(length*2)+1];
-   
-   // claim the bus during this operation
-	int old_in_use = i2c[bus].in_use;
-	i2c[bus].in_use = 1;
-	
+
+	if(check_bus(bus)) return -1;
+
    // assemble bytes to send
    writeData[0] = regAddr;
 	for (i=0; i<length; i++){
@@ -352,24 +515,19 @@ int rc_i2c_write_words(int bus, uint8_t regAddr, uint8_t length,\
 	}
 
 #ifdef DEBUG
-	printf("i2c devAddr:0x%x  ", i2c[bus].devAddr);
+	printf("i2c devAddr:0x%x  ", current_addr(bus));
 	printf("writing %d bytes to 0x%x\n", length, regAddr);
 	printf("0x");
 	for (i=0; i<(length*2)+1; i++){
 		printf("%x\t", writeData[i]);
 	}
 	printf("\n");
-#endif 
+#endif
 
-	ret = write(i2c[bus].file, writeData, (length*2)+1);
-	if(ret!=(length*2)+1){
+	if(rc_i2c_send_bytes(bus, (length*2)+1, writeData)){
 		printf("i2c write failed\n");
 		return -1;
 	}
-
-	// return the in_use state to previous state.
-	i2c[bus].in_use = old_in_use;
-	
    return 0;
 }
 
@@ -398,26 +556,19 @@ int rc_i2c_write_bit(int bus, uint8_t regAddr, uint8_t bitNum,\
 * rc_i2c_send_bytes
 ******************************************************************/
 int rc_i2c_send_bytes(int bus, uint8_t length, uint8_t* data){
-	int ret=0;
-	
-	if(bus!=1 && bus!=2){
-		printf("i2c bus must be 1 or 2\n");
-		return -1;
-	}
-	
-	// claim the bus during this operation
-	int old_in_use= i2c[bus].in_use;
-	i2c[bus].in_use = 1;
-	
+	uint8_t addr;
+
+	if(check_bus(bus)) return -1;
+	addr = current_addr(bus);
+
 #ifdef DEBUG
-	printf("i2c devAddr:0x%x  ", i2c[bus].devAddr);
+	printf("i2c devAddr:0x%x  ", addr);
 	printf("sending %d bytes\n", length);
 #endif
 
-	// send the bytes
-	ret = write(i2c[bus].file, data, length);
-	// write should have returned the correct # bytes written
-	if(ret!=length){
+	// send the bytes, write should return the correct # bytes written
+	if(transfer(bus, addr, i2c[bus].priority[addr&0x7F], 0, \
+										data, length, NULL, 0)!=0){
 		printf("rc_i2c_send failed\n");
 		return -1;
 	}
@@ -429,14 +580,11 @@ int rc_i2c_send_bytes(int bus, uint8_t length, uint8_t* data){
 		printf("%x\t", data[i]);
 	}
 	printf("\n");
-#endif 
-	
-	// return the in_use state to previous state.
-	i2c[bus].in_use = old_in_use;
-	
+#endif
+
 	return 0;
 }
- 
+
 /******************************************************************
 * rc_i2c_send_byte
 ******************************************************************/
@@ -444,3 +592,188 @@ int rc_i2c_send_byte(int bus, uint8_t data){
 	return rc_i2c_send_bytes(bus,1,&data);
 }
 
+/*******************************************************************************
+* static int check_bus(int bus)
+*******************************************************************************/
+static int check_bus(int bus){
+	if(bus!=1 && bus!=2){
+		printf("i2c bus must be 1 or 2\n");
+		return -1;
+	}
+	if(!i2c[bus].initialized){
+		printf("ERROR: i2c bus %d not initialized\n", bus);
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* static uint8_t current_addr(int bus)
+*******************************************************************************/
+static uint8_t current_addr(int bus){
+	uint8_t addr;
+	if(thread_addr_set[bus]) return thread_addr[bus];
+	pthread_mutex_lock(&i2c[bus].lock);
+	addr = i2c[bus].defaultAddr;
+	pthread_mutex_unlock(&i2c[bus].lock);
+	return addr;
+}
+
+/*******************************************************************************
+* static int owns_claim(rc_i2c_t* b)
+*
+* call with the bus lock held
+*******************************************************************************/
+static int owns_claim(rc_i2c_t* b){
+	return b->claimed && pthread_equal(b->owner, pthread_self());
+}
+
+/*******************************************************************************
+* static int acquire_bus(int bus, uint8_t addr, int priority, uint64_t deadline)
+*
+* Returns once the calling thread has the bus, or -2 if the deadline (on
+* CLOCK_MONOTONIC, 0 for none) passed while queued.
+*******************************************************************************/
+static int acquire_bus(int bus, uint8_t addr, int priority, uint64_t deadline){
+	rc_i2c_t* b = &i2c[bus];
+	i2c_waiter_t w, **pp;
+	i2c_dev_stats_t* s = &b->stats[addr&0x7F];
+	struct timespec ts;
+	uint64_t start, waited;
+	int ret = 0;
+
+	pthread_mutex_lock(&b->lock);
+	if(!b->busy && b->waiters==NULL){
+		b->busy = 1;
+		pthread_mutex_unlock(&b->lock);
+		return 0;
+	}
+	pthread_once(&cond_attr_once, init_cond_attr);
+	pthread_cond_init(&w.cond, &cond_attr);
+	w.priority = priority;
+	w.addr = addr;
+	w.deadline = deadline;
+	w.order = b->next_order++;
+	w.granted = 0;
+	w.next = b->waiters;
+	b->waiters = &w;
+	start = monotonic_nanos();
+	ts.tv_sec = deadline/1000000000ULL;
+	ts.tv_nsec = deadline%1000000000ULL;
+	while(!w.granted && ret==0){
+		if(deadline) ret = pthread_cond_timedwait(&w.cond, &b->lock, &ts);
+		else pthread_cond_wait(&w.cond, &b->lock);
+	}
+	if(!w.granted){
+		// timed out, take ourselves out of the queue
+		for(pp=&b->waiters; *pp!=&w; pp=&(*pp)->next);
+		*pp = w.next;
+		s->missed++;
+		ret = -2;
+	}
+	else{
+		waited = monotonic_nanos() - start;
+		s->wait_ns += waited;
+		if(waited>s->max_wait_ns) s->max_wait_ns = waited;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&b->lock);
+	pthread_cond_destroy(&w.cond);
+	return ret;
+}
+
+/*******************************************************************************
+* static void release_bus(int bus)
+*
+* hands the bus straight to the best waiter so nobody can barge in between
+*******************************************************************************/
+static void release_bus(int bus){
+	rc_i2c_t* b = &i2c[bus];
+	i2c_waiter_t *w, *best = NULL, **pp, **best_pp = NULL;
+	pthread_mutex_lock(&b->lock);
+	for(pp=&b->waiters; *pp!=NULL; pp=&(*pp)->next){
+		w = *pp;
+		if(best!=NULL){
+			if(w->priority!=best->priority){
+				if(w->priority<best->priority) continue;
+			}
+			else if((w->addr==b->devAddr) != (best->addr==b->devAddr)){
+				if(best->addr==b->devAddr) continue;
+			}
+			else if(w->deadline!=best->deadline){
+				if(w->deadline==0) continue;
+				if(best->deadline!=0 && w->deadline>best->deadline) continue;
+			}
+			else if(w->order>best->order) continue;
+		}
+		best = w;
+		best_pp = pp;
+	}
+	if(best!=NULL){
+		*best_pp = best->next;
+		best->granted = 1;
+		pthread_cond_signal(&best->cond);
+	}
+	else b->busy = 0;
+	pthread_mutex_unlock(&b->lock);
+}
+
+/*******************************************************************************
+* static int transfer(int bus, uint8_t addr, int priority, uint64_t deadline,
+*			const uint8_t* wdata, int wlen, uint8_t* rdata, int rlen)
+*
+* One scheduled transaction: write wlen bytes then read rlen bytes if rlen>0.
+* Returns the number of bytes read, 0 for a write, -1 on error or -2 if the
+* deadline passed first.
+*******************************************************************************/
+static int transfer(int bus, uint8_t addr, int priority, uint64_t deadline,\
+			const uint8_t* wdata, int wlen, uint8_t* rdata, int rlen){
+	rc_i2c_t* b = &i2c[bus];
+	i2c_dev_stats_t* s = &b->stats[addr&0x7F];
+	uint64_t start;
+	int nested, ret = 0;
+
+	pthread_mutex_lock(&b->lock);
+	nested = owns_claim(b);
+	pthread_mutex_unlock(&b->lock);
+	if(!nested){
+		ret = acquire_bus(bus, addr, priority, deadline);
+		if(ret) return ret;
+	}
+	start = monotonic_nanos();
+	if(b->devAddr!=addr){
+		if(ioctl(b->file, I2C_SLAVE, addr) < 0){
+			printf("ioctl slave address change failed\n");
+			ret = -1;
+		}
+		else b->devAddr = addr;
+	}
+	if(ret==0 && write(b->file, wdata, wlen)!=wlen) ret = -1;
+	if(ret==0 && rlen>0) ret = read(b->file, rdata, rlen);
+
+	pthread_mutex_lock(&b->lock);
+	s->transactions++;
+	s->busy_ns += monotonic_nanos() - start;
+	pthread_mutex_unlock(&b->lock);
+	if(!nested) release_bus(bus);
+	return ret;
+}
+
+/*******************************************************************************
+* static uint64_t monotonic_nanos()
+*
+* queue waits are real time even if rc_nanos_since_boot() is redirected
+*******************************************************************************/
+static uint64_t monotonic_nanos(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec*1000000000ULL) + ts.tv_nsec;
+}
+
+/*******************************************************************************
+* static void init_cond_attr()
+*******************************************************************************/
+static void init_cond_attr(){
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+}
@@ -1,7 +1,14 @@
 /*******************************************************************************
 * rc_spi.c
 *
-* Functions for interfacing with SPI1 on the beaglebone and Robotics Cape
+* Functions for interfacing with SPI1 on the beaglebone and Robotics Cape.
+* Transfers are built on the caller's stack and each slave has its own lock
+* so threads using the same slave don't trample each other's buffers. The two
+* slaves share the clock and data lines, so while either one uses manual
+* slave select a bus lock also makes each select, message and deselect one
+* unit, otherwise a manually selected slave would see the other's traffic or
+* lose its select line in the middle of a message. rc_spi_transfer_list()
+* submits a whole list of transfers to the driver in one ioctl.
 *******************************************************************************/
 
 #include "../roboticscape.h"
@@ -13,6 +20,7 @@
 #include <string.h>	// for memset
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <linux/spi/spidev.h>
 
@@ -23,13 +31,33 @@
 #define SPI_BITS_PER_WORD 	8
 #define SPI_BUF_SIZE		2
 
-int fd[2];			// file descriptor for SPI1_PATH device cs0, cs1
-int initialized[2];	// set to 1 after successful initialization 
-int gpio_ss[2];		// holds gpio pins for slave select lines
+/*******************************************************************************
+* Local Types
+*******************************************************************************/
+typedef struct spi_slave_t{
+	int fd;					// file descriptor for SPI1_PATH device cs0, cs1
+	int initialized;		// set to 1 after successful initialization
+	ss_mode_t ss_mode;
+	pthread_mutex_t lock;	// held for each message and manual select around it
+} spi_slave_t;
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+static spi_slave_t slaves[2] = {
+	{.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER},
+	{.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER}
+};
+static int gpio_ss[2];		// holds gpio pins for slave select lines
+static pthread_mutex_t bus_lock = PTHREAD_MUTEX_INITIALIZER; // see top of file
 
-struct spi_ioc_transfer xfer[2]; // ioctl transfer structs for tx & rx
-char tx_buf[SPI_BUF_SIZE];
-char rx_buf[SPI_BUF_SIZE];
+/*******************************************************************************
+* Local Function Declarations
+*******************************************************************************/
+static int check_slave(int slave);
+static void fill_xfer(struct spi_ioc_transfer* x, const void* tx, void* rx, \
+											uint32_t len, uint32_t speed_hz);
+static int submit(int slave, struct spi_ioc_transfer* x, int n, int manual_ss);
 
 /*******************************************************************************
 * @ int rc_spi_init(ss_mode_t ss_mode, int spi_mode, int speed_hz, int slave)
@@ -39,6 +67,7 @@ char rx_buf[SPI_BUF_SIZE];
 int rc_spi_init(ss_mode_t ss_mode, int spi_mode, int speed_hz, int slave){
 	int bits = SPI_BITS_PER_WORD;
 	int mode_proper;
+	int fd;
 	// sanity checks
 	if(speed_hz>SPI_MAX_SPEED || speed_hz<SPI_MIN_SPEED){
 		printf("ERROR: SPI speed_hz must be between %d & %d\n", SPI_MIN_SPEED,\
@@ -63,15 +92,15 @@ int rc_spi_init(ss_mode_t ss_mode, int spi_mode, int speed_hz, int slave){
 	// get file descriptor for spi1 device
 	switch(slave){
 	case 1: 
-		fd[0] = open(SPI10_PATH, O_RDWR);
-		if(fd[0] < 0) {
+		fd = open(SPI10_PATH, O_RDWR);
+		if(fd < 0) {
 			printf("ERROR: %s missing\n", SPI10_PATH); 
 		return -1; 
 		}
 		break;
 	case 2:
-		fd[1] = open(SPI11_PATH, O_RDWR);
-		if(fd[1] < 0) {
+		fd = open(SPI11_PATH, O_RDWR);
+		if(fd < 0) {
 			printf("ERROR: %s missing\n", SPI11_PATH); 
 		return -1; 
 		}
@@ -81,41 +110,35 @@ int rc_spi_init(ss_mode_t ss_mode, int spi_mode, int speed_hz, int slave){
 		return -1;
 	}
 	// set settings
-	if(ioctl(fd[slave-1], SPI_IOC_WR_MODE, &mode_proper)<0){
+	if(ioctl(fd, SPI_IOC_WR_MODE, &mode_proper)<0){
 		printf("can't set spi mode");
-		close(fd[slave-1]);
+		close(fd);
 		return -1;
-	}if(ioctl(fd[slave-1], SPI_IOC_RD_MODE, &mode_proper)<0){
+	}if(ioctl(fd, SPI_IOC_RD_MODE, &mode_proper)<0){
 		printf("can't get spi mode");
-		close(fd[slave-1]);
+		close(fd);
 		return -1;
-	}if(ioctl(fd[slave-1], SPI_IOC_WR_BITS_PER_WORD, &bits)<0){
+	}if(ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits)<0){
 		printf("can't set bits per word");
-		close(fd[slave-1]);
+		close(fd);
 		return -1;
-	}if(ioctl(fd[slave-1], SPI_IOC_RD_BITS_PER_WORD, &bits)<0){
+	}if(ioctl(fd, SPI_IOC_RD_BITS_PER_WORD, &bits)<0){
 		printf("can't get bits per word");
-		close(fd[slave-1]);
+		close(fd);
 		return -1;
-	} if(ioctl(fd[slave-1], SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz)<0){
+	} if(ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz)<0){
 		printf("can't set max speed hz");
-		close(fd[slave-1]);
+		close(fd);
 		return -1;
-	} if(ioctl(fd[slave-1], SPI_IOC_RD_MAX_SPEED_HZ, &speed_hz)<0){
+	} if(ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed_hz)<0){
 		printf("can't get max speed hz");
-		close(fd[slave-1]);
+		close(fd);
 		return -1;
 	}
 
 	// store settings
-	xfer[0].cs_change = 1;
-	xfer[0].delay_usecs = 0;
-	xfer[0].speed_hz = speed_hz;
-	xfer[0].bits_per_word = SPI_BITS_PER_WORD;
-	xfer[1].cs_change = 1;
-	xfer[1].delay_usecs = 0;
-	xfer[1].speed_hz = speed_hz;
-	xfer[1].bits_per_word = SPI_BITS_PER_WORD;
+	slaves[slave-1].fd = fd;
+	slaves[slave-1].ss_mode = ss_mode;
 
 	// set up slave select pins
 	if(rc_get_bb_model()==BB_BLUE){
@@ -142,7 +165,7 @@ int rc_spi_init(ss_mode_t ss_mode, int spi_mode, int speed_hz, int slave){
 		rc_manual_deselect_spi_slave(slave);
 	}
 	// all done
-	initialized[slave-1] = 1;
+	slaves[slave-1].initialized = 1;
 	return 0;
 }
 
@@ -155,22 +178,8 @@ int rc_spi_init(ss_mode_t ss_mode, int spi_mode, int speed_hz, int slave){
 * return -1
 *******************************************************************************/
 int rc_spi_fd(int slave){
-	switch(slave){
-	case 1:
-		if(initialized[0]==0){
-			printf("ERROR: SPI1 slave 1 not initialized yet\n");
-			return -1;
-		}
-		else return fd[0];
-	case 2:
-		if(initialized[1]==0){
-			printf("ERROR: SPI1 slave 2 not initialized yet\n");
-			return -1;
-		}
-		else return fd[1];
-	}
-	printf("ERROR: SPI Slave must be 1 or 2\n");
-	return -1;
+	if(check_slave(slave)) return -1;
+	return slaves[slave-1].fd;
 }
 
 /*******************************************************************************
@@ -179,43 +188,51 @@ int rc_spi_fd(int slave){
 * Closes the file descriptor and sets initialized to 0.
 *******************************************************************************/
 int rc_spi_close(int slave){
-	switch(slave){
-	case 1:
-		rc_manual_deselect_spi_slave(slave);
-		close(fd[0]);
-		initialized[0] = 0;
-		return 0;
-	case 2:
-		rc_manual_deselect_spi_slave(slave);
-		close(fd[1]);
-		initialized[1] = 0;
-		return 0;
+	spi_slave_t* s;
+	if(slave!=1 && slave!=2){
+		printf("ERROR: SPI Slave must be 1 or 2\n");
+		return -1;
 	}
-	printf("ERROR: SPI Slave must be 1 or 2\n");
-	return -1;
+	s = &slaves[slave-1];
+	pthread_mutex_lock(&s->lock);
+	rc_manual_deselect_spi_slave(slave);
+	close(s->fd);
+	s->fd = -1;
+	s->initialized = 0;
+	pthread_mutex_unlock(&s->lock);
+	return 0;
 }
 
 /*******************************************************************************
 * @ int manual_select_spi1_slave(int slave)
 *
 * Selects a slave (1 or 2) by pulling the corresponding slave select pin
-* to ground. It also ensures the other slave is not selected.
+* to ground. It also ensures the other slave is not selected. Fails if the
+* gpio registers can't be mapped.
 *******************************************************************************/
 int rc_manual_select_spi_slave(int slave){
+	int values[2];
 	switch(slave){
 		case 1:
-			rc_gpio_set_value_mmap(gpio_ss[0], LOW);
-			rc_gpio_set_value_mmap(gpio_ss[1], HIGH);
+			values[0] = LOW;
+			values[1] = HIGH;
 			break;
 		case 2:
-			rc_gpio_set_value_mmap(gpio_ss[0], HIGH);
-			rc_gpio_set_value_mmap(gpio_ss[1], LOW);
+			values[0] = HIGH;
+			values[1] = LOW;
 			break;
 		default:
 			printf("SPI slave number must be 1 or 2\n");
 			return -1;
 	}
-	return 0;
+	// rc_gpio_set_values() would quietly fall back to sysfs without mmap,
+	// which is far too slow for a select line, so insist on mmap here
+	if(initialize_mmap_gpio()){
+		fprintf(stderr,"ERROR in rc_manual_select_spi_slave, no mmap gpio\n");
+		return -1;
+	}
+	// both select lines change in one batched write
+	return rc_gpio_set_values(2, gpio_ss, values);
 }
 
 /*******************************************************************************
@@ -239,37 +256,54 @@ int rc_manual_deselect_spi_slave(int slave){
 	return 0;
 }
 
+/*******************************************************************************
+* int rc_spi_transfer_list(int slave, rc_spi_xfer_t* list, int n)
+*
+* Submits n transfers to the driver as one message so there is a single
+* ioctl and no gap for another thread to get in between. The chip select
+* stays asserted across the whole list except where cs_change asks for it
+* to be released. With SS_MODE_MANUAL the select line is driven around the
+* whole list and cs_change has no effect. Returns the total number of bytes
+* transferred or -1 on error.
+*******************************************************************************/
+int rc_spi_transfer_list(int slave, rc_spi_xfer_t* list, int n){
+	struct spi_ioc_transfer x[RC_SPI_MAX_XFERS];
+	int i;
+	if(check_slave(slave)) return -1;
+	if(list==NULL || n<1 || n>RC_SPI_MAX_XFERS){
+		printf("ERROR: in rc_spi_transfer_list, n must be from 1 to %d\n",\
+														RC_SPI_MAX_XFERS);
+		return -1;
+	}
+	for(i=0;i<n;i++){
+		if(list[i].len<1 || (list[i].speed_hz!=0 && \
+			(list[i].speed_hz>SPI_MAX_SPEED || list[i].speed_hz<SPI_MIN_SPEED))){
+			printf("ERROR: in rc_spi_transfer_list, invalid transfer %d\n", i);
+			return -1;
+		}
+		fill_xfer(&x[i], list[i].tx, list[i].rx, list[i].len, list[i].speed_hz);
+		x[i].delay_usecs = list[i].delay_us;
+		x[i].cs_change = list[i].cs_change ? 1 : 0;
+	}
+	return submit(slave, x, n, 1);
+}
+
 /*******************************************************************************
 * int rc_spi_send_bytes(char* data, int bytes, int slave)
 *
 * Like rc_uart_send_bytes, this lets you send any byte sequence you like.
 *******************************************************************************/
 int rc_spi_send_bytes(char* data, int bytes, int slave){
-	int ret;
+	struct spi_ioc_transfer x;
 	// sanity checks
-	if(slave!=1 && slave!=2){
-		printf("ERROR: SPI slave must be 1 or 2\n");
-		return -1;
-	}
-	if(initialized[slave-1]==0){
-		printf("ERROR: SPI slave %d not yet initialized\n", slave);
-		return -1;
-	} 
+	if(check_slave(slave)) return -1;
 	if(bytes<1){
 		printf("ERROR: rc_spi_send_bytes, bytes to send must be >=1\n");
 		return -1;
 	}
-	// fill in ioctl xfer struct. speed and bits were already set in initialize
-	xfer[0].rx_buf = 0;
-	xfer[0].tx_buf = (unsigned long) data;
-	xfer[0].len = bytes;
-	// send
-	ret = ioctl(fd[slave-1], SPI_IOC_MESSAGE(1), xfer);
-	if(ret<0){
-		printf("ERROR: SPI_IOC_MESSAGE_FAILED\n");
-		return -1;
-	}
-	return ret;
+	fill_xfer(&x, data, NULL, bytes, 0);
+	x.cs_change = 1;
+	return submit(slave, &x, 1, 0);
 }
 
 /*******************************************************************************
@@ -278,31 +312,16 @@ int rc_spi_send_bytes(char* data, int bytes, int slave){
 * Like rc_uart_read_bytes, this lets you read a byte sequence without sending.
 *******************************************************************************/
 int rc_spi_read_bytes(char* data, int bytes, int slave){
-	int ret;
+	struct spi_ioc_transfer x;
 	// sanity checks
-	if(slave!=1 && slave!=2){
-		printf("ERROR: SPI slave must be 1 or 2\n");
-		return -1;
-	}
-	if(initialized[slave-1]==0){
-		printf("ERROR: SPI slave %d not yet initialized\n", slave);
-		return -1;
-	} 
+	if(check_slave(slave)) return -1;
 	if(bytes<1){
 		printf("ERROR: rc_spi_read_bytes, bytes to read must be >=1\n");
 		return -1;
 	}
-	// fill in ioctl xfer struct. speed and bits were already set in initialize
-	xfer[0].rx_buf = (unsigned long) data;;
-	xfer[0].tx_buf = 0;
-	xfer[0].len = bytes;
-	// receive
-	ret=ioctl(fd[slave-1], SPI_IOC_MESSAGE(1), xfer);
-	if(ret<0){
-		printf("ERROR: SPI_IOC_MESSAGE_FAILED\n");
-		return -1;
-	}
-	return ret;
+	fill_xfer(&x, NULL, data, bytes, 0);
+	x.cs_change = 1;
+	return submit(slave, &x, 1, 0);
 }
 
 /*******************************************************************************
@@ -313,29 +332,16 @@ int rc_spi_read_bytes(char* data, int bytes, int slave){
 * the number of bytes received or -1 on error.
 *******************************************************************************/
 int rc_spi_transfer(char* tx_data, int tx_bytes, char* rx_data, int slave){
-	int ret;
+	struct spi_ioc_transfer x;
 	// sanity checks
-	if(slave!=1 && slave!=2){
-		printf("ERROR: SPI slave must be 1 or 2\n");
-		return -1;
-	}
-	if(initialized[slave-1]==0){
-		printf("ERROR: SPI slave %d not yet initialized\n", slave);
-		return -1;
-	} 
+	if(check_slave(slave)) return -1;
 	if(tx_bytes<1){
 		printf("ERROR: spi1_transfer, bytes must be >=1\n");
-	}
-	// fill in send struct 
-	xfer[0].tx_buf = (unsigned long) tx_data; 
-	xfer[0].rx_buf = (unsigned long) rx_data;
-	xfer[0].len = tx_bytes;
-	ret=ioctl(fd[slave-1], SPI_IOC_MESSAGE(1), xfer);
-	if(ret<0){
-		printf("SPI_IOC_MESSAGE_FAILED\n");
 		return -1;
 	}
-	return ret;
+	fill_xfer(&x, tx_data, rx_data, tx_bytes, 0);
+	x.cs_change = 1;
+	return submit(slave, &x, 1, 0);
 }
 
 /*******************************************************************************
@@ -347,27 +353,15 @@ int rc_spi_transfer(char* tx_data, int tx_bytes, char* rx_data, int slave){
 * functionality, use spi1_send_bytes() to send a byte string of your choosing.
 *******************************************************************************/
 int rc_spi_write_reg_byte(char reg_addr, char data, int slave){
+	struct spi_ioc_transfer x;
+	char tx_buf[SPI_BUF_SIZE];
 	// sanity checks
-	if(slave!=1 && slave!=2){
-		printf("ERROR: SPI slave must be 1 or 2\n");
-		return -1;
-	}
-	if(initialized[slave-1]==0){
-		printf("ERROR: SPI slave %d not yet initialized\n", slave);
-		return -1;
-	}
-	//wipe TX buffer and fill in register address and data
-	memset(tx_buf, 0, sizeof tx_buf);
+	if(check_slave(slave)) return -1;
 	tx_buf[0] = reg_addr | 0x80; /// set MSBit = 1 to indicate it's a write
 	tx_buf[1] = data;
-	// fill in ioctl zfer struct. speed and bits were already set in initialize
-	xfer[0].tx_buf = (unsigned long) tx_buf;
-	xfer[0].len = 2;
-	// send
-	if(ioctl(fd[slave-1], SPI_IOC_MESSAGE(1), xfer)<0){
-		printf("ERROR: SPI_IOC_MESSAGE_FAILED\n");
-		return -1;
-	}
+	fill_xfer(&x, tx_buf, NULL, 2, 0);
+	x.cs_change = 1;
+	if(submit(slave, &x, 1, 0)<0) return -1;
 	return 0;
 }
 
@@ -379,27 +373,15 @@ int rc_spi_write_reg_byte(char reg_addr, char data, int slave){
 * ICs. 
 *******************************************************************************/
 char rc_spi_read_reg_byte(char reg_addr, int slave){
+	struct spi_ioc_transfer x;
+	char tx_buf[SPI_BUF_SIZE] = {0};
+	char rx_buf[SPI_BUF_SIZE] = {0};
 	// sanity checks
-	if(slave!=1 && slave!=2){
-		printf("ERROR: SPI slave must be 1 or 2\n");
-		return -1;
-	}
-	if(initialized[slave-1]==0){
-		printf("ERROR: SPI slave %d not yet initialized\n", slave);
-		return -1;
-	}
-	// wipe buffers
-	memset(tx_buf, 0, sizeof tx_buf);
-	memset(rx_buf, 0, sizeof rx_buf);
-	// fill in xfer struct 
+	if(check_slave(slave)) return -1;
 	tx_buf[0] = reg_addr & 0x7f; // MSBit = 0 to indicate it's a read
-	xfer[0].tx_buf = (unsigned long) tx_buf; 
-	xfer[0].rx_buf = (unsigned long) rx_buf;
-	xfer[0].len = 1;
-	if(ioctl(fd[slave-1], SPI_IOC_MESSAGE(1), xfer)<0){
-		printf("SPI_IOC_MESSAGE_FAILED\n");
-		return -1;
-	}
+	fill_xfer(&x, tx_buf, rx_buf, 1, 0);
+	x.cs_change = 1;
+	if(submit(slave, &x, 1, 0)<0) return -1;
 	return rx_buf[0];
 }
 
@@ -408,40 +390,82 @@ char rc_spi_read_reg_byte(char reg_addr, int slave){
 *
 * Reads multiple bytes located at address reg_addr. This is accomplished
 * by sending the reg_addr with the MSB set to 0 indicating a read on many
-* ICs. 
+* ICs. The address and data are one message with the slave selected
+* throughout.
 *******************************************************************************/
 int rc_spi_read_reg_bytes(char reg_addr, char* data, int bytes, int slave){
-	int ret;
+	struct spi_ioc_transfer x[2];
+	char tx_buf[SPI_BUF_SIZE] = {0};
 	// sanity checks
-	if(slave!=1 && slave!=2){
-		printf("ERROR: SPI slave must be 1 or 2\n");
-		return -1;
-	}
-	if(initialized[slave-1]==0){
-		printf("ERROR: SPI slave %d not yet initialized\n", slave);
-		return -1;
-	} 
+	if(check_slave(slave)) return -1;
 	if(bytes<1){
 		printf("ERROR: spi1_read_reg_bytes, bytes must be >=1\n");
+		return -1;
 	}
-	// wipe buffers
-	memset(tx_buf, 0, sizeof tx_buf);
 	memset(data, 0, bytes);
-	// fill in send struct 
 	tx_buf[0] = reg_addr & 0x7f; // MSBit = 0 to indicate it's a read
-	xfer[0].tx_buf = (unsigned long) tx_buf; 
-	xfer[0].rx_buf = 0;
-	xfer[0].len = 1;
-	// fill in receive struct
-	xfer[1].tx_buf = 0;
-	xfer[1].rx_buf = (unsigned long) data;
-	xfer[1].len = bytes;
-	ret=ioctl(fd[slave-1], SPI_IOC_MESSAGE(2), xfer);
-	if (ret<0){
-		printf("SPI_IOC_MESSAGE_FAILED\n");
+	fill_xfer(&x[0], tx_buf, NULL, 1, 0);
+	fill_xfer(&x[1], NULL, data, bytes, 0);
+	x[1].cs_change = 1;
+	if(submit(slave, x, 2, 0)<0) return -1;
+	return 0;
+}
+
+/*******************************************************************************
+* static int check_slave(int slave)
+*******************************************************************************/
+static int check_slave(int slave){
+	if(slave!=1 && slave!=2){
+		printf("ERROR: SPI slave must be 1 or 2\n");
+		return -1;
+	}
+	if(slaves[slave-1].initialized==0){
+		printf("ERROR: SPI slave %d not yet initialized\n", slave);
 		return -1;
 	}
 	return 0;
 }
 
+/*******************************************************************************
+* static void fill_xfer(struct spi_ioc_transfer* x, const void* tx, void* rx,
+*											uint32_t len, uint32_t speed_hz)
+*
+* speed 0 uses the driver's speed set in rc_spi_init
+*******************************************************************************/
+static void fill_xfer(struct spi_ioc_transfer* x, const void* tx, void* rx, \
+											uint32_t len, uint32_t speed_hz){
+	memset(x, 0, sizeof(*x));
+	x->tx_buf = (unsigned long) tx;
+	x->rx_buf = (unsigned long) rx;
+	x->len = len;
+	x->speed_hz = speed_hz;
+	x->bits_per_word = SPI_BITS_PER_WORD;
+}
 
+/*******************************************************************************
+* static int submit(int slave, struct spi_ioc_transfer* x, int n, int manual_ss)
+*
+* Sends one message under the slave's lock, and the bus lock as well while
+* either slave uses manual select. With manual_ss set and the slave in
+* SS_MODE_MANUAL the select line is driven around the message too, the older
+* functions leave that to the caller.
+*******************************************************************************/
+static int submit(int slave, struct spi_ioc_transfer* x, int n, int manual_ss){
+	spi_slave_t* s = &slaves[slave-1];
+	int ret, shared;
+	manual_ss = manual_ss && s->ss_mode==SS_MODE_MANUAL;
+	shared = (slaves[0].initialized && slaves[0].ss_mode==SS_MODE_MANUAL) || \
+			(slaves[1].initialized && slaves[1].ss_mode==SS_MODE_MANUAL);
+	pthread_mutex_lock(&s->lock);
+	if(shared) pthread_mutex_lock(&bus_lock);
+	if(manual_ss) rc_manual_select_spi_slave(slave);
+	ret = ioctl(s->fd, SPI_IOC_MESSAGE(n), x);
+	if(manual_ss) rc_manual_deselect_spi_slave(slave);
+	if(shared) pthread_mutex_unlock(&bus_lock);
+	pthread_mutex_unlock(&s->lock);
+	if(ret<0){
+		printf("ERROR: SPI_IOC_MESSAGE_FAILED\n");
+		return -1;
+	}
+	return ret;
+}
@@ -0,0 +1,408 @@
+/*******************************************************************************
+* rc_telemetry.c
+*
+* Sending side of the telemetry link. The set functions keep the newest state
+* of each stream and rc_telemetry_update() picks which due streams to send
+* with a token bucket filled at the link budget, highest priority first. Each
+* message is encoded straight into space reserved in the port's TX ring with
+* the CRC worked out as the bytes are written.
+*******************************************************************************/
+#include "../roboticscape.h"
+#include "../preprocessor_macros.h"
+#include "rc_telemetry.h"
+#include <stdio.h>
+#include <string.h>
+
+// budget that may build up while there is nothing to send
+#define BURST_S			0.1f
+#define MAX_FRAME_LEN	(RC_TLM_MAX_PAYLOAD+RC_TLM_OVERHEAD)
+
+/*******************************************************************************
+* Local Types
+*******************************************************************************/
+typedef struct tlm_writer_t{
+	rc_uart_span_t span;
+	int piece;
+	int pos;
+	uint16_t crc;
+} tlm_writer_t;
+
+/*******************************************************************************
+* Local Function Declarations
+*******************************************************************************/
+static int next_stream(rc_telemetry_t* t, uint64_t now, int* done);
+static int payload_len(rc_telemetry_t* t, int stream);
+static int send_stream(rc_telemetry_t* t, int stream, uint64_t now);
+static void put_byte(tlm_writer_t* w, uint8_t c);
+static void put_u16(tlm_writer_t* w, uint16_t v);
+static void put_varint(tlm_writer_t* w, int32_t v);
+static int varint_len(int32_t v);
+static int16_t to_int16(float v, float scale);
+static uint16_t to_mv(float v);
+
+/*******************************************************************************
+* int rc_telemetry_init(rc_telemetry_t* t, int bus, float bytes_per_s)
+*
+* Starts a link on a port serviced by the UART I/O thread with every stream
+* disabled.
+*******************************************************************************/
+int rc_telemetry_init(rc_telemetry_t* t, int bus, float bytes_per_s){
+	if(t==NULL){
+		fprintf(stderr,"ERROR in rc_telemetry_init, received NULL pointer\n");
+		return -1;
+	}
+	if(bytes_per_s<=0.0f){
+		fprintf(stderr,"ERROR in rc_telemetry_init, bytes_per_s must be positive\n");
+		return -1;
+	}
+	if(rc_uart_io_available(bus)<0){
+		fprintf(stderr,"ERROR in rc_telemetry_init, call rc_uart_io_start first\n");
+		return -1;
+	}
+	memset(t, 0, sizeof(rc_telemetry_t));
+	t->bus = bus;
+	t->budget = bytes_per_s;
+	t->battery.percent = -1;
+	pthread_mutex_init(&t->mutex, NULL);
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_telemetry_set_rate(rc_telemetry_t* t, rc_tlm_stream_t stream,
+*											float hz, int priority)
+*
+* hz 0 disables the stream. The first message goes out as soon as there is
+* state for it.
+*******************************************************************************/
+int rc_telemetry_set_rate(rc_telemetry_t* t, rc_tlm_stream_t stream, \
+												float hz, int priority){
+	if(t==NULL || stream<0 || stream>=RC_TLM_STREAMS || hz<0.0f){
+		fprintf(stderr,"ERROR in rc_telemetry_set_rate, invalid argument\n");
+		return -1;
+	}
+	pthread_mutex_lock(&t->mutex);
+	t->stream[stream].period_ns = (hz>0.0f) ? (uint64_t)(1000000000.0/hz) : 0;
+	t->stream[stream].next_ns = 0;
+	t->stream[stream].priority = priority;
+	pthread_mutex_unlock(&t->mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_telemetry_set_imu(rc_telemetry_t* t, rc_imu_data_t* data)
+*
+* takes accel, gyro and the DMP quaternion
+*******************************************************************************/
+int rc_telemetry_set_imu(rc_telemetry_t* t, rc_imu_data_t* data){
+	int i;
+	if(unlikely(t==NULL || data==NULL)){
+		fprintf(stderr,"ERROR in rc_telemetry_set_imu, received NULL pointer\n");
+		return -1;
+	}
+	pthread_mutex_lock(&t->mutex);
+	for(i=0;i<3;i++){
+		t->imu.accel[i] = data->accel[i];
+		t->imu.gyro[i] = data->gyro[i];
+	}
+	for(i=0;i<4;i++) t->imu.quat[i] = data->dmp_quat[i];
+	t->stream[RC_TLM_IMU].fresh = 1;
+	pthread_mutex_unlock(&t->mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_telemetry_set_encoders(rc_telemetry_t* t, int n, int* pos)
+*
+* n positions, for example from rc_get_encoder_pos() for channels 1 to n
+*******************************************************************************/
+int rc_telemetry_set_encoders(rc_telemetry_t* t, int n, int* pos){
+	int i;
+	if(unlikely(t==NULL || pos==NULL || n<1 || n>RC_TLM_MAX_ENCODERS)){
+		fprintf(stderr,"ERROR in rc_telemetry_set_encoders, invalid argument\n");
+		return -1;
+	}
+	pthread_mutex_lock(&t->mutex);
+	t->encoders.n = n;
+	for(i=0;i<n;i++) t->encoders.pos[i] = pos[i];
+	t->stream[RC_TLM_ENCODERS].fresh = 1;
+	pthread_mutex_unlock(&t->mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_telemetry_set_battery(rc_telemetry_t* t, float pack_v, float jack_v,
+*																int percent)
+*
+* percent of charge left, -1 when unknown
+*******************************************************************************/
+int rc_telemetry_set_battery(rc_telemetry_t* t, float pack_v, float jack_v, \
+																int percent){
+	if(unlikely(t==NULL)){
+		fprintf(stderr,"ERROR in rc_telemetry_set_battery, received NULL pointer\n");
+		return -1;
+	}
+	pthread_mutex_lock(&t->mutex);
+	t->battery.pack_v = pack_v;
+	t->battery.jack_v = jack_v;
+	t->battery.percent = (percent<0 || percent>100) ? -1 : percent;
+	t->stream[RC_TLM_BATTERY].fresh = 1;
+	pthread_mutex_unlock(&t->mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_telemetry_set_controller(rc_telemetry_t* t, int mode, int n,
+*							float* setpoint, float* measured, float* output)
+*
+* n loops of a controller in an application defined mode 0-255, any of the
+* arrays may be NULL to send zeros
+*******************************************************************************/
+int rc_telemetry_set_controller(rc_telemetry_t* t, int mode, int n, \
+							float* setpoint, float* measured, float* output){
+	int i;
+	if(unlikely(t==NULL || n<1 || n>RC_TLM_MAX_CONTROLLER || mode<0 || mode>255)){
+		fprintf(stderr,"ERROR in rc_telemetry_set_controller, invalid argument\n");
+		return -1;
+	}
+	pthread_mutex_lock(&t->mutex);
+	t->controller.mode = mode;
+	t->controller.n = n;
+	for(i=0;i<n;i++){
+		t->controller.setpoint[i] = setpoint ? setpoint[i] : 0.0f;
+		t->controller.measured[i] = measured ? measured[i] : 0.0f;
+		t->controller.output[i] = output ? output[i] : 0.0f;
+	}
+	t->stream[RC_TLM_CONTROLLER].fresh = 1;
+	pthread_mutex_unlock(&t->mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_telemetry_update(rc_telemetry_t* t)
+*
+* Refills the budget and sends due streams in priority order until the next
+* one doesn't fit. That one stays due so a large high priority message isn't
+* starved by small ones slipping in ahead of it.
+*******************************************************************************/
+int rc_telemetry_update(rc_telemetry_t* t){
+	int done[RC_TLM_STREAMS] = {0};
+	uint64_t now;
+	float cap;
+	int s, ret, sent = 0;
+	if(unlikely(t==NULL)){
+		fprintf(stderr,"ERROR in rc_telemetry_update, received NULL pointer\n");
+		return -1;
+	}
+	now = rc_nanos_since_boot();
+	pthread_mutex_lock(&t->mutex);
+	cap = t->budget*BURST_S;
+	if(cap<MAX_FRAME_LEN) cap = MAX_FRAME_LEN;
+	if(t->last_ns) t->tokens += t->budget*(now-t->last_ns)/1000000000.0f;
+	else t->tokens = cap;
+	t->last_ns = now;
+	if(t->tokens>cap) t->tokens = cap;
+
+	while((s=next_stream(t, now, done))>=0){
+		done[s] = 1;
+		ret = send_stream(t, s, now);
+		if(ret<0){
+			pthread_mutex_unlock(&t->mutex);
+			return -1;
+		}
+		if(ret==0) break;
+		sent++;
+	}
+	pthread_mutex_unlock(&t->mutex);
+	return sent;
+}
+
+/*******************************************************************************
+* static int next_stream(rc_telemetry_t* t, uint64_t now, int* done)
+*
+* the due stream with new state and the highest priority, the longest
+* overdue among equals, or -1 if there is none
+*******************************************************************************/
+static int next_stream(rc_telemetry_t* t, uint64_t now, int* done){
+	rc_tlm_stream_state_t* st;
+	int i, best = -1;
+	for(i=0;i<RC_TLM_STREAMS;i++){
+		st = &t->stream[i];
+		if(done[i] || st->period_ns==0 || !st->fresh || st->next_ns>now) continue;
+		if(best<0 || st->priority>t->stream[best].priority || \
+			(st->priority==t->stream[best].priority && st->next_ns<t->stream[best].next_ns)){
+			best = i;
+		}
+	}
+	return best;
+}
+
+/*******************************************************************************
+* static int payload_len(rc_telemetry_t* t, int stream)
+*
+* size of the payload the stream's current state encodes to
+*******************************************************************************/
+static int payload_len(rc_telemetry_t* t, int stream){
+	int i, len;
+	switch(stream){
+	case RC_TLM_IMU:
+		return TLM_IMU_LEN;
+	case RC_TLM_ENCODERS:
+		len = 1;
+		for(i=0;i<t->encoders.n;i++) len += varint_len(t->encoders.pos[i]);
+		return len;
+	case RC_TLM_BATTERY:
+		return TLM_BATTERY_LEN;
+	case RC_TLM_CONTROLLER:
+		return 2 + 6*t->controller.n;
+	default:
+		return 0;
+	}
+}
+
+/*******************************************************************************
+* static int send_stream(rc_telemetry_t* t, int stream, uint64_t now)
+*
+* Encodes the stream into the TX ring if the budget and the ring have room.
+* Returns 1 if sent, 0 if not and -1 on error. Sends missed while waiting
+* for state or room are counted and the stream keeps its phase.
+*******************************************************************************/
+static int send_stream(rc_telemetry_t* t, int stream, uint64_t now){
+	rc_tlm_stream_state_t* st = &t->stream[stream];
+	tlm_writer_t w;
+	uint32_t t_ms;
+	uint64_t missed;
+	int i, len, plen, ret;
+	plen = payload_len(t, stream);
+	len = plen + RC_TLM_OVERHEAD;
+	if(t->tokens<len) return 0;
+	ret = rc_uart_io_reserve(t->bus, len, &w.span);
+	if(ret<=0) return ret;
+	w.piece = 0;
+	w.pos = 0;
+	w.crc = TLM_CRC_INIT;
+	t_ms = now/1000000;
+
+	put_byte(&w, RC_TLM_SYNC);
+	w.crc = TLM_CRC_INIT;	// the sync byte isn't covered
+	put_byte(&w, plen);
+	put_byte(&w, stream);
+	put_byte(&w, t->seq);
+	put_u16(&w, t_ms & 0xFFFF);
+	put_u16(&w, t_ms >> 16);
+	switch(stream){
+	case RC_TLM_IMU:
+		for(i=0;i<3;i++) put_u16(&w, to_int16(t->imu.accel[i], TLM_ACCEL_SCALE));
+		for(i=0;i<3;i++) put_u16(&w, to_int16(t->imu.gyro[i], TLM_GYRO_SCALE));
+		for(i=0;i<4;i++) put_u16(&w, to_int16(t->imu.quat[i], TLM_QUAT_SCALE));
+		break;
+	case RC_TLM_ENCODERS:
+		put_byte(&w, t->encoders.n);
+		for(i=0;i<t->encoders.n;i++) put_varint(&w, t->encoders.pos[i]);
+		break;
+	case RC_TLM_BATTERY:
+		put_u16(&w, to_mv(t->battery.pack_v));
+		put_u16(&w, to_mv(t->battery.jack_v));
+		put_byte(&w, (t->battery.percent<0) ? 255 : t->battery.percent);
+		break;
+	case RC_TLM_CONTROLLER:
+		put_byte(&w, t->controller.mode);
+		put_byte(&w, t->controller.n);
+		for(i=0;i<t->controller.n;i++){
+			put_u16(&w, tlm_float_to_half(t->controller.setpoint[i]));
+			put_u16(&w, tlm_float_to_half(t->controller.measured[i]));
+			put_u16(&w, tlm_float_to_half(t->controller.output[i]));
+		}
+		break;
+	}
+	put_u16(&w, w.crc);
+	rc_uart_io_commit(t->bus, len);
+
+	t->tokens -= len;
+	t->seq++;
+	st->fresh = 0;
+	st->sent++;
+	if(st->next_ns==0) st->next_ns = now;
+	missed = (now - st->next_ns)/st->period_ns;
+	st->skipped += missed;
+	st->next_ns += (missed+1)*st->period_ns;
+	return 1;
+}
+
+/*******************************************************************************
+* static void put_byte(tlm_writer_t* w, uint8_t c)
+*
+* writes into the reserved span and adds the byte to the CRC
+*******************************************************************************/
+static void put_byte(tlm_writer_t* w, uint8_t c){
+	if(w->pos>=w->span.len[w->piece]){
+		w->piece++;
+		w->pos = 0;
+	}
+	w->span.data[w->piece][w->pos++] = c;
+	w->crc = tlm_crc16(w->crc, c);
+}
+
+/*******************************************************************************
+* static void put_u16(tlm_writer_t* w, uint16_t v)
+*
+* little endian
+*******************************************************************************/
+static void put_u16(tlm_writer_t* w, uint16_t v){
+	put_byte(w, v & 0xFF);
+	put_byte(w, v >> 8);
+}
+
+/*******************************************************************************
+* static void put_varint(tlm_writer_t* w, int32_t v)
+*
+* Zigzag maps small negative counts to small numbers too, then 7 bits go in
+* each byte with the top bit set on all but the last.
+*******************************************************************************/
+static void put_varint(tlm_writer_t* w, int32_t v){
+	uint32_t u = ((uint32_t)v<<1) ^ (uint32_t)(v>>31);
+	while(u>=0x80){
+		put_byte(w, (u & 0x7F) | 0x80);
+		u >>= 7;
+	}
+	put_byte(w, u);
+}
+
+/*******************************************************************************
+* static int varint_len(int32_t v)
+*
+* bytes put_varint() takes for v
+*******************************************************************************/
+static int varint_len(int32_t v){
+	uint32_t u = ((uint32_t)v<<1) ^ (uint32_t)(v>>31);
+	int len = 1;
+	while(u>=0x80){
+		u >>= 7;
+		len++;
+	}
+	return len;
+}
+
+/*******************************************************************************
+* static int16_t to_int16(float v, float scale)
+*
+* rounds v*scale and saturates it rather than letting it wrap, NaN sends 0
+*******************************************************************************/
+static int16_t to_int16(float v, float scale){
+	v *= scale;
+	if(v!=v) return 0;
+	if(v>=32767.0f) return 32767;
+	if(v<=-32767.0f) return -32767;
+	return (int16_t)(v + ((v>=0.0f) ? 0.5f : -0.5f));
+}
+
+/*******************************************************************************
+* static uint16_t to_mv(float v)
+*
+* volts to saturated millivolts
+*******************************************************************************/
+static uint16_t to_mv(float v){
+	v *= 1000.0f;
+	if(!(v>0.0f)) return 0;
+	if(v>=65535.0f) return 65535;
+	return (uint16_t)(v + 0.5f);
+}
@@ -0,0 +1,34 @@
+/*******************************************************************************
+* rc_telemetry.h
+*
+* wire format helpers shared by the telemetry encoder in rc_telemetry.c and
+* the decoder in rc_telemetry_decode.c. The functions for the user are in
+* roboticscape.h
+*******************************************************************************/
+
+#ifndef RC_TELEMETRY
+#define RC_TELEMETRY
+
+#include <stdint.h>
+
+// frame layout, see the TELEMETRY section of roboticscape.h
+#define TLM_LEN_POS		1
+#define TLM_ID_POS		2
+#define TLM_SEQ_POS		3
+#define TLM_TIME_POS	4
+#define TLM_HEADER_LEN	8
+#define TLM_CRC_INIT	0xFFFF
+
+// fixed payload sizes and the scale of the int16 fields
+#define TLM_IMU_LEN		20
+#define TLM_BATTERY_LEN	5
+#define TLM_ACCEL_SCALE	100.0f
+#define TLM_GYRO_SCALE	10.0f
+#define TLM_QUAT_SCALE	32767.0f
+
+// rc_telemetry_decode.c
+uint16_t tlm_crc16(uint16_t crc, uint8_t c);
+uint16_t tlm_float_to_half(float f);
+float tlm_half_to_float(uint16_t h);
+
+#endif // RC_TELEMETRY
@@ -0,0 +1,225 @@
+/*******************************************************************************
+* rc_telemetry_decode.c
+*
+* Receiving side of the telemetry link. Nothing here touches the hardware or
+* the rest of the library, so a ground station can build this file on its
+* own against roboticscape.h, for example:
+*
+*	gcc -I<path to libraries> ground.c rc_telemetry_decode.c -o ground
+*******************************************************************************/
+#include "../roboticscape.h"
+#include "rc_telemetry.h"
+#include <string.h>
+
+/*******************************************************************************
+* Local Function Declarations
+*******************************************************************************/
+static uint16_t get_u16(const uint8_t* p);
+static int get_varint(const uint8_t* p, int len, int32_t* val);
+
+/*******************************************************************************
+* Local Global Variables
+*******************************************************************************/
+// CRC-16/CCITT a nibble at a time
+static const uint16_t crc_table[16] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+	0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef
+};
+
+/*******************************************************************************
+* int rc_telemetry_decoder_init(rc_telemetry_decoder_t* d)
+*
+* clears the decoder state and counters
+*******************************************************************************/
+int rc_telemetry_decoder_init(rc_telemetry_decoder_t* d){
+	if(d==NULL) return -1;
+	memset(d, 0, sizeof(rc_telemetry_decoder_t));
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_telemetry_decode_byte(rc_telemetry_decoder_t* d, uint8_t c,
+*												rc_telemetry_msg_t* msg)
+*
+* Adds one received byte. Returns 1 when it completed a good frame and msg
+* holds the message, otherwise 0. After a bad frame the bytes already taken
+* are searched for the next sync so a frame starting inside it isn't lost.
+*******************************************************************************/
+int rc_telemetry_decode_byte(rc_telemetry_decoder_t* d, uint8_t c, \
+												rc_telemetry_msg_t* msg){
+	int i, total;
+	if(d==NULL || msg==NULL) return -1;
+	if(d->len==0 && c!=RC_TLM_SYNC) return 0;
+	d->frame[d->len++] = c;
+	while(d->len>TLM_LEN_POS){
+		total = d->frame[TLM_LEN_POS] + RC_TLM_OVERHEAD;
+		if(d->len<total) return 0;
+		if(rc_telemetry_decode_frame(d->frame, total, msg)==0){
+			d->len -= total;
+			memmove(d->frame, d->frame+total, d->len);
+			if(d->started) d->lost += (uint8_t)(msg->seq - d->last_seq - 1);
+			d->started = 1;
+			d->last_seq = msg->seq;
+			d->frames++;
+			return 1;
+		}
+		d->bad_frames++;
+		for(i=1; i<d->len && d->frame[i]!=RC_TLM_SYNC; i++);
+		d->len -= i;
+		memmove(d->frame, d->frame+i, d->len);
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_telemetry_decode_frame(const uint8_t* frame, int len,
+*												rc_telemetry_msg_t* msg)
+*
+* Checks and unpacks one whole frame starting at the sync byte. Returns -1
+* if the length or CRC is wrong or the payload doesn't fit its message.
+*******************************************************************************/
+int rc_telemetry_decode_frame(const uint8_t* frame, int len, \
+												rc_telemetry_msg_t* msg){
+	const uint8_t* p;
+	uint16_t crc;
+	int i, n, used, plen;
+	if(frame==NULL || msg==NULL) return -1;
+	if(len<RC_TLM_OVERHEAD || frame[0]!=RC_TLM_SYNC) return -1;
+	plen = frame[TLM_LEN_POS];
+	if(len!=plen+RC_TLM_OVERHEAD) return -1;
+	crc = TLM_CRC_INIT;
+	for(i=1;i<TLM_HEADER_LEN+plen;i++) crc = tlm_crc16(crc, frame[i]);
+	if(crc!=get_u16(&frame[TLM_HEADER_LEN+plen])) return -1;
+
+	msg->id = frame[TLM_ID_POS];
+	msg->seq = frame[TLM_SEQ_POS];
+	msg->t_ms = get_u16(&frame[TLM_TIME_POS]) | \
+						(uint32_t)get_u16(&frame[TLM_TIME_POS+2])<<16;
+	p = &frame[TLM_HEADER_LEN];
+	switch(msg->id){
+	case RC_TLM_IMU:
+		if(plen!=TLM_IMU_LEN) return -1;
+		for(i=0;i<3;i++){
+			msg->imu.accel[i] = (int16_t)get_u16(&p[2*i]) / TLM_ACCEL_SCALE;
+			msg->imu.gyro[i] = (int16_t)get_u16(&p[6+2*i]) / TLM_GYRO_SCALE;
+		}
+		for(i=0;i<4;i++){
+			msg->imu.quat[i] = (int16_t)get_u16(&p[12+2*i]) / TLM_QUAT_SCALE;
+		}
+		return 0;
+	case RC_TLM_ENCODERS:
+		if(plen<1 || p[0]<1 || p[0]>RC_TLM_MAX_ENCODERS) return -1;
+		msg->encoders.n = p[0];
+		n = 1;
+		for(i=0;i<msg->encoders.n;i++){
+			used = get_varint(&p[n], plen-n, &msg->encoders.pos[i]);
+			if(used<0) return -1;
+			n += used;
+		}
+		return (n==plen) ? 0 : -1;
+	case RC_TLM_BATTERY:
+		if(plen!=TLM_BATTERY_LEN) return -1;
+		msg->battery.pack_v = get_u16(&p[0]) / 1000.0f;
+		msg->battery.jack_v = get_u16(&p[2]) / 1000.0f;
+		msg->battery.percent = (p[4]==255) ? -1 : p[4];
+		return 0;
+	case RC_TLM_CONTROLLER:
+		if(plen<2 || p[1]>RC_TLM_MAX_CONTROLLER || plen!=2+6*p[1]) return -1;
+		msg->controller.mode = p[0];
+		msg->controller.n = p[1];
+		for(i=0;i<msg->controller.n;i++){
+			msg->controller.setpoint[i] = tlm_half_to_float(get_u16(&p[2+6*i]));
+			msg->controller.measured[i] = tlm_half_to_float(get_u16(&p[4+6*i]));
+			msg->controller.output[i] = tlm_half_to_float(get_u16(&p[6+6*i]));
+		}
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/*******************************************************************************
+* uint16_t tlm_crc16(uint16_t crc, uint8_t c)
+*
+* adds one byte to a CRC-16/CCITT started at TLM_CRC_INIT
+*******************************************************************************/
+uint16_t tlm_crc16(uint16_t crc, uint8_t c){
+	crc = (uint16_t)(crc<<4) ^ crc_table[(crc>>12) ^ (c>>4)];
+	crc = (uint16_t)(crc<<4) ^ crc_table[(crc>>12) ^ (c&0x0F)];
+	return crc;
+}
+
+/*******************************************************************************
+* uint16_t tlm_float_to_half(float f)
+*
+* IEEE 754 half precision rounded to nearest. Values too large for it become
+* infinity and ones too small go through the subnormals to zero.
+*******************************************************************************/
+uint16_t tlm_float_to_half(float f){
+	uint32_t x, mant;
+	uint16_t sign;
+	int exp, shift;
+	memcpy(&x, &f, sizeof(x));
+	sign = (x>>16) & 0x8000;
+	mant = x & 0x007FFFFF;
+	if(((x>>23) & 0xFF)==0xFF) return sign | 0x7C00 | (mant ? 0x0200 : 0);
+	exp = (int)((x>>23) & 0xFF) - 127 + 15;
+	if(exp>=31) return sign | 0x7C00;
+	if(exp<=0){
+		if(exp<-10) return sign;
+		mant |= 0x00800000;
+		shift = 14 - exp;
+		return sign | ((mant>>shift) + ((mant>>(shift-1)) & 1));
+	}
+	// a carry out of the mantissa correctly bumps the exponent
+	return (sign | (exp<<10) | (mant>>13)) + ((mant>>12) & 1);
+}
+
+/*******************************************************************************
+* float tlm_half_to_float(uint16_t h)
+*
+* widens an IEEE 754 half precision value
+*******************************************************************************/
+float tlm_half_to_float(uint16_t h){
+	uint32_t x, exp, mant;
+	float f;
+	exp = (h>>10) & 0x1F;
+	mant = h & 0x03FF;
+	if(exp==0){
+		f = mant * (1.0f/16777216.0f);
+		return (h & 0x8000) ? -f : f;
+	}
+	if(exp==31) x = 0x7F800000 | (mant<<13);
+	else x = ((exp-15+127)<<23) | (mant<<13);
+	x |= (uint32_t)(h & 0x8000)<<16;
+	memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+/*******************************************************************************
+* static uint16_t get_u16(const uint8_t* p)
+*
+* little endian
+*******************************************************************************/
+static uint16_t get_u16(const uint8_t* p){
+	return p[0] | (uint16_t)p[1]<<8;
+}
+
+/*******************************************************************************
+* static int get_varint(const uint8_t* p, int len, int32_t* val)
+*
+* Reads one zigzag varint from at most len bytes. Returns the bytes used or -1
+* if it runs past len or is longer than an int32 can need.
+*******************************************************************************/
+static int get_varint(const uint8_t* p, int len, int32_t* val){
+	uint32_t u = 0;
+	int i;
+	for(i=0; i<len && i<5; i++){
+		u |= (uint32_t)(p[i] & 0x7F) << (7*i);
+		if(!(p[i] & 0x80)){
+			*val = (int32_t)(u>>1) ^ -(int32_t)(u&1);
+			return i+1;
+		}
+	}
+	return -1;
+}
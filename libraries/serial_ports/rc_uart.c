@@ -3,6 +3,10 @@
 *
 * This is a collection of C functions to make interfacing with UART ports on 
 * the BeagleBone easier. This could be used on other linux platforms too.
+*
+* Ports can also be handed to a shared I/O thread with rc_uart_io_start()
+* which waits on all of them in one epoll set and moves bytes between the
+* ports and per-port RX/TX ring buffers, or into the port's framing callback.
 *******************************************************************************/
 
 #include "../roboticscape.h"
@@ -15,7 +19,13 @@
 #include <unistd.h> // for close
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <linux/serial.h> // for serial_icounter_struct
 #include <math.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "../preprocessor_macros.h"
+#include "../other/rc_realtime.h"
 
 #define MIN_BUS 0
 #define MAX_BUS 5
@@ -23,6 +33,45 @@
 // Most bytes to read at once. This is the size of the Sitara UART FIFO buffer.
 #define MAX_READ_LEN 128
 
+#define IO_DEFAULT_RING		4096
+#define IO_CHUNK			256		// bytes moved per read() in the I/O thread
+#define IO_POLL_TIMEOUT_MS	100		// lets the thread notice it should stop
+
+/*******************************************************************************
+* Local Types
+*******************************************************************************/
+typedef struct io_ring_t{
+	char* buf;
+	int size;
+	int head;	// next byte written goes here
+	int count;
+} io_ring_t;
+
+typedef struct uart_io_t{
+	int active;
+	int tx_armed;	// EPOLLOUT is set for the port
+	int tx_reserved;	// bytes handed out by rc_uart_io_reserve()
+	io_ring_t rx;
+	io_ring_t tx;
+	rc_uart_framing_t framing;
+	char frame[RC_UART_MAX_FRAME];
+	int frame_len;
+	int frame_expect;	// whole length once a length prefix is in
+	int skipping;		// dropping the rest of an oversized frame
+	rc_uart_stats_t stats;
+	pthread_cond_t rx_cond;
+} uart_io_t;
+
+/*******************************************************************************
+* Local Function Declarations
+*******************************************************************************/
+static void* io_thread(void* ptr);
+static void service_rx(int bus);
+static void service_tx(int bus);
+static int frame_byte(uart_io_t* io, char c);
+static int ring_put(io_ring_t* r, const char* data, int n);
+static int ring_get(io_ring_t* r, char* data, int n, int consume);
+
 /*******************************************************************************
 * Local Global Variables
 *******************************************************************************/
@@ -38,6 +87,15 @@ char *paths[6] = { \
 int fd[6]; // file descriptors for all ports
 float bus_timeout_s[6]; // user-requested timeout in seconds for each bus
 
+static uart_io_t io[6];
+static pthread_mutex_t io_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t io_pthread;
+static int epoll_fd = -1;
+static int io_ports = 0;		// ports attached to the I/O thread
+static volatile int io_running = 0;
+static int io_stopping = 0;		// thread told to stop but not gone yet
+static pthread_cond_t io_stopped_cond = PTHREAD_COND_INITIALIZER;
+
 /*******************************************************************************
 * int rc_uart_init(int bus, int baudrate, float timeout_s)
 * 
@@ -214,6 +272,7 @@ int rc_uart_close(int bus){
 	if(initialized[bus]==0){
 		return 0;
 	}
+	rc_uart_io_stop(bus);
 	tcflush(fd[bus],TCIOFLUSH);
 	close(fd[bus]);
 	initialized[bus]=0;
@@ -261,6 +320,14 @@ int rc_uart_flush(int bus){
 		printf("ERROR: uart%d must be initialized first\n", bus);
 		return -1;
 	}
+	if(io[bus].active){
+		pthread_mutex_lock(&io_mutex);
+		io[bus].rx.count = 0;
+		io[bus].tx.count = 0;
+		io[bus].frame_len = 0;
+		io[bus].skipping = 0;
+		pthread_mutex_unlock(&io_mutex);
+	}
 	return tcflush(fd[bus],TCIOFLUSH);
 }
 
@@ -284,6 +351,8 @@ int rc_uart_send_bytes(int bus, int bytes, char* data){
 		printf("ERROR: uart%d must be initialized first\n", bus);
 		return -1;
 	}
+	// keep the order of bytes already queued for the I/O thread
+	if(io[bus].active) return rc_uart_io_write(bus, bytes, data);
 	
 	return write(fd[bus], data, bytes);
 }
@@ -306,6 +375,7 @@ int rc_uart_send_byte(int bus, char data){
 		printf("ERROR: uart%d must be initialized first\n", bus);
 		return -1;
 	}
+	if(io[bus].active) return rc_uart_io_write(bus, 1, &data);
 	
 	return write(fd[bus], &data, 1);
 }
@@ -336,6 +406,10 @@ int rc_uart_read_bytes(int bus, int bytes, char* buf){
 		printf("ERROR: uart%d must be initialized first\n", bus);
 		return -1;
 	}
+	if(io[bus].active){
+		printf("ERROR: uart%d is serviced by the I/O thread, use rc_uart_io_read\n", bus);
+		return -1;
+	}
 	
 	// // a single call to 'read' just isn't reliable, don't do it
 	// if(bytes<=MAX_READ_LEN){
@@ -427,6 +501,15 @@ int rc_uart_read_line(int bus, int max_bytes, char* buf){
 	struct timeval timeout;
 	int bytes_read=0; // number of bytes read so far
 
+	if(bus<MIN_BUS || bus>MAX_BUS || initialized[bus]==0){
+		printf("ERROR: uart%d must be initialized first\n", bus);
+		return -1;
+	}
+	if(io[bus].active){
+		printf("ERROR: uart%d is serviced by the I/O thread, use rc_uart_io_read\n", bus);
+		return -1;
+	}
+
 	// set up the timeout OUTSIDE of the read loop. We will likely be calling
 	// select() multiple times and that will decrease the timeout struct each
 	// time ensuring the TOTAL timeout requested by the user is honoured instead
@@ -477,7 +560,11 @@ int rc_uart_read_line(int bus, int max_bytes, char* buf){
 	return bytes_read;
 }
 
-
+/*******************************************************************************
+* int rc_uart_bytes_available(int bus)
+*
+* bytes received and not read yet
+*******************************************************************************/
 int rc_uart_bytes_available(int bus){
 	int out;
 	// sanity checks
@@ -489,6 +576,7 @@ int rc_uart_bytes_available(int bus){
 		printf("ERROR: uart%d must be initialized first\n", bus);
 		return -1;
 	}
+	if(io[bus].active) return rc_uart_io_available(bus);
 
 	if(ioctl(fd[bus], FIONREAD, &out)<0){
 		printf("ERROR: can't use ioctl on UART bus %d\n", bus);
@@ -497,3 +585,597 @@ int rc_uart_bytes_available(int bus){
 
 	return out;
 }
+
+/*******************************************************************************
+* int rc_uart_io_start(int bus, int rx_size, int tx_size)
+*
+* Hands an initialized port to the shared I/O thread with RX and TX rings of
+* the given sizes in bytes, 0 for the default. The thread is started with the
+* first port.
+*******************************************************************************/
+int rc_uart_io_start(int bus, int rx_size, int tx_size){
+	struct epoll_event ev;
+	uart_io_t* p;
+	pthread_condattr_t attr;
+	int flags;
+	if(bus<MIN_BUS || bus>MAX_BUS){
+		printf("ERROR: uart bus must be between %d & %d\n", MIN_BUS, MAX_BUS);
+		return -1;
+	}
+	if(initialized[bus]==0){
+		printf("ERROR: uart%d must be initialized first\n", bus);
+		return -1;
+	}
+	p = &io[bus];
+	if(p->active) return 0;
+	if(rx_size<=0) rx_size = IO_DEFAULT_RING;
+	if(tx_size<=0) tx_size = IO_DEFAULT_RING;
+
+	pthread_mutex_lock(&io_mutex);
+	// a thread that is stopping may still be servicing the epoll set, wait for
+	// it to exit rather than start a second one
+	if(io_stopping && pthread_equal(pthread_self(), io_pthread)){
+		pthread_mutex_unlock(&io_mutex);
+		printf("ERROR: can't restart uart I/O from a callback that stopped it\n");
+		return -1;
+	}
+	while(io_stopping) pthread_cond_wait(&io_stopped_cond, &io_mutex);
+	if(epoll_fd<0) epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(epoll_fd<0){
+		pthread_mutex_unlock(&io_mutex);
+		printf("ERROR: can't create epoll instance for uart I/O\n");
+		return -1;
+	}
+	p->rx.buf = malloc(rx_size);
+	p->tx.buf = malloc(tx_size);
+	if(p->rx.buf==NULL || p->tx.buf==NULL){
+		free(p->rx.buf);
+		free(p->tx.buf);
+		pthread_mutex_unlock(&io_mutex);
+		printf("ERROR: failed to allocate uart%d ring buffers\n", bus);
+		return -1;
+	}
+	p->rx.size = rx_size;
+	p->tx.size = tx_size;
+	p->rx.head = p->rx.count = 0;
+	p->tx.head = p->tx.count = 0;
+	p->frame_len = 0;
+	p->skipping = 0;
+	p->tx_armed = 0;
+	p->tx_reserved = 0;
+	memset(&p->framing, 0, sizeof(p->framing));
+	memset(&p->stats, 0, sizeof(p->stats));
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&p->rx_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	// the thread reads and writes whatever the port can take right now
+	flags = fcntl(fd[bus], F_GETFL);
+	fcntl(fd[bus], F_SETFL, flags|O_NONBLOCK);
+	ev.events = EPOLLIN;
+	ev.data.u32 = bus;
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd[bus], &ev)){
+		fcntl(fd[bus], F_SETFL, flags);
+		free(p->rx.buf);
+		free(p->tx.buf);
+		pthread_cond_destroy(&p->rx_cond);
+		pthread_mutex_unlock(&io_mutex);
+		printf("ERROR: can't add uart%d to epoll set\n", bus);
+		return -1;
+	}
+	p->active = 1;
+	io_ports++;
+	if(!io_running){
+		io_running = 1;
+		if(pthread_create(&io_pthread, NULL, io_thread, NULL)){
+			io_running = 0;
+			pthread_mutex_unlock(&io_mutex);
+			printf("ERROR: failed to start uart I/O thread\n");
+			rc_uart_io_stop(bus);
+			return -1;
+		}
+	}
+	pthread_mutex_unlock(&io_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_uart_io_stop(int bus)
+*
+* Takes a port back from the I/O thread, discarding anything still in its
+* rings, and stops the thread after the last port.
+*******************************************************************************/
+int rc_uart_io_stop(int bus){
+	uart_io_t* p;
+	pthread_t thread;
+	int join = 0;
+	if(bus<MIN_BUS || bus>MAX_BUS) return -1;
+	p = &io[bus];
+	pthread_mutex_lock(&io_mutex);
+	if(!p->active){
+		pthread_mutex_unlock(&io_mutex);
+		return 0;
+	}
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd[bus], NULL);
+	p->active = 0;
+	// the thread only reads or writes the port under the lock after checking
+	// active, so it is done with the fd and blocking mode is safe to restore
+	fcntl(fd[bus], F_SETFL, fcntl(fd[bus], F_GETFL) & ~O_NONBLOCK);
+	// wake anyone waiting so they see the port is gone
+	pthread_cond_broadcast(&p->rx_cond);
+	io_ports--;
+	if(io_ports==0 && io_running){
+		io_running = 0;
+		io_stopping = 1;
+		thread = io_pthread;
+		join = 1;
+	}
+	pthread_mutex_unlock(&io_mutex);
+	// A framing callback may stop the last port from the thread itself, then
+	// it clears io_stopping on its way out.
+	if(join){
+		if(pthread_equal(pthread_self(), thread)) pthread_detach(thread);
+		else{
+			pthread_join(thread, NULL);
+			pthread_mutex_lock(&io_mutex);
+			io_stopping = 0;
+			pthread_cond_broadcast(&io_stopped_cond);
+			pthread_mutex_unlock(&io_mutex);
+		}
+	}
+	pthread_mutex_lock(&io_mutex);
+	free(p->rx.buf);
+	free(p->tx.buf);
+	p->rx.buf = NULL;
+	p->tx.buf = NULL;
+	p->rx.size = p->tx.size = 0;
+	pthread_mutex_unlock(&io_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_uart_io_read(int bus, int max_bytes, char* buf)
+* int rc_uart_io_peek(int bus, int max_bytes, char* buf)
+*
+* Copy up to max_bytes from the RX ring without waiting, read removes them.
+* Return the number of bytes copied.
+*******************************************************************************/
+int rc_uart_io_read(int bus, int max_bytes, char* buf){
+	int n;
+	if(unlikely(bus<MIN_BUS || bus>MAX_BUS || !io[bus].active || buf==NULL)){
+		printf("ERROR: uart%d is not serviced by the I/O thread\n", bus);
+		return -1;
+	}
+	pthread_mutex_lock(&io_mutex);
+	n = ring_get(&io[bus].rx, buf, max_bytes, 1);
+	pthread_mutex_unlock(&io_mutex);
+	return n;
+}
+
+int rc_uart_io_peek(int bus, int max_bytes, char* buf){
+	int n;
+	if(unlikely(bus<MIN_BUS || bus>MAX_BUS || !io[bus].active || buf==NULL)){
+		printf("ERROR: uart%d is not serviced by the I/O thread\n", bus);
+		return -1;
+	}
+	pthread_mutex_lock(&io_mutex);
+	n = ring_get(&io[bus].rx, buf, max_bytes, 0);
+	pthread_mutex_unlock(&io_mutex);
+	return n;
+}
+
+/*******************************************************************************
+* int rc_uart_io_write(int bus, int bytes, const char* data)
+*
+* Queues bytes for the I/O thread to send without waiting. Returns how many
+* fit in the TX ring, the rest are counted as tx_overruns.
+*******************************************************************************/
+int rc_uart_io_write(int bus, int bytes, const char* data){
+	struct epoll_event ev;
+	uart_io_t* p;
+	int n;
+	if(unlikely(bus<MIN_BUS || bus>MAX_BUS || !io[bus].active || data==NULL)){
+		printf("ERROR: uart%d is not serviced by the I/O thread\n", bus);
+		return -1;
+	}
+	p = &io[bus];
+	pthread_mutex_lock(&io_mutex);
+	n = ring_put(&p->tx, data, bytes);
+	p->stats.tx_overruns += bytes-n;
+	if(n>0 && !p->tx_armed){
+		ev.events = EPOLLIN|EPOLLOUT;
+		ev.data.u32 = bus;
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd[bus], &ev);
+		p->tx_armed = 1;
+	}
+	pthread_mutex_unlock(&io_mutex);
+	return n;
+}
+
+/*******************************************************************************
+* int rc_uart_io_reserve(int bus, int bytes, rc_uart_span_t* span)
+*
+* Hands out the next bytes of free TX ring space so a message can be encoded
+* straight into the ring. The space may wrap so it comes as two pieces in
+* span. Returns bytes with the ring locked until rc_uart_io_commit(), 0 if
+* there isn't room right now, or -1 on error.
+*******************************************************************************/
+int rc_uart_io_reserve(int bus, int bytes, rc_uart_span_t* span){
+	uart_io_t* p;
+	int first;
+	if(unlikely(bus<MIN_BUS || bus>MAX_BUS || !io[bus].active || span==NULL)){
+		printf("ERROR: uart%d is not serviced by the I/O thread\n", bus);
+		return -1;
+	}
+	p = &io[bus];
+	if(unlikely(bytes<1 || bytes>p->tx.size)){
+		printf("ERROR in rc_uart_io_reserve, bytes must be 1-%d\n", p->tx.size);
+		return -1;
+	}
+	pthread_mutex_lock(&io_mutex);
+	if(p->tx.size-p->tx.count<bytes){
+		pthread_mutex_unlock(&io_mutex);
+		return 0;
+	}
+	first = p->tx.size - p->tx.head;
+	if(first>bytes) first = bytes;
+	span->data[0] = p->tx.buf + p->tx.head;
+	span->len[0] = first;
+	span->data[1] = p->tx.buf;
+	span->len[1] = bytes - first;
+	p->tx_reserved = bytes;
+	return bytes;
+}
+
+/*******************************************************************************
+* int rc_uart_io_commit(int bus, int bytes)
+*
+* Queues the first bytes of the space from rc_uart_io_reserve(), 0 to send
+* nothing, and unlocks the ring. Must come from the thread that reserved.
+*******************************************************************************/
+int rc_uart_io_commit(int bus, int bytes){
+	struct epoll_event ev;
+	uart_io_t* p;
+	if(unlikely(bus<MIN_BUS || bus>MAX_BUS || !io[bus].active)){
+		printf("ERROR: uart%d is not serviced by the I/O thread\n", bus);
+		return -1;
+	}
+	p = &io[bus];
+	if(unlikely(p->tx_reserved==0)){
+		printf("ERROR in rc_uart_io_commit, nothing reserved\n");
+		return -1;
+	}
+	if(bytes<0 || bytes>p->tx_reserved) bytes = 0;
+	p->tx_reserved = 0;
+	p->tx.head = (p->tx.head+bytes) % p->tx.size;
+	p->tx.count += bytes;
+	if(bytes>0 && !p->tx_armed){
+		ev.events = EPOLLIN|EPOLLOUT;
+		ev.data.u32 = bus;
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd[bus], &ev);
+		p->tx_armed = 1;
+	}
+	pthread_mutex_unlock(&io_mutex);
+	return bytes;
+}
+
+/*******************************************************************************
+* int rc_uart_io_available(int bus)
+*
+* bytes waiting in the RX ring
+*******************************************************************************/
+int rc_uart_io_available(int bus){
+	int n;
+	if(unlikely(bus<MIN_BUS || bus>MAX_BUS || !io[bus].active)){
+		printf("ERROR: uart%d is not serviced by the I/O thread\n", bus);
+		return -1;
+	}
+	pthread_mutex_lock(&io_mutex);
+	n = io[bus].rx.count;
+	pthread_mutex_unlock(&io_mutex);
+	return n;
+}
+
+/*******************************************************************************
+* int rc_uart_io_wait(int bus, int min_bytes, int timeout_ms)
+*
+* For callers that do want to block, waits until at least min_bytes are in
+* the RX ring or timeout_ms passes. Returns the number available.
+*******************************************************************************/
+int rc_uart_io_wait(int bus, int min_bytes, int timeout_ms){
+	struct timespec deadline;
+	uart_io_t* p;
+	int n;
+	if(unlikely(bus<MIN_BUS || bus>MAX_BUS || !io[bus].active)){
+		printf("ERROR: uart%d is not serviced by the I/O thread\n", bus);
+		return -1;
+	}
+	p = &io[bus];
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout_ms/1000;
+	deadline.tv_nsec += (timeout_ms%1000)*1000000L;
+	if(deadline.tv_nsec>=1000000000L){
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock(&io_mutex);
+	while(p->active && p->rx.count<min_bytes && rc_get_state()!=EXITING){
+		if(pthread_cond_timedwait(&p->rx_cond, &io_mutex, &deadline)) break;
+	}
+	n = p->rx.count;
+	pthread_mutex_unlock(&io_mutex);
+	return n;
+}
+
+/*******************************************************************************
+* int rc_uart_io_set_framing(int bus, rc_uart_framing_t* framing)
+*
+* Sends received bytes to framing->func one whole frame at a time instead of
+* the RX ring. NULL or UART_FRAME_NONE goes back to the ring.
+*******************************************************************************/
+int rc_uart_io_set_framing(int bus, rc_uart_framing_t* framing){
+	rc_uart_framing_t f;
+	int min_len;
+	if(bus<MIN_BUS || bus>MAX_BUS || !io[bus].active){
+		printf("ERROR: uart%d is not serviced by the I/O thread\n", bus);
+		return -1;
+	}
+	if(framing==NULL) memset(&f, 0, sizeof(f));
+	else f = *framing;
+	if(f.mode!=UART_FRAME_NONE){
+		if(f.func==NULL){
+			printf("ERROR in rc_uart_io_set_framing, no callback given\n");
+			return -1;
+		}
+		if(f.length<1 || f.length>RC_UART_MAX_FRAME){
+			printf("ERROR in rc_uart_io_set_framing, length must be 1-%d\n", RC_UART_MAX_FRAME);
+			return -1;
+		}
+	}
+	if(f.mode==UART_FRAME_LENGTH_PREFIX){
+		min_len = f.len_offset + f.len_bytes;
+		if(f.len_offset<0 || (f.len_bytes!=1 && f.len_bytes!=2) || min_len>f.length){
+			printf("ERROR in rc_uart_io_set_framing, invalid length field\n");
+			return -1;
+		}
+	}
+	pthread_mutex_lock(&io_mutex);
+	io[bus].framing = f;
+	io[bus].frame_len = 0;
+	io[bus].skipping = 0;
+	pthread_mutex_unlock(&io_mutex);
+	return 0;
+}
+
+/*******************************************************************************
+* int rc_uart_io_get_stats(int bus, rc_uart_stats_t* stats)
+*
+* Byte, frame and overrun counters since rc_uart_io_start(). driver_overruns
+* comes from the serial driver and is 0 where it doesn't count them.
+*******************************************************************************/
+int rc_uart_io_get_stats(int bus, rc_uart_stats_t* stats){
+	struct serial_icounter_struct icount;
+	if(bus<MIN_BUS || bus>MAX_BUS || !io[bus].active || stats==NULL){
+		printf("ERROR: uart%d is not serviced by the I/O thread\n", bus);
+		return -1;
+	}
+	pthread_mutex_lock(&io_mutex);
+	*stats = io[bus].stats;
+	pthread_mutex_unlock(&io_mutex);
+	stats->driver_overruns = 0;
+	if(ioctl(fd[bus], TIOCGICOUNT, &icount)==0){
+		stats->driver_overruns = icount.overrun + icount.buf_overrun;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+* static void* io_thread(void* ptr)
+*
+* Waits on every attached port at once and services whichever are ready.
+*******************************************************************************/
+static void* io_thread(__unused void* ptr){
+	struct epoll_event ev[MAX_BUS-MIN_BUS+1];
+	int i, n, bus;
+	configure_rt_thread(RT_THREAD_UART, 0);
+	while(io_running){
+		n = epoll_wait(epoll_fd, ev, MAX_BUS-MIN_BUS+1, IO_POLL_TIMEOUT_MS);
+		if(n<0){
+			if(errno==EINTR) continue;
+			printf("ERROR: uart epoll_wait() failed: %s\n", strerror(errno));
+			break;
+		}
+		for(i=0;i<n;i++){
+			bus = ev[i].data.u32;
+			if(ev[i].events & EPOLLIN) service_rx(bus);
+			if(ev[i].events & EPOLLOUT) service_tx(bus);
+			if(unlikely(ev[i].events & (EPOLLERR|EPOLLHUP))){
+				// stop watching rather than spin on a dead port
+				pthread_mutex_lock(&io_mutex);
+				if(io[bus].active){
+					printf("ERROR: uart%d reported an error, no longer serviced\n", bus);
+					epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd[bus], NULL);
+				}
+				pthread_mutex_unlock(&io_mutex);
+			}
+		}
+	}
+	release_rt_thread();
+	pthread_mutex_lock(&io_mutex);
+	io_stopping = 0;
+	pthread_cond_broadcast(&io_stopped_cond);
+	pthread_mutex_unlock(&io_mutex);
+	return NULL;
+}
+
+/*******************************************************************************
+* static void service_rx(int bus)
+*
+* Drains the port into the RX ring or the framer. Completed frames are
+* copied out and the callback runs without the lock held so it may call the
+* rc_uart_io functions itself.
+*******************************************************************************/
+static void service_rx(int bus){
+	uart_io_t* p = &io[bus];
+	char chunk[IO_CHUNK];
+	char frame[RC_UART_MAX_FRAME];
+	void (*func)(int bus, char* frame, int len);
+	int i, n, len, put;
+	while(1){
+		// read under the lock so a stop can't put the port back in blocking
+		// mode or close it between the check and the read
+		pthread_mutex_lock(&io_mutex);
+		if(!p->active){
+			pthread_mutex_unlock(&io_mutex);
+			return;
+		}
+		n = read(fd[bus], chunk, IO_CHUNK);
+		if(n<=0){
+			pthread_mutex_unlock(&io_mutex);
+			return;
+		}
+		p->stats.rx_bytes += n;
+		if(p->framing.mode==UART_FRAME_NONE){
+			put = ring_put(&p->rx, chunk, n);
+			p->stats.rx_overruns += n-put;
+			pthread_cond_broadcast(&p->rx_cond);
+			pthread_mutex_unlock(&io_mutex);
+			continue;
+		}
+		for(i=0;i<n;i++){
+			len = frame_byte(p, chunk[i]);
+			if(len==0) continue;
+			memcpy(frame, p->frame, len);
+			func = p->framing.func;
+			p->stats.frames++;
+			pthread_mutex_unlock(&io_mutex);
+			func(bus, frame, len);
+			pthread_mutex_lock(&io_mutex);
+			// the callback may have changed the framing or stopped the port
+			if(!p->active || p->framing.mode==UART_FRAME_NONE){
+				put = ring_put(&p->rx, &chunk[i+1], n-i-1);
+				p->stats.rx_overruns += n-i-1-put;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&io_mutex);
+	}
+}
+
+/*******************************************************************************
+* static void service_tx(int bus)
+*
+* Writes as much of the TX ring as the port takes and stops asking for
+* EPOLLOUT once it's empty.
+*******************************************************************************/
+static void service_tx(int bus){
+	struct epoll_event ev;
+	uart_io_t* p = &io[bus];
+	int tail, n, ret;
+	pthread_mutex_lock(&io_mutex);
+	while(p->active && p->tx.count>0){
+		tail = (p->tx.head - p->tx.count + p->tx.size) % p->tx.size;
+		n = p->tx.size - tail;
+		if(n>p->tx.count) n = p->tx.count;
+		ret = write(fd[bus], p->tx.buf+tail, n);
+		if(ret<=0) break;
+		p->tx.count -= ret;
+		p->stats.tx_bytes += ret;
+	}
+	if(p->active && p->tx.count==0 && p->tx_armed){
+		ev.events = EPOLLIN;
+		ev.data.u32 = bus;
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd[bus], &ev);
+		p->tx_armed = 0;
+	}
+	pthread_mutex_unlock(&io_mutex);
+}
+
+/*******************************************************************************
+* static int frame_byte(uart_io_t* p, char c)
+*
+* Adds one byte to the frame being assembled. Returns the frame length when
+* c completes it, otherwise 0. Bytes that can't be part of a frame are
+* dropped and counted as frame_errors.
+*******************************************************************************/
+static int frame_byte(uart_io_t* p, char c){
+	rc_uart_framing_t* f = &p->framing;
+	int len, field;
+	// hunt for the sync byte between frames
+	if(f->mode==UART_FRAME_LENGTH_PREFIX && f->has_sync && p->frame_len==0 \
+												&& (uint8_t)c!=f->sync){
+		p->stats.frame_errors++;
+		return 0;
+	}
+	if(p->skipping){
+		if(c==f->delimiter) p->skipping = 0;
+		return 0;
+	}
+	p->frame[p->frame_len++] = c;
+	switch(f->mode){
+	case UART_FRAME_DELIMITER:
+		if(c==f->delimiter) break;
+		if(p->frame_len>=f->length){
+			// too long, drop it and start over after the next delimiter
+			p->stats.frame_errors++;
+			p->frame_len = 0;
+			p->skipping = 1;
+		}
+		return 0;
+	case UART_FRAME_FIXED:
+		if(p->frame_len<f->length) return 0;
+		break;
+	case UART_FRAME_LENGTH_PREFIX:
+		if(p->frame_len==f->len_offset+f->len_bytes){
+			field = (uint8_t)p->frame[f->len_offset];
+			if(f->len_bytes==2) field |= (uint8_t)p->frame[f->len_offset+1]<<8;
+			p->frame_expect = field + f->len_adjust;
+			if(p->frame_expect<p->frame_len || p->frame_expect>f->length){
+				p->stats.frame_errors++;
+				p->frame_len = 0;
+				return 0;
+			}
+		}
+		if(p->frame_len<f->len_offset+f->len_bytes || p->frame_len<p->frame_expect){
+			return 0;
+		}
+		break;
+	default:
+		return 0;
+	}
+	len = p->frame_len;
+	p->frame_len = 0;
+	return len;
+}
+
+/*******************************************************************************
+* static int ring_put(io_ring_t* r, const char* data, int n)
+*
+* copies as much of data as fits, returns the number of bytes taken
+*******************************************************************************/
+static int ring_put(io_ring_t* r, const char* data, int n){
+	int i;
+	if(n>r->size-r->count) n = r->size-r->count;
+	for(i=0;i<n;i++){
+		r->buf[r->head] = data[i];
+		r->head = (r->head+1) % r->size;
+	}
+	r->count += n;
+	return n;
+}
+
+/*******************************************************************************
+* static int ring_get(io_ring_t* r, char* data, int n, int consume)
+*
+* copies up to n of the oldest bytes, removing them if consume is set
+*******************************************************************************/
+static int ring_get(io_ring_t* r, char* data, int n, int consume){
+	int i, tail;
+	if(n>r->count) n = r->count;
+	if(n<=0) return 0;
+	tail = (r->head - r->count + r->size) % r->size;
+	for(i=0;i<n;i++) data[i] = r->buf[(tail+i) % r->size];
+	if(consume) r->count -= n;
+	return n;
+}
@@ -35,6 +35,7 @@
 
 ; PRU setup definitions
 	; .asg    C4,     CONST_SYSCFG         
+	.asg    C26,    CONST_IEP
 	.asg    C28,    CONST_PRUSHAREDRAM   
  
 	.asg	0x22000,	PRU0_CTRL
@@ -46,6 +47,22 @@
 	.asg    0x100,	SHARED_RAM       ; This is so prudebug can find it.
 	.asg    64,     CNT_OFFSET
 
+; Sampler definitions, must match rc_pru.c
+; The host sets IEP compare 0 to the sample period and the loop below takes a
+; sample each time it fires. Records are 32 bytes: sequence number, IEP count
+; when the sample was taken, encoder count, 8 16-bit ADC values and the number
+; of ADC words drained. They go into a 256 record ring in shared memory and
+; the head counter is only advanced once the record is complete.
+	.asg	0x0C,		IEP_CNT
+	.asg	0x44,		IEP_CMP_STS
+	.asg	0x140,		SAMPLER_HEAD	; records written so far
+	.asg	0x148,		SAMPLER_LATEST	; newest value of each ADC channel
+	.asg	0x88,		PRU0_HEARTBEAT	; bumped every sample, see rc_pru.c
+	.asg	0x200,		SAMPLER_RING
+	.asg	0xFF,		SAMPLER_MASK	; ring length - 1
+	.asg	0x44E0D0F0,	ADC_FIFO1COUNT
+	.asg	0x44E0D200,	ADC_FIFO1DATA
+
 ; Encoder counting definitions
 ; these pin definitions are specific to SD-101D Robotics Cape
 	.asg	r31,		CH		; CHA: P8_16, CHB: P8_15
@@ -85,12 +102,16 @@ start:
 	MOV 	OLD, r31				
 	zero	&r2, 4
 	SBCO	&r2, CONST_PRUSHAREDRAM, CNT_OFFSET, 4	; write 0 to shared memory
+	LDI 	r18, 0
+	SBCO	&r18, CONST_PRUSHAREDRAM, PRU0_HEARTBEAT, 4	; tell the host we are up
 	
 ; CHECKPINS here forever looking for pin changes
 CHECKPINS:
 	XOR EXOR, OLD, r31
 	QBBS A_CHANGED, EXOR, A	; Branch if CHA has toggled
 	QBBS B_CHANGED, EXOR, B ; Branch if CHB has toggled
+	LBCO &r3, CONST_IEP, IEP_CMP_STS, 4
+	QBBS SAMPLE, r3, 0		; Branch if a sample period has passed
 	QBA CHECKPINS
 	
 	
@@ -121,6 +142,49 @@ DECREMENT:
 INCREMENT:
 	increment
 
+; take one sample, the IEP counter has already restarted so its value now is
+; how late we are. Each ADC word in FIFO1 carries its step id in bits 16-19,
+; the continuous steps 9-16 are tagged 8-15 for channels 0-7.
+SAMPLE:
+	LDI 	r3, 1
+	SBCO	&r3, CONST_IEP, IEP_CMP_STS, 4	; acknowledge compare 0
+	LBCO	&r11, CONST_IEP, IEP_CNT, 4
+	LBCO	&r12, CONST_PRUSHAREDRAM, CNT_OFFSET, 4
+	ADD 	r18, r18, 1
+	SBCO	&r18, CONST_PRUSHAREDRAM, PRU0_HEARTBEAT, 4
+	LDI32	r4, ADC_FIFO1COUNT
+	LBBO	&r5, r4, 0, 4
+	AND 	r5, r5, 0x7F
+	MOV 	r17, r5
+	QBEQ	ADC_DONE, r5, 0
+	LDI32	r4, ADC_FIFO1DATA
+	LDI 	r7, SAMPLER_LATEST
+ADC_LOOP:
+	LBBO	&r6, r4, 0, 4
+	LSR 	r8, r6, 16
+	AND 	r8, r8, 0x0F
+	QBGT	ADC_NEXT, r8, 8		; skip words from the one-shot steps
+	SUB 	r8, r8, 8			; step id to channel 0-7
+	LSL 	r8, r8, 1
+	ADD 	r8, r8, r7
+	SBCO	&r6.w0, CONST_PRUSHAREDRAM, r8, 2
+ADC_NEXT:
+	SUB 	r5, r5, 1
+	QBNE	ADC_LOOP, r5, 0
+ADC_DONE:
+	LDI 	r9, SAMPLER_HEAD
+	LBCO	&r10, CONST_PRUSHAREDRAM, r9, 4
+	LDI 	r7, SAMPLER_LATEST
+	LBCO	&r13, CONST_PRUSHAREDRAM, r7, 16
+	AND 	r3, r10, SAMPLER_MASK
+	LSL 	r3, r3, 5
+	LDI 	r4, SAMPLER_RING
+	ADD 	r3, r3, r4
+	SBCO	&r10, CONST_PRUSHAREDRAM, r3, 32	; whole record in one burst
+	ADD 	r10, r10, 1
+	SBCO	&r10, CONST_PRUSHAREDRAM, r9, 4	; then publish it
+	QBA 	CHECKPINS
+
 		
 	HALT	; we should never actually get here
 	
\ No newline at end of file
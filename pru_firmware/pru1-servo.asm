@@ -53,6 +53,28 @@ start:
 	.asg	0x020,	OTHER_RAM
 	.asg    0x100,	SHARED_RAM       ; This is so prudebug can find it.
 
+; Shared memory protocol, must match rc_pru.c. The header lets the host check
+; the firmware version and see that both PRUs are still running.
+	.asg	0x80,	HEADER_MAGIC
+	.asg	0x52435055,	PRU_MAGIC
+	.asg	1,		FW_VERSION
+	.asg	0x8C,	PRU1_HEARTBEAT	; bumped every frame or idle poll
+
+; Continuous mode. While the frame period is non-zero, at the start of every
+; frame the command buffer picked by the low bit of the sequence number is
+; copied into the pulse words 0-7, exactly as if the host had sent them. The
+; host fills the other buffer and then bumps the sequence number so all
+; channels change together. If the sequence number doesn't change for
+; timeout frames the failsafe widths are sent instead.
+	.asg	0x90,	SERVO_CTRL		; frame period in loops (0 = host pulses
+									; only), timeout frames, sequence number
+	.asg	0x98,	SERVO_SEQ
+	.asg	0xA0,	SERVO_STATUS	; seq in use, 1 while in failsafe
+	.asg	0xA8,	SERVO_FRAMES
+	.asg	0xC0,	SERVO_CMD0		; 2 buffers of 8 widths in loops
+	.asg	0x100,	SERVO_FAILSAFE	; 8 widths in loops
+	.asg	0x10000,	IDLE_POLL	; loops between checks for continuous mode
+
 	LBCO	&r0, CONST_SYSCFG, 4, 4		; Enable OCP master port
 	CLR 	r0, r0, 4					; Clear SYSCFG[STANDBY_INIT] to enable OCP master port
 	SBCO	&r0, CONST_SYSCFG, 4, 4
@@ -61,6 +83,10 @@ start:
 	LDI     r0, SHARED_RAM              ; Set C28 to point to shared RAM
 	LDI32   r1, PRU1_CTRL + CTPPR0		; Note we use beginning of shared ram unlike example which
 	SBBO    &r0, r1, 0, 4				;  page 25
+
+	LDI32	r0, PRU_MAGIC				; tell the host we are up
+	LDI 	r1, FW_VERSION
+	SBCO	&r0, CONST_PRUSHAREDRAM, HEADER_MAGIC, 8
 	
 	LDI		r9, 0x0				; erase r9 to use to use later
 	
@@ -73,9 +99,14 @@ start:
 	LDI 	r6, 0x0
 	LDI32 	r7, 0x0
 	LDI 	r30, 0x0				; turn off GPIO outputs
+	LDI 	r10, 1					; frame countdown, check the mode right away
+	LDI 	r15, 0					; last sequence number seen
+	LDI 	r16, 0					; frames since sequence number changed
+	LDI 	r20, 0					; heartbeat
+	LDI 	r21, 0					; frames sent
 	
 
-; Beginning of loop, should always take 48 instructions to complete
+; Beginning of loop, should always take 50 instructions to complete
 CH1:			
 	QBEQ	CLR1, r0, 0						; If timer is 0, jump to clear channel
 	SET		r30, CH1BIT						; If non-zero turn on the corresponding channel
@@ -124,6 +155,8 @@ CH8:
 	SUB		r7, r7, 1
 	SBCO	&r9, CONST_PRUSHAREDRAM, 28, 4
 
+	SUB 	r10, r10, 1						; count down to the next frame
+	QBEQ	FRAME, r10, 0
 	QBA		CH1								; return to beginning of loop
 	; no need to waste a cycle for timing here because of the QBA above
 	
@@ -159,4 +192,52 @@ CLR7:
 CLR8:
 	CLR		r30, CH8BIT
 	LBCO	&r7, CONST_PRUSHAREDRAM, 28, 4
+	SUB 	r10, r10, 1
+	QBEQ	FRAME, r10, 0
 	QBA		CH1								; return to beginning of loop
+
+; Start of a continuous mode frame. r11 = period, r12 = timeout frames,
+; r13 = sequence number. Only runs once a frame so timing doesn't matter here.
+FRAME:
+	ADD 	r20, r20, 1
+	SBCO	&r20, CONST_PRUSHAREDRAM, PRU1_HEARTBEAT, 4
+	LBCO	&r11, CONST_PRUSHAREDRAM, SERVO_CTRL, 12
+	QBEQ	FRAME_IDLE, r11, 0
+	MOV 	r10, r11
+	QBEQ	FRAME_STALE, r13, r15			; has the host checked in?
+	MOV 	r15, r13
+	LDI 	r16, 0
+	QBA 	FRAME_TARGET
+FRAME_STALE:
+	ADD 	r16, r16, 1
+	QBEQ	FRAME_TARGET, r12, 0			; timeout of 0 never fails safe
+	QBLT	FRAME_TARGET, r12, r16			; still within the timeout
+	LDI 	r25, SERVO_FAILSAFE
+	LBCO	&r17, CONST_PRUSHAREDRAM, r25, 32
+	SBCO	&r17, CONST_PRUSHAREDRAM, 0, 32
+	LDI 	r14, 1
+	QBA 	FRAME_STATUS
+FRAME_TARGET:
+	AND 	r25, r13, 1
+	LSL 	r25, r25, 5
+	ADD 	r25, r25, SERVO_CMD0
+	LBCO	&r17, CONST_PRUSHAREDRAM, r25, 32
+	; if the host published again meanwhile it may have been rewriting this
+	; buffer, take the new one instead
+	LBCO	&r26, CONST_PRUSHAREDRAM, SERVO_SEQ, 4
+	QBNE	FRAME_RETRY, r26, r13
+	SBCO	&r17, CONST_PRUSHAREDRAM, 0, 32
+	LDI 	r14, 0
+FRAME_STATUS:
+	ADD 	r21, r21, 1
+	SBCO	&r13, CONST_PRUSHAREDRAM, SERVO_STATUS, 8
+	SBCO	&r21, CONST_PRUSHAREDRAM, SERVO_FRAMES, 4
+	QBA 	CH1
+FRAME_RETRY:
+	MOV 	r13, r26
+	MOV 	r15, r26
+	QBA 	FRAME_TARGET
+FRAME_IDLE:
+	LDI32	r10, IDLE_POLL
+	LDI 	r16, 0
+	QBA 	CH1